@@ -0,0 +1,583 @@
+// steg_bench.cpp - Google Benchmark suite for the encode/decode pipeline.
+//
+// Synthetic covers come in three patterns (smooth, noisy, mixed) at 1, 12
+// and 48 megapixels. Every benchmark reports pixel throughput as "MP/s";
+// benchmarks that move data also report bytes/s. Filter with
+// --benchmark_filter, e.g. --benchmark_filter='Find.*/1/'.
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include "bmp.h"
+#include "contrast.h"
+#include "luma.h"
+#include "steg.h"
+}
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+enum Pattern { kSmooth = 0, kNoisy = 1, kMixed = 2 };
+
+// Image sizes by megapixel count.
+void image_dims(int64_t megapixels, int32_t *width, int32_t *height)
+{
+    switch (megapixels) {
+    case 1:
+        *width = 1024;
+        *height = 1024;
+        break;
+    case 12:
+        *width = 4000;
+        *height = 3000;
+        break;
+    default:
+        *width = 8000;
+        *height = 6000;
+        break;
+    }
+}
+
+// Helper: fill in a minimal valid 24-bit BMP header for img.
+void set_bmp_header(BmpImage *img)
+{
+    unsigned char *h = img->header;
+    uint32_t file_size = 54u + (uint32_t)img->size;
+    uint32_t data_offset = 54u;
+    uint32_t info_size = 40u;
+    uint16_t planes = 1;
+    uint16_t bpp = (uint16_t)(bmp_pixel_bytes(img) * 8);
+    uint32_t image_size = (uint32_t)img->size;
+
+    std::memset(h, 0, 54);
+    h[0] = 'B';
+    h[1] = 'M';
+    std::memcpy(h + 2, &file_size, 4);
+    std::memcpy(h + 10, &data_offset, 4);
+    std::memcpy(h + 14, &info_size, 4);
+    std::memcpy(h + 18, &img->width, 4);
+    std::memcpy(h + 22, &img->height, 4);
+    std::memcpy(h + 26, &planes, 2);
+    std::memcpy(h + 28, &bpp, 2);
+    std::memcpy(h + 34, &image_size, 4);
+}
+
+// Deterministic synthetic cover. Smooth is a slow gradient (almost every block
+// is low contrast), noisy is uniform noise (almost none is) and mixed
+// alternates flat, textured and noisy 64x64 tiles.
+void fill_image(BmpImage *img, int pattern)
+{
+    uint32_t state = 12345u;
+    for (int32_t row = 0; row < img->height; ++row) {
+        unsigned char *px = img->data + (size_t)row * (size_t)img->stride;
+        for (int32_t col = 0; col < img->width; ++col) {
+            state = state * 1664525u + 1013904223u;
+            int kind = pattern;
+            if (pattern == kMixed) {
+                kind = (col / 64 + row / 64) % 3;
+            }
+            for (int ch = 0; ch < 3; ++ch) {
+                unsigned char v;
+                if (kind == kSmooth) {
+                    v = (unsigned char)(64 + (col + row) / 64 % 128 + ((state >> (8 + ch)) & 1u));
+                } else if (kind == kNoisy) {
+                    v = (unsigned char)((state >> (8 * ch)) & 0xFFu);
+                } else {
+                    v = (unsigned char)(((col + row) & 1) ? 120 : 100);
+                }
+                px[(size_t)col * 3u + (size_t)ch] = v;
+            }
+        }
+    }
+}
+
+// Covers are expensive to build at 48 MP, so each one is made once and
+// shared (read-only) by all benchmarks.
+const BmpImage &cover(int64_t megapixels, int pattern)
+{
+    static std::map<std::pair<int64_t, int>, BmpImage> cache;
+    std::pair<int64_t, int> key(megapixels, pattern);
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+        return it->second;
+    }
+
+    BmpImage img;
+    std::memset(&img, 0, sizeof(img));
+    image_dims(megapixels, &img.width, &img.height);
+    img.stride = ((img.width * 3 + 3) / 4) * 4;
+    img.size = img.stride * img.height;
+    img.data = (unsigned char *)std::malloc((size_t)img.size);
+    if (!img.data) {
+        std::fprintf(stderr, "steg_bench: out of memory\n");
+        std::abort();
+    }
+    fill_image(&img, pattern);
+    set_bmp_header(&img);
+    return cache.emplace(key, img).first->second;
+}
+
+// Private copy of a cover for benchmarks that write into it.
+BmpImage copy_image(const BmpImage &src)
+{
+    BmpImage img = src;
+    img.data = (unsigned char *)std::malloc((size_t)src.size);
+    if (!img.data) {
+        std::fprintf(stderr, "steg_bench: out of memory\n");
+        std::abort();
+    }
+    std::memcpy(img.data, src.data, (size_t)src.size);
+    return img;
+}
+
+// 32-bit copy of a cover, opaque.
+BmpImage bgra_copy(const BmpImage &src)
+{
+    BmpImage img = src;
+    img.bytes_per_pixel = 4;
+    img.stride = src.width * 4;
+    img.size = img.stride * src.height;
+    img.data = (unsigned char *)std::malloc((size_t)img.size);
+    if (!img.data) {
+        std::fprintf(stderr, "steg_bench: out of memory\n");
+        std::abort();
+    }
+    for (int32_t row = 0; row < src.height; ++row) {
+        const unsigned char *in = src.data + (size_t)row * (size_t)src.stride;
+        unsigned char *out = img.data + (size_t)row * (size_t)img.stride;
+        for (int32_t col = 0; col < src.width; ++col) {
+            std::memcpy(out + (size_t)col * 4u, in + (size_t)col * 3u, 3);
+            out[(size_t)col * 4u + 3u] = 0xFF;
+        }
+    }
+    set_bmp_header(&img);
+    return img;
+}
+
+double pixels_of(const BmpImage &img)
+{
+    return (double)img.width * (double)img.height;
+}
+
+void set_throughput(benchmark::State &state, const BmpImage &img, int64_t bytes_per_iter)
+{
+    state.counters["MP/s"] = benchmark::Counter(
+        pixels_of(img) * 1e-6 * (double)state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed((int64_t)state.iterations() * bytes_per_iter);
+}
+
+// Payload for embed/extract: a quarter of the bitmap capacity, capped.
+std::vector<uint8_t> make_payload(const BmpImage &img, int block_size, double threshold)
+{
+    StegBitmap bitmap;
+    size_t capacity_bytes = 0;
+    if (find_low_contrast_bitmap(&img, block_size, threshold, &bitmap) == 0) {
+        capacity_bytes = bitmap.count * 3u / 8u;
+        steg_bitmap_free(&bitmap);
+    }
+    size_t len = capacity_bytes > 5u ? (capacity_bytes - 5u) / 4u : 0u;
+    if (len > (16u << 20)) {
+        len = 16u << 20;
+    }
+
+    std::vector<uint8_t> payload(len);
+    uint32_t state = 777u;
+    for (size_t i = 0; i < len; ++i) {
+        state = state * 1664525u + 1013904223u;
+        payload[i] = (uint8_t)(state >> 24);
+    }
+    return payload;
+}
+
+double threshold_arg(const benchmark::State &state, int index)
+{
+    return (double)state.range(index) / 10.0;
+}
+
+// Args: megapixels, pattern, block size, threshold * 10.
+void scan_args(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"mp", "pattern", "bs", "t10"});
+    b->ArgsProduct({{1, 12, 48}, {kSmooth, kNoisy, kMixed}, {4, 8, 16}, {50}});
+    b->ArgsProduct({{12}, {kMixed}, {8}, {25, 100}});
+    b->Unit(benchmark::kMillisecond);
+}
+
+// Args: megapixels, pattern.
+void image_args(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"mp", "pattern"});
+    b->ArgsProduct({{1, 12, 48}, {kSmooth, kNoisy, kMixed}});
+    b->Unit(benchmark::kMillisecond);
+}
+
+// Args: kernel (LumaKernel), bytes per pixel.
+void BM_LumaRow(benchmark::State &state)
+{
+    int32_t pixel_bytes = (int32_t)state.range(1);
+    LumaRowFn fn = luma_row_kernel_px((LumaKernel)state.range(0), pixel_bytes);
+    if (fn == NULL) {
+        state.SkipWithError("kernel not available on this CPU");
+        return;
+    }
+
+    static const BmpImage bgra = bgra_copy(cover(12, kMixed));
+    const BmpImage &img = pixel_bytes == 4 ? bgra : cover(12, kMixed);
+    std::vector<uint16_t> lum((size_t)img.width);
+    int32_t row = 0;
+    for (auto _ : state) {
+        fn(img.data + (size_t)row * (size_t)img.stride, lum.data(), img.width,
+           LUMA_CHANNEL_MASK(1));
+        benchmark::DoNotOptimize(lum.data());
+        row = row + 1 == img.height ? 0 : row + 1;
+    }
+
+    state.SetLabel(luma_kernel_name((LumaKernel)state.range(0)));
+    state.counters["MP/s"] = benchmark::Counter(
+        (double)img.width * 1e-6 * (double)state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed((int64_t)state.iterations() * img.width * pixel_bytes);
+}
+BENCHMARK(BM_LumaRow)
+    ->ArgNames({"kernel", "px"})
+    ->ArgsProduct({benchmark::CreateDenseRange(0, LUMA_KERNEL_COUNT - 1, 1), {3, 4}});
+
+// Args: layout (CONTRAST_LAYOUT_*), megapixels, block size. The block scan
+// alone, on the mixed pattern: the tiled layout pulls ahead as images get
+// wider and the integral tables fall out of cache.
+void BM_ContrastScan(benchmark::State &state)
+{
+    const BmpImage &img = cover(state.range(1), kMixed);
+    int layout = (int)state.range(0);
+    std::vector<uint8_t> accept((size_t)img.width);
+    for (auto _ : state) {
+        ContrastScanner s;
+        if (contrast_scanner_init_layout(&s, &img, (int)state.range(2), 5.0, layout,
+                                         nullptr) != 0) {
+            state.SkipWithError("contrast_scanner_init_layout failed");
+            break;
+        }
+        for (int32_t br = 0; br < s.max_row; ++br) {
+            contrast_scanner_scan_row(&s, accept.data());
+        }
+        benchmark::DoNotOptimize(accept.data());
+        contrast_scanner_free(&s);
+    }
+    state.SetLabel(layout == CONTRAST_LAYOUT_INTEGRAL ? "integral" : "tiled");
+    set_throughput(state, img, img.size);
+}
+BENCHMARK(BM_ContrastScan)
+    ->ArgNames({"layout", "mp", "bs"})
+    ->ArgsProduct({{CONTRAST_LAYOUT_INTEGRAL, CONTRAST_LAYOUT_TILED}, {1, 12, 48}, {8, 16}})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_FindPositions(benchmark::State &state)
+{
+    const BmpImage &img = cover(state.range(0), (int)state.range(1));
+    for (auto _ : state) {
+        EmbedPosition *positions = nullptr;
+        size_t count = 0;
+        if (find_low_contrast_positions(&img, (int)state.range(2), threshold_arg(state, 3),
+                                        &positions, &count) != 0) {
+            state.SkipWithError("find_low_contrast_positions failed");
+            break;
+        }
+        benchmark::DoNotOptimize(positions);
+        std::free(positions);
+    }
+    set_throughput(state, img, img.size);
+}
+BENCHMARK(BM_FindPositions)->Apply(scan_args);
+
+void BM_FindBitmap(benchmark::State &state)
+{
+    const BmpImage &img = cover(state.range(0), (int)state.range(1));
+    for (auto _ : state) {
+        StegBitmap bitmap;
+        if (find_low_contrast_bitmap(&img, (int)state.range(2), threshold_arg(state, 3),
+                                     &bitmap) != 0) {
+            state.SkipWithError("find_low_contrast_bitmap failed");
+            break;
+        }
+        benchmark::DoNotOptimize(bitmap.bits);
+        steg_bitmap_free(&bitmap);
+    }
+    set_throughput(state, img, img.size);
+}
+BENCHMARK(BM_FindBitmap)->Apply(scan_args);
+
+void BM_FindBitmapParallel(benchmark::State &state)
+{
+    const BmpImage &img = cover(state.range(0), (int)state.range(1));
+    StegThreadPool *pool = steg_thread_pool_create(0);
+    if (pool == nullptr) {
+        state.SkipWithError("steg_thread_pool_create failed");
+        return;
+    }
+    for (auto _ : state) {
+        StegBitmap bitmap;
+        if (find_low_contrast_bitmap_parallel(&img, (int)state.range(2),
+                                              threshold_arg(state, 3), pool, &bitmap) != 0) {
+            state.SkipWithError("find_low_contrast_bitmap_parallel failed");
+            break;
+        }
+        benchmark::DoNotOptimize(bitmap.bits);
+        steg_bitmap_free(&bitmap);
+    }
+    state.counters["threads"] = steg_thread_pool_size(pool);
+    steg_thread_pool_destroy(pool);
+    set_throughput(state, img, img.size);
+}
+BENCHMARK(BM_FindBitmapParallel)->Apply(scan_args)->UseRealTime();
+
+// Args as scan_args plus mode (STEG_CAPACITY_EXACT or STEG_CAPACITY_ESTIMATE).
+void BM_QueryCapacity(benchmark::State &state)
+{
+    const BmpImage &img = cover(state.range(0), (int)state.range(1));
+    for (auto _ : state) {
+        StegCapacity capacity;
+        if (steg_query_capacity(&img, (int)state.range(2), threshold_arg(state, 3),
+                                (int)state.range(4), &capacity) != 0) {
+            state.SkipWithError("steg_query_capacity failed");
+            break;
+        }
+        benchmark::DoNotOptimize(capacity.bits);
+    }
+    set_throughput(state, img, img.size);
+}
+BENCHMARK(BM_QueryCapacity)
+    ->ArgNames({"mp", "pattern", "bs", "t10", "mode"})
+    ->ArgsProduct({{1, 12, 48}, {kSmooth, kNoisy, kMixed}, {8}, {50},
+                   {STEG_CAPACITY_EXACT, STEG_CAPACITY_ESTIMATE}})
+    ->Unit(benchmark::kMicrosecond);
+
+// Embed: steg_encode_message() with a quarter-capacity payload. The
+// selection ignores LSBs, so encoding the same copy repeatedly is stable.
+void BM_Embed(benchmark::State &state)
+{
+    int block_size = (int)state.range(2);
+    double threshold = threshold_arg(state, 3);
+    BmpImage img = copy_image(cover(state.range(0), (int)state.range(1)));
+    std::vector<uint8_t> payload = make_payload(img, block_size, threshold);
+
+    for (auto _ : state) {
+        if (steg_encode_message(&img, payload.data(), payload.size(),
+                                block_size, threshold) != 0) {
+            state.SkipWithError("steg_encode_message failed");
+            break;
+        }
+    }
+
+    set_throughput(state, img, (int64_t)payload.size());
+    bmp_free(&img);
+}
+BENCHMARK(BM_Embed)->Apply(scan_args);
+
+// Args: megapixels, pattern, block size, threshold * 10. BM_Embed on a
+// 32-bit copy of the cover.
+void BM_EmbedBgra(benchmark::State &state)
+{
+    int block_size = (int)state.range(2);
+    double threshold = threshold_arg(state, 3);
+    BmpImage img = bgra_copy(cover(state.range(0), (int)state.range(1)));
+    std::vector<uint8_t> payload = make_payload(img, block_size, threshold);
+
+    for (auto _ : state) {
+        if (steg_encode_message(&img, payload.data(), payload.size(),
+                                block_size, threshold) != 0) {
+            state.SkipWithError("steg_encode_message failed");
+            break;
+        }
+    }
+
+    set_throughput(state, img, (int64_t)payload.size());
+    bmp_free(&img);
+}
+BENCHMARK(BM_EmbedBgra)->ArgsProduct({{1, 12}, {kMixed}, {8}, {50}})->Unit(benchmark::kMillisecond);
+
+// Args: megapixels, pattern, block size, threshold * 10. BM_Embed through
+// steg_encode_message_adaptive(), whose search scans the whole cover once.
+void BM_EmbedAdaptive(benchmark::State &state)
+{
+    int block_size = (int)state.range(2);
+    double threshold = threshold_arg(state, 3);
+    BmpImage img = copy_image(cover(state.range(0), (int)state.range(1)));
+    std::vector<uint8_t> payload = make_payload(img, block_size, threshold);
+
+    for (auto _ : state) {
+        if (steg_encode_message_adaptive(&img, payload.data(), payload.size(), block_size,
+                                         threshold, 1, nullptr) != 0) {
+            state.SkipWithError("steg_encode_message_adaptive failed");
+            break;
+        }
+    }
+
+    set_throughput(state, img, (int64_t)payload.size());
+    bmp_free(&img);
+}
+BENCHMARK(BM_EmbedAdaptive)
+    ->ArgsProduct({{1, 12}, {kMixed}, {8}, {50}})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_Extract(benchmark::State &state)
+{
+    int block_size = (int)state.range(2);
+    double threshold = threshold_arg(state, 3);
+    BmpImage img = copy_image(cover(state.range(0), (int)state.range(1)));
+    std::vector<uint8_t> payload = make_payload(img, block_size, threshold);
+    if (steg_encode_message(&img, payload.data(), payload.size(), block_size, threshold) != 0) {
+        state.SkipWithError("steg_encode_message failed");
+        bmp_free(&img);
+        return;
+    }
+
+    for (auto _ : state) {
+        uint8_t *message = nullptr;
+        size_t message_len = 0;
+        if (steg_decode_message(&img, &message, &message_len, block_size, threshold) != 0) {
+            state.SkipWithError("steg_decode_message failed");
+            break;
+        }
+        benchmark::DoNotOptimize(message);
+        std::free(message);
+    }
+
+    set_throughput(state, img, (int64_t)payload.size());
+    bmp_free(&img);
+}
+BENCHMARK(BM_Extract)->Apply(scan_args);
+
+// Embed and extract through a context with a thread pool: payloads this
+// large go through parallel ranges (selection included) on every thread.
+void BM_EmbedExtractParallel(benchmark::State &state)
+{
+    int block_size = (int)state.range(2);
+    double threshold = threshold_arg(state, 3);
+    BmpImage img = copy_image(cover(state.range(0), (int)state.range(1)));
+    std::vector<uint8_t> payload = make_payload(img, block_size, threshold);
+    StegThreadPool *pool = steg_thread_pool_create(0);
+    StegContext *ctx = steg_context_create();
+    if (pool == nullptr || ctx == nullptr) {
+        state.SkipWithError("setup failed");
+        steg_context_destroy(ctx);
+        steg_thread_pool_destroy(pool);
+        bmp_free(&img);
+        return;
+    }
+    steg_context_set_thread_pool(ctx, pool);
+
+    for (auto _ : state) {
+        const uint8_t *message = nullptr;
+        size_t message_len = 0;
+        if (steg_encode_message_ctx(ctx, &img, payload.data(), payload.size(),
+                                    block_size, threshold) != 0 ||
+            steg_decode_message_ctx(ctx, &img, &message, &message_len,
+                                    block_size, threshold) != 0) {
+            state.SkipWithError("round trip failed");
+            break;
+        }
+        benchmark::DoNotOptimize(message);
+    }
+
+    state.counters["threads"] = steg_thread_pool_size(pool);
+    steg_context_destroy(ctx);
+    steg_thread_pool_destroy(pool);
+    set_throughput(state, img, (int64_t)payload.size());
+    bmp_free(&img);
+}
+BENCHMARK(BM_EmbedExtractParallel)->Apply(scan_args)->UseRealTime();
+
+void BM_RoundTrip(benchmark::State &state)
+{
+    int block_size = (int)state.range(2);
+    double threshold = threshold_arg(state, 3);
+    BmpImage img = copy_image(cover(state.range(0), (int)state.range(1)));
+    std::vector<uint8_t> payload = make_payload(img, block_size, threshold);
+
+    for (auto _ : state) {
+        uint8_t *message = nullptr;
+        size_t message_len = 0;
+        if (steg_encode_message(&img, payload.data(), payload.size(),
+                                block_size, threshold) != 0 ||
+            steg_decode_message(&img, &message, &message_len, block_size, threshold) != 0) {
+            state.SkipWithError("round trip failed");
+            break;
+        }
+        benchmark::DoNotOptimize(message);
+        std::free(message);
+    }
+
+    set_throughput(state, img, (int64_t)payload.size());
+    bmp_free(&img);
+}
+BENCHMARK(BM_RoundTrip)->Apply(scan_args);
+
+std::string bench_path(int64_t megapixels, int pattern)
+{
+    const char *dir = std::getenv("TMPDIR");
+    std::string path = dir != nullptr ? dir : "/tmp";
+    return path + "/steg_bench_" + std::to_string(megapixels) + "_" +
+           std::to_string(pattern) + ".bmp";
+}
+
+void BM_BmpSave(benchmark::State &state)
+{
+    const BmpImage &img = cover(state.range(0), (int)state.range(1));
+    std::string path = bench_path(state.range(0), (int)state.range(1));
+    for (auto _ : state) {
+        if (bmp_save(path.c_str(), &img) != 0) {
+            state.SkipWithError("bmp_save failed");
+            break;
+        }
+    }
+    set_throughput(state, img, 54 + (int64_t)img.size);
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_BmpSave)->Apply(image_args);
+
+// Args: megapixels, pattern, mapped (0 = bmp_load, 1 = bmp_load_mapped).
+void BM_BmpLoad(benchmark::State &state)
+{
+    const BmpImage &src = cover(state.range(0), (int)state.range(1));
+    std::string path = bench_path(state.range(0), (int)state.range(1));
+    if (bmp_save(path.c_str(), &src) != 0) {
+        state.SkipWithError("bmp_save failed");
+        return;
+    }
+
+    bool mapped = state.range(2) != 0;
+    for (auto _ : state) {
+        BmpImage img;
+        int rc = mapped ? bmp_load_mapped(path.c_str(), &img, BMP_STORAGE_MAP_READ)
+                        : bmp_load(path.c_str(), &img);
+        if (rc != 0) {
+            state.SkipWithError("load failed");
+            break;
+        }
+        // Touch every page so mapped and heap loads do the same work.
+        unsigned sum = 0;
+        for (int32_t i = 0; i < img.size; i += 4096) {
+            sum += img.data[i];
+        }
+        benchmark::DoNotOptimize(sum);
+        bmp_free(&img);
+    }
+
+    set_throughput(state, src, 54 + (int64_t)src.size);
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_BmpLoad)
+    ->ArgNames({"mp", "pattern", "mapped"})
+    ->ArgsProduct({{1, 12, 48}, {kMixed}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+BENCHMARK_MAIN();
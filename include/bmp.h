@@ -1,31 +1,132 @@
 #ifndef BMP_H
 #define BMP_H
 
-// Basic BMP loading/saving helpers for 24-bit uncompressed BMP files.
+// Basic BMP loading/saving helpers for 24-bit and 32-bit uncompressed BMP
+// files, bottom-up or top-down.
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Where BmpImage.data lives.
+#define BMP_STORAGE_HEAP 0   // malloc'ed by bmp_load() (or by the caller)
+#define BMP_STORAGE_MAP_READ 1  // read-only file mapping: decode only
+#define BMP_STORAGE_MAP_COPY 2  // copy-on-write file mapping: writes stay private
+#define BMP_STORAGE_BORROWED 3  // caller-owned buffer (bmp_wrap_memory())
+
 typedef struct {
     unsigned char header[54];  // copy BMP header as-is
     int32_t width;
     int32_t height;
     int32_t stride;   // bytes per row (including padding)
     int32_t size;     // total pixel data size in bytes
-    unsigned char *data; // dynamically allocated pixel array (B, G, R, B, G, R, ...)
+    unsigned char *data; // pixel array (B, G, R, B, G, R, ... or B, G, R, A, ...),
+                         // see storage
+    int32_t bytes_per_pixel; // 3 (24-bit) or 4 (32-bit); 0 is read as 3
+    int storage;      // BMP_STORAGE_*
+    void *map_base;   // mapped file (BMP_STORAGE_MAP_*), data points into it
+    size_t map_len;
+    int32_t dirty_begin; // stored rows [dirty_begin, dirty_end) modified
+    int32_t dirty_end;   // since load; empty when dirty_begin >= dirty_end
 } BmpImage;
 
-// Load a 24-bit uncompressed BMP from disk.
+// Bytes per pixel of img: 4 for a 32-bit image, 3 otherwise (including
+// images filled in by hand with bytes_per_pixel left at 0). Only B, G and R
+// carry payload; the alpha byte of a 32-bit pixel is never changed.
+static inline int32_t bmp_pixel_bytes(const BmpImage *img)
+{
+    return img->bytes_per_pixel == 4 ? 4 : 3;
+}
+
+// Load a 24-bit or 32-bit uncompressed BMP from disk.
 // Returns 0 on success, non-zero on failure.
 int bmp_load(const char *filename, BmpImage *img);
 
-// Save a 24-bit BMP to disk, using the header/data from img.
+// Save a BMP to disk, using the header/data from img. Where files can be
+// mapped, the BMP is written to a temporary file that is then renamed over
+// filename, so an existing file, even one mapped by img itself, is never
+// truncated.
 // Returns 0 on success, non-zero on failure.
 int bmp_save(const char *filename, const BmpImage *img);
 
+// 1 when paths a and b name the same existing file (same device and inode,
+// whatever their spelling), 0 otherwise. Where files cannot be mapped the
+// paths themselves are compared.
+int bmp_same_file(const char *a, const char *b);
+
+// Map an uncompressed BMP instead of reading it. Pages are only read
+// from disk when touched. storage is BMP_STORAGE_MAP_READ (img->data must not
+// be written) or BMP_STORAGE_MAP_COPY (writes are private to this process and
+// only the touched pages are copied). Where mapping is unavailable the image
+// is loaded into heap memory instead.
+// Returns 0 on success, non-zero on failure.
+int bmp_load_mapped(const char *filename, BmpImage *img, int storage);
+
+// Parse a BMP file held in memory and copy its pixels into heap storage.
+// Returns 0 on success, non-zero on failure.
+int bmp_load_from_memory(const unsigned char *buf, size_t len, BmpImage *img);
+
+// Parse a BMP file held in memory without copying: img->data points into
+// buf, which must outlive img (bmp_free() leaves it alone). Encoding img then
+// modifies buf in place, so buf itself is the encoded file.
+// Returns 0 on success, non-zero on failure.
+int bmp_wrap_memory(unsigned char *buf, size_t len, BmpImage *img);
+
+// Serialise img as a BMP file into a new buffer. On success *buf_out must be
+// freed by the caller with free().
+// Returns 0 on success, non-zero on failure.
+int bmp_save_to_memory(const BmpImage *img, unsigned char **buf_out, size_t *len_out);
+
+// Record that stored rows [first_row, end_row) of img->data were modified.
+void bmp_mark_dirty(BmpImage *img, int32_t first_row, int32_t end_row);
+
+// Write only the dirty rows of img into filename, which must already hold a
+// BMP with the same header (typically the file img was loaded from, or a copy
+// of it). Returns 0 on success, non-zero on failure.
+int bmp_save_in_place(const char *filename, const BmpImage *img);
+
+// Sequential row access to a BMP file, for processing images that do not
+// fit in memory. Rows are read and written in the order they are stored
+// (bottom-up for positive height, top-down for negative height), which is
+// the row order the rest of the library uses.
+typedef struct {
+    FILE *file;
+    BmpImage info;    // header and geometry; info.data is NULL
+    int32_t rows;     // stored rows read or written so far
+    char *target;     // write: the file the stream ends up as
+    char *tmp;        // write: the file written until then, or NULL when
+                      // target is written directly
+} BmpStream;
+
+// Open filename and read its header into s->info.
+// Returns 0 on success, non-zero on failure.
+int bmp_stream_open_read(const char *filename, BmpStream *s);
+
+// Create filename and write the header of info. Like bmp_save(), the rows
+// go to a temporary file that bmp_stream_close() renames over filename, so
+// an existing file is left alone until then (and for good if the stream is
+// discarded).
+// Returns 0 on success, non-zero on failure.
+int bmp_stream_open_write(const char *filename, const BmpImage *info, BmpStream *s);
+
+// Read or write the next `rows` stored rows (rows * info.stride bytes).
+// Returns 0 on success, non-zero on failure or when rows run past the image.
+int bmp_stream_read_rows(BmpStream *s, unsigned char *dst, int32_t rows);
+int bmp_stream_write_rows(BmpStream *s, const unsigned char *src, int32_t rows);
+
+// Close the file; a write stream replaces its target. Returns non-zero if
+// pending writes failed.
+int bmp_stream_close(BmpStream *s);
+
+// Close a write stream without keeping anything it wrote: filename is left
+// as it was before bmp_stream_open_write(), or removed where the stream
+// writes it directly.
+void bmp_stream_discard(BmpStream *s);
+
 // Free dynamic memory associated with img.
 void bmp_free(BmpImage *img);
 
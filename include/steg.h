@@ -15,7 +15,111 @@ typedef struct {
     int pixel_index;  // index of the pixel in row-major order
 } EmbedPosition;
 
+// Payload layout versions.
+//
+// STEG_FORMAT_LEGACY walks the per-block pixel lists returned by
+// find_low_contrast_positions(), duplicates included, and starts with a bare
+// 4-byte little-endian length.
+//
+// STEG_FORMAT_BITMAP walks each selected pixel exactly once in raster order
+// (see find_low_contrast_bitmap()) and starts with a one-byte format tag
+// followed by the 4-byte little-endian length and a check byte over both
+// (as for STEG_FORMAT_COMPACT, never 0).
+//
+// STEG_FORMAT_COMPACT walks the same pixels as STEG_FORMAT_BITMAP and starts
+// with its own tag followed by the length as a varint: 7 bits per byte, low
+// group first, the high bit set on every byte but the last (1 to 5 bytes, no
+// redundant leading groups), and a check byte over the tag and varint that is
+// never 0. A message below 128 bytes costs a 3-byte header instead of 6. The
+// check byte keeps a legacy payload from passing for a compact one: its
+// 4-byte length can start like a compact tag and varint, but for any message
+// below 16 MiB the byte after them is 0. This is the layout the encoders
+// write by default.
+#define STEG_FORMAT_LEGACY 1
+#define STEG_FORMAT_BITMAP 2
+#define STEG_FORMAT_COMPACT 3
+
+// Format tag byte: magic in the high nibble, version in the low nibble.
+#define STEG_FORMAT_MAGIC 0xA0u
+#define STEG_FORMAT_TAG(version) ((uint8_t)(STEG_FORMAT_MAGIC | (unsigned)(version)))
+
+// The tagged layouts can carry 1 to STEG_MAX_BITS_PER_CHANNEL low bits of
+// every channel. The depth is recorded in bits 2-3 of the tag (depth - 1),
+// so a 1-bit payload keeps the plain STEG_FORMAT_TAG() of its layout.
+// Selection ignores as many low bits as are embedded, so the selected
+// pixels, and therefore capacity, depend on the depth too.
+#define STEG_MAX_BITS_PER_CHANNEL 3
+#define STEG_FORMAT_BITMAP_TAG(bits_per_channel) \
+    ((uint8_t)(STEG_FORMAT_TAG(STEG_FORMAT_BITMAP) | (((unsigned)(bits_per_channel) - 1u) << 2)))
+#define STEG_FORMAT_COMPACT_TAG(bits_per_channel) \
+    ((uint8_t)(STEG_FORMAT_TAG(STEG_FORMAT_COMPACT) | (((unsigned)(bits_per_channel) - 1u) << 2)))
+
+// STEG_FORMAT_ADAPTIVE carries its own contrast threshold. Its header, the
+// tag STEG_FORMAT_ADAPTIVE_TAG(), the threshold as an 8-byte little-endian
+// IEEE 754 double, the varint length and the check byte, walks the STEG_FORMAT_COMPACT
+// pixels selected at the caller's threshold. The message walks the pixels
+// selected at the stored threshold instead, starting with the first one
+// after the last header pixel in raster order, so the two never share a
+// pixel. Written by steg_encode_message_adaptive().
+#define STEG_FORMAT_ADAPTIVE 4
+#define STEG_FORMAT_ADAPTIVE_TAG(bits_per_channel) \
+    ((uint8_t)(STEG_FORMAT_TAG(1) | (((unsigned)(bits_per_channel) - 1u) << 2)))
+
+// Payload compression codecs. A compressed payload walks the STEG_FORMAT_COMPACT
+// pixels and starts with STEG_FORMAT_COMPRESSED_TAG() (the one tag version no
+// layout uses), a codec byte, the varint length of the original message, the
+// check byte and then the codec's self-delimiting frame (an LZ4 frame or a
+// zstd frame).
+// The codec libraries (liblz4, libzstd) are loaded when first needed; a
+// missing one makes its codec unavailable.
+#define STEG_CODEC_NONE 0
+#define STEG_CODEC_LZ4 1   // fast
+#define STEG_CODEC_ZSTD 2  // better ratio
+#define STEG_FORMAT_COMPRESSED_TAG(bits_per_channel) \
+    ((uint8_t)(STEG_FORMAT_TAG(0) | (((unsigned)(bits_per_channel) - 1u) << 2)))
+
+// 1 when codec can be used in this process (always for STEG_CODEC_NONE).
+int steg_codec_available(int codec);
+
+// One bit per pixel selection mask. Bit i of the mask (bit i % 64 of word
+// i / 64) is set when pixel i, in row-major order of the stored rows, lies in
+// at least one low-contrast block.
+typedef struct {
+    int32_t width;
+    int32_t height;   // absolute height
+    size_t count;     // number of selected pixels
+    uint64_t *bits;   // (width * height + 63) / 64 words
+} StegBitmap;
+
+// Lazy generator of low-contrast positions. Blocks are evaluated on demand
+// in raster order, so pulling the first few positions of a large image only
+// reads its first rows.
+typedef struct StegPositionIter StegPositionIter;
+
+// Create an iterator over the positions of a payload layout:
+// STEG_FORMAT_LEGACY yields the footprint of every low-contrast block, block
+// by block (the sequence find_low_contrast_positions() returns);
+// STEG_FORMAT_BITMAP and STEG_FORMAT_COMPACT yield every selected pixel
+// once, in raster order.
+// Returns 0 on success, non-zero on failure. Release with
+// steg_position_iter_free().
+int steg_position_iter_create(const BmpImage *img,
+                              int block_size,
+                              double contrast_threshold,
+                              int format,
+                              StegPositionIter **iter_out);
+
+// Produce the next position. Returns 1 if *position_out was set, 0 once the
+// positions are exhausted.
+int steg_position_iter_next(StegPositionIter *iter, EmbedPosition *position_out);
+
+// Number of image rows the iterator has read so far.
+int32_t steg_position_iter_rows_scanned(const StegPositionIter *iter);
+
+void steg_position_iter_free(StegPositionIter *iter);
+
 // Compute the candidate positions within the image using a low-contrast metric.
+// This collects a STEG_FORMAT_LEGACY iterator into an array.
 // Returns 0 on success, non-zero on failure. On success, *positions_out must
 // be freed by the caller with free().
 int find_low_contrast_positions(const BmpImage *img,
@@ -24,6 +128,116 @@ int find_low_contrast_positions(const BmpImage *img,
                                 EmbedPosition **positions_out,
                                 size_t *count_out);
 
+// Compute the same low-contrast selection as find_low_contrast_positions(),
+// but as a deduplicated per-pixel bitmap.
+// Returns 0 on success, non-zero on failure. On success, release the bitmap
+// with steg_bitmap_free().
+int find_low_contrast_bitmap(const BmpImage *img,
+                             int block_size,
+                             double contrast_threshold,
+                             StegBitmap *bitmap_out);
+
+// Free memory owned by bitmap.
+void steg_bitmap_free(StegBitmap *bitmap);
+
+// Capacity query modes.
+#define STEG_CAPACITY_EXACT 0     // full scan, exact
+#define STEG_CAPACITY_ESTIMATE 1  // scan a fixed grid of sample tiles
+
+// Payload capacity of a cover in the default (STEG_FORMAT_COMPACT) layout.
+typedef struct {
+    size_t selected_pixels;   // pixels in at least one low-contrast block
+    size_t bits;              // usable bit slots (three channels per selected
+                              // pixel, times the bits per channel)
+    size_t max_message_len;   // largest message in bytes, header excluded
+    int estimated;            // 1 when extrapolated from sample tiles
+} StegCapacity;
+
+// Count the usable bits of img without building any position list, using
+// O(width * block_size) memory. STEG_CAPACITY_ESTIMATE evaluates a fixed grid
+// of small tiles exactly and extrapolates, so its cost does not grow with
+// the image; small images are always scanned exactly.
+// Returns 0 on success, non-zero on failure.
+int steg_query_capacity(const BmpImage *img,
+                        int block_size,
+                        double contrast_threshold,
+                        int mode,
+                        StegCapacity *capacity_out);
+
+// Same as steg_query_capacity() (1 bit per channel) for a multi-bit payload
+// of bits_per_channel (1..STEG_MAX_BITS_PER_CHANNEL) bits per channel.
+int steg_query_capacity_depth(const BmpImage *img,
+                              int block_size,
+                              double contrast_threshold,
+                              int bits_per_channel,
+                              int mode,
+                              StegCapacity *capacity_out);
+
+// Fixed-size pool of worker threads for the parallel scans.
+typedef struct StegThreadPool StegThreadPool;
+
+// Create a pool that runs work on num_threads threads, the calling thread
+// included (num_threads <= 0 uses the number of online CPUs). Returns NULL
+// on failure. Release with steg_thread_pool_destroy().
+StegThreadPool *steg_thread_pool_create(int num_threads);
+
+void steg_thread_pool_destroy(StegThreadPool *pool);
+
+// Number of threads work is spread over (1 for a NULL pool).
+int steg_thread_pool_size(const StegThreadPool *pool);
+
+// Parallel versions of find_low_contrast_positions() and
+// find_low_contrast_bitmap(). The block rows are split into horizontal bands
+// scanned on the pool and the per-band results are merged in raster order,
+// so the output is identical to the serial functions. pool may be NULL, in
+// which case the scan runs serially.
+int find_low_contrast_positions_parallel(const BmpImage *img,
+                                         int block_size,
+                                         double contrast_threshold,
+                                         StegThreadPool *pool,
+                                         EmbedPosition **positions_out,
+                                         size_t *count_out);
+
+int find_low_contrast_bitmap_parallel(const BmpImage *img,
+                                      int block_size,
+                                      double contrast_threshold,
+                                      StegThreadPool *pool,
+                                      StegBitmap *bitmap_out);
+
+// Optional device backend (OpenCL) for the block classification.
+typedef struct StegGpu StegGpu;
+
+// Open the first GPU or accelerator device. Returns NULL when the library was
+// built without a backend, no runtime is installed or there is no device;
+// callers then simply use the CPU scans. Setting STEG_GPU_DEVICE=any in the
+// environment accepts any device type, CPU runtimes included. Release with
+// steg_gpu_destroy().
+StegGpu *steg_gpu_create(void);
+
+void steg_gpu_destroy(StegGpu *gpu);
+
+// Name of the device ("none" for a NULL gpu).
+const char *steg_gpu_device_name(const StegGpu *gpu);
+
+// Device versions of find_low_contrast_positions() and
+// find_low_contrast_bitmap(). The cover is uploaded once and every block is
+// classified on the device; blocks at the threshold are settled on the host
+// with the exact evaluation, so the output is identical to the serial
+// functions. A NULL gpu, a block_size above 256, a contrast_threshold <= 0 or
+// a device error fall back to the serial scan.
+int find_low_contrast_positions_gpu(const BmpImage *img,
+                                    int block_size,
+                                    double contrast_threshold,
+                                    StegGpu *gpu,
+                                    EmbedPosition **positions_out,
+                                    size_t *count_out);
+
+int find_low_contrast_bitmap_gpu(const BmpImage *img,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 StegGpu *gpu,
+                                 StegBitmap *bitmap_out);
+
 // Encode a message into the BMP image in memory.
 // message_len is in bytes. Function modifies img->data in-place.
 // Returns 0 on success, -1 if capacity is insufficient, non-zero on other errors.
@@ -33,7 +247,102 @@ int steg_encode_message(BmpImage *img,
                         int block_size,
                         double contrast_threshold);
 
+// Same as steg_encode_message() (which uses STEG_FORMAT_COMPACT) with an
+// explicit payload layout version.
+int steg_encode_message_format(BmpImage *img,
+                               const uint8_t *message,
+                               size_t message_len,
+                               int block_size,
+                               double contrast_threshold,
+                               int format);
+
+// Same as steg_encode_message(), embedding bits_per_channel (1 to
+// STEG_MAX_BITS_PER_CHANNEL) low bits of every channel instead of only the
+// LSB. A depth of k carries k times the bits per selected pixel, at the cost
+// of larger changes to the cover. steg_decode_message() detects the depth.
+int steg_encode_message_depth(BmpImage *img,
+                              const uint8_t *message,
+                              size_t message_len,
+                              int block_size,
+                              double contrast_threshold,
+                              int bits_per_channel);
+
+// Same as steg_encode_message_depth(), compressing message with codec first
+// (STEG_CODEC_NONE stores it as is). The message is compressed a chunk at a
+// time straight into the cover, so no compressed copy of it is kept. An
+// incompressible message is still stored compressed, at a small cost in
+// size. steg_decode_message() decompresses transparently.
+// Returns 0 on success, -1 if the compressed payload does not fit, non-zero
+// on other errors (including an unavailable codec).
+int steg_encode_message_compressed(BmpImage *img,
+                                   const uint8_t *message,
+                                   size_t message_len,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int bits_per_channel,
+                                   int codec);
+
+// Same as steg_encode_message_depth(), choosing the threshold of the message
+// positions instead of using contrast_threshold, which only places the header
+// (STEG_FORMAT_ADAPTIVE). The Q8 stddev of every block is computed in one
+// scan, and a binary search over their sorted values finds the lowest one, as
+// a threshold, whose selection holds the message; each step only re-counts
+// the selection from the stored stddevs. That threshold can be above or below
+// contrast_threshold, and is stored in the header, so steg_decode_message()
+// with contrast_threshold reads the message without being told it.
+// *threshold_out (may be NULL) receives it. The search peaks at three floats
+// (12 bytes) per block while it sorts the stddevs, the table and both sort
+// buffers, and keeps two per block for the bisection, on top of the usual
+// scan scratch.
+// Returns 0 on success, -1 if the message does not fit even when every block
+// is selected (img is left as it was), non-zero on other errors.
+int steg_encode_message_adaptive(BmpImage *img,
+                                 const uint8_t *message,
+                                 size_t message_len,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 int bits_per_channel,
+                                 double *threshold_out);
+
+// Replace the payload of a stego image with message, in place. The depth and
+// the layout (STEG_FORMAT_BITMAP, STEG_FORMAT_COMPACT or compressed, with
+// its codec) of the payload already in img are kept (a 1-bit
+// STEG_FORMAT_COMPACT payload when it has none), and the result is
+// identical to a fresh encode with those. A STEG_FORMAT_ADAPTIVE payload is
+// replaced by steg_encode_message_adaptive() at its depth, which searches
+// the whole image for a threshold again. The selection does not depend on
+// the embedded bits, so only as many rows are scanned as the new payload
+// needs, and only channel bytes whose bits differ are written: with a
+// BMP_STORAGE_MAP_COPY image just the pages that change are copied and
+// bmp_save_in_place() writes back just the rows that change.
+// Returns 0 on success, -1 if capacity is insufficient (img is left as it
+// was), non-zero on other errors.
+int steg_update_message(BmpImage *img,
+                        const uint8_t *message,
+                        size_t message_len,
+                        int block_size,
+                        double contrast_threshold);
+
+// Encode a message from input_bmp into a new output_bmp without holding the
+// image in memory: rows are streamed through a window of block_size + 1 rows,
+// so peak memory is O(width * block_size). Uses STEG_FORMAT_COMPACT and the
+// result is identical to bmp_load(), steg_encode_message() and bmp_save().
+// output_bmp must not be input_bmp under any spelling (see bmp_same_file()).
+// Returns 0 on success, -1 if capacity is insufficient, non-zero on other
+// errors; on failure output_bmp is removed (never input_bmp: the output is
+// written to a temporary file renamed over output_bmp once complete).
+int steg_encode_file_streaming(const char *input_bmp,
+                               const char *output_bmp,
+                               const uint8_t *message,
+                               size_t message_len,
+                               int block_size,
+                               double contrast_threshold);
+
 // Decode a message from the BMP image in memory.
+// Every payload layout is recognised: the tagged layouts are tried first, at
+// each depth from 1 to STEG_MAX_BITS_PER_CHANNEL bits per channel, and the
+// legacy layout is used when no format tag is found. A depth without a tag is
+// given up after its first 8 bits.
 // The function allocates a buffer for the message and sets *message_out and
 // *message_len_out. Caller must free(*message_out).
 // Returns 0 on success, non-zero on failure.
@@ -43,6 +352,271 @@ int steg_decode_message(const BmpImage *img,
                         int block_size,
                         double contrast_threshold);
 
+// What steg_probe_message() found.
+typedef struct {
+    int found;              // 1 when img has a plausible payload header
+    int format;             // STEG_FORMAT_* of that header
+    int bits_per_channel;   // its depth
+    int codec;              // STEG_CODEC_*, STEG_CODEC_NONE when uncompressed
+    size_t message_len;     // stored message length, before compression
+    double contrast_threshold; // threshold of the message positions: the
+                               // stored one for STEG_FORMAT_ADAPTIVE, the
+                               // caller's otherwise
+} StegProbe;
+
+// A header is not plausible when its payload needs more than this many
+// times the estimated capacity (STEG_CAPACITY_ESTIMATE) of the cover.
+#define STEG_PROBE_CAPACITY_SLACK 2u
+
+// Cheap check for a payload, for scanning many images of which few carry
+// one. The layouts are tried in the order steg_decode_message() tries them,
+// but only their headers are read: the block scan stops as soon as the
+// header slots are found and nothing is allocated for the message. A header
+// counts when its tag (and for a compressed payload, the codec magic) is
+// right and its length plausible: it must fit the image and, unless
+// adaptive, the capacity estimate with STEG_PROBE_CAPACITY_SLACK to spare,
+// which a compressed length may exceed by the most its codec can expand a
+// frame. An adaptive header needs a threshold the encoder can have written.
+// The estimate is only taken for headers that pass the other checks. A
+// legacy header, which has no tag, also needs a non-zero length. A payload
+// filling most of a cover whose low-contrast areas the sample tiles miss can
+// go unreported; steg_decode_message() still finds it.
+// Returns 0 on success (found or not), non-zero on failure.
+int steg_probe_message(const BmpImage *img,
+                       int block_size,
+                       double contrast_threshold,
+                       StegProbe *probe_out);
+
+// Sharded payloads, for messages larger than any one cover. The message is
+// split over a set of covers in proportion to their capacity, and each cover
+// carries an ordinary payload (STEG_FORMAT_COMPACT, 1 bit per channel)
+// whose message is a shard header followed by its piece. The header holds,
+// all little-endian: the magic "STSH", a set id (4 bytes), the shard index
+// and count (4 bytes each), the offset of the piece in the message and the
+// message length (8 bytes each) and a checksum of the piece (4 bytes). The
+// set id is derived from the count, the length and every piece checksum, so
+// shards of different messages do not mix.
+#define STEG_SHARD_MAGIC "STSH"
+#define STEG_SHARD_HEADER_BYTES 36u
+
+// Spread message over the count covers of imgs, encoding them concurrently
+// on pool (NULL: one after the other). A cover too small for a shard header
+// is left out of the set and unchanged; every other cover gets a shard,
+// possibly with an empty piece.
+// Returns 0 on success, -1 if the covers together are too small (none is
+// changed), non-zero on other errors (the covers may then hold some shards).
+int steg_encode_sharded(BmpImage *const *imgs,
+                        size_t count,
+                        const uint8_t *message,
+                        size_t message_len,
+                        int block_size,
+                        double contrast_threshold,
+                        StegThreadPool *pool);
+
+// Reassemble a message from all count shards of a set, given in any order,
+// decoding them concurrently on pool (NULL: one after the other). Covers too
+// small for a shard header, the ones steg_encode_sharded() leaves out, may be
+// among imgs and are ignored. Every shard is checked against its checksum
+// and the set. Allocates the message
+// into *message_out (free() it).
+// Returns 0 on success, non-zero on failure.
+int steg_decode_sharded(const BmpImage *const *imgs,
+                        size_t count,
+                        uint8_t **message_out,
+                        size_t *message_len_out,
+                        int block_size,
+                        double contrast_threshold,
+                        StegThreadPool *pool);
+
+// Cache of selection maps, for decoding many stego copies of the same
+// covers. Selection ignores the bits embedding changes, so all copies of a
+// cover made at one depth, block size and threshold share one selection.
+// Entries are keyed by a (non-cryptographic) hash of the pixels with those
+// bits masked off, plus the dimensions, block size, threshold and depth. A
+// decode reads the image once to hash it at every depth; on a hit it goes
+// straight to extraction, without any luma or block scan.
+//
+// Up to max_entries maps are kept in memory, least recently used first out
+// (0 keeps none). With a directory, every map is also written there as a
+// sidecar file named after its key and read back on a memory miss, so the
+// cache survives the process; the directory must exist (create fails
+// otherwise). A cache may be shared by several threads and contexts.
+typedef struct StegSelectionCache StegSelectionCache;
+
+typedef struct {
+    uint64_t memory_hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+} StegSelectionCacheStats;
+
+// Returns NULL on failure. Release with steg_selection_cache_destroy() once
+// no decode uses it any more.
+StegSelectionCache *steg_selection_cache_create(size_t max_entries, const char *directory);
+
+void steg_selection_cache_destroy(StegSelectionCache *cache);
+
+void steg_selection_cache_get_stats(StegSelectionCache *cache, StegSelectionCacheStats *stats_out);
+
+// Same as steg_decode_message(), with selection maps from cache (see
+// StegSelectionCache). On a miss in the bitmap layout the decode scans as
+// usual and, if it finds a payload, computes the full selection and stores
+// it. The legacy layout is never cached.
+int steg_decode_message_cached(StegSelectionCache *cache,
+                               const BmpImage *img,
+                               uint8_t **message_out,
+                               size_t *message_len_out,
+                               int block_size,
+                               double contrast_threshold);
+
+// Instrumentation counters, filled in by calls on a StegContext that has
+// them attached (see steg_context_set_stats()). Every call adds to them.
+typedef struct {
+    // Wall time per stage, in seconds. load and save are not timed by the
+    // library; they are there for callers (steg_cli fills them in).
+    double load_seconds;
+    double setup_seconds;     // header packing, iterator and scratch setup
+    double luma_seconds;      // luma rows for the integral tables
+    double scan_seconds;      // block scan and coverage, luma included
+    double embed_seconds;     // LSB writes, scanning excluded
+    double extract_seconds;   // LSB reads, scanning excluded
+    double save_seconds;
+    uint64_t calls;
+    uint64_t blocks_evaluated;
+    uint64_t blocks_accepted;
+    uint64_t blocks_exact;        // ties re-evaluated in floating point
+    uint64_t positions_emitted;   // pixels visited by embed/extract
+    uint64_t duplicate_writes;    // embed writes to an already written pixel
+    uint64_t bits_written;
+    uint64_t bits_read;
+    size_t peak_scratch_bytes;    // largest scratch the context has held
+} StegStats;
+
+// Add the counters of src to dst (peak_scratch_bytes takes the maximum).
+void steg_stats_merge(StegStats *dst, const StegStats *src);
+
+// Reusable state for repeated calls. A context owns the scratch memory of
+// the _ctx functions below (scan tables, undo log, results) and keeps it
+// between calls, sized to the largest image seen so far, so a worker that
+// processes images of one resolution allocates nothing in steady state.
+// A context must not be used by two threads at once.
+typedef struct StegContext StegContext;
+
+// Returns NULL on failure. Release with steg_context_destroy().
+StegContext *steg_context_create(void);
+
+void steg_context_destroy(StegContext *ctx);
+
+// Accumulate instrumentation of later calls on ctx into *stats (NULL turns
+// it off, the default). The stats must outlive their use by ctx. Counting
+// duplicate writes in the legacy layout costs one bit of scratch per pixel.
+void steg_context_set_stats(StegContext *ctx, StegStats *stats);
+
+// Let steg_decode_message_ctx() and steg_update_message_ctx() on ctx use
+// cache, as steg_decode_message_cached() does (NULL turns it off, the
+// default); updates read it but never fill it. The cache must outlive its
+// use by ctx.
+void steg_context_set_selection_cache(StegContext *ctx, StegSelectionCache *cache);
+
+// Let the _ctx encodes, decodes and updates on ctx embed and extract a large
+// payload (1 Mbit and up, uncompressed, tagged layout) on pool: the bit
+// stream is cut into ranges of selected pixels that are written or read
+// concurrently, straight from the message and into the output buffer. This
+// needs the whole selection first, found with a parallel scan unless a
+// cache has it. Results are identical to the serial path. NULL (the default)
+// keeps everything serial. The pool must outlive its use by ctx, and must
+// not be the one the call itself runs on.
+void steg_context_set_thread_pool(StegContext *ctx, StegThreadPool *pool);
+
+// Same as steg_encode_message(), with scratch memory from ctx.
+int steg_encode_message_ctx(StegContext *ctx,
+                            BmpImage *img,
+                            const uint8_t *message,
+                            size_t message_len,
+                            int block_size,
+                            double contrast_threshold);
+
+// Same as steg_encode_message_format(), with scratch memory from ctx.
+int steg_encode_message_format_ctx(StegContext *ctx,
+                                   BmpImage *img,
+                                   const uint8_t *message,
+                                   size_t message_len,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int format);
+
+// Same as steg_encode_message_depth(), with scratch memory from ctx.
+int steg_encode_message_depth_ctx(StegContext *ctx,
+                                  BmpImage *img,
+                                  const uint8_t *message,
+                                  size_t message_len,
+                                  int block_size,
+                                  double contrast_threshold,
+                                  int bits_per_channel);
+
+// Same as steg_encode_message_compressed(), with scratch memory from ctx.
+int steg_encode_message_compressed_ctx(StegContext *ctx,
+                                       BmpImage *img,
+                                       const uint8_t *message,
+                                       size_t message_len,
+                                       int block_size,
+                                       double contrast_threshold,
+                                       int bits_per_channel,
+                                       int codec);
+
+// Same as steg_encode_message_adaptive(), with scratch memory from ctx for
+// everything but the search.
+int steg_encode_message_adaptive_ctx(StegContext *ctx,
+                                     BmpImage *img,
+                                     const uint8_t *message,
+                                     size_t message_len,
+                                     int block_size,
+                                     double contrast_threshold,
+                                     int bits_per_channel,
+                                     double *threshold_out);
+
+// Same as steg_update_message(), with scratch memory from ctx.
+int steg_update_message_ctx(StegContext *ctx,
+                            BmpImage *img,
+                            const uint8_t *message,
+                            size_t message_len,
+                            int block_size,
+                            double contrast_threshold);
+
+// Same as steg_decode_message(), but *message_out points into ctx: it stays
+// valid until the next call on ctx and must not be freed.
+int steg_decode_message_ctx(StegContext *ctx,
+                            const BmpImage *img,
+                            const uint8_t **message_out,
+                            size_t *message_len_out,
+                            int block_size,
+                            double contrast_threshold);
+
+// Same as steg_probe_message(), with scratch memory from ctx: probing image
+// after image allocates nothing once the scratch has grown to fit. The
+// selection cache of ctx is not used, as hashing the image would cost more
+// than the probe.
+int steg_probe_message_ctx(StegContext *ctx,
+                           const BmpImage *img,
+                           int block_size,
+                           double contrast_threshold,
+                           StegProbe *probe_out);
+
+// Same as find_low_contrast_positions() and find_low_contrast_bitmap(), but
+// the results point into ctx: they stay valid until the next call on ctx and
+// must not be freed (do not call steg_bitmap_free() on the bitmap).
+int find_low_contrast_positions_ctx(StegContext *ctx,
+                                    const BmpImage *img,
+                                    int block_size,
+                                    double contrast_threshold,
+                                    const EmbedPosition **positions_out,
+                                    size_t *count_out);
+
+int find_low_contrast_bitmap_ctx(StegContext *ctx,
+                                 const BmpImage *img,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 StegBitmap *bitmap_out);
+
 #ifdef __cplusplus
 }
 #endif
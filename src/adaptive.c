@@ -0,0 +1,222 @@
+// adaptive.c - Threshold search over one scan's block statistics.
+
+#include "adaptive.h"
+
+#include "contrast.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Relative slack that keeps decisions taken on the float variances on the
+// side the double bounds would take them (floats are within 2^-24).
+#define ADAPTIVE_FLOAT_SLACK 1e-6
+
+// Candidate k of the search is the Q8 stddev of the k-th lowest block plus
+// LUMA_Q8_MAX_ERROR, which surely selects that block; the last candidate
+// adds this instead, selecting every block.
+#define ADAPTIVE_ALL_BLOCKS_MARGIN 1.0
+
+typedef struct {
+    const BmpImage *img;
+    int32_t height;       // absolute height
+    int32_t after_row;    // only pixels after this one count
+    int32_t after_col;
+    ContrastScanner scanner; // the table scan, then the exact evaluations
+    CoverageTracker tracker;
+    float *variance;      // max_row * max_col, from contrast_scanner_scan_variance()
+    uint8_t *accept;      // max_col
+    double n2;            // (block_size^2)^2: variance scale
+    StegStats *stats;
+} AdaptiveSearch;
+
+// Digits of the radix sort: three passes cover the 32 bits of a float.
+#define ADAPTIVE_RADIX_BITS 11
+#define ADAPTIVE_RADIX_SIZE (1u << ADAPTIVE_RADIX_BITS)
+
+// Helper: sort the n floats of keys (none negative, so their bit patterns
+// order like their values) with an LSD radix sort through tmp (n floats),
+// and return whichever of the two holds the result. qsort() of a large
+// image's blocks would take longer than all the rest of the search.
+static float *sort_variances(float *keys, float *tmp, size_t n)
+{
+    size_t count[ADAPTIVE_RADIX_SIZE];
+    for (unsigned shift = 0; shift < 32u; shift += ADAPTIVE_RADIX_BITS) {
+        memset(count, 0, sizeof(count));
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t bits = 0;
+            memcpy(&bits, &keys[i], sizeof(bits));
+            ++count[(bits >> shift) & (ADAPTIVE_RADIX_SIZE - 1u)];
+        }
+        size_t pos = 0;
+        for (size_t d = 0; d < ADAPTIVE_RADIX_SIZE; ++d) {
+            size_t c = count[d];
+            count[d] = pos;
+            pos += c;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t bits = 0;
+            memcpy(&bits, &keys[i], sizeof(bits));
+            tmp[count[(bits >> shift) & (ADAPTIVE_RADIX_SIZE - 1u)]++] = keys[i];
+        }
+        float *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    return keys;
+}
+
+// Helper: Q8 stddev of a block with variance v (scaled by n^2).
+static double variance_stddev(const AdaptiveSearch *a, float v)
+{
+    return sqrt((double)v / a->n2) / 256.0;
+}
+
+// Helper: selected pixels after the header at threshold t, counting only
+// until `enough` are found.
+static size_t adaptive_count(AdaptiveSearch *a, double t, size_t enough)
+{
+    const ContrastScanner *s = &a->scanner;
+    double accept_below = 0.0;
+    double reject_above = 0.0;
+    contrast_q8_bounds(s->block_size, t, &accept_below, &reject_above);
+    float below = (float)(accept_below * (1.0 - ADAPTIVE_FLOAT_SLACK));
+    float above = (float)(reject_above * (1.0 + ADAPTIVE_FLOAT_SLACK));
+    a->scanner.contrast_threshold = t;
+    coverage_tracker_reset(&a->tracker);
+
+    int32_t max_col = s->max_col;
+    uint64_t exact = 0;
+    size_t count = 0;
+    for (int32_t y = 0; y < a->height && count < enough; ++y) {
+        if (y < s->max_row) {
+            const float *v = a->variance + (size_t)y * (size_t)max_col;
+            for (int32_t bc = 0; bc < max_col; ++bc) {
+                uint8_t accept = (uint8_t)(v[bc] < below);
+                if (!(accept | (uint8_t)(v[bc] > above))) {
+                    accept = (uint8_t)contrast_scanner_block_exact(s, y, bc);
+                    ++exact;
+                }
+                a->accept[bc] = accept;
+            }
+            coverage_tracker_add_row(&a->tracker, y, a->accept, max_col);
+        }
+        if (y > a->after_row) {
+            count += coverage_tracker_count_row(&a->tracker, y, 0, a->img->width);
+        } else if (y == a->after_row) {
+            count += coverage_tracker_count_row(&a->tracker, y, a->after_col + 1,
+                                                a->img->width);
+        }
+    }
+
+    if (a->stats != NULL) {
+        a->stats->blocks_exact += exact;
+    }
+    return count;
+}
+
+int adaptive_find_threshold(const BmpImage *img,
+                            int block_size,
+                            int bits_per_channel,
+                            int32_t after_row,
+                            int32_t after_col,
+                            size_t required_bits,
+                            StegStats *stats,
+                            double *threshold_out)
+{
+    assert(threshold_out != NULL);
+
+    double start = stats != NULL ? stats_now() : 0.0;
+
+    AdaptiveSearch a;
+    memset(&a, 0, sizeof(a));
+    a.img = img;
+    a.height = img->height > 0 ? img->height : -img->height;
+    a.after_row = after_row;
+    a.after_col = after_col;
+    a.stats = stats;
+    double n = (double)block_size * (double)block_size;
+    a.n2 = n * n;
+
+    if (contrast_scanner_init(&a.scanner, img, block_size, 0.0, NULL) != 0) {
+        return 1;
+    }
+    a.scanner.channel_mask = LUMA_CHANNEL_MASK(bits_per_channel);
+    a.scanner.stats = stats;
+
+    size_t slots_per_pixel = 3u * (size_t)bits_per_channel;
+    size_t enough = (required_bits + slots_per_pixel - 1u) / slots_per_pixel;
+    size_t blocks = (size_t)a.scanner.max_row * (size_t)a.scanner.max_col;
+    if (blocks == 0) {
+        // Nothing is ever selected; only an empty message fits.
+        contrast_scanner_free(&a.scanner);
+        if (enough > 0) {
+            return -1;
+        }
+        *threshold_out = LUMA_Q8_MAX_ERROR;
+        return 0;
+    }
+
+    a.variance = (float *)malloc(blocks * sizeof(float));
+    float *sorted = (float *)malloc(blocks * sizeof(float));
+    float *spare = (float *)malloc(blocks * sizeof(float));
+    a.accept = (uint8_t *)malloc((size_t)a.scanner.max_col);
+    if (!a.variance || !sorted || !spare || !a.accept ||
+        coverage_tracker_init(&a.tracker, img->width, block_size, NULL) != 0) {
+        if (!a.variance || !sorted || !spare || !a.accept) {
+            perror("steg_encode_message_adaptive: malloc");
+        }
+        free(a.variance);
+        free(sorted);
+        free(spare);
+        free(a.accept);
+        contrast_scanner_free(&a.scanner);
+        return 1;
+    }
+
+    // The one scan: every later step reads the table.
+    for (int32_t br = 0; br < a.scanner.max_row; ++br) {
+        contrast_scanner_scan_variance(&a.scanner, a.variance + (size_t)br *
+                                                                 (size_t)a.scanner.max_col);
+    }
+    memcpy(sorted, a.variance, blocks * sizeof(float));
+    float *result = sort_variances(sorted, spare, blocks);
+    free(result == sorted ? spare : sorted);
+    sorted = result;
+
+    // The selection only grows with the threshold, so the lowest candidate
+    // that fits is found by bisection. Candidate `blocks` selects every block.
+    size_t lo = 0;
+    size_t hi = blocks;
+    double all = variance_stddev(&a, sorted[blocks - 1u]) + ADAPTIVE_ALL_BLOCKS_MARGIN;
+    int rc = 0;
+    if (adaptive_count(&a, all, enough) < enough) {
+        rc = -1;
+    } else {
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2u;
+            double t = variance_stddev(&a, sorted[mid]) + LUMA_Q8_MAX_ERROR;
+            if (adaptive_count(&a, t, enough) >= enough) {
+                hi = mid;
+            } else {
+                lo = mid + 1u;
+            }
+        }
+        *threshold_out = hi < blocks ? variance_stddev(&a, sorted[hi]) + LUMA_Q8_MAX_ERROR
+                                     : all;
+    }
+
+    coverage_tracker_free(&a.tracker);
+    contrast_scanner_free(&a.scanner);
+    free(a.variance);
+    free(sorted);
+    free(a.accept);
+
+    if (stats != NULL) {
+        stats->scan_seconds += stats_now() - start;
+    }
+    return rc;
+}
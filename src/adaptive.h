@@ -0,0 +1,37 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+// Private to steg_lib: the threshold search of adaptive payloads
+// (STEG_FORMAT_ADAPTIVE, see steg_encode_message_adaptive()).
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bmp.h"
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Find the lowest threshold, among the block stddevs of img, at which the
+// pixels selected after pixel (after_row, after_col) in raster order hold
+// required_bits slots at bits_per_channel bits per channel. The selection at
+// the threshold found is exactly the one a scan at it makes. Counters and scan
+// time go to stats (may be NULL).
+// Returns 0 with *threshold_out set, -1 if even a threshold that selects
+// every block leaves too few slots, non-zero on other errors.
+int adaptive_find_threshold(const BmpImage *img,
+                            int block_size,
+                            int bits_per_channel,
+                            int32_t after_row,
+                            int32_t after_col,
+                            size_t required_bits,
+                            StegStats *stats,
+                            double *threshold_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+// arena.c - Bump allocator for per-call scratch buffers.
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int arena_reset(StegArena *a, size_t bytes)
+{
+    a->used = 0;
+
+    // Room for aligning the start of the block as well.
+    bytes += ARENA_ALIGN;
+    if (bytes <= a->capacity) {
+        return 0;
+    }
+
+    unsigned char *base = (unsigned char *)malloc(bytes);
+    if (!base) {
+        perror("arena_reset: malloc");
+        return 1;
+    }
+
+    free(a->base);
+    a->base = base;
+    a->capacity = bytes;
+    return 0;
+}
+
+void *arena_alloc(StegArena *a, size_t bytes)
+{
+    uintptr_t start = (uintptr_t)(a->base + a->used);
+    size_t pad = (size_t)((ARENA_ALIGN - start % ARENA_ALIGN) % ARENA_ALIGN);
+    size_t size = ARENA_SIZE(bytes);
+
+    if (a->base == NULL || pad + size > a->capacity - a->used) {
+        return NULL;
+    }
+
+    void *p = a->base + a->used + pad;
+    a->used += pad + size;
+    return p;
+}
+
+void arena_free(StegArena *a)
+{
+    free(a->base);
+    a->base = NULL;
+    a->capacity = 0;
+    a->used = 0;
+}
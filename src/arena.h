@@ -0,0 +1,42 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Private to steg_lib: bump allocator for per-call scratch buffers.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One block of memory handed out front to back and released all at once.
+// Callers reserve the total they need at the start of an operation, so the
+// block only ever grows to the largest request seen and steady-state calls
+// do not allocate.
+typedef struct {
+    unsigned char *base;
+    size_t capacity;
+    size_t used;
+} StegArena;
+
+// Alignment of every arena allocation.
+#define ARENA_ALIGN 64u
+
+// Bytes an allocation of `bytes` can take up, alignment padding included.
+#define ARENA_SIZE(bytes) ((((size_t)(bytes)) + ARENA_ALIGN - 1u) / ARENA_ALIGN * ARENA_ALIGN)
+
+// Drop all allocations and make room for at least `bytes` bytes.
+// Returns 0 on success, non-zero on allocation failure.
+int arena_reset(StegArena *a, size_t bytes);
+
+// Carve ARENA_SIZE(bytes) bytes off the arena. Returns NULL when the
+// reservation is exhausted.
+void *arena_alloc(StegArena *a, size_t bytes);
+
+void arena_free(StegArena *a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,4 @@
-// bmp.c - Simple 24-bit BMP loading/saving implementation.
+// bmp.c - Simple 24/32-bit BMP loading/saving implementation.
 
 #include "bmp.h"
 
@@ -8,38 +8,43 @@
 #include <stdlib.h>
 #include <string.h>
 
-int bmp_load(const char *filename, BmpImage *img)
-{
-    assert(img != NULL);
+#if !defined(_WIN32)
+#define BMP_HAVE_MMAP 1
+#endif
+
+#ifdef BMP_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Offset of the pixel array in the files we read and write.
+#define BMP_HEADER_SIZE 54
 
+// Helper: reset img to an empty heap image.
+static void bmp_reset(BmpImage *img)
+{
     img->data = NULL;
     img->width = 0;
     img->height = 0;
     img->stride = 0;
     img->size = 0;
+    img->bytes_per_pixel = 0;
+    img->storage = BMP_STORAGE_HEAP;
+    img->map_base = NULL;
+    img->map_len = 0;
+    img->dirty_begin = 0;
+    img->dirty_end = 0;
+}
 
-    if (filename == NULL) {
-        fprintf(stderr, "bmp_load: filename is NULL\n");
-        return 1;
-    }
-
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        perror("bmp_load: fopen");
-        return 1;
-    }
-
-    size_t read_count = fread(img->header, 1, 54, f);
-    if (read_count != 54) {
-        fprintf(stderr, "bmp_load: failed to read BMP header\n");
-        fclose(f);
-        return 1;
-    }
-
+// Helper: validate img->header and fill in the geometry fields.
+// Returns 0 on success, non-zero on failure.
+static int bmp_parse_header(BmpImage *img, const char *caller)
+{
     // Basic header checks
     if (img->header[0] != 'B' || img->header[1] != 'M') {
-        fprintf(stderr, "bmp_load: not a BMP file\n");
-        fclose(f);
+        fprintf(stderr, "%s: not a BMP file\n", caller);
         return 1;
     }
 
@@ -55,46 +60,75 @@ int bmp_load(const char *filename, BmpImage *img)
     uint32_t compression = 0;
     memcpy(&compression, img->header + 30, sizeof(uint32_t));
 
-    if (bpp != 24) {
-        fprintf(stderr, "bmp_load: only 24-bit BMP supported (got %u bpp)\n",
-                (unsigned)bpp);
-        fclose(f);
+    if (bpp != 24 && bpp != 32) {
+        fprintf(stderr, "%s: only 24-bit and 32-bit BMP supported (got %u bpp)\n",
+                caller, (unsigned)bpp);
         return 1;
     }
 
     if (compression != 0) {
-        fprintf(stderr, "bmp_load: compressed BMP not supported (compression=%u)\n",
-                (unsigned)compression);
-        fclose(f);
+        fprintf(stderr, "%s: compressed BMP not supported (compression=%u)\n",
+                caller, (unsigned)compression);
         return 1;
     }
 
     if (width <= 0 || height == 0) {
-        fprintf(stderr, "bmp_load: invalid BMP dimensions\n");
-        fclose(f);
+        fprintf(stderr, "%s: invalid BMP dimensions\n", caller);
         return 1;
     }
 
     img->width = width;
     img->height = height;
+    img->bytes_per_pixel = bpp / 8;
 
-    // BMP rows are padded to multiples of 4 bytes
+    // BMP rows are padded to multiples of 4 bytes (32-bit rows never are)
     int32_t abs_height = height > 0 ? height : -height;
-    int32_t stride = ((width * 3 + 3) / 4) * 4;
+    int32_t stride = ((width * img->bytes_per_pixel + 3) / 4) * 4;
     int32_t size = stride * abs_height;
 
     img->stride = stride;
     img->size = size;
+    return 0;
+}
+
+int bmp_load(const char *filename, BmpImage *img)
+{
+    assert(img != NULL);
 
-    img->data = (unsigned char *)malloc((size_t)size);
+    bmp_reset(img);
+
+    if (filename == NULL) {
+        fprintf(stderr, "bmp_load: filename is NULL\n");
+        return 1;
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror("bmp_load: fopen");
+        return 1;
+    }
+
+    size_t read_count = fread(img->header, 1, BMP_HEADER_SIZE, f);
+    if (read_count != BMP_HEADER_SIZE) {
+        fprintf(stderr, "bmp_load: failed to read BMP header\n");
+        fclose(f);
+        return 1;
+    }
+
+    if (bmp_parse_header(img, "bmp_load") != 0) {
+        fclose(f);
+        return 1;
+    }
+
+    img->data = (unsigned char *)malloc((size_t)img->size);
     if (!img->data) {
         perror("bmp_load: malloc");
         fclose(f);
         return 1;
     }
 
-    size_t data_read = fread(img->data, 1, (size_t)size, f);
-    if (data_read != (size_t)size) {
+    size_t data_read = fread(img->data, 1, (size_t)img->size, f);
+    if (data_read != (size_t)img->size) {
         fprintf(stderr, "bmp_load: failed to read pixel data\n");
         free(img->data);
         img->data = NULL;
@@ -106,6 +140,293 @@ int bmp_load(const char *filename, BmpImage *img)
     return 0;
 }
 
+int bmp_load_mapped(const char *filename, BmpImage *img, int storage)
+{
+    assert(img != NULL);
+
+    if (storage != BMP_STORAGE_MAP_READ && storage != BMP_STORAGE_MAP_COPY) {
+        bmp_reset(img);
+        fprintf(stderr, "bmp_load_mapped: unsupported storage %d\n", storage);
+        return 1;
+    }
+
+#ifndef BMP_HAVE_MMAP
+    return bmp_load(filename, img);
+#else
+    bmp_reset(img);
+
+    if (filename == NULL) {
+        fprintf(stderr, "bmp_load_mapped: filename is NULL\n");
+        return 1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("bmp_load_mapped: open");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("bmp_load_mapped: fstat");
+        close(fd);
+        return 1;
+    }
+
+    size_t file_len = (size_t)st.st_size;
+    if (file_len < BMP_HEADER_SIZE) {
+        fprintf(stderr, "bmp_load_mapped: failed to read BMP header\n");
+        close(fd);
+        return 1;
+    }
+
+    int prot = storage == BMP_STORAGE_MAP_READ ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = storage == BMP_STORAGE_MAP_READ ? MAP_SHARED : MAP_PRIVATE;
+    void *base = mmap(NULL, file_len, prot, flags, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (base == MAP_FAILED) {
+        perror("bmp_load_mapped: mmap");
+        return 1;
+    }
+
+    memcpy(img->header, base, BMP_HEADER_SIZE);
+    if (bmp_parse_header(img, "bmp_load_mapped") != 0) {
+        munmap(base, file_len);
+        bmp_reset(img);
+        return 1;
+    }
+
+    if (file_len - BMP_HEADER_SIZE < (size_t)img->size) {
+        fprintf(stderr, "bmp_load_mapped: failed to read pixel data\n");
+        munmap(base, file_len);
+        bmp_reset(img);
+        return 1;
+    }
+
+    img->data = (unsigned char *)base + BMP_HEADER_SIZE;
+    img->storage = storage;
+    img->map_base = base;
+    img->map_len = file_len;
+    return 0;
+#endif
+}
+
+// Helper: parse the header at the start of buf and check that the pixel
+// data is all there. Returns 0 on success, non-zero on failure.
+static int bmp_parse_memory(const unsigned char *buf, size_t len, BmpImage *img,
+                            const char *caller)
+{
+    bmp_reset(img);
+
+    if (buf == NULL) {
+        fprintf(stderr, "%s: buffer is NULL\n", caller);
+        return 1;
+    }
+
+    if (len < BMP_HEADER_SIZE) {
+        fprintf(stderr, "%s: failed to read BMP header\n", caller);
+        return 1;
+    }
+
+    memcpy(img->header, buf, BMP_HEADER_SIZE);
+    if (bmp_parse_header(img, caller) != 0) {
+        bmp_reset(img);
+        return 1;
+    }
+
+    if (len - BMP_HEADER_SIZE < (size_t)img->size) {
+        fprintf(stderr, "%s: failed to read pixel data\n", caller);
+        bmp_reset(img);
+        return 1;
+    }
+
+    return 0;
+}
+
+int bmp_load_from_memory(const unsigned char *buf, size_t len, BmpImage *img)
+{
+    assert(img != NULL);
+
+    if (bmp_parse_memory(buf, len, img, "bmp_load_from_memory") != 0) {
+        return 1;
+    }
+
+    img->data = (unsigned char *)malloc((size_t)img->size);
+    if (!img->data) {
+        perror("bmp_load_from_memory: malloc");
+        bmp_reset(img);
+        return 1;
+    }
+
+    memcpy(img->data, buf + BMP_HEADER_SIZE, (size_t)img->size);
+    return 0;
+}
+
+int bmp_wrap_memory(unsigned char *buf, size_t len, BmpImage *img)
+{
+    assert(img != NULL);
+
+    if (bmp_parse_memory(buf, len, img, "bmp_wrap_memory") != 0) {
+        return 1;
+    }
+
+    img->data = buf + BMP_HEADER_SIZE;
+    img->storage = BMP_STORAGE_BORROWED;
+    return 0;
+}
+
+int bmp_save_to_memory(const BmpImage *img, unsigned char **buf_out, size_t *len_out)
+{
+    assert(img != NULL);
+    assert(buf_out != NULL);
+    assert(len_out != NULL);
+
+    *buf_out = NULL;
+    *len_out = 0;
+
+    if (img->data == NULL || img->size <= 0) {
+        fprintf(stderr, "bmp_save_to_memory: invalid image data\n");
+        return 1;
+    }
+
+    size_t len = BMP_HEADER_SIZE + (size_t)img->size;
+    unsigned char *buf = (unsigned char *)malloc(len);
+    if (!buf) {
+        perror("bmp_save_to_memory: malloc");
+        return 1;
+    }
+
+    memcpy(buf, img->header, BMP_HEADER_SIZE);
+    memcpy(buf + BMP_HEADER_SIZE, img->data, (size_t)img->size);
+
+    *buf_out = buf;
+    *len_out = len;
+    return 0;
+}
+
+void bmp_mark_dirty(BmpImage *img, int32_t first_row, int32_t end_row)
+{
+    assert(img != NULL);
+
+    if (first_row >= end_row) {
+        return;
+    }
+
+    if (img->dirty_begin >= img->dirty_end) {
+        img->dirty_begin = first_row;
+        img->dirty_end = end_row;
+        return;
+    }
+
+    if (first_row < img->dirty_begin) {
+        img->dirty_begin = first_row;
+    }
+    if (end_row > img->dirty_end) {
+        img->dirty_end = end_row;
+    }
+}
+
+// Helper: write the header and pixels of img to f.
+// Returns 0 on success, non-zero on failure.
+static int bmp_write_file(FILE *f, const BmpImage *img)
+{
+    size_t written = fwrite(img->header, 1, BMP_HEADER_SIZE, f);
+    if (written != BMP_HEADER_SIZE) {
+        fprintf(stderr, "bmp_save: failed to write header\n");
+        return 1;
+    }
+
+    written = fwrite(img->data, 1, (size_t)img->size, f);
+    if (written != (size_t)img->size) {
+        fprintf(stderr, "bmp_save: failed to write pixel data\n");
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef BMP_HAVE_MMAP
+// Helper: create a new file next to filename, to be renamed over it by
+// bmp_replace_finish() once written. The file filename names so far is never
+// truncated, so a mapping of it (any image's) stays valid. *target_out (the
+// file a symbolic link filename points to, or filename) and *tmp_out are
+// malloc'ed. Returns the new file, or NULL on failure.
+static FILE *bmp_replace_begin(const char *filename, const char *caller,
+                               char **target_out, char **tmp_out)
+{
+    *target_out = NULL;
+    *tmp_out = NULL;
+
+    // Replace the file a symbolic link points to, not the link.
+    char *target = realpath(filename, NULL);
+    if (target == NULL) {
+        target = strdup(filename);
+    }
+    size_t tmp_size = target != NULL ? strlen(target) + 32u : 0u;
+    char *tmp = target != NULL ? (char *)malloc(tmp_size) : NULL;
+    if (tmp == NULL) {
+        fprintf(stderr, "%s: out of memory\n", caller);
+        free(target);
+        return NULL;
+    }
+
+    int fd = -1;
+    for (unsigned attempt = 0; attempt < 100u && fd < 0; ++attempt) {
+        snprintf(tmp, tmp_size, "%s.%ld.%u.tmp", target, (long)getpid(), attempt);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: open: %s\n", caller, strerror(errno));
+        free(tmp);
+        free(target);
+        return NULL;
+    }
+
+    // A file that is replaced keeps its permissions.
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        (void)fchmod(fd, st.st_mode & 07777);
+    }
+
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        fprintf(stderr, "%s: fdopen: %s\n", caller, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        free(target);
+        return NULL;
+    }
+    *target_out = target;
+    *tmp_out = tmp;
+    return f;
+}
+
+// Helper: close f, opened by bmp_replace_begin(), and rename tmp over target
+// when ok, or remove tmp. Frees both paths.
+// Returns 0 on success, non-zero on failure (always when !ok).
+static int bmp_replace_finish(FILE *f, char *target, char *tmp, int ok, const char *caller)
+{
+    int rc = ok ? 0 : 1;
+    if (fclose(f) != 0 && rc == 0) {
+        fprintf(stderr, "%s: fclose: %s\n", caller, strerror(errno));
+        rc = 1;
+    }
+    if (rc == 0 && rename(tmp, target) != 0) {
+        fprintf(stderr, "%s: rename: %s\n", caller, strerror(errno));
+        rc = 1;
+    }
+    if (rc != 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    free(target);
+    return rc;
+}
+#endif
+
 int bmp_save(const char *filename, const BmpImage *img)
 {
     assert(img != NULL);
@@ -120,45 +441,282 @@ int bmp_save(const char *filename, const BmpImage *img)
         return 1;
     }
 
+#ifdef BMP_HAVE_MMAP
+    char *target = NULL;
+    char *tmp = NULL;
+    FILE *f = bmp_replace_begin(filename, "bmp_save", &target, &tmp);
+    if (!f) {
+        return 1;
+    }
+    return bmp_replace_finish(f, target, tmp, bmp_write_file(f, img) == 0, "bmp_save");
+#else
     FILE *f = fopen(filename, "wb");
     if (!f) {
         perror("bmp_save: fopen");
         return 1;
     }
 
-    size_t written = fwrite(img->header, 1, 54, f);
-    if (written != 54) {
-        fprintf(stderr, "bmp_save: failed to write header\n");
-        fclose(f);
+    int rc = bmp_write_file(f, img);
+    if (fclose(f) != 0 && rc == 0) {
+        perror("bmp_save: fclose");
+        rc = 1;
+    }
+    return rc;
+#endif
+}
+
+int bmp_same_file(const char *a, const char *b)
+{
+    assert(a != NULL && b != NULL);
+
+#ifdef BMP_HAVE_MMAP
+    struct stat sa;
+    struct stat sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev &&
+           sa.st_ino == sb.st_ino;
+#else
+    return strcmp(a, b) == 0;
+#endif
+}
+
+int bmp_save_in_place(const char *filename, const BmpImage *img)
+{
+    assert(img != NULL);
+
+    if (filename == NULL) {
+        fprintf(stderr, "bmp_save_in_place: filename is NULL\n");
         return 1;
     }
 
-    written = fwrite(img->data, 1, (size_t)img->size, f);
-    if (written != (size_t)img->size) {
-        fprintf(stderr, "bmp_save: failed to write pixel data\n");
+    if (img->data == NULL || img->size <= 0) {
+        fprintf(stderr, "bmp_save_in_place: invalid image data\n");
+        return 1;
+    }
+
+    FILE *f = fopen(filename, "r+b");
+    if (!f) {
+        perror("bmp_save_in_place: fopen");
+        return 1;
+    }
+
+    // Only patch a file that holds the same image layout.
+    unsigned char header[BMP_HEADER_SIZE];
+    if (fread(header, 1, BMP_HEADER_SIZE, f) != BMP_HEADER_SIZE ||
+        memcmp(header, img->header, BMP_HEADER_SIZE) != 0) {
+        fprintf(stderr, "bmp_save_in_place: '%s' does not match the image header\n",
+                filename);
         fclose(f);
         return 1;
     }
 
-    fclose(f);
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    int32_t begin = img->dirty_begin < 0 ? 0 : img->dirty_begin;
+    int32_t end = img->dirty_end > abs_height ? abs_height : img->dirty_end;
+
+    if (begin < end) {
+        long offset = (long)BMP_HEADER_SIZE + (long)begin * (long)img->stride;
+        size_t len = (size_t)(end - begin) * (size_t)img->stride;
+        if (fseek(f, offset, SEEK_SET) != 0) {
+            perror("bmp_save_in_place: fseek");
+            fclose(f);
+            return 1;
+        }
+        if (fwrite(img->data + (size_t)begin * (size_t)img->stride, 1, len, f) != len) {
+            fprintf(stderr, "bmp_save_in_place: failed to write pixel data\n");
+            fclose(f);
+            return 1;
+        }
+    }
+
+    if (fclose(f) != 0) {
+        perror("bmp_save_in_place: fclose");
+        return 1;
+    }
     return 0;
 }
 
+int bmp_stream_open_read(const char *filename, BmpStream *s)
+{
+    assert(s != NULL);
+
+    memset(s, 0, sizeof(*s));
+    bmp_reset(&s->info);
+
+    if (filename == NULL) {
+        fprintf(stderr, "bmp_stream_open_read: filename is NULL\n");
+        return 1;
+    }
+
+    s->file = fopen(filename, "rb");
+    if (!s->file) {
+        perror("bmp_stream_open_read: fopen");
+        return 1;
+    }
+
+    if (fread(s->info.header, 1, BMP_HEADER_SIZE, s->file) != BMP_HEADER_SIZE) {
+        fprintf(stderr, "bmp_stream_open_read: failed to read BMP header\n");
+        bmp_stream_close(s);
+        return 1;
+    }
+
+    if (bmp_parse_header(&s->info, "bmp_stream_open_read") != 0) {
+        bmp_stream_close(s);
+        return 1;
+    }
+
+    return 0;
+}
+
+int bmp_stream_open_write(const char *filename, const BmpImage *info, BmpStream *s)
+{
+    assert(info != NULL);
+    assert(s != NULL);
+
+    memset(s, 0, sizeof(*s));
+    s->info = *info;
+    s->info.data = NULL;
+
+    if (filename == NULL) {
+        fprintf(stderr, "bmp_stream_open_write: filename is NULL\n");
+        return 1;
+    }
+
+#ifdef BMP_HAVE_MMAP
+    s->file = bmp_replace_begin(filename, "bmp_stream_open_write", &s->target, &s->tmp);
+    if (!s->file) {
+        return 1;
+    }
+#else
+    s->target = strdup(filename);
+    s->file = s->target != NULL ? fopen(filename, "wb") : NULL;
+    if (!s->file) {
+        perror("bmp_stream_open_write: fopen");
+        free(s->target);
+        s->target = NULL;
+        return 1;
+    }
+#endif
+
+    if (fwrite(info->header, 1, BMP_HEADER_SIZE, s->file) != BMP_HEADER_SIZE) {
+        fprintf(stderr, "bmp_stream_open_write: failed to write header\n");
+        bmp_stream_discard(s);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Helper: check that `rows` more rows fit in the image.
+static int bmp_stream_rows_fit(const BmpStream *s, int32_t rows, const char *caller)
+{
+    int32_t abs_height = s->info.height > 0 ? s->info.height : -s->info.height;
+    if (s->file == NULL || rows < 0 || rows > abs_height - s->rows) {
+        fprintf(stderr, "%s: rows out of range\n", caller);
+        return 0;
+    }
+    return 1;
+}
+
+int bmp_stream_read_rows(BmpStream *s, unsigned char *dst, int32_t rows)
+{
+    assert(s != NULL);
+
+    if (!bmp_stream_rows_fit(s, rows, "bmp_stream_read_rows")) {
+        return 1;
+    }
+
+    size_t len = (size_t)rows * (size_t)s->info.stride;
+    if (fread(dst, 1, len, s->file) != len) {
+        fprintf(stderr, "bmp_stream_read_rows: failed to read pixel data\n");
+        return 1;
+    }
+
+    s->rows += rows;
+    return 0;
+}
+
+int bmp_stream_write_rows(BmpStream *s, const unsigned char *src, int32_t rows)
+{
+    assert(s != NULL);
+
+    if (!bmp_stream_rows_fit(s, rows, "bmp_stream_write_rows")) {
+        return 1;
+    }
+
+    size_t len = (size_t)rows * (size_t)s->info.stride;
+    if (fwrite(src, 1, len, s->file) != len) {
+        fprintf(stderr, "bmp_stream_write_rows: failed to write pixel data\n");
+        return 1;
+    }
+
+    s->rows += rows;
+    return 0;
+}
+
+// Helper: close s, keeping what it wrote when keep.
+static int bmp_stream_finish(BmpStream *s, int keep)
+{
+    if (s == NULL || s->file == NULL) {
+        return 0;
+    }
+
+    int rc = 0;
+#ifdef BMP_HAVE_MMAP
+    if (s->tmp != NULL) {
+        rc = bmp_replace_finish(s->file, s->target, s->tmp, keep, "bmp_stream_close");
+        rc = keep ? rc : 0;
+    } else
+#endif
+    {
+        rc = fclose(s->file) != 0;
+        if (rc) {
+            perror("bmp_stream_close: fclose");
+        }
+        if (!keep && s->target != NULL) {
+            remove(s->target);
+        }
+        free(s->target);
+    }
+    s->file = NULL;
+    s->target = NULL;
+    s->tmp = NULL;
+    return rc;
+}
+
+int bmp_stream_close(BmpStream *s)
+{
+    return bmp_stream_finish(s, 1);
+}
+
+void bmp_stream_discard(BmpStream *s)
+{
+    (void)bmp_stream_finish(s, 0);
+}
+
 void bmp_free(BmpImage *img)
 {
     if (img == NULL) {
         return;
     }
 
-    if (img->data) {
+    if (img->storage == BMP_STORAGE_HEAP) {
         free(img->data);
-        img->data = NULL;
     }
+#ifdef BMP_HAVE_MMAP
+    else if (img->map_base) {
+        munmap(img->map_base, img->map_len);
+    }
+#endif
+    img->data = NULL;
 
     img->width = 0;
     img->height = 0;
     img->stride = 0;
     img->size = 0;
+    img->bytes_per_pixel = 0;
+    img->storage = BMP_STORAGE_HEAP;
+    img->map_base = NULL;
+    img->map_len = 0;
+    img->dirty_begin = 0;
+    img->dirty_end = 0;
 }
-
-
@@ -0,0 +1,191 @@
+// capacity.c - Payload capacity of a cover without building positions.
+
+#include "steg.h"
+
+#include "arena.h"
+#include "contrast.h"
+#include "payload.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Estimate mode samples a grid of tiles; each tile is evaluated exactly.
+#define CAPACITY_TILES_X 6
+#define CAPACITY_TILES_Y 6
+#define CAPACITY_TILE_SIZE 32
+
+// Helper: number of selected pixels of img inside rows [y0, y1) and columns
+// [x0, x1). Only the part of the image that can hold blocks covering that
+// window is read. Scratch comes from arena. Returns 0 on success.
+static int count_selected(const BmpImage *img,
+                          int block_size,
+                          double contrast_threshold,
+                          int32_t y0, int32_t y1,
+                          int32_t x0, int32_t x1,
+                          int bits_per_channel,
+                          StegArena *arena,
+                          size_t *count_out)
+{
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+
+    // Blocks covering the window start at most block_size - 1 pixels before
+    // it and end at most block_size - 1 pixels after it.
+    int32_t margin = block_size - 1;
+    int32_t vy0 = y0 - margin > 0 ? y0 - margin : 0;
+    int32_t vx0 = x0 - margin > 0 ? x0 - margin : 0;
+    int32_t vy1 = y1 + margin < abs_height ? y1 + margin : abs_height;
+    int32_t vx1 = x1 + margin < img->width ? x1 + margin : img->width;
+
+    // View of that region; rows keep the image stride.
+    BmpImage view = *img;
+    view.data = img->data + (size_t)vy0 * (size_t)img->stride +
+                (size_t)vx0 * (size_t)bmp_pixel_bytes(img);
+    view.width = vx1 - vx0;
+    view.height = vy1 - vy0;
+
+    size_t scratch = contrast_scanner_scratch_size(view.width, block_size) +
+                     coverage_tracker_scratch_size(view.width) +
+                     ARENA_SIZE((size_t)view.width);
+    if (arena_reset(arena, scratch) != 0) {
+        return 1;
+    }
+
+    ContrastScanner scanner;
+    CoverageTracker tracker;
+    if (contrast_scanner_init(&scanner, &view, block_size, contrast_threshold, arena) != 0) {
+        return 1;
+    }
+    scanner.channel_mask = LUMA_CHANNEL_MASK(bits_per_channel);
+    if (coverage_tracker_init(&tracker, view.width, block_size, arena) != 0) {
+        contrast_scanner_free(&scanner);
+        return 1;
+    }
+    uint8_t *accept = (uint8_t *)arena_alloc(arena, (size_t)view.width);
+    assert(accept != NULL);
+
+    size_t count = 0;
+    for (int32_t y = 0; y < y1 - vy0; ++y) {
+        if (y < scanner.max_row) {
+            contrast_scanner_scan_row(&scanner, accept);
+            coverage_tracker_add_row(&tracker, y, accept, scanner.max_col);
+        }
+        if (y >= y0 - vy0) {
+            count += coverage_tracker_count_row(&tracker, y, x0 - vx0, x1 - vx0);
+        }
+    }
+
+    coverage_tracker_free(&tracker);
+    contrast_scanner_free(&scanner);
+
+    *count_out = count;
+    return 0;
+}
+
+// Helper: start of tile i of n tiles of size `tile` spread over `extent`.
+static int32_t tile_origin(int i, int n, int32_t extent, int32_t tile)
+{
+    if (n <= 1) {
+        return (extent - tile) / 2;
+    }
+    return (int32_t)((int64_t)i * (extent - tile) / (n - 1));
+}
+
+int steg_query_capacity(const BmpImage *img,
+                        int block_size,
+                        double contrast_threshold,
+                        int mode,
+                        StegCapacity *capacity_out)
+{
+    return steg_query_capacity_depth(img, block_size, contrast_threshold, 1, mode,
+                                     capacity_out);
+}
+
+int steg_query_capacity_depth(const BmpImage *img,
+                              int block_size,
+                              double contrast_threshold,
+                              int bits_per_channel,
+                              int mode,
+                              StegCapacity *capacity_out)
+{
+    assert(capacity_out != NULL);
+
+    memset(capacity_out, 0, sizeof(*capacity_out));
+
+    if (img == NULL || img->data == NULL) {
+        fprintf(stderr, "steg_query_capacity: invalid image\n");
+        return 1;
+    }
+
+    if (block_size <= 0) {
+        fprintf(stderr, "steg_query_capacity: block_size must be > 0\n");
+        return 1;
+    }
+
+    if (bits_per_channel < 1 || bits_per_channel > STEG_MAX_BITS_PER_CHANNEL) {
+        fprintf(stderr, "steg_query_capacity: bits_per_channel must be 1..%d\n",
+                STEG_MAX_BITS_PER_CHANNEL);
+        return 1;
+    }
+
+    if (mode != STEG_CAPACITY_EXACT && mode != STEG_CAPACITY_ESTIMATE) {
+        fprintf(stderr, "steg_query_capacity: unsupported mode %d\n", mode);
+        return 1;
+    }
+
+    int32_t width = img->width;
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    if (width <= 0 || abs_height <= 0) {
+        fprintf(stderr, "steg_query_capacity: invalid dimensions\n");
+        return 1;
+    }
+
+    StegArena arena;
+    memset(&arena, 0, sizeof(arena));
+
+    // Sampling only pays off when the tiles cover a small part of the image.
+    size_t total_pixels = (size_t)width * (size_t)abs_height;
+    size_t tile_pixels = (size_t)CAPACITY_TILES_X * CAPACITY_TILES_Y *
+                         CAPACITY_TILE_SIZE * CAPACITY_TILE_SIZE;
+    int estimate = mode == STEG_CAPACITY_ESTIMATE &&
+                   width >= CAPACITY_TILES_X * CAPACITY_TILE_SIZE &&
+                   abs_height >= CAPACITY_TILES_Y * CAPACITY_TILE_SIZE &&
+                   tile_pixels * 4u <= total_pixels;
+
+    size_t selected = 0;
+    if (!estimate) {
+        if (count_selected(img, block_size, contrast_threshold, 0, abs_height, 0, width,
+                           bits_per_channel, &arena, &selected) != 0) {
+            arena_free(&arena);
+            return 1;
+        }
+    } else {
+        size_t sampled = 0;
+        for (int ty = 0; ty < CAPACITY_TILES_Y; ++ty) {
+            int32_t y0 = tile_origin(ty, CAPACITY_TILES_Y, abs_height, CAPACITY_TILE_SIZE);
+            for (int tx = 0; tx < CAPACITY_TILES_X; ++tx) {
+                int32_t x0 = tile_origin(tx, CAPACITY_TILES_X, width, CAPACITY_TILE_SIZE);
+                size_t count = 0;
+                if (count_selected(img, block_size, contrast_threshold,
+                                   y0, y0 + CAPACITY_TILE_SIZE,
+                                   x0, x0 + CAPACITY_TILE_SIZE, bits_per_channel,
+                                   &arena, &count) != 0) {
+                    arena_free(&arena);
+                    return 1;
+                }
+                sampled += count;
+            }
+        }
+        selected = (size_t)((double)sampled * (double)total_pixels / (double)tile_pixels + 0.5);
+        capacity_out->estimated = 1;
+    }
+
+    arena_free(&arena);
+
+    capacity_out->selected_pixels = selected;
+    capacity_out->bits = selected * 3u * (size_t)bits_per_channel;
+    size_t bytes = capacity_out->bits / 8u;
+    capacity_out->max_message_len = payload_max_message_len(STEG_FORMAT_COMPACT, bytes);
+    return 0;
+}
@@ -0,0 +1,400 @@
+// codec.c - LZ4 and zstd payload compression, loaded at runtime.
+//
+// Like the OpenCL backend, the libraries are opened with dlopen() on first
+// use, so building needs neither their headers nor their import libraries
+// and a codec whose library is missing is simply unavailable. Only the
+// streaming entry points used here are declared, with the types of the
+// stable lz4frame (LZ4F_VERSION 100) and zstd 1.4+ ABIs.
+
+#include "codec.h"
+
+#include "steg.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Input is compressed, and compressed input requested, this much at a time.
+#define CODEC_CHUNK 16384u
+
+typedef struct LZ4F_cctx_s LZ4F_cctx;
+typedef struct LZ4F_dctx_s LZ4F_dctx;
+#define LZ4F_VERSION 100u
+
+typedef struct {
+    const void *src;
+    size_t size;
+    size_t pos;
+} ZstdInBuffer;
+
+typedef struct {
+    void *dst;
+    size_t size;
+    size_t pos;
+} ZstdOutBuffer;
+
+#define ZSTD_E_END 2
+
+typedef struct {
+    size_t (*createCompressionContext)(LZ4F_cctx **, unsigned);
+    size_t (*freeCompressionContext)(LZ4F_cctx *);
+    size_t (*compressBegin)(LZ4F_cctx *, void *, size_t, const void *);
+    size_t (*compressBound)(size_t, const void *);
+    size_t (*compressUpdate)(LZ4F_cctx *, void *, size_t, const void *, size_t, const void *);
+    size_t (*compressEnd)(LZ4F_cctx *, void *, size_t, const void *);
+    size_t (*compressFrameBound)(size_t, const void *);
+    size_t (*createDecompressionContext)(LZ4F_dctx **, unsigned);
+    size_t (*freeDecompressionContext)(LZ4F_dctx *);
+    size_t (*decompress)(LZ4F_dctx *, void *, size_t *, const void *, size_t *, const void *);
+    unsigned (*isError)(size_t);
+} Lz4Api;
+
+typedef struct {
+    void *(*createCCtx)(void);
+    size_t (*freeCCtx)(void *);
+    size_t (*compressStream2)(void *, ZstdOutBuffer *, ZstdInBuffer *, int);
+    size_t (*CStreamOutSize)(void);
+    size_t (*compressBound)(size_t);
+    void *(*createDCtx)(void);
+    size_t (*freeDCtx)(void *);
+    size_t (*decompressStream)(void *, ZstdOutBuffer *, ZstdInBuffer *);
+    unsigned (*isError)(size_t);
+} ZstdApi;
+
+static Lz4Api lz4;
+static ZstdApi zstd;
+static int lz4_loaded;
+static int zstd_loaded;
+static pthread_once_t lz4_once = PTHREAD_ONCE_INIT;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    void **slot;
+    const char *name;
+} CodecSymbol;
+
+// Helper: open the first library found and resolve every symbol. The
+// library stays loaded for the life of the process. Returns 1 on success.
+static int codec_load(const char *const *libraries, const CodecSymbol *symbols, size_t count)
+{
+    void *library = NULL;
+    for (size_t i = 0; libraries[i] != NULL && library == NULL; ++i) {
+        library = dlopen(libraries[i], RTLD_NOW | RTLD_LOCAL);
+    }
+    if (library == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        // POSIX guarantees that data and function pointers convert.
+        *symbols[i].slot = dlsym(library, symbols[i].name);
+        if (*symbols[i].slot == NULL) {
+            dlclose(library);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void lz4_load(void)
+{
+    static const char *const libraries[] = {"liblz4.so.1", "liblz4.so", "liblz4.1.dylib", NULL};
+    const CodecSymbol symbols[] = {
+        {(void **)&lz4.createCompressionContext, "LZ4F_createCompressionContext"},
+        {(void **)&lz4.freeCompressionContext, "LZ4F_freeCompressionContext"},
+        {(void **)&lz4.compressBegin, "LZ4F_compressBegin"},
+        {(void **)&lz4.compressBound, "LZ4F_compressBound"},
+        {(void **)&lz4.compressUpdate, "LZ4F_compressUpdate"},
+        {(void **)&lz4.compressEnd, "LZ4F_compressEnd"},
+        {(void **)&lz4.compressFrameBound, "LZ4F_compressFrameBound"},
+        {(void **)&lz4.createDecompressionContext, "LZ4F_createDecompressionContext"},
+        {(void **)&lz4.freeDecompressionContext, "LZ4F_freeDecompressionContext"},
+        {(void **)&lz4.decompress, "LZ4F_decompress"},
+        {(void **)&lz4.isError, "LZ4F_isError"},
+    };
+    lz4_loaded = codec_load(libraries, symbols, sizeof(symbols) / sizeof(symbols[0]));
+}
+
+static void zstd_load(void)
+{
+    static const char *const libraries[] = {"libzstd.so.1", "libzstd.so", "libzstd.1.dylib",
+                                            NULL};
+    const CodecSymbol symbols[] = {
+        {(void **)&zstd.createCCtx, "ZSTD_createCCtx"},
+        {(void **)&zstd.freeCCtx, "ZSTD_freeCCtx"},
+        {(void **)&zstd.compressStream2, "ZSTD_compressStream2"},
+        {(void **)&zstd.CStreamOutSize, "ZSTD_CStreamOutSize"},
+        {(void **)&zstd.compressBound, "ZSTD_compressBound"},
+        {(void **)&zstd.createDCtx, "ZSTD_createDCtx"},
+        {(void **)&zstd.freeDCtx, "ZSTD_freeDCtx"},
+        {(void **)&zstd.decompressStream, "ZSTD_decompressStream"},
+        {(void **)&zstd.isError, "ZSTD_isError"},
+    };
+    zstd_loaded = codec_load(libraries, symbols, sizeof(symbols) / sizeof(symbols[0]));
+}
+
+int codec_available(int codec)
+{
+    if (codec == STEG_CODEC_LZ4) {
+        pthread_once(&lz4_once, lz4_load);
+        return lz4_loaded;
+    }
+    if (codec == STEG_CODEC_ZSTD) {
+        pthread_once(&zstd_once, zstd_load);
+        return zstd_loaded;
+    }
+    return 0;
+}
+
+const char *codec_name(int codec)
+{
+    return codec == STEG_CODEC_LZ4 ? "lz4" : codec == STEG_CODEC_ZSTD ? "zstd" : "none";
+}
+
+size_t codec_compress_bound(int codec, size_t len)
+{
+    if (!codec_available(codec)) {
+        return 0;
+    }
+    return codec == STEG_CODEC_LZ4 ? lz4.compressFrameBound(len, NULL) : zstd.compressBound(len);
+}
+
+int codec_magic_matches(int codec, const uint8_t *magic)
+{
+    // Both magic numbers are stored little-endian.
+    uint32_t value = (uint32_t)magic[0] | (uint32_t)magic[1] << 8 |
+                     (uint32_t)magic[2] << 16 | (uint32_t)magic[3] << 24;
+    if (codec == STEG_CODEC_LZ4) {
+        return value == 0x184D2204u;
+    }
+    if (codec == STEG_CODEC_ZSTD) {
+        return value == 0xFD2FB528u;
+    }
+    return 0;
+}
+
+static int lz4_compress(const uint8_t *src, size_t len, CodecSinkFn sink, void *ctx)
+{
+    LZ4F_cctx *cctx = NULL;
+    if (lz4.isError(lz4.createCompressionContext(&cctx, LZ4F_VERSION))) {
+        fprintf(stderr, "codec_compress: lz4 context creation failed\n");
+        return 1;
+    }
+
+    // Large enough for the frame header too.
+    size_t cap = lz4.compressBound(CODEC_CHUNK, NULL);
+    uint8_t *out = (uint8_t *)malloc(cap);
+    if (!out) {
+        perror("codec_compress: malloc");
+        lz4.freeCompressionContext(cctx);
+        return 1;
+    }
+
+    int rc = 0;
+    size_t n = lz4.compressBegin(cctx, out, cap, NULL);
+    if (lz4.isError(n)) {
+        rc = 1;
+    } else if (sink(ctx, out, n) != 0) {
+        rc = -1;
+    }
+    for (size_t pos = 0; rc == 0 && pos < len; pos += CODEC_CHUNK) {
+        size_t chunk = len - pos < CODEC_CHUNK ? len - pos : CODEC_CHUNK;
+        n = lz4.compressUpdate(cctx, out, cap, src + pos, chunk, NULL);
+        if (lz4.isError(n)) {
+            rc = 1;
+        } else if (n > 0 && sink(ctx, out, n) != 0) {
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        n = lz4.compressEnd(cctx, out, cap, NULL);
+        if (lz4.isError(n)) {
+            rc = 1;
+        } else if (sink(ctx, out, n) != 0) {
+            rc = -1;
+        }
+    }
+    if (rc == 1) {
+        fprintf(stderr, "codec_compress: lz4 compression failed\n");
+    }
+
+    free(out);
+    lz4.freeCompressionContext(cctx);
+    return rc;
+}
+
+static int zstd_compress(const uint8_t *src, size_t len, CodecSinkFn sink, void *ctx)
+{
+    void *cctx = zstd.createCCtx();
+    size_t cap = zstd.CStreamOutSize();
+    uint8_t *out = (uint8_t *)malloc(cap);
+    if (!cctx || !out) {
+        fprintf(stderr, "codec_compress: zstd setup failed\n");
+        free(out);
+        zstd.freeCCtx(cctx);
+        return 1;
+    }
+
+    // One ZSTD_e_end pass: zstd works through the input in blocks and hands
+    // back one staging buffer of output at a time.
+    int rc = 0;
+    ZstdInBuffer in = {src, len, 0};
+    size_t remaining;
+    do {
+        ZstdOutBuffer o = {out, cap, 0};
+        remaining = zstd.compressStream2(cctx, &o, &in, ZSTD_E_END);
+        if (zstd.isError(remaining)) {
+            fprintf(stderr, "codec_compress: zstd compression failed\n");
+            rc = 1;
+        } else if (o.pos > 0 && sink(ctx, out, o.pos) != 0) {
+            rc = -1;
+        }
+    } while (rc == 0 && remaining != 0);
+
+    free(out);
+    zstd.freeCCtx(cctx);
+    return rc;
+}
+
+int codec_compress(int codec, const uint8_t *src, size_t len, CodecSinkFn sink, void *ctx)
+{
+    if (!codec_available(codec)) {
+        fprintf(stderr, "codec_compress: %s is not available\n", codec_name(codec));
+        return 1;
+    }
+    return codec == STEG_CODEC_LZ4 ? lz4_compress(src, len, sink, ctx)
+                                   : zstd_compress(src, len, sink, ctx);
+}
+
+// Staged compressed input of codec_decompress().
+typedef struct {
+    uint8_t bytes[CODEC_CHUNK];
+    size_t len;
+    size_t pos;
+    size_t consumed;
+    CodecSourceFn source;
+    void *ctx;
+} CodecInput;
+
+// Helper: refill an exhausted input with up to `want` bytes (at least one,
+// at most a chunk). Returns 0 when bytes are available.
+static int codec_input_refill(CodecInput *in, size_t want)
+{
+    if (in->pos < in->len) {
+        return 0;
+    }
+    if (want == 0) {
+        want = 1;
+    }
+    if (want > CODEC_CHUNK) {
+        want = CODEC_CHUNK;
+    }
+    in->len = in->source(in->ctx, in->bytes, want);
+    in->pos = 0;
+    in->consumed += in->len;
+    return in->len > 0 ? 0 : 1;
+}
+
+static int lz4_decompress(CodecInput *in, uint8_t *dst, size_t len)
+{
+    LZ4F_dctx *dctx = NULL;
+    if (lz4.isError(lz4.createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        return 1;
+    }
+
+    int rc = 1;
+    size_t out_pos = 0;
+    for (;;) {
+        size_t src_size = in->len - in->pos;
+        size_t dst_size = len - out_pos;
+        size_t hint = lz4.decompress(dctx, dst + out_pos, &dst_size, in->bytes + in->pos,
+                                     &src_size, NULL);
+        if (lz4.isError(hint)) {
+            break;
+        }
+        in->pos += src_size;
+        out_pos += dst_size;
+        if (hint == 0) {
+            rc = out_pos == len ? 0 : 1;
+            break;
+        }
+        // Output full with the frame unfinished: longer than the header said.
+        if (src_size == 0 && dst_size == 0 && in->pos < in->len) {
+            break;
+        }
+        if (codec_input_refill(in, hint) != 0) {
+            break;
+        }
+    }
+
+    lz4.freeDecompressionContext(dctx);
+    return rc;
+}
+
+static int zstd_decompress(CodecInput *in, uint8_t *dst, size_t len)
+{
+    void *dctx = zstd.createDCtx();
+    if (!dctx) {
+        return 1;
+    }
+
+    int rc = 1;
+    ZstdOutBuffer out = {dst, len, 0};
+    for (;;) {
+        ZstdInBuffer src = {in->bytes, in->len, in->pos};
+        size_t before = out.pos;
+        size_t hint = zstd.decompressStream(dctx, &out, &src);
+        if (zstd.isError(hint)) {
+            break;
+        }
+        int progress = src.pos != in->pos || out.pos != before;
+        in->pos = src.pos;
+        if (hint == 0) {
+            rc = out.pos == len ? 0 : 1;
+            break;
+        }
+        if (!progress && in->pos < in->len) {
+            break;
+        }
+        if (in->pos == in->len && codec_input_refill(in, hint) != 0) {
+            break;
+        }
+    }
+
+    zstd.freeDCtx(dctx);
+    return rc;
+}
+
+int codec_decompress(int codec,
+                     const uint8_t *prefix,
+                     size_t prefix_len,
+                     CodecSourceFn source,
+                     void *ctx,
+                     uint8_t *dst,
+                     size_t len,
+                     size_t *consumed_out)
+{
+    *consumed_out = 0;
+    if (!codec_available(codec) || prefix_len > CODEC_CHUNK) {
+        return 1;
+    }
+
+    CodecInput *in = (CodecInput *)malloc(sizeof(CodecInput));
+    if (!in) {
+        perror("codec_decompress: malloc");
+        return 1;
+    }
+    memcpy(in->bytes, prefix, prefix_len);
+    in->len = prefix_len;
+    in->pos = 0;
+    in->consumed = prefix_len;
+    in->source = source;
+    in->ctx = ctx;
+
+    int rc = codec == STEG_CODEC_LZ4 ? lz4_decompress(in, dst, len) : zstd_decompress(in, dst, len);
+    *consumed_out = in->consumed;
+    free(in);
+    return rc;
+}
@@ -0,0 +1,76 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+// Private to steg_lib: payload compression (STEG_CODEC_*) for the compressed
+// payload header. Built from codec.c, which loads liblz4 and libzstd at run
+// time, with STEG_ENABLE_COMPRESSION, from codec_none.c (no codec) otherwise.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Every compressed frame starts with a 4-byte magic number.
+#define CODEC_MAGIC_BYTES 4u
+
+// Most bytes one byte of a codec frame can decompress to, a property of the
+// format rather than of the library: an LZ4 match grows by at most 255 bytes
+// per byte, and a zstd RLE block (3-byte header and the repeated byte) expands
+// to at most 128 KiB. Bounds the stored length of a compressed payload by the
+// frame that can follow it. 0 for an unknown codec.
+#define CODEC_LZ4_MAX_RATIO 255u
+#define CODEC_ZSTD_MAX_RATIO (131072u / 4u)
+static inline size_t codec_max_ratio(int codec)
+{
+    return codec == STEG_CODEC_LZ4 ? CODEC_LZ4_MAX_RATIO
+         : codec == STEG_CODEC_ZSTD ? CODEC_ZSTD_MAX_RATIO : 0u;
+}
+
+// Receives compressed output. Returns 0 to go on, non-zero to stop.
+typedef int (*CodecSinkFn)(void *ctx, const uint8_t *data, size_t len);
+
+// Supplies compressed input: at most max bytes into dst. Returns how many
+// were written, 0 when there are no more.
+typedef size_t (*CodecSourceFn)(void *ctx, uint8_t *dst, size_t max);
+
+// 1 when codec (not STEG_CODEC_NONE) can be used in this process.
+int codec_available(int codec);
+
+// Library name of codec, for messages.
+const char *codec_name(int codec);
+
+// Upper bound on the compressed size of len bytes.
+size_t codec_compress_bound(int codec, size_t len);
+
+// Compress src into one self-delimiting frame, handed to sink a piece at a
+// time through a fixed staging buffer. Returns 0 on success, -1 when sink
+// stopped, 1 on other errors.
+int codec_compress(int codec, const uint8_t *src, size_t len, CodecSinkFn sink, void *ctx);
+
+// 1 when the first CODEC_MAGIC_BYTES bytes of a frame are those of codec.
+int codec_magic_matches(int codec, const uint8_t *magic);
+
+// Decompress one frame into dst, which it must fill exactly (len bytes). The
+// frame starts with the prefix_len bytes of prefix and continues with what
+// source supplies, which is only asked for as much as the codec expects
+// next. *consumed_out is the size of the frame read so far.
+// Returns 0 on success, non-zero when the frame is damaged or its size does
+// not match len.
+int codec_decompress(int codec,
+                     const uint8_t *prefix,
+                     size_t prefix_len,
+                     CodecSourceFn source,
+                     void *ctx,
+                     uint8_t *dst,
+                     size_t len,
+                     size_t *consumed_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
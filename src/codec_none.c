@@ -0,0 +1,62 @@
+// codec_none.c - Payload compression when the library is built without it.
+// No codec is ever available, so compressed encodes fail and compressed
+// payloads cannot be decoded.
+
+#include "codec.h"
+
+#include "steg.h"
+
+int codec_available(int codec)
+{
+    (void)codec;
+    return 0;
+}
+
+const char *codec_name(int codec)
+{
+    return codec == STEG_CODEC_LZ4 ? "lz4" : codec == STEG_CODEC_ZSTD ? "zstd" : "none";
+}
+
+size_t codec_compress_bound(int codec, size_t len)
+{
+    (void)codec;
+    (void)len;
+    return 0;
+}
+
+int codec_compress(int codec, const uint8_t *src, size_t len, CodecSinkFn sink, void *ctx)
+{
+    (void)codec;
+    (void)src;
+    (void)len;
+    (void)sink;
+    (void)ctx;
+    return 1;
+}
+
+int codec_magic_matches(int codec, const uint8_t *magic)
+{
+    (void)codec;
+    (void)magic;
+    return 0;
+}
+
+int codec_decompress(int codec,
+                     const uint8_t *prefix,
+                     size_t prefix_len,
+                     CodecSourceFn source,
+                     void *ctx,
+                     uint8_t *dst,
+                     size_t len,
+                     size_t *consumed_out)
+{
+    (void)codec;
+    (void)prefix;
+    (void)prefix_len;
+    (void)source;
+    (void)ctx;
+    (void)dst;
+    (void)len;
+    *consumed_out = 0;
+    return 1;
+}
@@ -0,0 +1,696 @@
+// contrast.c - Low-contrast block scan and coverage tracking.
+
+#include "contrast.h"
+
+#include "stats.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Helper: compute luminance for a pixel given its RGB values.
+static double compute_luminance(unsigned char r,
+                                unsigned char g,
+                                unsigned char b)
+{
+    // Standard ITU-R BT.601 luma transform.
+    return 0.299 * (double)r + 0.587 * (double)g + 0.114 * (double)b;
+}
+
+// Relative slack added to the tie band to absorb floating-point rounding in
+// the variance computations on either side.
+#define CONTRAST_TIE_EPSILON 1e-9
+
+void contrast_scanner_free(ContrastScanner *s)
+{
+    if (s->owns_buffers) {
+        free(s->sat_sum);
+        free(s->sat_sq);
+        free(s->col_sum);
+        free(s->col_sq);
+        free(s->lum_ring);
+        free(s->lum_row);
+    }
+    s->sat_sum = NULL;
+    s->sat_sq = NULL;
+    s->col_sum = NULL;
+    s->col_sq = NULL;
+    s->lum_ring = NULL;
+    s->lum_row = NULL;
+}
+
+// Helper: the buffer sizes (in elements) of a layout: two uint64_t tables of
+// `table` entries, a uint16_t ring of `ring` entries and a uint16_t row of
+// `row` entries.
+static void contrast_scanner_sizes(int32_t width,
+                                   int block_size,
+                                   int layout,
+                                   size_t *table,
+                                   size_t *ring,
+                                   size_t *row)
+{
+    if (layout == CONTRAST_LAYOUT_INTEGRAL) {
+        *table = ((size_t)block_size + 1u) * ((size_t)width + 1u);
+        *ring = 0;
+        *row = (size_t)width;
+    } else {
+        *table = (size_t)width;
+        *ring = (size_t)block_size * (size_t)width;
+        *row = width < CONTRAST_TILE_COLS ? (size_t)width : (size_t)CONTRAST_TILE_COLS;
+    }
+}
+
+size_t contrast_scanner_layout_scratch_size(int32_t width, int block_size, int layout)
+{
+    size_t table = 0;
+    size_t ring = 0;
+    size_t row = 0;
+    contrast_scanner_sizes(width, block_size, layout, &table, &ring, &row);
+    return 2u * ARENA_SIZE(table * sizeof(uint64_t)) +
+           (ring > 0 ? ARENA_SIZE(ring * sizeof(uint16_t)) : 0u) +
+           ARENA_SIZE(row * sizeof(uint16_t));
+}
+
+size_t contrast_scanner_scratch_size(int32_t width, int block_size)
+{
+    return contrast_scanner_layout_scratch_size(width, block_size, CONTRAST_LAYOUT_DEFAULT);
+}
+
+int contrast_scanner_init(ContrastScanner *s,
+                          const BmpImage *img,
+                          int block_size,
+                          double contrast_threshold,
+                          StegArena *arena)
+{
+    return contrast_scanner_init_layout(s, img, block_size, contrast_threshold,
+                                        CONTRAST_LAYOUT_DEFAULT, arena);
+}
+
+int contrast_scanner_init_layout(ContrastScanner *s,
+                                 const BmpImage *img,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 int layout,
+                                 StegArena *arena)
+{
+    int32_t width = img->width;
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+
+    memset(s, 0, sizeof(*s));
+    s->img = img;
+    s->pixel_bytes = bmp_pixel_bytes(img);
+    s->luma_row = luma_row_best_px(s->pixel_bytes);
+    s->layout = layout;
+    s->channel_mask = LUMA_CHANNEL_MASK(1);
+    s->width = width;
+    s->block_size = block_size;
+    s->contrast_threshold = contrast_threshold;
+    s->max_row = abs_height - block_size + 1;
+    s->max_col = width - block_size + 1;
+    s->sat_stride = (size_t)width + 1u;
+
+    if (s->max_row <= 0 || s->max_col <= 0) {
+        s->max_row = 0;
+        s->max_col = 0;
+        return 0;
+    }
+
+    size_t table = 0;
+    size_t ring = 0;
+    size_t row = 0;
+    contrast_scanner_sizes(width, block_size, layout, &table, &ring, &row);
+    uint64_t **sum = layout == CONTRAST_LAYOUT_INTEGRAL ? &s->sat_sum : &s->col_sum;
+    uint64_t **sq = layout == CONTRAST_LAYOUT_INTEGRAL ? &s->sat_sq : &s->col_sq;
+
+    if (arena != NULL) {
+        *sum = (uint64_t *)arena_alloc(arena, table * sizeof(uint64_t));
+        *sq = (uint64_t *)arena_alloc(arena, table * sizeof(uint64_t));
+        if (ring > 0) {
+            s->lum_ring = (uint16_t *)arena_alloc(arena, ring * sizeof(uint16_t));
+        }
+        s->lum_row = (uint16_t *)arena_alloc(arena, row * sizeof(uint16_t));
+        if (!*sum || !*sq || (ring > 0 && !s->lum_ring) || !s->lum_row) {
+            fprintf(stderr, "contrast_scanner_init: arena exhausted\n");
+            contrast_scanner_free(s);
+            return 1;
+        }
+        memset(*sum, 0, table * sizeof(uint64_t));
+        memset(*sq, 0, table * sizeof(uint64_t));
+    } else {
+        s->owns_buffers = 1;
+        *sum = (uint64_t *)calloc(table, sizeof(uint64_t));
+        *sq = (uint64_t *)calloc(table, sizeof(uint64_t));
+        if (ring > 0) {
+            s->lum_ring = (uint16_t *)malloc(ring * sizeof(uint16_t));
+        }
+        s->lum_row = (uint16_t *)malloc(row * sizeof(uint16_t));
+        if (!*sum || !*sq || (ring > 0 && !s->lum_ring) || !s->lum_row) {
+            perror("contrast_scanner_init: malloc");
+            contrast_scanner_free(s);
+            return 1;
+        }
+    }
+
+    // Integral row 0 is all zeros; the tiled window starts out empty.
+    s->sat_rows = 1;
+    return 0;
+}
+
+void contrast_scanner_seek(ContrastScanner *s, int32_t br)
+{
+    assert(s->next_row == 0 && s->sat_rows <= 1 && s->win_rows == 0);
+    assert(br >= 0 && br <= s->max_row);
+
+    if (s->max_row == 0) {
+        return;
+    }
+
+    // Only differences of integral rows are ever used, so the tables may as
+    // well start from zero at row br: its ring slot is still all zeros. The
+    // tiled window simply fills from row br.
+    s->next_row = br;
+    s->sat_rows = br + 1;
+    s->win_top = br;
+}
+
+int32_t contrast_scanner_rows_read(const ContrastScanner *s)
+{
+    if (s->layout == CONTRAST_LAYOUT_INTEGRAL) {
+        return s->sat_rows > 0 ? s->sat_rows - 1 : 0;
+    }
+    return s->win_top + s->win_rows;
+}
+
+// Helper: Q8 luma of columns [x0, x0 + count) of image row y into lum_row.
+static void contrast_scanner_luma(ContrastScanner *s, int32_t y, int32_t x0, int32_t count)
+{
+    const unsigned char *src = contrast_scanner_row(s, y) + (size_t)x0 * (size_t)s->pixel_bytes;
+    if (s->stats != NULL) {
+        double start = stats_now();
+        s->luma_row(src, s->lum_row, count, s->channel_mask);
+        s->stats->luma_seconds += stats_now() - start;
+    } else {
+        s->luma_row(src, s->lum_row, count, s->channel_mask);
+    }
+}
+
+// Append integral row sat_rows, built from image row sat_rows - 1.
+static void contrast_scanner_push_row(ContrastScanner *s)
+{
+    size_t ring = (size_t)s->block_size + 1u;
+    int32_t y = s->sat_rows - 1;
+    const uint64_t *prev_sum = s->sat_sum + ((size_t)y % ring) * s->sat_stride;
+    const uint64_t *prev_sq = s->sat_sq + ((size_t)y % ring) * s->sat_stride;
+    uint64_t *cur_sum = s->sat_sum + ((size_t)s->sat_rows % ring) * s->sat_stride;
+    uint64_t *cur_sq = s->sat_sq + ((size_t)s->sat_rows % ring) * s->sat_stride;
+
+    // We treat rows in the order stored in data, which is bottom-up for
+    // positive height. Since encode and decode both use the same convention,
+    // consistency is all we need. The kernel never reads the row padding.
+    const uint16_t *lum_row = s->lum_row;
+    contrast_scanner_luma(s, y, 0, s->width);
+    uint64_t acc_sum = 0;
+    uint64_t acc_sq = 0;
+
+    cur_sum[0] = 0;
+    cur_sq[0] = 0;
+    for (int32_t col = 0; col < s->width; ++col) {
+        uint64_t v = lum_row[col];
+        acc_sum += v;
+        acc_sq += v * v;
+        cur_sum[col + 1] = prev_sum[col + 1] + acc_sum;
+        cur_sq[col + 1] = prev_sq[col + 1] + acc_sq;
+    }
+
+    ++s->sat_rows;
+}
+
+// Reference two-pass evaluation on floating-point luma computed straight from
+// the pixels, identical to the original per-block loop. Only used for blocks
+// whose stddev sits right at the threshold.
+static int block_is_low_contrast_exact(const ContrastScanner *s,
+                                       int32_t br,
+                                       int32_t bc)
+{
+    int block_size = s->block_size;
+    unsigned char mask = s->channel_mask;
+    size_t pixel_bytes = (size_t)s->pixel_bytes;
+    double sum = 0.0;
+    int n = 0;
+    for (int r = 0; r < block_size; ++r) {
+        const unsigned char *px = contrast_scanner_row(s, br + r) + (size_t)bc * pixel_bytes;
+        for (int c = 0; c < block_size; ++c) {
+            sum += compute_luminance((unsigned char)(px[2] & mask),
+                                     (unsigned char)(px[1] & mask),
+                                     (unsigned char)(px[0] & mask));
+            px += pixel_bytes;
+            ++n;
+        }
+    }
+
+    double mean = sum / (double)n;
+
+    double sq_sum = 0.0;
+    for (int r = 0; r < block_size; ++r) {
+        const unsigned char *px = contrast_scanner_row(s, br + r) + (size_t)bc * pixel_bytes;
+        for (int c = 0; c < block_size; ++c) {
+            double d = compute_luminance((unsigned char)(px[2] & mask),
+                                         (unsigned char)(px[1] & mask),
+                                         (unsigned char)(px[0] & mask)) - mean;
+            sq_sum += d * d;
+            px += pixel_bytes;
+        }
+    }
+
+    double variance = sq_sum / (double)n;
+    double stddev = sqrt(variance);
+    return stddev < s->contrast_threshold;
+}
+
+int contrast_scanner_block_exact(const ContrastScanner *s, int32_t br, int32_t bc)
+{
+    return block_is_low_contrast_exact(s, br, bc);
+}
+
+// Decision bounds of one block row: Q8 variances (luma^2 * 65536) below
+// accept_below or above reject_above provably decide like the floating-point
+// code; anything in between is re-evaluated exactly. The bounds are scaled
+// by n^2 so that a block compares sq * n - sum^2 against them, without any
+// division.
+typedef struct {
+    double n;             // pixels per block
+    double accept_below;  // times n^2
+    double reject_above;
+    uint64_t accepted;
+    uint64_t exact;
+} ContrastBounds;
+
+void contrast_q8_bounds(int block_size,
+                        double contrast_threshold,
+                        double *accept_below,
+                        double *reject_above)
+{
+    double lo = contrast_threshold - LUMA_Q8_MAX_ERROR;
+    double hi = contrast_threshold + LUMA_Q8_MAX_ERROR;
+    double n = (double)block_size * (double)block_size;
+    *accept_below = lo > 0.0 ? lo * lo * 65536.0 * (1.0 - CONTRAST_TIE_EPSILON) * n * n : -1.0;
+    *reject_above = hi * hi * 65536.0 * (1.0 + CONTRAST_TIE_EPSILON) * n * n;
+}
+
+static void contrast_bounds_init(ContrastBounds *b, const ContrastScanner *s)
+{
+    b->n = (double)s->block_size * (double)s->block_size;
+    contrast_q8_bounds(s->block_size, s->contrast_threshold, &b->accept_below,
+                       &b->reject_above);
+    b->accepted = 0;
+    b->exact = 0;
+}
+
+// Helper: Q8 variance of a block of n pixels with sums sum and sq, times n^2.
+static inline double contrast_variance(double n, uint64_t sum, uint64_t sq)
+{
+    // Both sums are far below 2^63; the signed conversion is the cheap one.
+    double dsum = (double)(int64_t)sum;
+    return (double)(int64_t)sq * n - dsum * dsum;
+}
+
+// Helper: decide block (br, bc) from its Q8 sums. The bounds come by value
+// and the counts go to locals of the caller: the accept rows are bytes, and
+// stores through them would otherwise force everything to be reloaded.
+static inline uint8_t contrast_classify(const ContrastScanner *s,
+                                        ContrastBounds b,
+                                        int32_t br,
+                                        int32_t bc,
+                                        uint64_t sum,
+                                        uint64_t sq,
+                                        uint64_t *exact)
+{
+    double variance = contrast_variance(b.n, sum, sq);
+
+    // Decided without a branch; only the rare ties need one.
+    uint8_t accept = (uint8_t)(variance < b.accept_below);
+    if (!(accept | (uint8_t)(variance > b.reject_above))) {
+        accept = (uint8_t)block_is_low_contrast_exact(s, br, bc);
+        ++*exact;
+    }
+    return accept;
+}
+
+// Helper (integral layout): evaluate block row br, or only bring the tables
+// up to date when b is NULL.
+static void contrast_scan_integral(ContrastScanner *s,
+                                   int32_t br,
+                                   ContrastBounds *b,
+                                   uint8_t *accept)
+{
+    int block_size = s->block_size;
+    while (s->sat_rows <= br + block_size) {
+        contrast_scanner_push_row(s);
+    }
+    if (b == NULL) {
+        return;
+    }
+
+    size_t ring = (size_t)block_size + 1u;
+    const uint64_t *top_sum = s->sat_sum + ((size_t)br % ring) * s->sat_stride;
+    const uint64_t *top_sq = s->sat_sq + ((size_t)br % ring) * s->sat_stride;
+    const uint64_t *bot_sum =
+        s->sat_sum + ((size_t)(br + block_size) % ring) * s->sat_stride;
+    const uint64_t *bot_sq =
+        s->sat_sq + ((size_t)(br + block_size) % ring) * s->sat_stride;
+
+    ContrastBounds bounds = *b;
+    int32_t max_col = s->max_col;
+    uint64_t accepted = 0;
+    uint64_t exact = 0;
+    for (int32_t bc = 0; bc < max_col; ++bc) {
+        int32_t ec = bc + block_size;
+        uint64_t sum = bot_sum[ec] - top_sum[ec] - bot_sum[bc] + top_sum[bc];
+        uint64_t sq = bot_sq[ec] - top_sq[ec] - bot_sq[bc] + top_sq[bc];
+        uint8_t a = contrast_classify(s, bounds, br, bc, sum, sq, &exact);
+        accept[bc] = a;
+        accepted += a;
+    }
+    b->accepted += accepted;
+    b->exact += exact;
+}
+
+// Helper (tiled layout): add image row y to the column sums of columns
+// [x0, x1), replacing the row in its ring slot when `replace` is set.
+static void contrast_tile_add_row(ContrastScanner *s,
+                                  int32_t y,
+                                  int32_t x0,
+                                  int32_t x1,
+                                  int replace)
+{
+    contrast_scanner_luma(s, y, x0, x1 - x0);
+
+    const uint16_t *lum = s->lum_row;
+    uint16_t *slot = s->lum_ring + (size_t)(y % s->block_size) * (size_t)s->width;
+    uint64_t *col_sum = s->col_sum;
+    uint64_t *col_sq = s->col_sq;
+    if (replace) {
+        for (int32_t col = x0; col < x1; ++col) {
+            uint64_t v = lum[col - x0];
+            uint64_t old = slot[col];
+            col_sum[col] += v - old;
+            col_sq[col] += v * v - old * old;
+            slot[col] = (uint16_t)v;
+        }
+    } else {
+        for (int32_t col = x0; col < x1; ++col) {
+            uint64_t v = lum[col - x0];
+            col_sum[col] += v;
+            col_sq[col] += v * v;
+            slot[col] = (uint16_t)v;
+        }
+    }
+}
+
+// Helper (tiled layout): move the window to rows br .. br + block_size - 1
+// and evaluate block row br, or only move the window when b is NULL. Both
+// are done a tile at a time: the blocks that end inside a tile are
+// evaluated right after its columns are updated.
+static void contrast_scan_tiled(ContrastScanner *s,
+                                int32_t br,
+                                ContrastBounds *b,
+                                uint8_t *accept)
+{
+    int32_t width = s->width;
+    int block_size = s->block_size;
+
+    // First block row after init or seek: fill the window.
+    while (s->win_rows < block_size - 1) {
+        for (int32_t x0 = 0; x0 < width; x0 += CONTRAST_TILE_COLS) {
+            int32_t x1 = width - x0 < CONTRAST_TILE_COLS ? width : x0 + CONTRAST_TILE_COLS;
+            contrast_tile_add_row(s, s->win_top + s->win_rows, x0, x1, 0);
+        }
+        ++s->win_rows;
+    }
+
+    // The last row (or the one replacing the row that leaves) goes in along
+    // with the evaluation.
+    int replace = s->win_rows == block_size;
+    assert(s->win_top + (replace ? 1 : 0) == br);
+    int32_t y = br + block_size - 1;
+
+    ContrastBounds bounds;
+    if (b != NULL) {
+        bounds = *b;
+    }
+    const uint64_t *col_sum = s->col_sum;
+    const uint64_t *col_sq = s->col_sq;
+    int32_t max_col = s->max_col;
+    uint64_t accepted = 0;
+    uint64_t exact = 0;
+    uint64_t sum = 0;
+    uint64_t sq = 0;
+    int32_t bc = 0;
+    for (int32_t x0 = 0; x0 < width; x0 += CONTRAST_TILE_COLS) {
+        int32_t x1 = width - x0 < CONTRAST_TILE_COLS ? width : x0 + CONTRAST_TILE_COLS;
+        contrast_tile_add_row(s, y, x0, x1, replace);
+        if (b == NULL) {
+            continue;
+        }
+
+        // Running sums over columns bc .. bc + block_size - 1.
+        if (bc == 0 && block_size <= x1) {
+            for (int c = 0; c < block_size; ++c) {
+                sum += col_sum[c];
+                sq += col_sq[c];
+            }
+            uint8_t a = contrast_classify(s, bounds, br, 0, sum, sq, &exact);
+            accept[0] = a;
+            accepted += a;
+            bc = 1;
+        }
+        int32_t end = x1 - block_size + 1 < max_col ? x1 - block_size + 1 : max_col;
+        for (; bc < end; ++bc) {
+            int32_t ec = bc + block_size - 1;
+            sum += col_sum[ec] - col_sum[bc - 1];
+            sq += col_sq[ec] - col_sq[bc - 1];
+            uint8_t a = contrast_classify(s, bounds, br, bc, sum, sq, &exact);
+            accept[bc] = a;
+            accepted += a;
+        }
+    }
+    if (b != NULL) {
+        b->accepted += accepted;
+        b->exact += exact;
+    }
+
+    if (replace) {
+        ++s->win_top;
+    } else {
+        ++s->win_rows;
+    }
+}
+
+void contrast_scanner_scan_row(ContrastScanner *s, uint8_t *accept)
+{
+    assert(s->next_row < s->max_row);
+
+    int32_t br = s->next_row;
+    if (s->stats != NULL) {
+        s->stats->blocks_evaluated += (uint64_t)s->max_col;
+    }
+
+    // stddev >= 0, so "stddev < threshold" can never hold; the rows are
+    // still read so the scanner advances as usual.
+    ContrastBounds bounds;
+    ContrastBounds *b = NULL;
+    if (s->contrast_threshold > 0.0) {
+        contrast_bounds_init(&bounds, s);
+        b = &bounds;
+    } else {
+        memset(accept, 0, (size_t)s->max_col);
+    }
+
+    if (s->layout == CONTRAST_LAYOUT_INTEGRAL) {
+        contrast_scan_integral(s, br, b, accept);
+    } else {
+        contrast_scan_tiled(s, br, b, accept);
+    }
+
+    if (s->stats != NULL && b != NULL) {
+        s->stats->blocks_accepted += b->accepted;
+        s->stats->blocks_exact += b->exact;
+    }
+
+    ++s->next_row;
+}
+
+void contrast_scanner_scan_variance(ContrastScanner *s, float *variance)
+{
+    assert(s->next_row < s->max_row);
+
+    int32_t br = s->next_row;
+    if (s->stats != NULL) {
+        s->stats->blocks_evaluated += (uint64_t)s->max_col;
+    }
+
+    // Bring the sums up to date without deciding anything, then read every
+    // block off them.
+    int block_size = s->block_size;
+    double n = (double)block_size * (double)block_size;
+    int32_t max_col = s->max_col;
+    if (s->layout == CONTRAST_LAYOUT_INTEGRAL) {
+        contrast_scan_integral(s, br, NULL, NULL);
+        size_t ring = (size_t)block_size + 1u;
+        const uint64_t *top_sum = s->sat_sum + ((size_t)br % ring) * s->sat_stride;
+        const uint64_t *top_sq = s->sat_sq + ((size_t)br % ring) * s->sat_stride;
+        const uint64_t *bot_sum =
+            s->sat_sum + ((size_t)(br + block_size) % ring) * s->sat_stride;
+        const uint64_t *bot_sq =
+            s->sat_sq + ((size_t)(br + block_size) % ring) * s->sat_stride;
+        for (int32_t bc = 0; bc < max_col; ++bc) {
+            int32_t ec = bc + block_size;
+            uint64_t sum = bot_sum[ec] - top_sum[ec] - bot_sum[bc] + top_sum[bc];
+            uint64_t sq = bot_sq[ec] - top_sq[ec] - bot_sq[bc] + top_sq[bc];
+            variance[bc] = (float)contrast_variance(n, sum, sq);
+        }
+    } else {
+        contrast_scan_tiled(s, br, NULL, NULL);
+        const uint64_t *col_sum = s->col_sum;
+        const uint64_t *col_sq = s->col_sq;
+        uint64_t sum = 0;
+        uint64_t sq = 0;
+        for (int c = 0; c < block_size; ++c) {
+            sum += col_sum[c];
+            sq += col_sq[c];
+        }
+        variance[0] = (float)contrast_variance(n, sum, sq);
+        for (int32_t bc = 1; bc < max_col; ++bc) {
+            int32_t ec = bc + block_size - 1;
+            sum += col_sum[ec] - col_sum[bc - 1];
+            sq += col_sq[ec] - col_sq[bc - 1];
+            variance[bc] = (float)contrast_variance(n, sum, sq);
+        }
+    }
+
+    ++s->next_row;
+}
+
+size_t coverage_tracker_scratch_size(int32_t width)
+{
+    return ARENA_SIZE((size_t)width * sizeof(int32_t));
+}
+
+int coverage_tracker_init(CoverageTracker *t,
+                          int32_t width,
+                          int block_size,
+                          StegArena *arena)
+{
+    t->width = width;
+    t->block_size = block_size;
+    t->owns_buffers = arena == NULL;
+    if (arena != NULL) {
+        t->last_row = (int32_t *)arena_alloc(arena, (size_t)width * sizeof(int32_t));
+        if (!t->last_row) {
+            fprintf(stderr, "coverage_tracker_init: arena exhausted\n");
+            return 1;
+        }
+    } else {
+        t->last_row = (int32_t *)malloc((size_t)width * sizeof(int32_t));
+        if (!t->last_row) {
+            perror("coverage_tracker_init: malloc");
+            return 1;
+        }
+    }
+    coverage_tracker_reset(t);
+    return 0;
+}
+
+void coverage_tracker_reset(CoverageTracker *t)
+{
+    for (int32_t col = 0; col < t->width; ++col) {
+        t->last_row[col] = COVERAGE_NONE;
+    }
+}
+
+void coverage_tracker_free(CoverageTracker *t)
+{
+    if (t->owns_buffers) {
+        free(t->last_row);
+    }
+    t->last_row = NULL;
+}
+
+void coverage_tracker_add_row(CoverageTracker *t,
+                              int32_t br,
+                              const uint8_t *accept,
+                              int32_t max_col)
+{
+    int32_t last_bc = COVERAGE_NONE;
+    for (int32_t col = 0; col < t->width; ++col) {
+        if (col < max_col && accept[col]) {
+            last_bc = col;
+        }
+        if (last_bc > col - t->block_size) {
+            t->last_row[col] = br;
+        }
+    }
+}
+
+size_t coverage_tracker_emit_row(const CoverageTracker *t, int32_t y, uint64_t *bits)
+{
+    size_t count = 0;
+    size_t base = (size_t)y * (size_t)t->width;
+    for (int32_t col = 0; col < t->width; ++col) {
+        if (t->last_row[col] > y - t->block_size) {
+            size_t idx = base + (size_t)col;
+            bits[idx >> 6] |= (uint64_t)1u << (idx & 63u);
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t coverage_tracker_count_row(const CoverageTracker *t,
+                                  int32_t y,
+                                  int32_t col_begin,
+                                  int32_t col_end)
+{
+    size_t count = 0;
+    int32_t limit = y - t->block_size;
+    for (int32_t col = col_begin; col < col_end; ++col) {
+        count += t->last_row[col] > limit;
+    }
+    return count;
+}
+
+size_t coverage_tracker_row_columns(const CoverageTracker *t, int32_t y, int32_t *cols)
+{
+    size_t count = 0;
+    for (int32_t col = 0; col < t->width; ++col) {
+        if (t->last_row[col] > y - t->block_size) {
+            cols[count++] = col;
+        }
+    }
+    return count;
+}
+
+size_t coverage_tracker_row_runs(const CoverageTracker *t, int32_t y, int32_t *runs)
+{
+    size_t count = 0;
+    int32_t limit = y - t->block_size;
+    int32_t col = 0;
+    while (col < t->width) {
+        while (col < t->width && t->last_row[col] <= limit) {
+            ++col;
+        }
+        if (col == t->width) {
+            break;
+        }
+        int32_t begin = col;
+        while (col < t->width && t->last_row[col] > limit) {
+            ++col;
+        }
+        runs[2 * count] = begin;
+        runs[2 * count + 1] = col;
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,223 @@
+#ifndef CONTRAST_H
+#define CONTRAST_H
+
+// Private to steg_lib: incremental low-contrast block scan and the coverage
+// tracker that turns accepted blocks into per-pixel selection rows.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "bmp.h"
+#include "luma.h"
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Source of image rows for scanners that do not see the whole pixel array
+// (streaming). Returns a pointer to stored row y.
+typedef const unsigned char *(*ContrastRowFn)(void *ctx, int32_t y);
+
+// Contrast engine.
+//
+// Block statistics are exact integer sums of the Q8 luma (both the plain sum
+// and the sum of squares), so each block costs O(1) regardless of
+// block_size. Memory stays O(width * block_size) instead of O(width *
+// height), and luma is computed right before a row enters the sums, so
+// scanning the first k block rows only touches the first k + block_size - 1
+// rows. Two layouts produce the same sums, and so the same selection:
+//
+// CONTRAST_LAYOUT_INTEGRAL keeps summed-area tables in a ring of
+// block_size + 1 rows; block row br reads integral rows br and
+// br + block_size. Every row costs passes over 2 * 16 bytes per column of
+// tables, which no longer fits in L2 on wide images.
+//
+// CONTRAST_LAYOUT_TILED (the default) keeps per-column sums over the
+// block_size rows of the current window plus the window's luma. Moving to the
+// next block row subtracts the row that leaves and adds the row that enters,
+// and a running sum across the columns gives each block. All of it is done a
+// tile of CONTRAST_TILE_COLS columns at a time, so the luma, column sums and
+// luma ring of a tile stay in L1 while it is updated and evaluated: every
+// luma value is computed once and read back once when it leaves.
+//
+// Unsigned wrap-around is harmless in both: the differences are exact
+// modulo 2^64 and the true block sums are far below that.
+//
+// Q8 luma is within LUMA_Q8_MAX_ERROR of the floating-point BT.601 value, so
+// the block stddev is too. Blocks whose Q8 stddev is closer than that to the
+// threshold are re-evaluated with the original floating-point two-pass code,
+// which keeps the selection bit-identical to the original implementation.
+#define CONTRAST_LAYOUT_INTEGRAL 0
+#define CONTRAST_LAYOUT_TILED 1
+#define CONTRAST_LAYOUT_DEFAULT CONTRAST_LAYOUT_TILED
+
+// Columns per tile of CONTRAST_LAYOUT_TILED.
+#define CONTRAST_TILE_COLS 1024
+
+typedef struct {
+    const BmpImage *img;
+    LumaRowFn luma_row;  // kernel for the pixel layout of img
+    int32_t pixel_bytes; // bmp_pixel_bytes(img)
+    int layout;          // CONTRAST_LAYOUT_*
+    int32_t width;
+    int block_size;
+    double contrast_threshold;
+    int32_t max_row;     // number of block rows
+    int32_t max_col;     // number of blocks per row
+    int32_t next_row;    // next block row to scan
+    // CONTRAST_LAYOUT_INTEGRAL
+    int32_t sat_rows;    // integral rows computed so far (relative to row 0,
+                         // or to the row passed to contrast_scanner_seek())
+    size_t sat_stride;   // width + 1
+    uint64_t *sat_sum;   // ring of block_size + 1 integral rows
+    uint64_t *sat_sq;
+    // CONTRAST_LAYOUT_TILED
+    uint64_t *col_sum;   // per column, sums over the window rows
+    uint64_t *col_sq;
+    uint16_t *lum_ring;  // luma of the window rows, row y in slot y % block_size
+    int32_t win_top;     // the window holds image rows [win_top, win_top + win_rows)
+    int32_t win_rows;
+    uint16_t *lum_row;   // scratch: luma of the row (integral) or tile (tiled)
+                         // being added
+    int owns_buffers;    // 0 when the buffers came from an arena
+    ContrastRowFn fetch_row; // NULL: rows are read from img->data
+    void *fetch_ctx;
+    StegStats *stats;    // NULL: no instrumentation (set after init)
+    unsigned char channel_mask; // LUMA_CHANNEL_MASK() of the embedding depth;
+                                // 1 bit unless changed before the first scan
+} ContrastScanner;
+
+// Stored row y of the scanned image.
+static inline const unsigned char *contrast_scanner_row(const ContrastScanner *s, int32_t y)
+{
+    if (s->fetch_row != NULL) {
+        return s->fetch_row(s->fetch_ctx, y);
+    }
+    return s->img->data + (size_t)y * (size_t)s->img->stride;
+}
+
+// Arena bytes contrast_scanner_init() takes for an image of this width.
+size_t contrast_scanner_scratch_size(int32_t width, int block_size);
+
+// Same as contrast_scanner_scratch_size(), for contrast_scanner_init_layout().
+size_t contrast_scanner_layout_scratch_size(int32_t width, int block_size, int layout);
+
+// Prepare a scan of img. The image must have valid data and dimensions and
+// block_size must be > 0. A scanner with max_row == 0 has no blocks. Buffers
+// are taken from arena when it is not NULL, from malloc otherwise. Set
+// fetch_row after init to supply the rows some other way; block row br reads
+// rows br .. br + block_size - 1 only.
+// Returns 0 on success, non-zero on allocation failure.
+int contrast_scanner_init(ContrastScanner *s,
+                          const BmpImage *img,
+                          int block_size,
+                          double contrast_threshold,
+                          StegArena *arena);
+
+// Same as contrast_scanner_init() (which uses CONTRAST_LAYOUT_DEFAULT) with
+// an explicit layout; the selection does not depend on it.
+int contrast_scanner_init_layout(ContrastScanner *s,
+                                 const BmpImage *img,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 int layout,
+                                 StegArena *arena);
+
+// Number of image rows the scanner has read so far (counting from the row
+// passed to contrast_scanner_seek() as if the rows before it had been read).
+int32_t contrast_scanner_rows_read(const ContrastScanner *s);
+
+void contrast_scanner_free(ContrastScanner *s);
+
+// Start a fresh scanner at block row br (0 <= br <= max_row) instead of row
+// 0; only image rows from br on are read. Must be called before the first
+// contrast_scanner_scan_row(). Used to scan horizontal bands independently.
+void contrast_scanner_seek(ContrastScanner *s, int32_t br);
+
+// Evaluate block row `next_row` into accept[0..max_col-1] (1 = low contrast)
+// and advance. Block rows must be scanned in order.
+void contrast_scanner_scan_row(ContrastScanner *s, uint8_t *accept);
+
+// Evaluate block row `next_row` without deciding it: write the Q8 variance
+// of every block, scaled by n^2 like the bounds of contrast_q8_bounds(), into
+// variance[0..max_col-1] and advance. The float is within a relative 2^-24 of
+// the value a scan compares against its bounds.
+void contrast_scanner_scan_variance(ContrastScanner *s, float *variance);
+
+// Decide block (br, bc) with the reference floating-point evaluation, the
+// one the scan falls back to for ties. Reads the block's rows through
+// contrast_scanner_row() and needs no scanned state.
+int contrast_scanner_block_exact(const ContrastScanner *s, int32_t br, int32_t bc);
+
+// Decision bounds of the Q8 scan for this block size and threshold, scaled
+// by n^2 (n = block_size^2): a block with Q8 sums sum and sq is low contrast
+// if sq * n - sum^2 < *accept_below and not if it is > *reject_above; in
+// between only the exact evaluation decides. *accept_below is negative when
+// no block can be accepted that way.
+void contrast_q8_bounds(int block_size,
+                        double contrast_threshold,
+                        double *accept_below,
+                        double *reject_above);
+
+// Coverage tracking for deduplicated (per-pixel) selection.
+//
+// Pixel (y, x) is selected iff some accepted block (br, bc) has
+// y - block_size < br <= y and x - block_size < bc <= x. For every column we
+// remember the last block row whose accepted blocks cover it; once block row y
+// has been scanned, image row y is final and can be emitted in O(width).
+typedef struct {
+    int32_t width;
+    int block_size;
+    int32_t *last_row;   // per column, last covering block row (or COVERAGE_NONE)
+    int owns_buffers;    // 0 when last_row came from an arena
+} CoverageTracker;
+
+#define COVERAGE_NONE (INT32_MIN / 2)
+
+// Arena bytes coverage_tracker_init() takes for this width.
+size_t coverage_tracker_scratch_size(int32_t width);
+
+// last_row is taken from arena when it is not NULL, from malloc otherwise.
+// Returns 0 on success, non-zero on allocation failure.
+int coverage_tracker_init(CoverageTracker *t,
+                          int32_t width,
+                          int block_size,
+                          StegArena *arena);
+
+void coverage_tracker_free(CoverageTracker *t);
+
+// Forget every row added so far, to track another selection from block row 0.
+void coverage_tracker_reset(CoverageTracker *t);
+
+// Record the accept flags of block row br (max_col entries).
+void coverage_tracker_add_row(CoverageTracker *t,
+                              int32_t br,
+                              const uint8_t *accept,
+                              int32_t max_col);
+
+// Set the bits of image row y (bit y * width + x of a row-major bitmap) and
+// return how many were set.
+size_t coverage_tracker_emit_row(const CoverageTracker *t, int32_t y, uint64_t *bits);
+
+// Count the selected pixels of image row y in columns [col_begin, col_end).
+size_t coverage_tracker_count_row(const CoverageTracker *t,
+                                  int32_t y,
+                                  int32_t col_begin,
+                                  int32_t col_end);
+
+// Write the selected columns of image row y, in increasing order, into
+// cols[] (at least width entries) and return how many there are.
+size_t coverage_tracker_row_columns(const CoverageTracker *t, int32_t y, int32_t *cols);
+
+// Write the maximal runs of selected columns of image row y, left to right,
+// as [begin, end) pairs into runs[] (at least width + 1 entries) and return
+// the number of runs.
+size_t coverage_tracker_row_runs(const CoverageTracker *t, int32_t y, int32_t *runs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
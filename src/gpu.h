@@ -0,0 +1,43 @@
+#ifndef GPU_H
+#define GPU_H
+
+// Private to steg_lib: optional device backend for the block classification
+// behind the find_low_contrast_*_gpu() functions. Built from gpu_opencl.c
+// with STEG_ENABLE_OPENCL, from gpu_none.c (no device, ever) otherwise.
+
+#include <stdint.h>
+
+#include "bmp.h"
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// accept[] value of a block whose Q8 variance is too close to the threshold
+// for the device to decide; the host settles it with the exact
+// floating-point evaluation, as the CPU scan does.
+#define GPU_BLOCK_TIE 2
+
+// Largest block_size the device handles: its block sums are exact 64-bit
+// integers up to that size. Larger blocks are scanned on the CPU.
+#define GPU_MAX_BLOCK_SIZE 256
+
+// Classify every block of img into accept[br * max_col + bc] (max_row *
+// max_col entries, see ContrastScanner): 1 low contrast, 0 not,
+// GPU_BLOCK_TIE undecided. Luma is taken from channels ANDed with
+// channel_mask. contrast_threshold must be > 0 and block_size at most
+// GPU_MAX_BLOCK_SIZE. Returns 0 on success, non-zero when the device could
+// not do it (the caller then scans on the CPU).
+int gpu_classify_blocks(StegGpu *gpu,
+                        const BmpImage *img,
+                        int block_size,
+                        double contrast_threshold,
+                        unsigned char channel_mask,
+                        uint8_t *accept);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+// gpu_none.c - StegGpu when the library is built without a device backend.
+// steg_gpu_create() never succeeds, so the *_gpu() scans always run on the
+// CPU.
+
+#include "gpu.h"
+
+#include <stddef.h>
+
+StegGpu *steg_gpu_create(void)
+{
+    return NULL;
+}
+
+void steg_gpu_destroy(StegGpu *gpu)
+{
+    (void)gpu;
+}
+
+const char *steg_gpu_device_name(const StegGpu *gpu)
+{
+    (void)gpu;
+    return "none";
+}
+
+int gpu_classify_blocks(StegGpu *gpu,
+                        const BmpImage *img,
+                        int block_size,
+                        double contrast_threshold,
+                        unsigned char channel_mask,
+                        uint8_t *accept)
+{
+    (void)gpu;
+    (void)img;
+    (void)block_size;
+    (void)contrast_threshold;
+    (void)channel_mask;
+    (void)accept;
+    return 1;
+}
@@ -0,0 +1,398 @@
+// gpu_opencl.c - OpenCL block classification, loaded at runtime.
+//
+// The OpenCL runtime is opened with dlopen() on first use, so building needs
+// neither headers nor an import library and a machine without a runtime or a
+// device simply gets no StegGpu. Only the handful of entry points used here
+// are declared, with the types of the OpenCL 1.2 ABI.
+//
+// The cover is uploaded once. One kernel turns it into the masked Q8 luma
+// map, a second one gives every block its exact integer sums and compares
+// sq * n - sum^2 with the same bounds the CPU scan uses (see contrast.h), so
+// the device decides exactly the blocks the CPU decides without the exact
+// fallback and flags the rest as GPU_BLOCK_TIE.
+
+#include "gpu.h"
+
+#include "contrast.h"
+#include "luma.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_ulong;
+typedef cl_ulong cl_bitfield;
+typedef struct _cl_platform_id *cl_platform_id;
+typedef struct _cl_device_id *cl_device_id;
+typedef struct _cl_context *cl_context;
+typedef struct _cl_command_queue *cl_command_queue;
+typedef struct _cl_mem *cl_mem;
+typedef struct _cl_program *cl_program;
+typedef struct _cl_kernel *cl_kernel;
+typedef struct _cl_event *cl_event;
+
+#define CL_SUCCESS 0
+#define CL_TRUE 1u
+#define CL_DEVICE_TYPE_GPU ((cl_bitfield)1 << 2)
+#define CL_DEVICE_TYPE_ACCELERATOR ((cl_bitfield)1 << 3)
+#define CL_DEVICE_TYPE_ALL ((cl_bitfield)0xFFFFFFFFu)
+#define CL_DEVICE_NAME 0x102Bu
+#define CL_MEM_READ_WRITE ((cl_bitfield)1 << 0)
+#define CL_MEM_WRITE_ONLY ((cl_bitfield)1 << 1)
+#define CL_MEM_READ_ONLY ((cl_bitfield)1 << 2)
+#define CL_PROGRAM_BUILD_LOG 0x1183u
+
+typedef struct {
+    cl_int (*GetPlatformIDs)(cl_uint, cl_platform_id *, cl_uint *);
+    cl_int (*GetDeviceIDs)(cl_platform_id, cl_bitfield, cl_uint, cl_device_id *, cl_uint *);
+    cl_int (*GetDeviceInfo)(cl_device_id, cl_uint, size_t, void *, size_t *);
+    cl_context (*CreateContext)(const intptr_t *, cl_uint, const cl_device_id *,
+                                void (*)(const char *, const void *, size_t, void *),
+                                void *, cl_int *);
+    cl_command_queue (*CreateCommandQueue)(cl_context, cl_device_id, cl_bitfield, cl_int *);
+    cl_program (*CreateProgramWithSource)(cl_context, cl_uint, const char **,
+                                          const size_t *, cl_int *);
+    cl_int (*BuildProgram)(cl_program, cl_uint, const cl_device_id *, const char *,
+                           void (*)(cl_program, void *), void *);
+    cl_int (*GetProgramBuildInfo)(cl_program, cl_device_id, cl_uint, size_t, void *,
+                                  size_t *);
+    cl_kernel (*CreateKernel)(cl_program, const char *, cl_int *);
+    cl_mem (*CreateBuffer)(cl_context, cl_bitfield, size_t, void *, cl_int *);
+    cl_int (*SetKernelArg)(cl_kernel, cl_uint, size_t, const void *);
+    cl_int (*EnqueueWriteBuffer)(cl_command_queue, cl_mem, cl_uint, size_t, size_t,
+                                 const void *, cl_uint, const cl_event *, cl_event *);
+    cl_int (*EnqueueReadBuffer)(cl_command_queue, cl_mem, cl_uint, size_t, size_t, void *,
+                                cl_uint, const cl_event *, cl_event *);
+    cl_int (*EnqueueNDRangeKernel)(cl_command_queue, cl_kernel, cl_uint, const size_t *,
+                                   const size_t *, const size_t *, cl_uint,
+                                   const cl_event *, cl_event *);
+    cl_int (*Finish)(cl_command_queue);
+    cl_int (*ReleaseMemObject)(cl_mem);
+    cl_int (*ReleaseKernel)(cl_kernel);
+    cl_int (*ReleaseProgram)(cl_program);
+    cl_int (*ReleaseCommandQueue)(cl_command_queue);
+    cl_int (*ReleaseContext)(cl_context);
+} ClApi;
+
+struct StegGpu {
+    void *library;
+    ClApi cl;
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel luma;
+    cl_kernel classify;
+    char name[128];
+};
+
+// Weights and rounding are those of luma_q8(); they come in as -D options.
+static const char *const gpu_kernel_source =
+    "__kernel void steg_luma(__global const uchar *bgr, ulong stride, uint width,\n"
+    "                        uchar mask, __global ushort *lum, uint pixel_bytes)\n"
+    "{\n"
+    "    size_t x = get_global_id(0);\n"
+    "    size_t y = get_global_id(1);\n"
+    "    __global const uchar *p = bgr + y * stride + x * pixel_bytes;\n"
+    "    uint acc = (uint)(p[2] & mask) * LUMA_R + (uint)(p[1] & mask) * LUMA_G +\n"
+    "               (uint)(p[0] & mask) * LUMA_B;\n"
+    "    lum[y * width + x] = (ushort)((acc + 128u) >> 8);\n"
+    "}\n"
+    "\n"
+    "__kernel void steg_classify(__global const ushort *lum, uint width, uint block_size,\n"
+    "                            ulong accept_below, ulong reject_above, uint max_col,\n"
+    "                            __global uchar *accept)\n"
+    "{\n"
+    "    size_t bc = get_global_id(0);\n"
+    "    size_t br = get_global_id(1);\n"
+    "    ulong sum = 0;\n"
+    "    ulong sq = 0;\n"
+    "    for (uint r = 0; r < block_size; ++r) {\n"
+    "        __global const ushort *row = lum + (br + r) * width + bc;\n"
+    "        for (uint c = 0; c < block_size; ++c) {\n"
+    "            ulong v = row[c];\n"
+    "            sum += v;\n"
+    "            sq += v * v;\n"
+    "        }\n"
+    "    }\n"
+    "    ulong n = (ulong)block_size * block_size;\n"
+    "    ulong variance = sq * n - sum * sum;\n"
+    "    accept[br * max_col + bc] =\n"
+    "        variance < accept_below ? 1 : (variance > reject_above ? 0 : 2);\n"
+    "}\n";
+
+// Helper: resolve every entry point. Returns 0 when all of them exist.
+static int gpu_load_api(StegGpu *gpu)
+{
+    static const char *const libraries[] = {"libOpenCL.so.1", "libOpenCL.so",
+                                            "/System/Library/Frameworks/OpenCL.framework/OpenCL"};
+    for (size_t i = 0; i < sizeof(libraries) / sizeof(libraries[0]) && !gpu->library; ++i) {
+        gpu->library = dlopen(libraries[i], RTLD_NOW | RTLD_LOCAL);
+    }
+    if (gpu->library == NULL) {
+        return 1;
+    }
+
+    struct {
+        void **slot;
+        const char *name;
+    } symbols[] = {
+        {(void **)&gpu->cl.GetPlatformIDs, "clGetPlatformIDs"},
+        {(void **)&gpu->cl.GetDeviceIDs, "clGetDeviceIDs"},
+        {(void **)&gpu->cl.GetDeviceInfo, "clGetDeviceInfo"},
+        {(void **)&gpu->cl.CreateContext, "clCreateContext"},
+        {(void **)&gpu->cl.CreateCommandQueue, "clCreateCommandQueue"},
+        {(void **)&gpu->cl.CreateProgramWithSource, "clCreateProgramWithSource"},
+        {(void **)&gpu->cl.BuildProgram, "clBuildProgram"},
+        {(void **)&gpu->cl.GetProgramBuildInfo, "clGetProgramBuildInfo"},
+        {(void **)&gpu->cl.CreateKernel, "clCreateKernel"},
+        {(void **)&gpu->cl.CreateBuffer, "clCreateBuffer"},
+        {(void **)&gpu->cl.SetKernelArg, "clSetKernelArg"},
+        {(void **)&gpu->cl.EnqueueWriteBuffer, "clEnqueueWriteBuffer"},
+        {(void **)&gpu->cl.EnqueueReadBuffer, "clEnqueueReadBuffer"},
+        {(void **)&gpu->cl.EnqueueNDRangeKernel, "clEnqueueNDRangeKernel"},
+        {(void **)&gpu->cl.Finish, "clFinish"},
+        {(void **)&gpu->cl.ReleaseMemObject, "clReleaseMemObject"},
+        {(void **)&gpu->cl.ReleaseKernel, "clReleaseKernel"},
+        {(void **)&gpu->cl.ReleaseProgram, "clReleaseProgram"},
+        {(void **)&gpu->cl.ReleaseCommandQueue, "clReleaseCommandQueue"},
+        {(void **)&gpu->cl.ReleaseContext, "clReleaseContext"},
+    };
+    for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); ++i) {
+        // POSIX guarantees that data and function pointers convert.
+        *symbols[i].slot = dlsym(gpu->library, symbols[i].name);
+        if (*symbols[i].slot == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper: the first device of the wanted types on any platform.
+static int gpu_find_device(StegGpu *gpu, cl_bitfield types)
+{
+    cl_platform_id platforms[16];
+    cl_uint platform_count = 0;
+    if (gpu->cl.GetPlatformIDs(16, platforms, &platform_count) != CL_SUCCESS) {
+        return 1;
+    }
+    if (platform_count > 16) {
+        platform_count = 16;
+    }
+
+    for (cl_uint i = 0; i < platform_count; ++i) {
+        cl_uint count = 0;
+        if (gpu->cl.GetDeviceIDs(platforms[i], types, 1, &gpu->device, &count) == CL_SUCCESS &&
+            count > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Helper: build the kernels. Returns 0 on success.
+static int gpu_build(StegGpu *gpu)
+{
+    cl_int err = CL_SUCCESS;
+    gpu->context = gpu->cl.CreateContext(NULL, 1, &gpu->device, NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        return 1;
+    }
+    gpu->queue = gpu->cl.CreateCommandQueue(gpu->context, gpu->device, 0, &err);
+    if (err != CL_SUCCESS) {
+        return 1;
+    }
+
+    const char *source = gpu_kernel_source;
+    gpu->program = gpu->cl.CreateProgramWithSource(gpu->context, 1, &source, NULL, &err);
+    if (err != CL_SUCCESS) {
+        return 1;
+    }
+
+    char options[128];
+    snprintf(options, sizeof(options), "-DLUMA_R=%uu -DLUMA_G=%uu -DLUMA_B=%uu",
+             LUMA_Q8_WEIGHT_R, LUMA_Q8_WEIGHT_G, LUMA_Q8_WEIGHT_B);
+    if (gpu->cl.BuildProgram(gpu->program, 1, &gpu->device, options, NULL, NULL) !=
+        CL_SUCCESS) {
+        char log[1024];
+        size_t len = 0;
+        if (gpu->cl.GetProgramBuildInfo(gpu->program, gpu->device, CL_PROGRAM_BUILD_LOG,
+                                        sizeof(log) - 1u, log, &len) == CL_SUCCESS) {
+            log[len < sizeof(log) ? len : sizeof(log) - 1u] = '\0';
+            fprintf(stderr, "steg_gpu_create: kernel build failed:\n%s\n", log);
+        }
+        return 1;
+    }
+
+    gpu->luma = gpu->cl.CreateKernel(gpu->program, "steg_luma", &err);
+    if (err != CL_SUCCESS) {
+        return 1;
+    }
+    gpu->classify = gpu->cl.CreateKernel(gpu->program, "steg_classify", &err);
+    return err == CL_SUCCESS ? 0 : 1;
+}
+
+StegGpu *steg_gpu_create(void)
+{
+    StegGpu *gpu = (StegGpu *)calloc(1, sizeof(StegGpu));
+    if (!gpu) {
+        perror("steg_gpu_create: calloc");
+        return NULL;
+    }
+
+    // STEG_GPU_DEVICE=any also accepts CPU OpenCL runtimes, for testing.
+    const char *wanted = getenv("STEG_GPU_DEVICE");
+    cl_bitfield types = wanted != NULL && strcmp(wanted, "any") == 0
+                            ? CL_DEVICE_TYPE_ALL
+                            : CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+    if (gpu_load_api(gpu) != 0 || gpu_find_device(gpu, types) != 0 || gpu_build(gpu) != 0) {
+        steg_gpu_destroy(gpu);
+        return NULL;
+    }
+
+    if (gpu->cl.GetDeviceInfo(gpu->device, CL_DEVICE_NAME, sizeof(gpu->name) - 1u,
+                              gpu->name, NULL) != CL_SUCCESS) {
+        strcpy(gpu->name, "OpenCL device");
+    }
+    return gpu;
+}
+
+void steg_gpu_destroy(StegGpu *gpu)
+{
+    if (gpu == NULL) {
+        return;
+    }
+
+    if (gpu->classify) {
+        gpu->cl.ReleaseKernel(gpu->classify);
+    }
+    if (gpu->luma) {
+        gpu->cl.ReleaseKernel(gpu->luma);
+    }
+    if (gpu->program) {
+        gpu->cl.ReleaseProgram(gpu->program);
+    }
+    if (gpu->queue) {
+        gpu->cl.ReleaseCommandQueue(gpu->queue);
+    }
+    if (gpu->context) {
+        gpu->cl.ReleaseContext(gpu->context);
+    }
+    if (gpu->library) {
+        dlclose(gpu->library);
+    }
+    free(gpu);
+}
+
+const char *steg_gpu_device_name(const StegGpu *gpu)
+{
+    return gpu != NULL ? gpu->name : "none";
+}
+
+int gpu_classify_blocks(StegGpu *gpu,
+                        const BmpImage *img,
+                        int block_size,
+                        double contrast_threshold,
+                        unsigned char channel_mask,
+                        uint8_t *accept)
+{
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    cl_uint width = (cl_uint)img->width;
+    cl_uint bs = (cl_uint)block_size;
+    cl_uint max_col = (cl_uint)(img->width - block_size + 1);
+    size_t max_row = (size_t)(abs_height - block_size + 1);
+    cl_ulong stride = (cl_ulong)img->stride;
+    cl_uint pixel_bytes = (cl_uint)bmp_pixel_bytes(img);
+    size_t pixels = (size_t)width * (size_t)abs_height;
+
+    // Integer bounds that the exact variance must clear: strictly inside the
+    // CPU's floating-point ones, so the device never decides a block the CPU
+    // would not.
+    double accept_below = 0.0;
+    double reject_above = 0.0;
+    contrast_q8_bounds(block_size, contrast_threshold, &accept_below, &reject_above);
+    // Exact variances stay below 2^64 up to GPU_MAX_BLOCK_SIZE; a bound at or
+    // past that is clamped, which only sends more blocks to the host.
+    const double ulong_limit = 18446744073709549568.0; // largest double < 2^64
+    cl_ulong accept_bound =
+        accept_below <= 0.0 ? 0u
+                            : (cl_ulong)floor(accept_below < ulong_limit ? accept_below
+                                                                          : ulong_limit);
+    cl_ulong reject_bound =
+        reject_above < ulong_limit ? (cl_ulong)ceil(reject_above) : UINT64_MAX;
+
+    cl_int err = CL_SUCCESS;
+    cl_mem bgr = gpu->cl.CreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+                                      (size_t)img->stride * (size_t)abs_height, NULL, &err);
+    cl_mem lum = err == CL_SUCCESS
+                     ? gpu->cl.CreateBuffer(gpu->context, CL_MEM_READ_WRITE,
+                                            pixels * sizeof(uint16_t), NULL, &err)
+                     : NULL;
+    cl_mem out = err == CL_SUCCESS
+                     ? gpu->cl.CreateBuffer(gpu->context, CL_MEM_WRITE_ONLY,
+                                            max_row * (size_t)max_col, NULL, &err)
+                     : NULL;
+
+    if (err == CL_SUCCESS) {
+        err = gpu->cl.EnqueueWriteBuffer(gpu->queue, bgr, CL_TRUE, 0,
+                                         (size_t)img->stride * (size_t)abs_height, img->data,
+                                         0, NULL, NULL);
+    }
+
+    if (err == CL_SUCCESS) {
+        cl_int e = CL_SUCCESS;
+        e |= gpu->cl.SetKernelArg(gpu->luma, 0, sizeof(cl_mem), &bgr);
+        e |= gpu->cl.SetKernelArg(gpu->luma, 1, sizeof(cl_ulong), &stride);
+        e |= gpu->cl.SetKernelArg(gpu->luma, 2, sizeof(cl_uint), &width);
+        e |= gpu->cl.SetKernelArg(gpu->luma, 3, sizeof(unsigned char), &channel_mask);
+        e |= gpu->cl.SetKernelArg(gpu->luma, 4, sizeof(cl_mem), &lum);
+        e |= gpu->cl.SetKernelArg(gpu->luma, 5, sizeof(cl_uint), &pixel_bytes);
+        size_t global[2] = {(size_t)width, (size_t)abs_height};
+        err = e != CL_SUCCESS ? e
+                              : gpu->cl.EnqueueNDRangeKernel(gpu->queue, gpu->luma, 2, NULL,
+                                                             global, NULL, 0, NULL, NULL);
+    }
+
+    if (err == CL_SUCCESS) {
+        cl_int e = CL_SUCCESS;
+        e |= gpu->cl.SetKernelArg(gpu->classify, 0, sizeof(cl_mem), &lum);
+        e |= gpu->cl.SetKernelArg(gpu->classify, 1, sizeof(cl_uint), &width);
+        e |= gpu->cl.SetKernelArg(gpu->classify, 2, sizeof(cl_uint), &bs);
+        e |= gpu->cl.SetKernelArg(gpu->classify, 3, sizeof(cl_ulong), &accept_bound);
+        e |= gpu->cl.SetKernelArg(gpu->classify, 4, sizeof(cl_ulong), &reject_bound);
+        e |= gpu->cl.SetKernelArg(gpu->classify, 5, sizeof(cl_uint), &max_col);
+        e |= gpu->cl.SetKernelArg(gpu->classify, 6, sizeof(cl_mem), &out);
+        size_t global[2] = {(size_t)max_col, max_row};
+        err = e != CL_SUCCESS ? e
+                              : gpu->cl.EnqueueNDRangeKernel(gpu->queue, gpu->classify, 2,
+                                                             NULL, global, NULL, 0, NULL,
+                                                             NULL);
+    }
+
+    if (err == CL_SUCCESS) {
+        err = gpu->cl.EnqueueReadBuffer(gpu->queue, out, CL_TRUE, 0,
+                                        max_row * (size_t)max_col, accept, 0, NULL, NULL);
+    }
+
+    gpu->cl.Finish(gpu->queue);
+    if (out) {
+        gpu->cl.ReleaseMemObject(out);
+    }
+    if (lum) {
+        gpu->cl.ReleaseMemObject(lum);
+    }
+    if (bgr) {
+        gpu->cl.ReleaseMemObject(bgr);
+    }
+
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "gpu_classify_blocks: OpenCL error %d\n", (int)err);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+// luma.c - Scalar Q8 luma kernel and runtime CPU dispatch.
+
+#include "luma.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// Helper: the scalar loop for pixels of pixel_bytes bytes. Always called
+// with a constant, so each layout gets its own loop with a fixed step.
+static inline void luma_row_scalar_px(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                                      unsigned char mask, const size_t pixel_bytes)
+{
+    for (int32_t col = 0; col < width; ++col) {
+        dst[col] = luma_q8(bgr[2], bgr[1], bgr[0], mask);
+        bgr += pixel_bytes;
+    }
+}
+
+void luma_row_scalar(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                     unsigned char mask)
+{
+    luma_row_scalar_px(bgr, dst, width, mask, 3u);
+}
+
+void luma_row_scalar_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                          unsigned char mask)
+{
+    luma_row_scalar_px(bgr, dst, width, mask, 4u);
+}
+
+#if defined(STEG_HAVE_SSE41) || defined(STEG_HAVE_AVX2)
+static int cpu_has_x86_feature(LumaKernel kernel)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if (kernel == LUMA_KERNEL_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    return __builtin_cpu_supports("sse4.1");
+#elif defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 1);
+    if (kernel == LUMA_KERNEL_SSE41) {
+        return (regs[2] & (1 << 19)) != 0;
+    }
+    // AVX2 needs OSXSAVE plus YMM state enabled by the OS.
+    if ((regs[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6u) != 6u) {
+        return 0;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    (void)kernel;
+    return 0;
+#endif
+}
+#endif
+
+LumaRowFn luma_row_kernel_px(LumaKernel kernel, int32_t pixel_bytes)
+{
+    int bgra = pixel_bytes == 4;
+    switch (kernel) {
+    case LUMA_KERNEL_SCALAR:
+        return bgra ? luma_row_scalar_bgra : luma_row_scalar;
+#if defined(STEG_HAVE_SSE41)
+    case LUMA_KERNEL_SSE41:
+        if (!cpu_has_x86_feature(kernel)) {
+            return NULL;
+        }
+        return bgra ? luma_row_sse41_bgra : luma_row_sse41;
+#endif
+#if defined(STEG_HAVE_AVX2)
+    case LUMA_KERNEL_AVX2:
+        if (!cpu_has_x86_feature(kernel)) {
+            return NULL;
+        }
+        return bgra ? luma_row_avx2_bgra : luma_row_avx2;
+#endif
+#if defined(STEG_HAVE_NEON)
+    case LUMA_KERNEL_NEON:
+        // NEON is only built where it is part of the baseline ISA.
+        return bgra ? luma_row_neon_bgra : luma_row_neon;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+LumaRowFn luma_row_kernel(LumaKernel kernel)
+{
+    return luma_row_kernel_px(kernel, 3);
+}
+
+LumaRowFn luma_row_best_px(int32_t pixel_bytes)
+{
+    LumaRowFn scalar = luma_row_kernel_px(LUMA_KERNEL_SCALAR, pixel_bytes);
+    const char *forced = getenv("STEG_LUMA_KERNEL");
+    if (forced != NULL && strcmp(forced, "scalar") == 0) {
+        return scalar;
+    }
+
+    static const LumaKernel preference[] = {
+        LUMA_KERNEL_AVX2, LUMA_KERNEL_NEON, LUMA_KERNEL_SSE41
+    };
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); ++i) {
+        LumaRowFn fn = luma_row_kernel_px(preference[i], pixel_bytes);
+        if (fn != NULL) {
+            return fn;
+        }
+    }
+    return scalar;
+}
+
+LumaRowFn luma_row_best(void)
+{
+    return luma_row_best_px(3);
+}
+
+const char *luma_kernel_name(LumaKernel kernel)
+{
+    switch (kernel) {
+    case LUMA_KERNEL_SCALAR:
+        return "scalar";
+    case LUMA_KERNEL_SSE41:
+        return "sse4.1";
+    case LUMA_KERNEL_AVX2:
+        return "avx2";
+    case LUMA_KERNEL_NEON:
+        return "neon";
+    default:
+        return "unknown";
+    }
+}
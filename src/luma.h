@@ -0,0 +1,104 @@
+#ifndef LUMA_H
+#define LUMA_H
+
+// Private to steg_lib: Q8 fixed-point BT.601 luma kernels with runtime CPU
+// dispatch. Every kernel produces exactly the same values as luma_q8().
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fixed-point BT.601 weights: luma * 256 = (R*19595 + G*38470 + B*7471) >> 8,
+// rounded. The weights sum to 65536, so white maps to 255 * 256 = 65280 and
+// every value fits in a uint16_t.
+#define LUMA_Q8_WEIGHT_R 19595u
+#define LUMA_Q8_WEIGHT_G 38470u
+#define LUMA_Q8_WEIGHT_B 7471u
+
+// Upper bound on |luma_q8 / 256 - floating-point BT.601 luma| over all
+// LSB-masked inputs (the exhaustive maximum is about 0.0033). Wider masks
+// only keep inputs with more low bits clear, a subset, so the bound holds
+// for every LUMA_CHANNEL_MASK().
+#define LUMA_Q8_MAX_ERROR (1.0 / 256.0)
+
+// Channel mask that ignores the low `bits` bits, the ones embedding may
+// change. Luma is always computed on masked channels so that selection is
+// stable under embedding.
+#define LUMA_CHANNEL_MASK(bits) ((unsigned char)(0xFFu << (unsigned)(bits)))
+
+// Q8 fixed-point luma of one pixel, every channel ANDed with mask.
+static inline uint16_t luma_q8(unsigned char r, unsigned char g, unsigned char b,
+                               unsigned char mask)
+{
+    uint32_t acc = (uint32_t)(r & mask) * LUMA_Q8_WEIGHT_R +
+                   (uint32_t)(g & mask) * LUMA_Q8_WEIGHT_G +
+                   (uint32_t)(b & mask) * LUMA_Q8_WEIGHT_B;
+    return (uint16_t)((acc + 128u) >> 8);
+}
+
+// Convert one row of `width` packed BGR pixels into Q8 luma of the channels
+// ANDed with mask (a LUMA_CHANNEL_MASK()). Kernels never read past
+// bgr[3 * width - 1], so row padding and the end of the pixel buffer are
+// safe. The _bgra kernels take 32-bit B, G, R, A pixels instead, ignore the
+// alpha byte and never read past bgr[4 * width - 1].
+typedef void (*LumaRowFn)(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                          unsigned char mask);
+
+typedef enum {
+    LUMA_KERNEL_SCALAR = 0,
+    LUMA_KERNEL_SSE41,
+    LUMA_KERNEL_AVX2,
+    LUMA_KERNEL_NEON,
+    LUMA_KERNEL_COUNT
+} LumaKernel;
+
+void luma_row_scalar(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                     unsigned char mask);
+void luma_row_scalar_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                          unsigned char mask);
+
+#if defined(STEG_HAVE_SSE41)
+void luma_row_sse41(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                    unsigned char mask);
+void luma_row_sse41_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                         unsigned char mask);
+#endif
+
+#if defined(STEG_HAVE_AVX2)
+void luma_row_avx2(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                   unsigned char mask);
+void luma_row_avx2_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                        unsigned char mask);
+#endif
+
+#if defined(STEG_HAVE_NEON)
+void luma_row_neon(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                   unsigned char mask);
+void luma_row_neon_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                        unsigned char mask);
+#endif
+
+// Kernel for `kernel`, or NULL if it was not built or the CPU lacks support.
+LumaRowFn luma_row_kernel(LumaKernel kernel);
+
+// Same as luma_row_kernel() for pixels of pixel_bytes bytes: 3 (BGR) or 4
+// (BGRA, the _bgra kernels).
+LumaRowFn luma_row_kernel_px(LumaKernel kernel, int32_t pixel_bytes);
+
+// The fastest kernel usable on this CPU. Setting the environment variable
+// STEG_LUMA_KERNEL=scalar forces the portable code path.
+LumaRowFn luma_row_best(void);
+
+// Same as luma_row_best() for pixels of pixel_bytes bytes (3 or 4).
+LumaRowFn luma_row_best_px(int32_t pixel_bytes);
+
+// Human-readable kernel name ("scalar", "sse4.1", "avx2", "neon").
+const char *luma_kernel_name(LumaKernel kernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
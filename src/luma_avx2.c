@@ -0,0 +1,71 @@
+// luma_avx2.c - AVX2 Q8 luma kernels (32 pixels per iteration).
+
+#include "luma.h"
+#include "luma_x86.h"
+
+// Q8 luma of 16 pixels given as zero-extended 16-bit R, G, B lanes.
+//
+// The in-lane unpacks and the in-lane pack cancel out, so the result is in
+// pixel order without any cross-lane permute.
+static inline __m256i luma16_avx2(__m256i r16, __m256i g16, __m256i b16)
+{
+    const __m256i w_rb = _mm256_set1_epi32((int)((LUMA_Q8_WEIGHT_B << 16) | LUMA_Q8_WEIGHT_R));
+    const __m256i w_g = _mm256_set1_epi16((short)LUMA_Q8_WEIGHT_G);
+    const __m256i round = _mm256_set1_epi32(128);
+
+    __m256i rb_lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(r16, b16), w_rb);
+    __m256i rb_hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(r16, b16), w_rb);
+
+    __m256i g_lo16 = _mm256_mullo_epi16(g16, w_g);
+    __m256i g_hi16 = _mm256_mulhi_epu16(g16, w_g);
+    __m256i g_lo = _mm256_unpacklo_epi16(g_lo16, g_hi16);
+    __m256i g_hi = _mm256_unpackhi_epi16(g_lo16, g_hi16);
+
+    __m256i acc_lo = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(rb_lo, g_lo), round), 8);
+    __m256i acc_hi = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(rb_hi, g_hi), round), 8);
+
+    return _mm256_packus_epi32(acc_lo, acc_hi);
+}
+
+// Helper: the kernel for pixels of pixel_bytes bytes, always a constant.
+static inline void luma_row_avx2_px(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                                    unsigned char mask, const size_t pixel_bytes)
+{
+    const __m128i channel_mask = _mm_set1_epi8((char)mask);
+    int32_t col = 0;
+
+    for (; col + 32 <= width; col += 32) {
+        __m128i b0, g0, r0, b1, g1, r1;
+        luma_x86_deinterleave16_px(bgr + (size_t)col * pixel_bytes, channel_mask, &b0, &g0,
+                                   &r0, pixel_bytes);
+        luma_x86_deinterleave16_px(bgr + (size_t)(col + 16) * pixel_bytes, channel_mask, &b1,
+                                   &g1, &r1, pixel_bytes);
+
+        __m256i lo = luma16_avx2(_mm256_cvtepu8_epi16(r0), _mm256_cvtepu8_epi16(g0),
+                                 _mm256_cvtepu8_epi16(b0));
+        __m256i hi = luma16_avx2(_mm256_cvtepu8_epi16(r1), _mm256_cvtepu8_epi16(g1),
+                                 _mm256_cvtepu8_epi16(b1));
+
+        _mm256_storeu_si256((__m256i *)(void *)(dst + col), lo);
+        _mm256_storeu_si256((__m256i *)(void *)(dst + col + 16), hi);
+    }
+
+    const unsigned char *tail = bgr + (size_t)col * pixel_bytes;
+    if (pixel_bytes == 4u) {
+        luma_row_scalar_bgra(tail, dst + col, width - col, mask);
+    } else {
+        luma_row_scalar(tail, dst + col, width - col, mask);
+    }
+}
+
+void luma_row_avx2(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                   unsigned char mask)
+{
+    luma_row_avx2_px(bgr, dst, width, mask, 3u);
+}
+
+void luma_row_avx2_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                        unsigned char mask)
+{
+    luma_row_avx2_px(bgr, dst, width, mask, 4u);
+}
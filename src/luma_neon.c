@@ -0,0 +1,62 @@
+// luma_neon.c - NEON Q8 luma kernels (16 pixels per iteration).
+
+#include "luma.h"
+
+#include <arm_neon.h>
+
+// Q8 luma of 8 pixels given as 16-bit R, G, B lanes.
+static inline uint16x8_t luma8_neon(uint16x8_t r16, uint16x8_t g16, uint16x8_t b16)
+{
+    uint32x4_t lo = vmull_n_u16(vget_low_u16(r16), (uint16_t)LUMA_Q8_WEIGHT_R);
+    lo = vmlal_n_u16(lo, vget_low_u16(g16), (uint16_t)LUMA_Q8_WEIGHT_G);
+    lo = vmlal_n_u16(lo, vget_low_u16(b16), (uint16_t)LUMA_Q8_WEIGHT_B);
+
+    uint32x4_t hi = vmull_n_u16(vget_high_u16(r16), (uint16_t)LUMA_Q8_WEIGHT_R);
+    hi = vmlal_n_u16(hi, vget_high_u16(g16), (uint16_t)LUMA_Q8_WEIGHT_G);
+    hi = vmlal_n_u16(hi, vget_high_u16(b16), (uint16_t)LUMA_Q8_WEIGHT_B);
+
+    // Rounding narrow shift: (acc + 128) >> 8.
+    return vcombine_u16(vrshrn_n_u32(lo, 8), vrshrn_n_u32(hi, 8));
+}
+
+// Helper: luma of 16 pixels from their B, G and R bytes.
+static inline void luma16_neon(uint8x16_t b, uint8x16_t g, uint8x16_t r,
+                               uint8x16_t channel_mask, uint16_t *dst)
+{
+    b = vandq_u8(b, channel_mask);
+    g = vandq_u8(g, channel_mask);
+    r = vandq_u8(r, channel_mask);
+
+    vst1q_u16(dst, luma8_neon(vmovl_u8(vget_low_u8(r)), vmovl_u8(vget_low_u8(g)),
+                              vmovl_u8(vget_low_u8(b))));
+    vst1q_u16(dst + 8, luma8_neon(vmovl_u8(vget_high_u8(r)), vmovl_u8(vget_high_u8(g)),
+                                  vmovl_u8(vget_high_u8(b))));
+}
+
+void luma_row_neon(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                   unsigned char mask)
+{
+    const uint8x16_t channel_mask = vdupq_n_u8(mask);
+    int32_t col = 0;
+
+    for (; col + 16 <= width; col += 16) {
+        uint8x16x3_t px = vld3q_u8(bgr + (size_t)col * 3u);
+        luma16_neon(px.val[0], px.val[1], px.val[2], channel_mask, dst + col);
+    }
+
+    luma_row_scalar(bgr + (size_t)col * 3u, dst + col, width - col, mask);
+}
+
+void luma_row_neon_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                        unsigned char mask)
+{
+    const uint8x16_t channel_mask = vdupq_n_u8(mask);
+    int32_t col = 0;
+
+    for (; col + 16 <= width; col += 16) {
+        uint8x16x4_t px = vld4q_u8(bgr + (size_t)col * 4u);
+        luma16_neon(px.val[0], px.val[1], px.val[2], channel_mask, dst + col);
+    }
+
+    luma_row_scalar_bgra(bgr + (size_t)col * 4u, dst + col, width - col, mask);
+}
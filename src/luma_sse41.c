@@ -0,0 +1,69 @@
+// luma_sse41.c - SSE4.1 Q8 luma kernels (16 pixels per iteration).
+
+#include "luma.h"
+#include "luma_x86.h"
+
+// Q8 luma of 8 pixels given as zero-extended 16-bit R, G, B lanes.
+static inline __m128i luma8_sse41(__m128i r16, __m128i g16, __m128i b16)
+{
+    const __m128i w_rb = _mm_set1_epi32((int)((LUMA_Q8_WEIGHT_B << 16) | LUMA_Q8_WEIGHT_R));
+    const __m128i w_g = _mm_set1_epi16((short)LUMA_Q8_WEIGHT_G);
+    const __m128i round = _mm_set1_epi32(128);
+
+    // R and B weights fit in int16, so pmaddwd computes r*wr + b*wb directly;
+    // the G weight does not, so G uses an unsigned 16x16->32 multiply.
+    __m128i rb_lo = _mm_madd_epi16(_mm_unpacklo_epi16(r16, b16), w_rb);
+    __m128i rb_hi = _mm_madd_epi16(_mm_unpackhi_epi16(r16, b16), w_rb);
+
+    __m128i g_lo16 = _mm_mullo_epi16(g16, w_g);
+    __m128i g_hi16 = _mm_mulhi_epu16(g16, w_g);
+    __m128i g_lo = _mm_unpacklo_epi16(g_lo16, g_hi16);
+    __m128i g_hi = _mm_unpackhi_epi16(g_lo16, g_hi16);
+
+    __m128i acc_lo = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(rb_lo, g_lo), round), 8);
+    __m128i acc_hi = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(rb_hi, g_hi), round), 8);
+
+    return _mm_packus_epi32(acc_lo, acc_hi);
+}
+
+// Helper: the kernel for pixels of pixel_bytes bytes, always a constant.
+static inline void luma_row_sse41_px(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                                     unsigned char mask, const size_t pixel_bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i channel_mask = _mm_set1_epi8((char)mask);
+    int32_t col = 0;
+
+    for (; col + 16 <= width; col += 16) {
+        __m128i b, g, r;
+        luma_x86_deinterleave16_px(bgr + (size_t)col * pixel_bytes, channel_mask, &b, &g, &r,
+                                   pixel_bytes);
+
+        __m128i lo = luma8_sse41(_mm_cvtepu8_epi16(r), _mm_cvtepu8_epi16(g),
+                                 _mm_cvtepu8_epi16(b));
+        __m128i hi = luma8_sse41(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+                                 _mm_unpackhi_epi8(b, zero));
+
+        _mm_storeu_si128((__m128i *)(void *)(dst + col), lo);
+        _mm_storeu_si128((__m128i *)(void *)(dst + col + 8), hi);
+    }
+
+    const unsigned char *tail = bgr + (size_t)col * pixel_bytes;
+    if (pixel_bytes == 4u) {
+        luma_row_scalar_bgra(tail, dst + col, width - col, mask);
+    } else {
+        luma_row_scalar(tail, dst + col, width - col, mask);
+    }
+}
+
+void luma_row_sse41(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                    unsigned char mask)
+{
+    luma_row_sse41_px(bgr, dst, width, mask, 3u);
+}
+
+void luma_row_sse41_bgra(const unsigned char *bgr, uint16_t *dst, int32_t width,
+                         unsigned char mask)
+{
+    luma_row_sse41_px(bgr, dst, width, mask, 4u);
+}
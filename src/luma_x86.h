@@ -0,0 +1,112 @@
+#ifndef LUMA_X86_H
+#define LUMA_X86_H
+
+// Private to the x86 luma kernels: SSSE3 deinterleave of 16 packed BGR or
+// BGRA pixels. Include only from translation units built with SSE4.1 or AVX2.
+
+#include <immintrin.h>
+
+#define LUMA_X86_Z (-1)
+
+// Split 48 bytes at src into 16 B, G and R bytes ANDed with channel_mask.
+static inline void luma_x86_deinterleave16(const unsigned char *src,
+                                           __m128i channel_mask,
+                                           __m128i *b_out,
+                                           __m128i *g_out,
+                                           __m128i *r_out)
+{
+    const __m128i v0 = _mm_loadu_si128((const __m128i *)(const void *)(src + 0));
+    const __m128i v1 = _mm_loadu_si128((const __m128i *)(const void *)(src + 16));
+    const __m128i v2 = _mm_loadu_si128((const __m128i *)(const void *)(src + 32));
+
+    const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z);
+    const __m128i b1 = _mm_setr_epi8(LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, 2, 5, 8, 11, 14, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z);
+    const __m128i b2 = _mm_setr_epi8(LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, 1, 4, 7, 10, 13);
+
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z);
+    const __m128i g1 = _mm_setr_epi8(LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, 0, 3, 6, 9, 12, 15, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z);
+    const __m128i g2 = _mm_setr_epi8(LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, 2, 5, 8, 11, 14);
+
+    const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z);
+    const __m128i r1 = _mm_setr_epi8(LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, 1, 4, 7, 10, 13, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z);
+    const __m128i r2 = _mm_setr_epi8(LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z, LUMA_X86_Z,
+                                     LUMA_X86_Z, LUMA_X86_Z, 0, 3, 6, 9, 12, 15);
+
+    __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1)),
+                             _mm_shuffle_epi8(v2, b2));
+    __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1)),
+                             _mm_shuffle_epi8(v2, g2));
+    __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1)),
+                             _mm_shuffle_epi8(v2, r2));
+
+    *b_out = _mm_and_si128(b, channel_mask);
+    *g_out = _mm_and_si128(g, channel_mask);
+    *r_out = _mm_and_si128(r, channel_mask);
+}
+
+// Split 64 bytes of BGRA pixels at src into 16 B, G and R bytes ANDed with
+// channel_mask; the alpha bytes are dropped.
+static inline void luma_x86_deinterleave16_bgra(const unsigned char *src,
+                                                __m128i channel_mask,
+                                                __m128i *b_out,
+                                                __m128i *g_out,
+                                                __m128i *r_out)
+{
+    // Each load of four pixels becomes dwords B, G, R, A; a 4x4 dword
+    // transpose then puts all the B (G, R) bytes of the 16 pixels together.
+    const __m128i planar = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14,
+                                         3, 7, 11, 15);
+    __m128i t0 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(const void *)(src + 0)), planar);
+    __m128i t1 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(const void *)(src + 16)), planar);
+    __m128i t2 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(const void *)(src + 32)), planar);
+    __m128i t3 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(const void *)(src + 48)), planar);
+
+    __m128i bg01 = _mm_unpacklo_epi32(t0, t1);
+    __m128i bg23 = _mm_unpacklo_epi32(t2, t3);
+    __m128i ra01 = _mm_unpackhi_epi32(t0, t1);
+    __m128i ra23 = _mm_unpackhi_epi32(t2, t3);
+
+    *b_out = _mm_and_si128(_mm_unpacklo_epi64(bg01, bg23), channel_mask);
+    *g_out = _mm_and_si128(_mm_unpackhi_epi64(bg01, bg23), channel_mask);
+    *r_out = _mm_and_si128(_mm_unpacklo_epi64(ra01, ra23), channel_mask);
+}
+
+// Deinterleave 16 pixels of pixel_bytes bytes (a constant: 3 or 4).
+static inline void luma_x86_deinterleave16_px(const unsigned char *src,
+                                              __m128i channel_mask,
+                                              __m128i *b_out,
+                                              __m128i *g_out,
+                                              __m128i *r_out,
+                                              const size_t pixel_bytes)
+{
+    if (pixel_bytes == 4u) {
+        luma_x86_deinterleave16_bgra(src, channel_mask, b_out, g_out, r_out);
+    } else {
+        luma_x86_deinterleave16(src, channel_mask, b_out, g_out, r_out);
+    }
+}
+
+#undef LUMA_X86_Z
+
+#endif
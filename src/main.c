@@ -1,16 +1,29 @@
 // main.c - Simple CLI for BMP LSB steganography with low-contrast selection.
 //
 // Usage:
-//   Encode: steg_cli encode <input_bmp> <input_txt> <output_bmp>
+//   Encode: steg_cli encode [-b bits] [-c lz4|zstd | -a] <input_bmp> <input_txt> <output_bmp>
 //   Decode: steg_cli decode <input_bmp> <output_txt>
+//   Update: steg_cli update <stego_bmp> <input_txt> [output_bmp]
+//   Probe:  steg_cli probe <bmp> [<bmp> ...]
+//   Batch:  steg_cli batch [-j threads] [manifest | -]
+//   Shards: steg_cli shard-encode <input_txt> <cover_bmp> <output_bmp> [...]
+//           steg_cli shard-decode <output_txt> <stego_bmp> [...]
+//
+// --stats before the mode prints stage timings and counters as JSON on
+// stdout when the command finishes. --cache DIR before the mode keeps decode
+// selection maps in DIR, so decoding another stego copy of a cover decoded
+// before skips the contrast scan.
 
 #include "bmp.h"
 #include "steg.h"
+#include "thread_pool.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static int read_file_to_buffer(const char *path, unsigned char **buf_out, size_t *len_out)
 {
@@ -83,118 +96,1250 @@ static int write_buffer_to_file(const char *path, const unsigned char *buf, size
     return 0;
 }
 
-static void print_usage(const char *prog)
+// Reasonable defaults
+#define CLI_BLOCK_SIZE 8
+#define CLI_CONTRAST_THRESHOLD 5.0
+#define CLI_CACHE_ENTRIES 64
+
+// What one encode or decode processed, for the batch summary.
+typedef struct {
+    double pixels;
+    size_t payload_bytes;
+} JobStats;
+
+// Per-thread state for --stats: a context with the stats attached, so the
+// library fills in the stages it runs and the CLI adds load and save.
+typedef struct {
+    StegContext *ctx;
+    StegStats stats;
+} CliWorker;
+
+static double monotonic_seconds(void)
 {
-    fprintf(stderr,
-            "Usage:\n"
-            "  %s encode <input_bmp> <input_txt> <output_bmp>\n"
-            "  %s decode <input_bmp> <output_txt>\n",
-            prog, prog);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
 }
 
-int main(int argc, char **argv)
+// Returns 0 on success, non-zero on allocation failure.
+static int cli_worker_init(CliWorker *worker)
 {
-    if (argc < 2) {
-        print_usage(argv[0]);
+    memset(worker, 0, sizeof(*worker));
+    worker->ctx = steg_context_create();
+    if (worker->ctx == NULL) {
         return 1;
     }
+    steg_context_set_stats(worker->ctx, &worker->stats);
+    return 0;
+}
 
-    const char *mode = argv[1];
+static void cli_worker_free(CliWorker *worker)
+{
+    steg_context_destroy(worker->ctx);
+    worker->ctx = NULL;
+}
 
-    // Reasonable defaults
-    const int block_size = 8;
-    const double contrast_threshold = 5.0;
+// Helper: open the --cache selection cache. With no directory returns NULL
+// in *cache_out. Returns 0 on success, non-zero on failure.
+static int cli_cache_open(const char *directory, StegSelectionCache **cache_out)
+{
+    *cache_out = NULL;
+    if (directory == NULL) {
+        return 0;
+    }
+    *cache_out = steg_selection_cache_create(CLI_CACHE_ENTRIES, directory);
+    if (*cache_out == NULL) {
+        fprintf(stderr, "Failed to open the selection cache '%s'\n", directory);
+        return 1;
+    }
+    return 0;
+}
 
-    if (strcmp(mode, "encode") == 0) {
-        if (argc != 5) {
-            print_usage(argv[0]);
-            return 1;
+// Helper: report the cache counters (with --stats) and destroy the cache.
+static void cli_cache_close(StegSelectionCache *cache, int print_stats)
+{
+    if (cache == NULL) {
+        return;
+    }
+    if (print_stats) {
+        StegSelectionCacheStats cs;
+        steg_selection_cache_get_stats(cache, &cs);
+        fprintf(stderr, "cache: %llu memory hits, %llu disk hits, %llu misses\n",
+                (unsigned long long)cs.memory_hits, (unsigned long long)cs.disk_hits,
+                (unsigned long long)cs.misses);
+    }
+    steg_selection_cache_destroy(cache);
+}
+
+static void print_stats_json(const StegStats *s)
+{
+    printf("{\n"
+           "  \"load_seconds\": %.6f,\n"
+           "  \"setup_seconds\": %.6f,\n"
+           "  \"luma_seconds\": %.6f,\n"
+           "  \"scan_seconds\": %.6f,\n"
+           "  \"embed_seconds\": %.6f,\n"
+           "  \"extract_seconds\": %.6f,\n"
+           "  \"save_seconds\": %.6f,\n"
+           "  \"calls\": %llu,\n"
+           "  \"blocks_evaluated\": %llu,\n"
+           "  \"blocks_accepted\": %llu,\n"
+           "  \"blocks_exact\": %llu,\n"
+           "  \"positions_emitted\": %llu,\n"
+           "  \"duplicate_writes\": %llu,\n"
+           "  \"bits_written\": %llu,\n"
+           "  \"bits_read\": %llu,\n"
+           "  \"peak_scratch_bytes\": %zu\n"
+           "}\n",
+           s->load_seconds, s->setup_seconds, s->luma_seconds, s->scan_seconds,
+           s->embed_seconds, s->extract_seconds, s->save_seconds,
+           (unsigned long long)s->calls,
+           (unsigned long long)s->blocks_evaluated,
+           (unsigned long long)s->blocks_accepted,
+           (unsigned long long)s->blocks_exact,
+           (unsigned long long)s->positions_emitted,
+           (unsigned long long)s->duplicate_writes,
+           (unsigned long long)s->bits_written,
+           (unsigned long long)s->bits_read,
+           s->peak_scratch_bytes);
+}
+
+// Helper: embed message into img at bits_per_channel bits per channel,
+// compressed with codec or, when adaptive is set, at the lowest threshold
+// that fits (steg_encode_message_adaptive()), or replace the payload already
+// there with bits_per_channel 0 (steg_update_message(), which keeps the codec
+// of that payload). input_bmp names the cover in error messages.
+// Returns 0 on success, -1 if the message does not fit, 1 on other errors.
+static int encode_image(BmpImage *img,
+                        const unsigned char *message,
+                        size_t message_len,
+                        int bits_per_channel,
+                        int codec,
+                        int adaptive,
+                        const char *input_bmp,
+                        CliWorker *worker)
+{
+    int rc;
+    if (adaptive) {
+        rc = worker != NULL
+                 ? steg_encode_message_adaptive_ctx(worker->ctx, img, message, message_len,
+                                                    CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD,
+                                                    bits_per_channel, NULL)
+                 : steg_encode_message_adaptive(img, message, message_len, CLI_BLOCK_SIZE,
+                                                CLI_CONTRAST_THRESHOLD, bits_per_channel,
+                                                NULL);
+    } else if (bits_per_channel == 0) {
+        rc = worker != NULL
+                 ? steg_update_message_ctx(worker->ctx, img, message, message_len,
+                                           CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD)
+                 : steg_update_message(img, message, message_len,
+                                       CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD);
+    } else {
+        rc = worker != NULL
+                 ? steg_encode_message_compressed_ctx(worker->ctx, img, message, message_len,
+                                                      CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD,
+                                                      bits_per_channel, codec)
+                 : steg_encode_message_compressed(img, message, message_len,
+                                                  CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD,
+                                                  bits_per_channel, codec);
+    }
+    if (rc != 0) {
+        if (rc == -1) {
+            fprintf(stderr, "Error: message too large for cover image '%s'\n", input_bmp);
+        } else {
+            fprintf(stderr, "Error: steg_encode_message failed (code %d)\n", rc);
         }
+        return rc == -1 ? -1 : 1;
+    }
+    return 0;
+}
 
-        const char *input_bmp = argv[2];
-        const char *input_txt = argv[3];
-        const char *output_bmp = argv[4];
+// Helper: save an encoded image. In place (output_bmp is the file img was
+// loaded from, see bmp_same_file()) only the rows that changed are rewritten;
+// otherwise bmp_save() replaces output_bmp without truncating it, which keeps
+// any cover still mapped under that name intact.
+// Returns 0 on success, non-zero on failure.
+static int save_encoded(const char *output_bmp, const BmpImage *img, int in_place)
+{
+    int rc = in_place ? bmp_save_in_place(output_bmp, img) : bmp_save(output_bmp, img);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to save output BMP '%s'\n", output_bmp);
+        return 1;
+    }
+    return 0;
+}
 
-        BmpImage img;
-        if (bmp_load(input_bmp, &img) != 0) {
-            fprintf(stderr, "Failed to load input BMP '%s'\n", input_bmp);
-            return 1;
+// Helper: extract the message of img. Without a worker the message is
+// allocated into *message_out (free() it); with one it stays in the
+// context's scratch, valid until the worker's next call, and *message_out is
+// NULL. *data_out points to it either way.
+// Returns 0 on success, non-zero on failure.
+static int decode_image(const BmpImage *img,
+                        StegSelectionCache *cache,
+                        CliWorker *worker,
+                        uint8_t **message_out,
+                        const uint8_t **data_out,
+                        size_t *len_out)
+{
+    *message_out = NULL;
+    *data_out = NULL;
+    *len_out = 0;
+
+    if (worker != NULL) {
+        steg_context_set_selection_cache(worker->ctx, cache);
+    }
+    int rc = worker != NULL
+                 ? steg_decode_message_ctx(worker->ctx, img, data_out, len_out,
+                                           CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD)
+                 : steg_decode_message_cached(cache, img, message_out, len_out,
+                                              CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD);
+    if (rc != 0) {
+        fprintf(stderr, "Error: steg_decode_message failed (code %d)\n", rc);
+        return 1;
+    }
+    if (*message_out != NULL) {
+        *data_out = *message_out;
+    }
+    return 0;
+}
+
+static void job_stats_set(JobStats *stats, const BmpImage *img, size_t payload_bytes)
+{
+    if (stats != NULL) {
+        stats->pixels = (double)img->width * (double)(img->height > 0 ? img->height : -img->height);
+        stats->payload_bytes = payload_bytes;
+    }
+}
+
+// Encode input_txt into input_bmp at bits_per_channel bits per channel,
+// compressed with codec or at an adaptive threshold, and write output_bmp. bits_per_channel 0 replaces
+// the payload already in input_bmp at its own depth instead
+// (steg_update_message()). worker may be NULL (no instrumentation).
+// Returns 0 on success, -1 if the message does not fit, 1 on other errors.
+static int encode_file(const char *input_bmp,
+                       const char *input_txt,
+                       const char *output_bmp,
+                       int bits_per_channel,
+                       int codec,
+                       int adaptive,
+                       JobStats *stats,
+                       CliWorker *worker)
+{
+    // Copy-on-write mapping: only the pages the payload touches are
+    // copied, and the input file itself is never modified.
+    double start = monotonic_seconds();
+    BmpImage img;
+    if (bmp_load_mapped(input_bmp, &img, BMP_STORAGE_MAP_COPY) != 0) {
+        fprintf(stderr, "Failed to load input BMP '%s'\n", input_bmp);
+        return 1;
+    }
+    if (worker != NULL) {
+        worker->stats.load_seconds += monotonic_seconds() - start;
+    }
+
+    unsigned char *message = NULL;
+    size_t message_len = 0;
+
+    if (read_file_to_buffer(input_txt, &message, &message_len) != 0) {
+        fprintf(stderr, "Failed to read input text '%s'\n", input_txt);
+        bmp_free(&img);
+        return 1;
+    }
+
+    int rc = encode_image(&img, message, message_len, bits_per_channel, codec, adaptive,
+                          input_bmp, worker);
+    if (rc != 0) {
+        free(message);
+        bmp_free(&img);
+        return rc;
+    }
+
+    start = monotonic_seconds();
+    if (save_encoded(output_bmp, &img, bmp_same_file(input_bmp, output_bmp)) != 0) {
+        free(message);
+        bmp_free(&img);
+        return 1;
+    }
+    if (worker != NULL) {
+        worker->stats.save_seconds += monotonic_seconds() - start;
+    }
+
+    job_stats_set(stats, &img, message_len);
+
+    free(message);
+    bmp_free(&img);
+    return 0;
+}
+
+// Decode the message in input_bmp into output_txt. cache and worker may be
+// NULL (no selection cache, no instrumentation).
+// Returns 0 on success, non-zero on failure.
+static int decode_file(const char *input_bmp,
+                       const char *output_txt,
+                       JobStats *stats,
+                       StegSelectionCache *cache,
+                       CliWorker *worker)
+{
+    double start = monotonic_seconds();
+    BmpImage img;
+    if (bmp_load_mapped(input_bmp, &img, BMP_STORAGE_MAP_READ) != 0) {
+        fprintf(stderr, "Failed to load input BMP '%s'\n", input_bmp);
+        return 1;
+    }
+    if (worker != NULL) {
+        worker->stats.load_seconds += monotonic_seconds() - start;
+    }
+
+    uint8_t *message = NULL;
+    const uint8_t *data = NULL;
+    size_t message_len = 0;
+    if (decode_image(&img, cache, worker, &message, &data, &message_len) != 0) {
+        bmp_free(&img);
+        return 1;
+    }
+
+    start = monotonic_seconds();
+    if (write_buffer_to_file(output_txt, data, message_len) != 0) {
+        fprintf(stderr, "Failed to write output text '%s'\n", output_txt);
+        free(message);
+        bmp_free(&img);
+        return 1;
+    }
+    if (worker != NULL) {
+        worker->stats.save_seconds += monotonic_seconds() - start;
+    }
+
+    job_stats_set(stats, &img, message_len);
+
+    free(message);
+    bmp_free(&img);
+    return 0;
+}
+
+// Batch mode.
+//
+// Every manifest line is one job, with whitespace-separated fields (paths
+// cannot contain spaces):
+//   [encode] <input_bmp> <input_txt> <output_bmp>
+//   decode <input_bmp> <output_txt>
+// Blank lines and lines starting with '#' are skipped. Jobs are independent
+// and may run in any order, so a decode cannot rely on an encode from the
+// same manifest. Failures are reported per line, in manifest order, followed
+// by a throughput summary.
+//
+// Jobs go through a three-stage pipeline so that the disk and the CPU are
+// busy at the same time: a reader thread loads covers and messages in
+// manifest order, the pool threads embed or extract, and a writer thread
+// saves the results. Bounded queues connect the stages, so only a few
+// images per pool thread are in memory at once and a slow stage holds the
+// others back instead of piling up work.
+
+#define BATCH_MAX_FIELDS 4
+
+// Queue slots between two stages, per pool thread.
+#define BATCH_QUEUE_PER_THREAD 2
+
+typedef struct {
+    int line;                  // manifest line number
+    int is_encode;
+    char *fields[3];           // paths, pointing into text
+    char *text;                // owned copy of the line
+    int rc;
+    JobStats stats;
+    // In flight through the pipeline
+    BmpImage img;              // loaded cover (encode) or stego image (decode)
+    int loaded;                // img holds an image
+    unsigned char *message;    // message read (encode) or extracted (decode)
+    size_t message_len;
+} BatchJob;
+
+// Bounded FIFO of job indices between two stages.
+typedef struct {
+    int *slots;
+    int capacity;
+    int head;
+    int count;
+    int closed;                // no more pushes: pops drain, then return -1
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} BatchQueue;
+
+typedef struct {
+    BatchJob *jobs;
+    size_t count;
+    size_t capacity;
+    CliWorker *workers;        // one per pool thread with --stats, else NULL
+    StegSelectionCache *cache; // shared by all threads with --cache, else NULL
+    BatchQueue loaded;         // reader -> pool threads
+    BatchQueue processed;      // pool threads -> writer
+    double load_seconds;       // reader thread
+    double save_seconds;       // writer thread
+} Batch;
+
+// Returns 0 on success, non-zero on failure.
+static int batch_queue_init(BatchQueue *q, int capacity)
+{
+    memset(q, 0, sizeof(*q));
+    q->slots = (int *)malloc((size_t)capacity * sizeof(int));
+    if (!q->slots) {
+        perror("batch: malloc");
+        return 1;
+    }
+    q->capacity = capacity;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+static void batch_queue_free(BatchQueue *q)
+{
+    if (q->slots == NULL) {
+        return;
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->slots);
+    q->slots = NULL;
+}
+
+// Append job, waiting while the queue is full.
+static void batch_queue_push(BatchQueue *q, int job)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+    q->slots[(q->head + q->count) % q->capacity] = job;
+    ++q->count;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void batch_queue_close(BatchQueue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Take the oldest job, waiting while the queue is empty. Returns -1 once the
+// queue is closed and drained.
+static int batch_queue_pop(BatchQueue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    int job = -1;
+    if (q->count > 0) {
+        job = q->slots[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        --q->count;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return job;
+}
+
+static void batch_free(Batch *batch)
+{
+    for (size_t i = 0; i < batch->count; ++i) {
+        free(batch->jobs[i].text);
+    }
+    free(batch->jobs);
+    batch->jobs = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+}
+
+// Helper: parse one manifest line into a job. Returns 1 if a job was added,
+// 0 for a line without one, -1 on a malformed line or allocation failure.
+static int batch_add_line(Batch *batch, const char *line, int line_no)
+{
+    size_t len = strlen(line);
+    char *text = (char *)malloc(len + 1u);
+    if (!text) {
+        perror("batch: malloc");
+        return -1;
+    }
+    memcpy(text, line, len + 1u);
+
+    char *fields[BATCH_MAX_FIELDS + 1];
+    int nfields = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(text, " \t\r\n", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (nfields == 0 && tok[0] == '#') {
+            break;
         }
+        if (nfields == BATCH_MAX_FIELDS + 1) {
+            break;
+        }
+        fields[nfields++] = tok;
+    }
 
-        unsigned char *message = NULL;
-        size_t message_len = 0;
+    if (nfields == 0) {
+        free(text);
+        return 0;
+    }
+
+    BatchJob job;
+    memset(&job, 0, sizeof(job));
+    job.line = line_no;
+    job.text = text;
+
+    if (nfields == 4 && strcmp(fields[0], "encode") == 0) {
+        job.is_encode = 1;
+        job.fields[0] = fields[1];
+        job.fields[1] = fields[2];
+        job.fields[2] = fields[3];
+    } else if (nfields == 3 && strcmp(fields[0], "decode") == 0) {
+        job.fields[0] = fields[1];
+        job.fields[1] = fields[2];
+    } else if (nfields == 3) {
+        job.is_encode = 1;
+        job.fields[0] = fields[0];
+        job.fields[1] = fields[1];
+        job.fields[2] = fields[2];
+    } else {
+        fprintf(stderr, "batch: line %d: expected '[encode] <input_bmp> <input_txt> "
+                        "<output_bmp>' or 'decode <input_bmp> <output_txt>'\n", line_no);
+        free(text);
+        return -1;
+    }
+
+    if (batch->count == batch->capacity) {
+        size_t new_cap = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        BatchJob *tmp = (BatchJob *)realloc(batch->jobs, new_cap * sizeof(BatchJob));
+        if (!tmp) {
+            perror("batch: realloc");
+            free(text);
+            return -1;
+        }
+        batch->jobs = tmp;
+        batch->capacity = new_cap;
+    }
 
-        if (read_file_to_buffer(input_txt, &message, &message_len) != 0) {
-            fprintf(stderr, "Failed to read input text '%s'\n", input_txt);
-            bmp_free(&img);
+    batch->jobs[batch->count++] = job;
+    return 1;
+}
+
+// Helper: read the whole manifest before starting, so every line is
+// validated up front. Returns 0 on success, non-zero on failure.
+static int batch_read_manifest(Batch *batch, FILE *f)
+{
+    char line[8192];
+    int line_no = 0;
+    int failed = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        ++line_no;
+        size_t len = strlen(line);
+        if (len == sizeof(line) - 1u && line[len - 1u] != '\n' && !feof(f)) {
+            fprintf(stderr, "batch: line %d: too long\n", line_no);
             return 1;
         }
+        if (batch_add_line(batch, line, line_no) < 0) {
+            failed = 1;
+        }
+    }
+    if (ferror(f)) {
+        perror("batch: read manifest");
+        return 1;
+    }
+    return failed;
+}
 
-        int rc = steg_encode_message(&img, message, message_len,
-                                     block_size, contrast_threshold);
-        if (rc != 0) {
-            if (rc == -1) {
-                fprintf(stderr, "Error: message too large for cover image\n");
-            } else {
-                fprintf(stderr, "Error: steg_encode_message failed (code %d)\n", rc);
+// Helper: release whatever a job still holds.
+static void batch_job_release(BatchJob *job)
+{
+    if (job->loaded) {
+        bmp_free(&job->img);
+        job->loaded = 0;
+    }
+    free(job->message);
+    job->message = NULL;
+}
+
+// Stage 1: read every cover (and message) into memory, in manifest order.
+// The images are read rather than mapped so that the disk work happens here
+// and not as page faults in the pool threads.
+static void *batch_reader_main(void *arg)
+{
+    Batch *batch = (Batch *)arg;
+    for (size_t i = 0; i < batch->count; ++i) {
+        BatchJob *job = &batch->jobs[i];
+        double start = monotonic_seconds();
+        if (bmp_load(job->fields[0], &job->img) != 0) {
+            fprintf(stderr, "Failed to load input BMP '%s'\n", job->fields[0]);
+            job->rc = 1;
+        } else {
+            job->loaded = 1;
+            if (job->is_encode &&
+                read_file_to_buffer(job->fields[1], &job->message, &job->message_len) != 0) {
+                fprintf(stderr, "Failed to read input text '%s'\n", job->fields[1]);
+                job->rc = 1;
+            }
+        }
+        batch->load_seconds += monotonic_seconds() - start;
+        batch_queue_push(&batch->loaded, (int)i);
+    }
+    batch_queue_close(&batch->loaded);
+    return NULL;
+}
+
+// Helper: embed or extract one loaded job. A decoded message is copied out
+// of the worker's scratch, since the writer saves it after the worker moved
+// on; the stego image is not needed any more and is freed right away.
+static void batch_process_job(Batch *batch, BatchJob *job, CliWorker *worker)
+{
+    if (job->is_encode) {
+        job->rc = encode_image(&job->img, job->message, job->message_len, 1,
+                               STEG_CODEC_NONE, 0, job->fields[0], worker);
+        return;
+    }
+
+    uint8_t *message = NULL;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    if (decode_image(&job->img, batch->cache, worker, &message, &data, &len) != 0) {
+        job->rc = 1;
+        return;
+    }
+    if (message == NULL) {
+        message = (uint8_t *)malloc(len > 0 ? len : 1u);
+        if (!message) {
+            perror("batch: malloc");
+            job->rc = 1;
+            return;
+        }
+        if (len > 0) {
+            memcpy(message, data, len);
+        }
+    }
+    job->message = message;
+    job->message_len = len;
+    job_stats_set(&job->stats, &job->img, len);
+    bmp_free(&job->img);
+    job->loaded = 0;
+}
+
+// Stage 2, one task per pool thread: process loaded jobs until the reader is
+// done.
+static void batch_compute_task(void *ctx, int task, int thread)
+{
+    (void)task;
+    Batch *batch = (Batch *)ctx;
+    CliWorker *worker = batch->workers != NULL ? &batch->workers[thread] : NULL;
+    for (int i = batch_queue_pop(&batch->loaded); i >= 0; i = batch_queue_pop(&batch->loaded)) {
+        BatchJob *job = &batch->jobs[i];
+        if (job->rc == 0) {
+            batch_process_job(batch, job, worker);
+        }
+        batch_queue_push(&batch->processed, i);
+    }
+}
+
+// Stage 3: save the results in the order they come out of the pool.
+static void *batch_writer_main(void *arg)
+{
+    Batch *batch = (Batch *)arg;
+    for (int i = batch_queue_pop(&batch->processed); i >= 0;
+         i = batch_queue_pop(&batch->processed)) {
+        BatchJob *job = &batch->jobs[i];
+        if (job->rc == 0) {
+            double start = monotonic_seconds();
+            if (job->is_encode) {
+                if (save_encoded(job->fields[2], &job->img,
+                                 bmp_same_file(job->fields[0], job->fields[2])) != 0) {
+                    job->rc = 1;
+                } else {
+                    job_stats_set(&job->stats, &job->img, job->message_len);
+                }
+            } else if (write_buffer_to_file(job->fields[1], job->message,
+                                            job->message_len) != 0) {
+                fprintf(stderr, "Failed to write output text '%s'\n", job->fields[1]);
+                job->rc = 1;
             }
-            free(message);
-            bmp_free(&img);
+            batch->save_seconds += monotonic_seconds() - start;
+        }
+        batch_job_release(job);
+    }
+    return NULL;
+}
+
+// Helper: run every job through the pipeline. Returns 0 on success,
+// non-zero when the pipeline could not be set up (no job ran then).
+static int batch_run_pipeline(Batch *batch, StegThreadPool *pool)
+{
+    int depth = steg_thread_pool_size(pool) * BATCH_QUEUE_PER_THREAD;
+    if (batch_queue_init(&batch->loaded, depth) != 0 ||
+        batch_queue_init(&batch->processed, depth) != 0) {
+        batch_queue_free(&batch->loaded);
+        return 1;
+    }
+
+    pthread_t reader;
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, batch_writer_main, batch) != 0) {
+        fprintf(stderr, "batch: failed to start the writer thread\n");
+        batch_queue_free(&batch->processed);
+        batch_queue_free(&batch->loaded);
+        return 1;
+    }
+    if (pthread_create(&reader, NULL, batch_reader_main, batch) != 0) {
+        fprintf(stderr, "batch: failed to start the reader thread\n");
+        batch_queue_close(&batch->processed);
+        pthread_join(writer, NULL);
+        batch_queue_free(&batch->processed);
+        batch_queue_free(&batch->loaded);
+        return 1;
+    }
+
+    thread_pool_run(pool, batch_compute_task, batch, steg_thread_pool_size(pool));
+
+    pthread_join(reader, NULL);
+    batch_queue_close(&batch->processed);
+    pthread_join(writer, NULL);
+
+    batch_queue_free(&batch->processed);
+    batch_queue_free(&batch->loaded);
+    return 0;
+}
+
+// Helper: one CliWorker per pool thread. Returns 0 on success.
+static int batch_create_workers(Batch *batch, int count)
+{
+    batch->workers = (CliWorker *)calloc((size_t)count, sizeof(CliWorker));
+    if (!batch->workers) {
+        perror("batch: calloc");
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (cli_worker_init(&batch->workers[i]) != 0) {
+            fprintf(stderr, "batch: failed to create a context\n");
             return 1;
         }
+    }
+    return 0;
+}
+
+// Helper: merge the per-thread stats into *total and free the workers.
+static void batch_free_workers(Batch *batch, int count, StegStats *total)
+{
+    if (batch->workers == NULL) {
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (total != NULL) {
+            steg_stats_merge(total, &batch->workers[i].stats);
+        }
+        cli_worker_free(&batch->workers[i]);
+    }
+    free(batch->workers);
+    batch->workers = NULL;
+}
 
-        if (bmp_save(output_bmp, &img) != 0) {
-            fprintf(stderr, "Failed to save output BMP '%s'\n", output_bmp);
-            free(message);
-            bmp_free(&img);
+static int run_batch(const char *manifest, int threads, int print_stats, const char *cache_dir)
+{
+    FILE *f = stdin;
+    if (manifest != NULL && strcmp(manifest, "-") != 0) {
+        f = fopen(manifest, "r");
+        if (!f) {
+            perror("batch: fopen");
             return 1;
         }
+    }
 
-        free(message);
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    int rc = batch_read_manifest(&batch, f);
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (rc != 0) {
+        batch_free(&batch);
+        return 1;
+    }
+
+    if (batch.count > (size_t)INT32_MAX) {
+        fprintf(stderr, "batch: too many jobs\n");
+        batch_free(&batch);
+        return 1;
+    }
+
+    if (cli_cache_open(cache_dir, &batch.cache) != 0) {
+        batch_free(&batch);
+        return 1;
+    }
+
+    StegThreadPool *pool = steg_thread_pool_create(threads);
+    if (pool == NULL) {
+        cli_cache_close(batch.cache, 0);
+        batch_free(&batch);
+        return 1;
+    }
+
+    int pool_size = steg_thread_pool_size(pool);
+    if (print_stats && batch_create_workers(&batch, pool_size) != 0) {
+        batch_free_workers(&batch, pool_size, NULL);
+        steg_thread_pool_destroy(pool);
+        cli_cache_close(batch.cache, 0);
+        batch_free(&batch);
+        return 1;
+    }
+
+    double start = monotonic_seconds();
+    if (batch_run_pipeline(&batch, pool) != 0) {
+        batch_free_workers(&batch, pool_size, NULL);
+        steg_thread_pool_destroy(pool);
+        cli_cache_close(batch.cache, 0);
+        batch_free(&batch);
+        return 1;
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    size_t ok = 0;
+    double pixels = 0.0;
+    double payload_bytes = 0.0;
+    for (size_t i = 0; i < batch.count; ++i) {
+        const BatchJob *job = &batch.jobs[i];
+        if (job->rc != 0) {
+            fprintf(stderr, "batch: line %d: %s %s failed%s\n", job->line,
+                    job->is_encode ? "encode" : "decode", job->fields[0],
+                    job->rc == -1 ? " (message too large)" : "");
+            continue;
+        }
+        ++ok;
+        pixels += job->stats.pixels;
+        payload_bytes += (double)job->stats.payload_bytes;
+    }
+
+    double rate = elapsed > 0.0 ? 1.0 / elapsed : 0.0;
+    fprintf(stderr,
+            "batch: %zu ok, %zu failed, %d threads, %.3f s "
+            "(%.1f images/s, %.1f MP/s, %.1f KiB/s payload)\n",
+            ok, batch.count - ok, pool_size, elapsed,
+            (double)batch.count * rate, pixels * 1e-6 * rate,
+            payload_bytes / 1024.0 * rate);
+
+    if (print_stats) {
+        StegStats total;
+        memset(&total, 0, sizeof(total));
+        batch_free_workers(&batch, pool_size, &total);
+        total.load_seconds += batch.load_seconds;
+        total.save_seconds += batch.save_seconds;
+        print_stats_json(&total);
+    }
+
+    steg_thread_pool_destroy(pool);
+    cli_cache_close(batch.cache, print_stats);
+    rc = ok == batch.count ? 0 : 1;
+    batch_free(&batch);
+    return rc;
+}
+
+// Probe mode: report which images seem to carry a payload, reading only
+// their headers (steg_probe_message()). Returns 0 when every image could be
+// probed.
+static int probe_files(char **paths, size_t count)
+{
+    StegContext *ctx = steg_context_create();
+    if (ctx == NULL) {
+        fprintf(stderr, "probe: out of memory\n");
+        return 1;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; i < count; ++i) {
+        // Mapped read-only: only the pages of the rows scanned are read.
+        BmpImage img;
+        if (bmp_load_mapped(paths[i], &img, BMP_STORAGE_MAP_READ) != 0) {
+            fprintf(stderr, "Failed to load input BMP '%s'\n", paths[i]);
+            rc = 1;
+            continue;
+        }
+
+        StegProbe probe;
+        if (steg_probe_message_ctx(ctx, &img, CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD,
+                                   &probe) != 0) {
+            fprintf(stderr, "Error: steg_probe_message failed for '%s'\n", paths[i]);
+            rc = 1;
+        } else if (!probe.found) {
+            printf("%s: no payload\n", paths[i]);
+        } else {
+            printf("%s: %zu byte payload, %d bit(s) per channel%s", paths[i],
+                   probe.message_len, probe.bits_per_channel,
+                   probe.codec == STEG_CODEC_LZ4    ? ", lz4"
+                   : probe.codec == STEG_CODEC_ZSTD ? ", zstd"
+                   : probe.format == STEG_FORMAT_LEGACY ? ", legacy layout"
+                                                        : "");
+            if (probe.format == STEG_FORMAT_ADAPTIVE) {
+                printf(", threshold %.4f", probe.contrast_threshold);
+            }
+            printf("\n");
+        }
         bmp_free(&img);
+    }
+
+    steg_context_destroy(ctx);
+    return rc;
+}
+
+// Shard mode: one message spread over several covers, which are encoded or
+// decoded concurrently on one thread per CPU (steg_encode_sharded()).
+
+// Helper: load the count BMPs paths[0], paths[step], ... into imgs with
+// storage (BMP_STORAGE_*). Returns 0 on success; on failure nothing is left
+// loaded.
+static int load_images(char **paths, size_t count, size_t step, int storage, BmpImage *imgs)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (bmp_load_mapped(paths[i * step], &imgs[i], storage) != 0) {
+            fprintf(stderr, "Failed to load input BMP '%s'\n", paths[i * step]);
+            while (i > 0) {
+                bmp_free(&imgs[--i]);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper: 1 when output pairs[2 * i + 1] may be patched in place: it is
+// cover i's own file and no other cover or output of the run is that file.
+// Another cover mapped from it would see the patched rows through the pages it
+// has not copied yet, and another output would rename a new file over it.
+static int shard_save_in_place(char **pairs, size_t count, size_t i)
+{
+    const char *output = pairs[2 * i + 1];
+    if (!bmp_same_file(pairs[2 * i], output)) {
         return 0;
+    }
+    for (size_t j = 0; j < count; ++j) {
+        if (j != i && (bmp_same_file(pairs[2 * j], output) ||
+                       bmp_same_file(pairs[2 * j + 1], output))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Encode input_txt over pairs[0] (cover), pairs[1] (output), pairs[2] ...
+// Every output that is not patched in place is replaced by bmp_save()
+// without truncating it, so covers still mapped under an output's name (in
+// any spelling) stay intact until they are saved themselves.
+static int shard_encode_files(const char *input_txt, char **pairs, size_t count)
+{
+    unsigned char *message = NULL;
+    size_t message_len = 0;
+    if (read_file_to_buffer(input_txt, &message, &message_len) != 0) {
+        fprintf(stderr, "Failed to read input text '%s'\n", input_txt);
+        return 1;
+    }
+
+    BmpImage *imgs = (BmpImage *)calloc(count, sizeof(BmpImage));
+    BmpImage **ptrs = (BmpImage **)calloc(count, sizeof(BmpImage *));
+    int *in_place = (int *)calloc(count, sizeof(int));
+    StegThreadPool *pool = steg_thread_pool_create(0);
+    int rc = imgs != NULL && ptrs != NULL && in_place != NULL && pool != NULL ? 0 : 1;
+    if (rc != 0) {
+        fprintf(stderr, "shard-encode: out of memory\n");
+    } else {
+        rc = load_images(pairs, count, 2, BMP_STORAGE_MAP_COPY, imgs);
+    }
+
+    if (rc == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            ptrs[i] = &imgs[i];
+        }
+        int enc = steg_encode_sharded(ptrs, count, message, message_len,
+                                      CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD, pool);
+        if (enc != 0) {
+            fprintf(stderr, enc == -1 ? "Error: message too large for the covers\n"
+                                      : "Error: steg_encode_sharded failed\n");
+            rc = 1;
+        }
+        // Decided before the first save renames anything.
+        for (size_t i = 0; i < count; ++i) {
+            in_place[i] = shard_save_in_place(pairs, count, i);
+        }
+        for (size_t i = 0; i < count && rc == 0; ++i) {
+            rc = save_encoded(pairs[2 * i + 1], &imgs[i], in_place[i]);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            bmp_free(&imgs[i]);
+        }
+    }
+
+    steg_thread_pool_destroy(pool);
+    free(in_place);
+    free(ptrs);
+    free(imgs);
+    free(message);
+    return rc;
+}
+
+// Reassemble the message of the count stego images in paths into output_txt.
+static int shard_decode_files(const char *output_txt, char **paths, size_t count)
+{
+    BmpImage *imgs = (BmpImage *)calloc(count, sizeof(BmpImage));
+    const BmpImage **ptrs = (const BmpImage **)calloc(count, sizeof(BmpImage *));
+    StegThreadPool *pool = steg_thread_pool_create(0);
+    int rc = imgs != NULL && ptrs != NULL && pool != NULL ? 0 : 1;
+    if (rc != 0) {
+        fprintf(stderr, "shard-decode: out of memory\n");
+    } else {
+        rc = load_images(paths, count, 1, BMP_STORAGE_MAP_READ, imgs);
+    }
+
+    if (rc == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            ptrs[i] = &imgs[i];
+        }
+        uint8_t *message = NULL;
+        size_t message_len = 0;
+        if (steg_decode_sharded(ptrs, count, &message, &message_len,
+                                CLI_BLOCK_SIZE, CLI_CONTRAST_THRESHOLD, pool) != 0) {
+            fprintf(stderr, "Error: steg_decode_sharded failed\n");
+            rc = 1;
+        } else if (write_buffer_to_file(output_txt, message, message_len) != 0) {
+            fprintf(stderr, "Failed to write output text '%s'\n", output_txt);
+            rc = 1;
+        }
+        free(message);
+        for (size_t i = 0; i < count; ++i) {
+            bmp_free(&imgs[i]);
+        }
+    }
+
+    steg_thread_pool_destroy(pool);
+    free(ptrs);
+    free(imgs);
+    return rc;
+}
+
+static void print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage:\n"
+            "  %s [--stats] [--cache dir] encode [-b bits] [-c lz4|zstd | -a]\n"
+            "      <input_bmp> <input_txt> <output_bmp>\n"
+            "  %s [--stats] [--cache dir] decode <input_bmp> <output_txt>\n"
+            "  %s [--stats] [--cache dir] update <stego_bmp> <input_txt> [output_bmp]\n"
+            "  %s [--stats] [--cache dir] batch [-j threads] [manifest | -]\n"
+            "  %s probe <bmp> [<bmp> ...]\n"
+            "  %s shard-encode <input_txt> <cover_bmp> <output_bmp> [<cover_bmp> <output_bmp> ...]\n"
+            "  %s shard-decode <output_txt> <stego_bmp> [<stego_bmp> ...]\n"
+            "\n"
+            "Batch manifest lines (read from stdin without a manifest or with '-'):\n"
+            "  [encode] <input_bmp> <input_txt> <output_bmp>\n"
+            "  decode <input_bmp> <output_txt>\n"
+            "-b embeds 1 (the default) to %d bits per channel; decode detects it.\n"
+            "-c compresses the message first (lz4 fast, zstd smaller); decode and\n"
+            "update detect it.\n"
+            "-a picks the lowest contrast threshold the message fits at and stores it\n"
+            "in the payload; decode and update detect it.\n"
+            "update replaces the payload at its depth, in place without output_bmp,\n"
+            "rewriting only the rows that change.\n"
+            "-j 0 (the default) uses one thread per CPU.\n"
+            "probe reports which images seem to hold a payload, reading only\n"
+            "their headers.\n"
+            "shard-encode splits the message over the covers; shard-decode takes\n"
+            "all of them back, in any order.\n"
+            "--stats prints stage timings and counters as JSON on stdout.\n"
+            "--cache keeps decode selection maps in dir (which must exist).\n",
+            prog, prog, prog, prog, prog, prog, prog, STEG_MAX_BITS_PER_CHANNEL);
+}
+
+// Helper: run a single encode (an update with bits_per_channel 0) or decode,
+// with stats when asked for.
+static int run_single(int is_encode,
+                      char **paths,
+                      int bits_per_channel,
+                      int codec,
+                      int adaptive,
+                      int print_stats,
+                      const char *cache_dir)
+{
+    // Plain encodes never look selections up.
+    StegSelectionCache *cache = NULL;
+    int uses_cache = !is_encode || bits_per_channel == 0;
+    if (uses_cache && cli_cache_open(cache_dir, &cache) != 0) {
+        return 1;
+    }
+
+    CliWorker worker;
+    if (print_stats && cli_worker_init(&worker) != 0) {
+        fprintf(stderr, "Failed to create a context\n");
+        cli_cache_close(cache, 0);
+        return 1;
+    }
+
+    CliWorker *w = print_stats ? &worker : NULL;
+    if (w != NULL) {
+        steg_context_set_selection_cache(w->ctx, cache);
+    }
+    int rc = is_encode ? encode_file(paths[0], paths[1], paths[2], bits_per_channel, codec,
+                                     adaptive, NULL, w)
+                       : decode_file(paths[0], paths[1], NULL, cache, w);
+
+    if (print_stats) {
+        if (rc == 0) {
+            print_stats_json(&worker.stats);
+        }
+        cli_worker_free(&worker);
+    }
+    cli_cache_close(cache, print_stats);
+    return rc == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *prog = argv[0];
+    int print_stats = 0;
+    const char *cache_dir = NULL;
+    while (argc >= 2) {
+        if (strcmp(argv[1], "--stats") == 0) {
+            print_stats = 1;
+            ++argv;
+            --argc;
+        } else if (strcmp(argv[1], "--cache") == 0 && argc >= 3) {
+            cache_dir = argv[2];
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+
+    if (argc < 2) {
+        print_usage(prog);
+        return 1;
+    }
+
+    const char *mode = argv[1];
+
+    if (strcmp(mode, "encode") == 0) {
+        int bits = 1;
+        int codec = STEG_CODEC_NONE;
+        int adaptive = 0;
+        int arg = 2;
+        while (arg < argc && (strcmp(argv[arg], "-b") == 0 || strcmp(argv[arg], "-c") == 0 ||
+                              strcmp(argv[arg], "-a") == 0)) {
+            if (argv[arg][1] == 'a') {
+                adaptive = 1;
+                ++arg;
+                continue;
+            }
+            if (arg + 1 >= argc) {
+                print_usage(prog);
+                return 1;
+            }
+            const char *value_arg = argv[arg + 1];
+            if (argv[arg][1] == 'c') {
+                if (strcmp(value_arg, "lz4") == 0) {
+                    codec = STEG_CODEC_LZ4;
+                } else if (strcmp(value_arg, "zstd") == 0) {
+                    codec = STEG_CODEC_ZSTD;
+                } else {
+                    fprintf(stderr, "encode: unknown codec '%s'\n", value_arg);
+                    return 1;
+                }
+                arg += 2;
+                continue;
+            }
+            char *end = NULL;
+            long value = strtol(value_arg, &end, 10);
+            if (*value_arg == '\0' || *end != '\0' || value < 1 ||
+                value > STEG_MAX_BITS_PER_CHANNEL) {
+                fprintf(stderr, "encode: invalid bits per channel '%s'\n", value_arg);
+                return 1;
+            }
+            bits = (int)value;
+            arg += 2;
+        }
+        if (argc - arg != 3) {
+            print_usage(prog);
+            return 1;
+        }
+        if (adaptive && codec != STEG_CODEC_NONE) {
+            fprintf(stderr, "encode: -a does not combine with -c\n");
+            return 1;
+        }
+
+        return run_single(1, argv + arg, bits, codec, adaptive, print_stats, cache_dir);
 
     } else if (strcmp(mode, "decode") == 0) {
         if (argc != 4) {
-            print_usage(argv[0]);
+            print_usage(prog);
             return 1;
         }
 
-        const char *input_bmp = argv[2];
-        const char *output_txt = argv[3];
+        return run_single(0, argv + 2, 1, STEG_CODEC_NONE, 0, print_stats, cache_dir);
 
-        BmpImage img;
-        if (bmp_load(input_bmp, &img) != 0) {
-            fprintf(stderr, "Failed to load input BMP '%s'\n", input_bmp);
+    } else if (strcmp(mode, "update") == 0) {
+        if (argc != 4 && argc != 5) {
+            print_usage(prog);
             return 1;
         }
 
-        uint8_t *message = NULL;
-        size_t message_len = 0;
+        char *paths[3] = {argv[2], argv[3], argc == 5 ? argv[4] : argv[2]};
+        return run_single(1, paths, 0, STEG_CODEC_NONE, 0, print_stats, cache_dir);
 
-        int rc = steg_decode_message(&img, &message, &message_len,
-                                     block_size, contrast_threshold);
-        if (rc != 0) {
-            fprintf(stderr, "Error: steg_decode_message failed (code %d)\n", rc);
-            bmp_free(&img);
+    } else if (strcmp(mode, "batch") == 0) {
+        int threads = 0;
+        int arg = 2;
+        if (arg < argc && strcmp(argv[arg], "-j") == 0) {
+            char *end = NULL;
+            if (arg + 1 >= argc) {
+                print_usage(prog);
+                return 1;
+            }
+            long value = strtol(argv[arg + 1], &end, 10);
+            if (*argv[arg + 1] == '\0' || *end != '\0' || value < 0 || value > 1024) {
+                fprintf(stderr, "batch: invalid thread count '%s'\n", argv[arg + 1]);
+                return 1;
+            }
+            threads = (int)value;
+            arg += 2;
+        }
+        if (argc - arg > 1) {
+            print_usage(prog);
             return 1;
         }
 
-        if (write_buffer_to_file(output_txt, message, message_len) != 0) {
-            fprintf(stderr, "Failed to write output text '%s'\n", output_txt);
-            free(message);
-            bmp_free(&img);
+        return run_batch(arg < argc ? argv[arg] : NULL, threads, print_stats, cache_dir);
+
+    } else if (strcmp(mode, "probe") == 0) {
+        if (argc < 3) {
+            print_usage(prog);
             return 1;
         }
 
-        free(message);
-        bmp_free(&img);
-        return 0;
+        return probe_files(argv + 2, (size_t)(argc - 2)) == 0 ? 0 : 1;
+
+    } else if (strcmp(mode, "shard-encode") == 0) {
+        if (argc < 5 || (argc - 3) % 2 != 0) {
+            print_usage(prog);
+            return 1;
+        }
+
+        return shard_encode_files(argv[2], argv + 3, (size_t)(argc - 3) / 2u) == 0 ? 0 : 1;
+
+    } else if (strcmp(mode, "shard-decode") == 0) {
+        if (argc < 4) {
+            print_usage(prog);
+            return 1;
+        }
+
+        return shard_decode_files(argv[2], argv + 3, (size_t)(argc - 3)) == 0 ? 0 : 1;
 
     } else {
-        print_usage(argv[0]);
+        print_usage(prog);
         return 1;
     }
 }
-
-
@@ -0,0 +1,179 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+// Private to steg_lib: the payload headers of the layouts (see STEG_FORMAT_*
+// in steg.h), shared by the encoders, the decoder and the capacity query.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Longest header: the adaptive tag, its 8-byte threshold, a 5-byte length
+// varint and the check byte.
+#define PAYLOAD_MAX_HEADER_BYTES 15u
+
+// Bytes of the threshold of an adaptive header.
+#define PAYLOAD_THRESHOLD_BYTES 8u
+
+// Largest threshold an adaptive header may hold: the search writes at most
+// the highest block stddev of 8-bit luma (127.5, give or take the Q8 error)
+// plus 1.
+#define PAYLOAD_MAX_THRESHOLD 129.0
+
+// A header as read back.
+typedef struct {
+    int format;          // STEG_FORMAT_*
+    int codec;           // STEG_CODEC_*, not STEG_CODEC_NONE for a compressed
+                         // payload (whose format is STEG_FORMAT_COMPACT)
+    size_t header_len;   // bytes
+    uint32_t len;        // message length, before compression
+    double threshold;    // STEG_FORMAT_ADAPTIVE: contrast threshold of the
+                         // message positions
+} PayloadHeader;
+
+// Bytes of the varint of len: 7 bits each, so 1 below 128 and 5 at most.
+static inline size_t payload_varint_size(uint32_t len)
+{
+    size_t size = 1;
+    while (len >= 0x80u) {
+        len >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+// Header bytes in front of a message of len bytes.
+static inline size_t payload_header_size(int format, uint32_t len)
+{
+    if (format == STEG_FORMAT_COMPACT) {
+        return 2u + payload_varint_size(len);
+    }
+    if (format == STEG_FORMAT_ADAPTIVE) {
+        return 2u + PAYLOAD_THRESHOLD_BYTES + payload_varint_size(len);
+    }
+    return format == STEG_FORMAT_LEGACY ? 4u : 6u;
+}
+
+// Check byte closing a tagged header whose first n bytes are bytes: their
+// CRC-8 (polynomial 0x07) folded into 1..255. Never 0, which a legacy length
+// below 16 MiB always has where the check byte of a varint header would be.
+static inline uint8_t payload_check_byte(const uint8_t *bytes, size_t n)
+{
+    unsigned crc = 0;
+    for (size_t i = 0; i < n; ++i) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x80u) ? ((crc << 1) ^ 0x07u) & 0xFFu : (crc << 1) & 0xFFu;
+        }
+    }
+    return (uint8_t)(1u + crc % 255u);
+}
+
+// Helper: append the varint of len at out[h], then the check byte over
+// out[0..], and return the new size.
+static inline size_t payload_varint_encode(uint8_t *out, size_t h, uint32_t len)
+{
+    while (len >= 0x80u) {
+        out[h++] = (uint8_t)(len | 0x80u);
+        len >>= 7;
+    }
+    out[h++] = (uint8_t)len;
+    out[h] = payload_check_byte(out, h);
+    return h + 1u;
+}
+
+// Write the header of a message of len bytes into out (at least
+// PAYLOAD_MAX_HEADER_BYTES) and return its size. A codec other than
+// STEG_CODEC_NONE writes the compressed header, of format STEG_FORMAT_COMPACT.
+static inline size_t payload_header_encode(uint8_t *out,
+                                           int format,
+                                           int codec,
+                                           int bits_per_channel,
+                                           uint32_t len)
+{
+    size_t h = 0;
+    if (format == STEG_FORMAT_COMPACT) {
+        if (codec != STEG_CODEC_NONE) {
+            out[h++] = STEG_FORMAT_COMPRESSED_TAG(bits_per_channel);
+            out[h++] = (uint8_t)codec;
+        } else {
+            out[h++] = STEG_FORMAT_COMPACT_TAG(bits_per_channel);
+        }
+        return payload_varint_encode(out, h, len);
+    }
+
+    if (format != STEG_FORMAT_LEGACY) {
+        out[h++] = STEG_FORMAT_BITMAP_TAG(bits_per_channel);
+    }
+    out[h++] = (uint8_t)(len & 0xFFu);
+    out[h++] = (uint8_t)((len >> 8) & 0xFFu);
+    out[h++] = (uint8_t)((len >> 16) & 0xFFu);
+    out[h++] = (uint8_t)((len >> 24) & 0xFFu);
+    if (format != STEG_FORMAT_LEGACY) {
+        out[h] = payload_check_byte(out, h);
+        ++h;
+    }
+    return h;
+}
+
+// Write the adaptive header of a message of len bytes at threshold into out
+// (at least PAYLOAD_MAX_HEADER_BYTES) and return its size, which does not
+// depend on threshold.
+static inline size_t payload_adaptive_header_encode(uint8_t *out,
+                                                    int bits_per_channel,
+                                                    double threshold,
+                                                    uint32_t len)
+{
+    uint64_t v = 0;
+    memcpy(&v, &threshold, sizeof(v));
+    out[0] = STEG_FORMAT_ADAPTIVE_TAG(bits_per_channel);
+    for (size_t i = 0; i < PAYLOAD_THRESHOLD_BYTES; ++i) {
+        out[1u + i] = (uint8_t)(v >> (8u * i));
+    }
+    return payload_varint_encode(out, 1u + PAYLOAD_THRESHOLD_BYTES, len);
+}
+
+// Threshold stored little-endian in bytes[0..PAYLOAD_THRESHOLD_BYTES-1].
+static inline double payload_threshold_decode(const uint8_t *bytes)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < PAYLOAD_THRESHOLD_BYTES; ++i) {
+        v |= (uint64_t)bytes[i] << (8u * i);
+    }
+    double threshold = 0.0;
+    memcpy(&threshold, &v, sizeof(threshold));
+    return threshold;
+}
+
+// Largest message whose header and bytes fit in `bytes` bytes.
+static inline size_t payload_max_message_len(int format, size_t bytes)
+{
+    if (format != STEG_FORMAT_COMPACT) {
+        size_t header = format == STEG_FORMAT_LEGACY ? 4u : 6u;
+        return bytes > header ? bytes - header : 0u;
+    }
+
+    // The shortest varint that still covers what is left wins.
+    for (size_t k = 1; k <= 5u && bytes > 2u + k; ++k) {
+        size_t len = bytes - 2u - k;
+        if (len > UINT32_MAX) {
+            len = UINT32_MAX;
+        }
+        if (payload_varint_size((uint32_t)len) <= k) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
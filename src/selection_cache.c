@@ -0,0 +1,484 @@
+// selection_cache.c - In-memory LRU and on-disk store of selection maps.
+
+#include "selection_cache.h"
+
+#include "luma.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define cache_getpid _getpid
+#else
+#include <unistd.h>
+#define cache_getpid getpid
+#endif
+
+struct StegSelectionCache {
+    pthread_mutex_t mutex;
+    SelectionEntry **entries;    // resident entries, max_entries slots
+    size_t count;
+    size_t max_entries;
+    char *directory;             // NULL: memory only
+    uint64_t tick;
+    unsigned tmp_serial;         // distinguishes concurrent sidecar writes
+    StegSelectionCacheStats stats;
+};
+
+// Sidecar file: magic, then the key, the selected count and the bitmap
+// words, all little-endian.
+static const unsigned char SIDECAR_MAGIC[8] = {'S', 'T', 'E', 'G', 'S', 'E', 'L', 1};
+#define SIDECAR_HEADER_SIZE (8u + 8u + 4u * 4u + 8u + 8u)
+
+static uint64_t load_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void store_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void store_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint32_t load_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+// Non-cryptographic 64-bit mixing step.
+static inline uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h *= 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+static uint64_t double_bits(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+void selection_keys_init(SelectionKey keys[STEG_MAX_BITS_PER_CHANNEL],
+                         const BmpImage *img,
+                         int block_size,
+                         double contrast_threshold)
+{
+    enum { DEPTHS = STEG_MAX_BITS_PER_CHANNEL };
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    size_t row_bytes = (size_t)img->width * (size_t)bmp_pixel_bytes(img);
+    uint64_t mask[DEPTHS];
+    for (int d = 0; d < DEPTHS; ++d) {
+        mask[d] = 0x0101010101010101ull * LUMA_CHANNEL_MASK(d + 1);
+    }
+
+    // One pass feeds every depth. Four independent lanes per depth keep the
+    // multiplies pipelined.
+    uint64_t lane[DEPTHS][4];
+    for (int d = 0; d < DEPTHS; ++d) {
+        for (int l = 0; l < 4; ++l) {
+            lane[d][l] = (uint64_t)l + 1u;
+        }
+    }
+    for (int32_t y = 0; y < abs_height; ++y) {
+        const unsigned char *p = img->data + (size_t)y * (size_t)img->stride;
+        size_t i = 0;
+        for (; i + 32u <= row_bytes; i += 32u) {
+            uint64_t w0 = load_le64(p + i);
+            uint64_t w1 = load_le64(p + i + 8u);
+            uint64_t w2 = load_le64(p + i + 16u);
+            uint64_t w3 = load_le64(p + i + 24u);
+            for (int d = 0; d < DEPTHS; ++d) {
+                lane[d][0] = hash_mix(lane[d][0], w0 & mask[d]);
+                lane[d][1] = hash_mix(lane[d][1], w1 & mask[d]);
+                lane[d][2] = hash_mix(lane[d][2], w2 & mask[d]);
+                lane[d][3] = hash_mix(lane[d][3], w3 & mask[d]);
+            }
+        }
+        for (; i + 8u <= row_bytes; i += 8u) {
+            uint64_t w = load_le64(p + i);
+            for (int d = 0; d < DEPTHS; ++d) {
+                lane[d][0] = hash_mix(lane[d][0], w & mask[d]);
+            }
+        }
+        uint64_t tail = 0;
+        for (size_t k = 0; i + k < row_bytes; ++k) {
+            tail |= (uint64_t)p[i + k] << (8u * k);
+        }
+        for (int d = 0; d < DEPTHS; ++d) {
+            lane[d][1] = hash_mix(lane[d][1], (tail & mask[d]) ^ ((uint64_t)(uint32_t)y << 32));
+        }
+    }
+
+    for (int d = 0; d < DEPTHS; ++d) {
+        uint64_t h = hash_mix(lane[d][0], lane[d][1]);
+        h = hash_mix(h, lane[d][2]);
+        keys[d].content_hash = hash_mix(h, lane[d][3]);
+        keys[d].width = img->width;
+        keys[d].height = abs_height;
+        keys[d].block_size = block_size;
+        keys[d].contrast_threshold = contrast_threshold;
+        keys[d].bits_per_channel = d + 1;
+    }
+}
+
+static int key_equal(const SelectionKey *a, const SelectionKey *b)
+{
+    return a->content_hash == b->content_hash && a->width == b->width &&
+           a->height == b->height && a->block_size == b->block_size &&
+           double_bits(a->contrast_threshold) == double_bits(b->contrast_threshold) &&
+           a->bits_per_channel == b->bits_per_channel;
+}
+
+// Helper: the sidecar path of key, or NULL without a directory. Caller frees.
+static char *sidecar_path(const StegSelectionCache *cache, const SelectionKey *key)
+{
+    if (cache->directory == NULL) {
+        return NULL;
+    }
+
+    uint64_t name = hash_mix(key->content_hash, (uint64_t)(uint32_t)key->width);
+    name = hash_mix(name, (uint64_t)(uint32_t)key->height);
+    name = hash_mix(name, (uint64_t)(uint32_t)key->block_size);
+    name = hash_mix(name, double_bits(key->contrast_threshold));
+    name = hash_mix(name, (uint64_t)(uint32_t)key->bits_per_channel);
+
+    size_t len = strlen(cache->directory) + 1u + 16u + 4u + 1u;
+    char *path = (char *)malloc(len);
+    if (!path) {
+        perror("steg_selection_cache: malloc");
+        return NULL;
+    }
+    snprintf(path, len, "%s/%016llx.sel", cache->directory, (unsigned long long)name);
+    return path;
+}
+
+static void entry_free(SelectionEntry *entry)
+{
+    steg_bitmap_free(&entry->bitmap);
+    free(entry);
+}
+
+// Helper: 1 when the words of a width * height pixel bitmap have no bit set
+// past the last pixel and count bits set in all.
+static int sidecar_bits_valid(const uint64_t *bits, size_t words, size_t pixels, size_t count)
+{
+    size_t tail = pixels & 63u;
+    if (tail != 0u && (bits[words - 1u] >> tail) != 0u) {
+        return 0;
+    }
+    size_t set = 0;
+    for (size_t i = 0; i < words; ++i) {
+        set += popcount64(bits[i]);
+    }
+    return set == count;
+}
+
+// Helper: read the sidecar of key. Returns a new unreferenced entry or NULL
+// when there is no valid one. A missing or stale file is not an error; nor
+// is a corrupt one, whose stored count does not match its bits (decode walks
+// the selection by that count).
+static SelectionEntry *sidecar_load(const StegSelectionCache *cache, const SelectionKey *key)
+{
+    char *path = sidecar_path(cache, key);
+    if (path == NULL) {
+        return NULL;
+    }
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f) {
+        return NULL;
+    }
+
+    unsigned char header[SIDECAR_HEADER_SIZE];
+    size_t pixels = (size_t)key->width * (size_t)key->height;
+    size_t words = (pixels + 63u) / 64u;
+    SelectionEntry *entry = NULL;
+    if (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+        memcmp(header, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) == 0 &&
+        load_le64(header + 8) == key->content_hash &&
+        (int32_t)load_le32(header + 16) == key->width &&
+        (int32_t)load_le32(header + 20) == key->height &&
+        (int)load_le32(header + 24) == key->block_size &&
+        (int)load_le32(header + 28) == key->bits_per_channel &&
+        load_le64(header + 32) == double_bits(key->contrast_threshold)) {
+        entry = (SelectionEntry *)calloc(1, sizeof(SelectionEntry));
+        uint64_t *bits = (uint64_t *)malloc(words * sizeof(uint64_t));
+        unsigned char *raw = (unsigned char *)malloc(words * 8u);
+        int ok = entry && bits && raw && fread(raw, 1, words * 8u, f) == words * 8u;
+        if (ok) {
+            for (size_t i = 0; i < words; ++i) {
+                bits[i] = load_le64(raw + 8u * i);
+            }
+            ok = sidecar_bits_valid(bits, words, pixels, (size_t)load_le64(header + 40));
+        }
+        if (ok) {
+            entry->key = *key;
+            entry->bitmap.width = key->width;
+            entry->bitmap.height = key->height;
+            entry->bitmap.count = (size_t)load_le64(header + 40);
+            entry->bitmap.bits = bits;
+            bits = NULL;
+        } else {
+            free(entry);
+            entry = NULL;
+        }
+        free(bits);
+        free(raw);
+    }
+    fclose(f);
+    return entry;
+}
+
+// Helper: write the sidecar of entry, through a temporary file so readers
+// never see a partial one. Failures only cost the disk copy.
+static void sidecar_store(StegSelectionCache *cache, const SelectionEntry *entry, unsigned serial)
+{
+    char *path = sidecar_path(cache, &entry->key);
+    if (path == NULL) {
+        return;
+    }
+
+    size_t tmp_len = strlen(path) + 32u;
+    char *tmp = (char *)malloc(tmp_len);
+    if (!tmp) {
+        perror("steg_selection_cache: malloc");
+        free(path);
+        return;
+    }
+    snprintf(tmp, tmp_len, "%s.%ld.%u.tmp", path, (long)cache_getpid(), serial);
+
+    size_t words = ((size_t)entry->key.width * (size_t)entry->key.height + 63u) / 64u;
+    unsigned char header[SIDECAR_HEADER_SIZE];
+    memcpy(header, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+    store_le64(header + 8, entry->key.content_hash);
+    store_le32(header + 16, (uint32_t)entry->key.width);
+    store_le32(header + 20, (uint32_t)entry->key.height);
+    store_le32(header + 24, (uint32_t)entry->key.block_size);
+    store_le32(header + 28, (uint32_t)entry->key.bits_per_channel);
+    store_le64(header + 32, double_bits(entry->key.contrast_threshold));
+    store_le64(header + 40, (uint64_t)entry->bitmap.count);
+
+    int ok = 0;
+    unsigned char *raw = (unsigned char *)malloc(words * 8u);
+    FILE *f = raw != NULL ? fopen(tmp, "wb") : NULL;
+    if (f) {
+        for (size_t i = 0; i < words; ++i) {
+            store_le64(raw + 8u * i, entry->bitmap.bits[i]);
+        }
+        ok = fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+             fwrite(raw, 1, words * 8u, f) == words * 8u;
+        ok = fclose(f) == 0 && ok;
+    }
+    if (ok) {
+        remove(path); // rename() does not replace files everywhere
+        ok = rename(tmp, path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "steg_selection_cache: failed to write '%s'\n", path);
+        remove(tmp);
+    }
+
+    free(raw);
+    free(tmp);
+    free(path);
+}
+
+StegSelectionCache *steg_selection_cache_create(size_t max_entries, const char *directory)
+{
+    struct stat st;
+    if (directory != NULL && (stat(directory, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, "steg_selection_cache_create: '%s' is not a directory\n", directory);
+        return NULL;
+    }
+
+    StegSelectionCache *cache = (StegSelectionCache *)calloc(1, sizeof(StegSelectionCache));
+    if (!cache) {
+        perror("steg_selection_cache_create: calloc");
+        return NULL;
+    }
+
+    cache->max_entries = max_entries;
+    if (max_entries > 0) {
+        cache->entries = (SelectionEntry **)calloc(max_entries, sizeof(SelectionEntry *));
+        if (!cache->entries) {
+            perror("steg_selection_cache_create: calloc");
+            free(cache);
+            return NULL;
+        }
+    }
+
+    if (directory != NULL) {
+        size_t len = strlen(directory);
+        cache->directory = (char *)malloc(len + 1u);
+        if (!cache->directory) {
+            perror("steg_selection_cache_create: malloc");
+            free(cache->entries);
+            free(cache);
+            return NULL;
+        }
+        memcpy(cache->directory, directory, len + 1u);
+    }
+
+    if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        fprintf(stderr, "steg_selection_cache_create: mutex init failed\n");
+        free(cache->directory);
+        free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void steg_selection_cache_destroy(StegSelectionCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    // Entries still acquired by a decode would be a caller bug.
+    for (size_t i = 0; i < cache->count; ++i) {
+        entry_free(cache->entries[i]);
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->entries);
+    free(cache->directory);
+    free(cache);
+}
+
+void steg_selection_cache_get_stats(StegSelectionCache *cache, StegSelectionCacheStats *stats_out)
+{
+    pthread_mutex_lock(&cache->mutex);
+    *stats_out = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Helper: resident entry for key, or NULL. Called with mutex held.
+static SelectionEntry *cache_find(StegSelectionCache *cache, const SelectionKey *key)
+{
+    for (size_t i = 0; i < cache->count; ++i) {
+        if (key_equal(&cache->entries[i]->key, key)) {
+            return cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Helper: make entry resident, evicting the least recently used entry when
+// full. Called with mutex held; the cache takes its own reference.
+static void cache_admit(StegSelectionCache *cache, SelectionEntry *entry)
+{
+    if (cache->max_entries == 0) {
+        return;
+    }
+
+    if (cache->count == cache->max_entries) {
+        size_t lru = 0;
+        for (size_t i = 1; i < cache->count; ++i) {
+            if (cache->entries[i]->last_used < cache->entries[lru]->last_used) {
+                lru = i;
+            }
+        }
+        SelectionEntry *victim = cache->entries[lru];
+        cache->entries[lru] = cache->entries[--cache->count];
+        if (--victim->refs == 0) {
+            entry_free(victim);
+        }
+    }
+
+    ++entry->refs;
+    entry->last_used = ++cache->tick;
+    cache->entries[cache->count++] = entry;
+}
+
+SelectionEntry *selection_cache_acquire(StegSelectionCache *cache, const SelectionKey *key)
+{
+    pthread_mutex_lock(&cache->mutex);
+    SelectionEntry *entry = cache_find(cache, key);
+    if (entry != NULL) {
+        ++entry->refs;
+        entry->last_used = ++cache->tick;
+        ++cache->stats.memory_hits;
+        pthread_mutex_unlock(&cache->mutex);
+        return entry;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    // Disk I/O happens outside the lock.
+    SelectionEntry *loaded = sidecar_load(cache, key);
+
+    pthread_mutex_lock(&cache->mutex);
+    if (loaded == NULL) {
+        ++cache->stats.misses;
+        pthread_mutex_unlock(&cache->mutex);
+        return NULL;
+    }
+    ++cache->stats.disk_hits;
+    entry = cache_find(cache, key); // another thread may have loaded it meanwhile
+    if (entry != NULL) {
+        entry_free(loaded);
+    } else {
+        entry = loaded;
+        cache_admit(cache, entry);
+    }
+    ++entry->refs;
+    pthread_mutex_unlock(&cache->mutex);
+    return entry;
+}
+
+void selection_cache_release(StegSelectionCache *cache, SelectionEntry *entry)
+{
+    pthread_mutex_lock(&cache->mutex);
+    int last = --entry->refs == 0;
+    pthread_mutex_unlock(&cache->mutex);
+    if (last) {
+        entry_free(entry);
+    }
+}
+
+int selection_cache_insert(StegSelectionCache *cache,
+                           const SelectionKey *key,
+                           StegBitmap *bitmap)
+{
+    SelectionEntry *entry = (SelectionEntry *)calloc(1, sizeof(SelectionEntry));
+    if (!entry) {
+        perror("steg_selection_cache: calloc");
+        steg_bitmap_free(bitmap);
+        return 1;
+    }
+    entry->key = *key;
+    entry->bitmap = *bitmap;
+    memset(bitmap, 0, sizeof(*bitmap));
+
+    // Hold a reference while writing the sidecar so eviction cannot free it.
+    pthread_mutex_lock(&cache->mutex);
+    unsigned serial = cache->tmp_serial++;
+    if (cache_find(cache, key) == NULL) {
+        cache_admit(cache, entry);
+    }
+    ++entry->refs;
+    pthread_mutex_unlock(&cache->mutex);
+
+    sidecar_store(cache, entry, serial);
+    selection_cache_release(cache, entry);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef SELECTION_CACHE_H
+#define SELECTION_CACHE_H
+
+// Private to steg_lib: storage side of StegSelectionCache. steg.c computes
+// the selection maps; this file keys, keeps and persists them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bmp.h"
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Everything a selection map depends on. The pixels enter through a hash
+// of every stored row with the low bits_per_channel bits of each channel
+// masked off, so every stego copy of a cover at that depth has the same key.
+typedef struct {
+    uint64_t content_hash;
+    int32_t width;
+    int32_t height;          // absolute height
+    int block_size;
+    double contrast_threshold;
+    int bits_per_channel;
+} SelectionKey;
+
+// A cached selection. Entries are shared: the cache holds one reference
+// while the entry is resident and every acquire adds one.
+typedef struct {
+    SelectionKey key;
+    StegBitmap bitmap;
+    int refs;
+    uint64_t last_used;      // LRU tick
+} SelectionEntry;
+
+// Set bits of w.
+static inline size_t popcount64(uint64_t w)
+{
+    w = w - ((w >> 1) & 0x5555555555555555ull);
+    w = (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
+    w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (size_t)((w * 0x0101010101010101ull) >> 56);
+}
+
+// Keys for every depth: keys[d - 1] is the key at bits_per_channel d. The
+// image is read once for all of them.
+void selection_keys_init(SelectionKey keys[STEG_MAX_BITS_PER_CHANNEL],
+                         const BmpImage *img,
+                         int block_size,
+                         double contrast_threshold);
+
+// Look key up in memory, then on disk. Returns a referenced entry, or NULL
+// on a miss. Release with selection_cache_release().
+SelectionEntry *selection_cache_acquire(StegSelectionCache *cache, const SelectionKey *key);
+
+void selection_cache_release(StegSelectionCache *cache, SelectionEntry *entry);
+
+// Store a freshly computed selection, taking ownership of bitmap->bits
+// (freed on failure too). Returns 0 on success, non-zero on failure.
+int selection_cache_insert(StegSelectionCache *cache,
+                           const SelectionKey *key,
+                           StegBitmap *bitmap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
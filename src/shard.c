@@ -0,0 +1,460 @@
+// shard.c - Payloads split over several covers (see steg_encode_sharded()).
+
+#include "steg.h"
+
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One cover of a set being encoded or decoded.
+typedef struct {
+    size_t capacity;      // encode: largest piece the cover holds
+    uint64_t offset;      // piece [offset, offset + len) of the message
+    size_t len;
+    uint32_t index;
+    uint32_t checksum;
+    uint32_t set_id;      // decode: as read from the shard header
+    uint32_t count;
+    uint64_t total;
+    uint8_t *data;        // decode: the cover's whole message (header first)
+    int skip;             // the cover cannot hold a shard header: no shard
+    int rc;
+} Shard;
+
+typedef struct {
+    BmpImage *const *imgs;        // encode
+    const BmpImage *const *covers; // decode
+    Shard *shards;
+    const uint8_t *message;       // encode: the message
+    uint8_t *out;                 // decode: the reassembled message
+    uint64_t total;               // message length
+    uint32_t count;               // shards, skipped covers not counted
+    uint32_t set_id;
+    int block_size;
+    double contrast_threshold;
+} ShardSet;
+
+// FNV-1a, 32 bits.
+#define SHARD_FNV_BASIS 2166136261u
+#define SHARD_FNV_PRIME 16777619u
+
+static uint32_t shard_fnv(uint32_t h, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ data[i]) * SHARD_FNV_PRIME;
+    }
+    return h;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// Helper: the set id of a set whose shards have their checksums in index
+// order.
+static uint32_t shard_set_id(const ShardSet *set, const Shard *const *by_index)
+{
+    uint8_t bytes[12];
+    put_le32(bytes, set->count);
+    put_le64(bytes + 4, set->total);
+    uint32_t h = shard_fnv(SHARD_FNV_BASIS, bytes, sizeof(bytes));
+    for (uint32_t i = 0; i < set->count; ++i) {
+        put_le32(bytes, by_index[i]->checksum);
+        h = shard_fnv(h, bytes, 4u);
+    }
+    return h;
+}
+
+static void shard_capacity_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ShardSet *set = (ShardSet *)ctx;
+    Shard *shard = &set->shards[task];
+    StegCapacity capacity;
+    memset(&capacity, 0, sizeof(capacity));
+    shard->rc = steg_query_capacity(set->imgs[task], set->block_size, set->contrast_threshold,
+                                    STEG_CAPACITY_EXACT, &capacity);
+    shard->capacity = capacity.max_message_len > STEG_SHARD_HEADER_BYTES
+                          ? capacity.max_message_len - STEG_SHARD_HEADER_BYTES
+                          : 0u;
+    shard->skip = shard->rc == 0 && capacity.max_message_len < STEG_SHARD_HEADER_BYTES;
+}
+
+// Helper: 1 when img cannot hold a shard header, the covers
+// steg_encode_sharded() leaves out of a set. Selection ignores the embedded
+// bits, so a stego copy answers as its cover did.
+static int shard_cover_too_small(const ShardSet *set, const BmpImage *img)
+{
+    StegCapacity capacity;
+    memset(&capacity, 0, sizeof(capacity));
+    return steg_query_capacity(img, set->block_size, set->contrast_threshold,
+                               STEG_CAPACITY_EXACT, &capacity) == 0 &&
+           capacity.max_message_len < STEG_SHARD_HEADER_BYTES;
+}
+
+static void shard_checksum_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ShardSet *set = (ShardSet *)ctx;
+    Shard *shard = &set->shards[task];
+    shard->checksum = shard_fnv(SHARD_FNV_BASIS, set->message + shard->offset, shard->len);
+}
+
+static void shard_encode_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ShardSet *set = (ShardSet *)ctx;
+    Shard *shard = &set->shards[task];
+    if (shard->skip) {
+        return;
+    }
+
+    size_t len = STEG_SHARD_HEADER_BYTES + shard->len;
+    uint8_t *buf = (uint8_t *)malloc(len);
+    if (!buf) {
+        perror("steg_encode_sharded: malloc");
+        shard->rc = 1;
+        return;
+    }
+    memcpy(buf, STEG_SHARD_MAGIC, 4u);
+    put_le32(buf + 4, set->set_id);
+    put_le32(buf + 8, shard->index);
+    put_le32(buf + 12, set->count);
+    put_le64(buf + 16, shard->offset);
+    put_le64(buf + 24, set->total);
+    put_le32(buf + 32, shard->checksum);
+    if (shard->len > 0) {
+        memcpy(buf + STEG_SHARD_HEADER_BYTES, set->message + shard->offset, shard->len);
+    }
+
+    shard->rc = steg_encode_message(set->imgs[task], buf, len, set->block_size,
+                                    set->contrast_threshold);
+    free(buf);
+}
+
+int steg_encode_sharded(BmpImage *const *imgs,
+                        size_t count,
+                        const uint8_t *message,
+                        size_t message_len,
+                        int block_size,
+                        double contrast_threshold,
+                        StegThreadPool *pool)
+{
+    if (imgs == NULL || count == 0) {
+        fprintf(stderr, "steg_encode_sharded: no covers\n");
+        return 1;
+    }
+
+    if (count > (size_t)INT32_MAX) {
+        fprintf(stderr, "steg_encode_sharded: too many covers\n");
+        return 1;
+    }
+
+    if (message == NULL && message_len > 0) {
+        fprintf(stderr, "steg_encode_sharded: message is NULL but length > 0\n");
+        return 1;
+    }
+
+    ShardSet set;
+    memset(&set, 0, sizeof(set));
+    set.imgs = imgs;
+    set.message = message;
+    set.total = message_len;
+    set.count = (uint32_t)count;
+    set.block_size = block_size;
+    set.contrast_threshold = contrast_threshold;
+    set.shards = (Shard *)calloc(count, sizeof(Shard));
+    if (!set.shards) {
+        perror("steg_encode_sharded: calloc");
+        return 1;
+    }
+
+    // Capacities first: nothing is written unless the whole message fits.
+    thread_pool_run(pool, shard_capacity_task, &set, (int)count);
+    size_t total_capacity = 0;
+    int rc = 0;
+    set.count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (set.shards[i].rc != 0) {
+            rc = 1;
+        } else if (!set.shards[i].skip) {
+            ++set.count;
+        }
+        total_capacity += set.shards[i].capacity;
+    }
+    if (rc == 0 && set.count == 0) {
+        fprintf(stderr, "steg_encode_sharded: no cover can hold a shard header\n");
+        rc = -1;
+    } else if (rc == 0 && total_capacity < message_len) {
+        fprintf(stderr, "steg_encode_sharded: capacity insufficient "
+                        "(have %zu bytes, need %zu bytes)\n",
+                total_capacity, message_len);
+        rc = -1;
+    }
+    if (rc != 0) {
+        free(set.shards);
+        return rc;
+    }
+
+    // Pieces in proportion to capacity, so the covers take about as long
+    // each; rounding leftovers go to the first covers with room.
+    size_t assigned = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Shard *shard = &set.shards[i];
+        size_t len = (size_t)((double)message_len * (double)shard->capacity /
+                              (double)total_capacity);
+        shard->len = len < shard->capacity ? len : shard->capacity;
+        if (shard->len > message_len - assigned) {
+            shard->len = message_len - assigned;
+        }
+        assigned += shard->len;
+    }
+    for (size_t i = 0; i < count && assigned < message_len; ++i) {
+        Shard *shard = &set.shards[i];
+        size_t more = shard->capacity - shard->len;
+        if (more > message_len - assigned) {
+            more = message_len - assigned;
+        }
+        shard->len += more;
+        assigned += more;
+    }
+
+    // Skipped covers have no capacity, so no piece either.
+    const Shard **by_index = (const Shard **)malloc(set.count * sizeof(Shard *));
+    if (!by_index) {
+        perror("steg_encode_sharded: malloc");
+        free(set.shards);
+        return 1;
+    }
+    uint64_t offset = 0;
+    uint32_t index = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (set.shards[i].skip) {
+            continue;
+        }
+        set.shards[i].index = index;
+        set.shards[i].offset = offset;
+        offset += set.shards[i].len;
+        by_index[index++] = &set.shards[i];
+    }
+
+    thread_pool_run(pool, shard_checksum_task, &set, (int)count);
+    set.set_id = shard_set_id(&set, by_index);
+    free(by_index);
+
+    thread_pool_run(pool, shard_encode_task, &set, (int)count);
+    for (size_t i = 0; i < count; ++i) {
+        if (set.shards[i].rc != 0) {
+            fprintf(stderr, "steg_encode_sharded: cover %zu failed\n", i);
+            rc = 1;
+        }
+    }
+
+    free(set.shards);
+    return rc;
+}
+
+static void shard_decode_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ShardSet *set = (ShardSet *)ctx;
+    Shard *shard = &set->shards[task];
+
+    size_t len = 0;
+    int rc = steg_decode_message(set->covers[task], &shard->data, &len, set->block_size,
+                                 set->contrast_threshold);
+    if (rc != 0 || len < STEG_SHARD_HEADER_BYTES ||
+        memcmp(shard->data, STEG_SHARD_MAGIC, 4u) != 0) {
+        free(shard->data);
+        shard->data = NULL;
+        shard->len = 0;
+        // Only the capacity tells a skipped cover from a lost shard.
+        if (shard_cover_too_small(set, set->covers[task])) {
+            shard->skip = 1;
+        } else {
+            if (rc == 0) {
+                fprintf(stderr, "steg_decode_sharded: cover %d holds no shard\n", task);
+            }
+            shard->rc = 1;
+        }
+        return;
+    }
+
+    const uint8_t *h = shard->data;
+    shard->set_id = get_le32(h + 4);
+    shard->index = get_le32(h + 8);
+    shard->count = get_le32(h + 12);
+    shard->offset = get_le64(h + 16);
+    shard->total = get_le64(h + 24);
+    shard->len = len - STEG_SHARD_HEADER_BYTES;
+    shard->checksum = get_le32(h + 32);
+    if (shard_fnv(SHARD_FNV_BASIS, h + STEG_SHARD_HEADER_BYTES, shard->len) !=
+        shard->checksum) {
+        fprintf(stderr, "steg_decode_sharded: shard %u is damaged\n", (unsigned)shard->index);
+        shard->rc = 1;
+    }
+}
+
+static void shard_copy_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ShardSet *set = (ShardSet *)ctx;
+    Shard *shard = &set->shards[task];
+    if (shard->len > 0) {
+        memcpy(set->out + shard->offset, shard->data + STEG_SHARD_HEADER_BYTES, shard->len);
+    }
+    free(shard->data);
+    shard->data = NULL;
+}
+
+int steg_decode_sharded(const BmpImage *const *imgs,
+                        size_t count,
+                        uint8_t **message_out,
+                        size_t *message_len_out,
+                        int block_size,
+                        double contrast_threshold,
+                        StegThreadPool *pool)
+{
+    assert(message_out != NULL);
+    assert(message_len_out != NULL);
+
+    *message_out = NULL;
+    *message_len_out = 0;
+
+    if (imgs == NULL || count == 0) {
+        fprintf(stderr, "steg_decode_sharded: no covers\n");
+        return 1;
+    }
+
+    if (count > (size_t)INT32_MAX) {
+        fprintf(stderr, "steg_decode_sharded: too many covers\n");
+        return 1;
+    }
+
+    ShardSet set;
+    memset(&set, 0, sizeof(set));
+    set.covers = imgs;
+    set.block_size = block_size;
+    set.contrast_threshold = contrast_threshold;
+    set.shards = (Shard *)calloc(count, sizeof(Shard));
+    const Shard **by_index = (const Shard **)calloc(count, sizeof(Shard *));
+    if (!set.shards || !by_index) {
+        perror("steg_decode_sharded: calloc");
+        free(set.shards);
+        free(by_index);
+        return 1;
+    }
+
+    thread_pool_run(pool, shard_decode_task, &set, (int)count);
+
+    // One set, every index once, and the pieces tile the message in index
+    // order.
+    int rc = 0;
+    size_t given = 0;
+    const Shard *first = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        rc |= set.shards[i].rc;
+        if (!set.shards[i].skip) {
+            first = first != NULL ? first : &set.shards[i];
+            ++given;
+        }
+    }
+    if (rc == 0 && first == NULL) {
+        fprintf(stderr, "steg_decode_sharded: no cover can hold a shard\n");
+        rc = 1;
+    }
+    if (rc == 0) {
+        set.set_id = first->set_id;
+        set.count = first->count;
+        set.total = first->total;
+        if (set.count != given) {
+            fprintf(stderr, "steg_decode_sharded: the set has %u shards, %zu given\n",
+                    (unsigned)set.count, given);
+            rc = 1;
+        } else if (set.total > (uint64_t)SIZE_MAX) {
+            fprintf(stderr, "steg_decode_sharded: message too large\n");
+            rc = 1;
+        }
+    }
+    for (size_t i = 0; i < count && rc == 0; ++i) {
+        const Shard *shard = &set.shards[i];
+        if (shard->skip) {
+            continue;
+        }
+        if (shard->set_id != set.set_id || shard->count != set.count ||
+            shard->total != set.total) {
+            fprintf(stderr, "steg_decode_sharded: cover %zu is from another set\n", i);
+            rc = 1;
+        } else if (shard->index >= set.count || by_index[shard->index] != NULL) {
+            fprintf(stderr, "steg_decode_sharded: bad or repeated shard index %u\n",
+                    (unsigned)shard->index);
+            rc = 1;
+        } else {
+            by_index[shard->index] = shard;
+        }
+    }
+    uint64_t offset = 0;
+    for (size_t i = 0; i < set.count && rc == 0; ++i) {
+        if (by_index[i]->offset != offset || by_index[i]->len > set.total - offset) {
+            fprintf(stderr, "steg_decode_sharded: shard %zu is out of place\n", i);
+            rc = 1;
+        }
+        offset += by_index[i]->len;
+    }
+    if (rc == 0 && (offset != set.total || shard_set_id(&set, by_index) != set.set_id)) {
+        fprintf(stderr, "steg_decode_sharded: shards do not make up the set\n");
+        rc = 1;
+    }
+    free(by_index);
+
+    if (rc == 0) {
+        // Always hand back a valid pointer, even for an empty message.
+        set.out = (uint8_t *)malloc(set.total > 0 ? (size_t)set.total : 1u);
+        if (!set.out) {
+            perror("steg_decode_sharded: malloc");
+            rc = 1;
+        }
+    }
+    if (rc == 0) {
+        thread_pool_run(pool, shard_copy_task, &set, (int)count);
+        *message_out = set.out;
+        *message_len_out = (size_t)set.total;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        free(set.shards[i].data);
+    }
+    free(set.shards);
+    return rc;
+}
@@ -0,0 +1,40 @@
+// stats.c - Instrumentation helpers.
+
+#include "stats.h"
+
+#include "steg.h"
+
+#include <time.h>
+
+double stats_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / (double)CLOCKS_PER_SEC;
+#endif
+}
+
+void steg_stats_merge(StegStats *dst, const StegStats *src)
+{
+    dst->load_seconds += src->load_seconds;
+    dst->setup_seconds += src->setup_seconds;
+    dst->luma_seconds += src->luma_seconds;
+    dst->scan_seconds += src->scan_seconds;
+    dst->embed_seconds += src->embed_seconds;
+    dst->extract_seconds += src->extract_seconds;
+    dst->save_seconds += src->save_seconds;
+    dst->calls += src->calls;
+    dst->blocks_evaluated += src->blocks_evaluated;
+    dst->blocks_accepted += src->blocks_accepted;
+    dst->blocks_exact += src->blocks_exact;
+    dst->positions_emitted += src->positions_emitted;
+    dst->duplicate_writes += src->duplicate_writes;
+    dst->bits_written += src->bits_written;
+    dst->bits_read += src->bits_read;
+    if (src->peak_scratch_bytes > dst->peak_scratch_bytes) {
+        dst->peak_scratch_bytes = src->peak_scratch_bytes;
+    }
+}
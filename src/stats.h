@@ -0,0 +1,17 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Private to steg_lib: clock for StegStats stage timings.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Monotonic wall clock in seconds.
+double stats_now(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,472 +2,3605 @@
 
 #include "steg.h"
 
+#include "adaptive.h"
+#include "arena.h"
+#include "codec.h"
+#include "contrast.h"
+#include "gpu.h"
+#include "payload.h"
+#include "selection_cache.h"
+#include "stats.h"
+#include "thread_pool.h"
+
 #include <assert.h>
 #include <errno.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Helper: compute luminance for a pixel given its RGB values.
-static double compute_luminance(unsigned char r,
-                                unsigned char g,
-                                unsigned char b)
+// Lazy position generator.
+//
+// Block rows are scanned only when the consumer needs positions from them:
+// in the bitmap layout image row y is final as soon as block row y has been
+// scanned, in the legacy layout a block row's footprints are final as soon as
+// that row is scanned. Nothing beyond the rows needed so far is read.
+//
+// Positions come in horizontal runs: the maximal runs of selected pixels of
+// a row in the bitmap layout, the rows of each block footprint in the legacy
+// layout. Consumers that take whole runs skip the per-pixel bookkeeping.
+struct StegPositionIter {
+    int format;
+    int block_size;
+    int32_t width;
+    int32_t height;          // absolute height
+    ContrastScanner scanner;
+    CoverageTracker tracker; // bitmap layout only
+    uint8_t *accept;         // accept flags of the last scanned block row
+    int32_t *runs;           // bitmap layout: [begin, end) runs of `row`
+    size_t runs_count;
+    size_t runs_pos;         // current run
+    int32_t run_col;         // next column of the current run
+    int32_t row;             // bitmap: current image row; legacy: current block row
+    int32_t bc;              // legacy: current block column (max_col = none)
+    int r;                   // legacy: offset inside the current block
+    int c;
+    int owns_buffers;        // 0 when accept and runs came from an arena
+    StegStats *stats;        // NULL: no instrumentation
+    int bits_per_channel;    // embedding depth the selection is stable under
+    const StegBitmap *selection; // bitmap layout: precomputed, nothing is scanned
+};
+
+// Attach instrumentation to an initialised iterator.
+static void position_iter_set_stats(StegPositionIter *iter, StegStats *stats)
 {
-    // Standard ITU-R BT.601 luma transform.
-    return 0.299 * (double)r + 0.587 * (double)g + 0.114 * (double)b;
+    iter->stats = stats;
+    iter->scanner.stats = stats;
 }
 
-// Helper: safely allocate an array of doubles for luminance.
-static int compute_luminance_map(const BmpImage *img, double **lum_out)
+// Select for an embedding depth other than 1 bit per channel. Must be
+// called before the first position is produced.
+static void position_iter_set_depth(StegPositionIter *iter, int bits_per_channel)
 {
-    assert(img != NULL);
-    assert(lum_out != NULL);
-
-    *lum_out = NULL;
+    iter->bits_per_channel = bits_per_channel;
+    iter->scanner.channel_mask = LUMA_CHANNEL_MASK(bits_per_channel);
+}
 
-    if (img->data == NULL || img->width <= 0 || img->height == 0) {
-        fprintf(stderr, "compute_luminance_map: invalid image\n");
-        return 1;
+// Arena bytes position_iter_init() takes.
+static size_t position_iter_scratch_size(int32_t width, int block_size, int format)
+{
+    if (width <= 0 || block_size <= 0) {
+        return 0; // rejected by position_iter_init()
     }
 
-    int32_t width = img->width;
-    int32_t abs_height = img->height > 0 ? img->height : -img->height;
-    size_t count = (size_t)width * (size_t)abs_height;
-
-    double *lum = (double *)malloc(count * sizeof(double));
-    if (!lum) {
-        perror("compute_luminance_map: malloc");
-        return 1;
+    size_t size = contrast_scanner_scratch_size(width, block_size) + ARENA_SIZE((size_t)width);
+    if (format != STEG_FORMAT_LEGACY) {
+        size += ARENA_SIZE(((size_t)width + 1u) * sizeof(int32_t)) +
+                coverage_tracker_scratch_size(width);
     }
+    return size;
+}
 
-    // We treat rows in the order stored in data, which is bottom-up for positive height.
-    // Since encode and decode both use the same convention, consistency is all we need.
-    for (int32_t row = 0; row < abs_height; ++row) {
-        for (int32_t col = 0; col < width; ++col) {
-            size_t pixel_index = (size_t)row * (size_t)width + (size_t)col;
-            size_t offset = (size_t)row * (size_t)img->stride + (size_t)col * 3u;
-
-            unsigned char b = img->data[offset + 0];
-            unsigned char g = img->data[offset + 1];
-            unsigned char r = img->data[offset + 2];
-
-            // Ignore the least significant bit of each channel so that
-            // our low-contrast selection is stable under LSB embedding.
-            // This way, encode and decode see the same blocks.
-            unsigned char b_hi = (unsigned char)(b & 0xFEu);
-            unsigned char g_hi = (unsigned char)(g & 0xFEu);
-            unsigned char r_hi = (unsigned char)(r & 0xFEu);
-
-            lum[pixel_index] = compute_luminance(r_hi, g_hi, b_hi);
-        }
+static void position_iter_release(StegPositionIter *iter)
+{
+    contrast_scanner_free(&iter->scanner);
+    coverage_tracker_free(&iter->tracker);
+    if (iter->owns_buffers) {
+        free(iter->accept);
+        free(iter->runs);
     }
-
-    *lum_out = lum;
-    return 0;
+    iter->accept = NULL;
+    iter->runs = NULL;
 }
 
-int find_low_contrast_positions(const BmpImage *img,
-                                int block_size,
-                                double contrast_threshold,
-                                EmbedPosition **positions_out,
-                                size_t *count_out)
+// Set up an iterator in caller-provided storage, taking its buffers from
+// arena when it is not NULL. Returns 0 on success; on failure nothing needs
+// releasing.
+static int position_iter_init(StegPositionIter *iter,
+                              const BmpImage *img,
+                              int block_size,
+                              double contrast_threshold,
+                              int format,
+                              StegArena *arena)
 {
-    assert(positions_out != NULL);
-    assert(count_out != NULL);
-
-    *positions_out = NULL;
-    *count_out = 0;
+    memset(iter, 0, sizeof(*iter));
 
     if (img == NULL || img->data == NULL) {
-        fprintf(stderr, "find_low_contrast_positions: invalid image\n");
+        fprintf(stderr, "steg_position_iter_create: invalid image\n");
         return 1;
     }
 
     if (block_size <= 0) {
-        fprintf(stderr, "find_low_contrast_positions: block_size must be > 0\n");
+        fprintf(stderr, "steg_position_iter_create: block_size must be > 0\n");
+        return 1;
+    }
+
+    if (format != STEG_FORMAT_LEGACY && format != STEG_FORMAT_BITMAP &&
+        format != STEG_FORMAT_COMPACT) {
+        fprintf(stderr, "steg_position_iter_create: unsupported format %d\n", format);
         return 1;
     }
 
+    // The compact layout only differs in its header.
+    if (format == STEG_FORMAT_COMPACT) {
+        format = STEG_FORMAT_BITMAP;
+    }
+
     int32_t width = img->width;
     int32_t height = img->height;
     int32_t abs_height = height > 0 ? height : -height;
 
     if (width <= 0 || abs_height <= 0) {
-        fprintf(stderr, "find_low_contrast_positions: invalid dimensions\n");
+        fprintf(stderr, "steg_position_iter_create: invalid dimensions\n");
         return 1;
     }
 
-    double *lum = NULL;
-    if (compute_luminance_map(img, &lum) != 0) {
+    iter->format = format;
+    iter->block_size = block_size;
+    iter->width = width;
+    iter->height = abs_height;
+    iter->row = -1;
+    iter->owns_buffers = arena == NULL;
+    iter->bits_per_channel = 1;
+
+    if (contrast_scanner_init(&iter->scanner, img, block_size, contrast_threshold,
+                              arena) != 0) {
         return 1;
     }
+    iter->bc = iter->scanner.max_col;
+
+    if (iter->scanner.max_col > 0) {
+        iter->accept = arena != NULL
+                           ? (uint8_t *)arena_alloc(arena, (size_t)iter->scanner.max_col)
+                           : (uint8_t *)malloc((size_t)iter->scanner.max_col);
+        if (!iter->accept) {
+            perror("steg_position_iter_create: malloc");
+            position_iter_release(iter);
+            return 1;
+        }
+    }
 
-    EmbedPosition *positions = NULL;
-    size_t capacity = 0;
-    size_t count = 0;
+    if (format == STEG_FORMAT_BITMAP) {
+        size_t runs_size = ((size_t)width + 1u) * sizeof(int32_t);
+        iter->runs = arena != NULL ? (int32_t *)arena_alloc(arena, runs_size)
+                                   : (int32_t *)malloc(runs_size);
+        if (!iter->runs) {
+            perror("steg_position_iter_create: malloc");
+            position_iter_release(iter);
+            return 1;
+        }
+        if (coverage_tracker_init(&iter->tracker, width, block_size, arena) != 0) {
+            position_iter_release(iter);
+            return 1;
+        }
+    }
 
-    int32_t max_row = abs_height - block_size + 1;
-    int32_t max_col = width - block_size + 1;
+    return 0;
+}
 
-    if (max_row < 0 || max_col < 0) {
-        free(lum);
-        return 0; // no blocks available, but not a hard error
+// Set up a bitmap layout iterator over a precomputed selection instead of a
+// scan. The selection must outlive the iterator. Returns 0 on success.
+static int position_iter_init_selection(StegPositionIter *iter,
+                                        const StegBitmap *selection,
+                                        StegArena *arena)
+{
+    memset(iter, 0, sizeof(*iter));
+
+    iter->format = STEG_FORMAT_BITMAP;
+    iter->width = selection->width;
+    iter->height = selection->height;
+    iter->row = -1;
+    iter->owns_buffers = arena == NULL;
+    iter->bits_per_channel = 1;
+    iter->selection = selection;
+
+    size_t runs_size = ((size_t)selection->width + 1u) * sizeof(int32_t);
+    iter->runs = arena != NULL ? (int32_t *)arena_alloc(arena, runs_size)
+                               : (int32_t *)malloc(runs_size);
+    if (!iter->runs) {
+        perror("steg_position_iter_create: malloc");
+        return 1;
     }
+    return 0;
+}
 
-    for (int32_t br = 0; br < max_row; ++br) {
-        for (int32_t bc = 0; bc < max_col; ++bc) {
-            // Compute mean luminance in the block
-            double sum = 0.0;
-            int n = 0;
-            for (int r = 0; r < block_size; ++r) {
-                int32_t row = br + r;
-                for (int c = 0; c < block_size; ++c) {
-                    int32_t col = bc + c;
-                    size_t idx = (size_t)row * (size_t)width + (size_t)col;
-                    sum += lum[idx];
-                    ++n;
-                }
-            }
+// Helper: set iter up at a depth of bits_per_channel, over selection when it
+// is not NULL (bitmap layout only) and over a scan of img otherwise. arena
+// (may be NULL) is reset to exactly the scratch this needs, so a second call
+// with the same arguments never allocates. Returns 0 on success.
+static int position_iter_begin(StegPositionIter *iter,
+                               const BmpImage *img,
+                               int block_size,
+                               double contrast_threshold,
+                               int format,
+                               int bits_per_channel,
+                               const StegBitmap *selection,
+                               StegArena *arena)
+{
+    size_t scratch = selection != NULL
+                         ? ARENA_SIZE(((size_t)img->width + 1u) * sizeof(int32_t))
+                         : position_iter_scratch_size(img->width, block_size, format);
+    if (arena != NULL && arena_reset(arena, scratch) != 0) {
+        return 1;
+    }
 
-            if (n == 0) {
-                continue;
-            }
+    int rc = selection != NULL
+                 ? position_iter_init_selection(iter, selection, arena)
+                 : position_iter_init(iter, img, block_size, contrast_threshold, format, arena);
+    if (rc != 0) {
+        return 1;
+    }
+    position_iter_set_depth(iter, bits_per_channel);
+    return 0;
+}
 
-            double mean = sum / (double)n;
+int steg_position_iter_create(const BmpImage *img,
+                              int block_size,
+                              double contrast_threshold,
+                              int format,
+                              StegPositionIter **iter_out)
+{
+    assert(iter_out != NULL);
 
-            // Compute standard deviation
-            double sq_sum = 0.0;
-            for (int r = 0; r < block_size; ++r) {
-                int32_t row = br + r;
-                for (int c = 0; c < block_size; ++c) {
-                    int32_t col = bc + c;
-                    size_t idx = (size_t)row * (size_t)width + (size_t)col;
-                    double d = lum[idx] - mean;
-                    sq_sum += d * d;
-                }
-            }
+    *iter_out = NULL;
 
-            double variance = sq_sum / (double)n;
-            double stddev = sqrt(variance);
-
-            if (stddev < contrast_threshold) {
-                // Block is "low contrast": record all its pixels.
-                for (int r = 0; r < block_size; ++r) {
-                    int32_t row = br + r;
-                    for (int c = 0; c < block_size; ++c) {
-                        int32_t col = bc + c;
-                        int pixel_index = row * width + col;
-
-                        if (count == capacity) {
-                            size_t new_cap = capacity == 0 ? 128 : capacity * 2;
-                            EmbedPosition *tmp = (EmbedPosition *)realloc(
-                                positions, new_cap * sizeof(EmbedPosition));
-                            if (!tmp) {
-                                perror("find_low_contrast_positions: realloc");
-                                free(positions);
-                                free(lum);
-                                return 1;
-                            }
-                            positions = tmp;
-                            capacity = new_cap;
-                        }
-
-                        positions[count].pixel_index = pixel_index;
-                        ++count;
-                    }
-                }
-            }
-        }
+    StegPositionIter *iter = (StegPositionIter *)malloc(sizeof(StegPositionIter));
+    if (!iter) {
+        perror("steg_position_iter_create: malloc");
+        return 1;
     }
 
-    free(lum);
+    if (position_iter_init(iter, img, block_size, contrast_threshold, format, NULL) != 0) {
+        free(iter);
+        return 1;
+    }
 
-    *positions_out = positions;
-    *count_out = count;
+    *iter_out = iter;
     return 0;
 }
 
-// Helper: write bits from a buffer into image pixels at given positions.
-// Bits are taken from bitstream[0..total_bits-1] (0 or 1).
-// Channels order per pixel: R, G, B (note: data is BGR).
-static int embed_bits(BmpImage *img,
-                      const EmbedPosition *positions,
-                      size_t positions_count,
-                      const uint8_t *bitstream,
-                      size_t total_bits)
+void steg_position_iter_free(StegPositionIter *iter)
 {
-    assert(img != NULL);
-    assert(positions != NULL);
-    assert(bitstream != NULL);
-
-    int32_t width = img->width;
-    int32_t abs_height = img->height > 0 ? img->height : -img->height;
-    (void)abs_height; // not strictly needed, but kept for invariants
+    if (iter == NULL) {
+        return;
+    }
 
-    size_t bit_index = 0;
-    for (size_t i = 0; i < positions_count && bit_index < total_bits; ++i) {
-        int pixel_index = positions[i].pixel_index;
-        assert(pixel_index >= 0);
-        int row = pixel_index / width;
-        int col = pixel_index % width;
+    position_iter_release(iter);
+    free(iter);
+}
 
-        size_t base = (size_t)row * (size_t)img->stride + (size_t)col * 3u;
+// Helper: write the runs of set bits of row y of a selection bitmap as
+// [begin, end) pairs into runs[] (width + 1 entries) and return their count.
+static size_t bitmap_row_runs(const StegBitmap *bitmap, int32_t y, int32_t *runs)
+{
+    size_t base = (size_t)y * (size_t)bitmap->width;
+    size_t count = 0;
+    int in_run = 0;
+    for (int32_t col = 0; col < bitmap->width; ++col) {
+        size_t idx = base + (size_t)col;
+        int set = (int)((bitmap->bits[idx >> 6] >> (idx & 63u)) & 1u);
+        if (set && !in_run) {
+            runs[2 * count] = col;
+            in_run = 1;
+        } else if (!set && in_run) {
+            runs[2 * count + 1] = col;
+            ++count;
+            in_run = 0;
+        }
+    }
+    if (in_run) {
+        runs[2 * count + 1] = bitmap->width;
+        ++count;
+    }
+    return count;
+}
 
-        // Order: R, G, B => indices 2, 1, 0 in BGR layout
-        for (int channel = 2; channel >= 0 && bit_index < total_bits; --channel) {
-            assert(bit_index < total_bits);
-            size_t offset = base + (size_t)channel;
-            unsigned char value = img->data[offset];
-            uint8_t bit = bitstream[bit_index];
+// Helper (bitmap layout): advance to the next image row and collect its
+// runs of selected columns. Returns 0 when all rows are done.
+static int position_iter_next_row(StegPositionIter *iter)
+{
+    if (iter->row + 1 >= iter->height) {
+        return 0;
+    }
 
-            value &= (unsigned char)~1u;       // clear LSB
-            value |= (unsigned char)(bit & 1u); // set LSB
-            img->data[offset] = value;
+    double start = iter->stats != NULL ? stats_now() : 0.0;
 
-            ++bit_index;
+    ++iter->row;
+    if (iter->selection != NULL) {
+        iter->runs_count = bitmap_row_runs(iter->selection, iter->row, iter->runs);
+    } else {
+        if (iter->row < iter->scanner.max_row) {
+            contrast_scanner_scan_row(&iter->scanner, iter->accept);
+            coverage_tracker_add_row(&iter->tracker, iter->row, iter->accept,
+                                     iter->scanner.max_col);
         }
+        iter->runs_count = coverage_tracker_row_runs(&iter->tracker, iter->row, iter->runs);
     }
+    iter->runs_pos = 0;
+    iter->run_col = iter->runs_count > 0 ? iter->runs[0] : 0;
 
-    // At this point we assume capacity check was done beforehand, so we should
-    // always embed all bits.
-    assert(bit_index == total_bits);
-    return 0;
+    if (iter->stats != NULL) {
+        iter->stats->scan_seconds += stats_now() - start;
+    }
+    return 1;
 }
 
-// Helper: read bits from image according to positions into bitstream.
-static int extract_bits(const BmpImage *img,
-                        const EmbedPosition *positions,
-                        size_t positions_count,
-                        uint8_t *bitstream,
-                        size_t total_bits)
+// Helper (selection iterators): make the skip-th selected pixel (from 0) of
+// row the next position. skip must be below the selected pixels of row.
+static void position_iter_seek(StegPositionIter *iter, int32_t row, size_t skip)
 {
-    assert(img != NULL);
-    assert(positions != NULL);
-    assert(bitstream != NULL);
-
-    int32_t width = img->width;
-    int32_t abs_height = img->height > 0 ? img->height : -img->height;
-    (void)abs_height;
-
-    size_t bit_index = 0;
-    for (size_t i = 0; i < positions_count && bit_index < total_bits; ++i) {
-        int pixel_index = positions[i].pixel_index;
-        assert(pixel_index >= 0);
-        int row = pixel_index / width;
-        int col = pixel_index % width;
+    iter->row = row - 1;
+    position_iter_next_row(iter);
+    while (iter->runs_pos < iter->runs_count) {
+        size_t len = (size_t)(iter->runs[2 * iter->runs_pos + 1] - iter->run_col);
+        if (skip < len) {
+            iter->run_col += (int32_t)skip;
+            return;
+        }
+        skip -= len;
+        if (++iter->runs_pos < iter->runs_count) {
+            iter->run_col = iter->runs[2 * iter->runs_pos];
+        }
+    }
+}
 
-        size_t base = (size_t)row * (size_t)img->stride + (size_t)col * 3u;
+// Helper (legacy layout): first accepted block column >= from, or max_col.
+static int32_t position_iter_next_block(const StegPositionIter *iter, int32_t from)
+{
+    int32_t max_col = iter->scanner.max_col;
+    while (from < max_col && !iter->accept[from]) {
+        ++from;
+    }
+    return from;
+}
 
-        // Same order as embed: R, G, B
-        for (int channel = 2; channel >= 0 && bit_index < total_bits; --channel) {
-            size_t offset = base + (size_t)channel;
-            unsigned char value = img->data[offset];
-            uint8_t bit = (uint8_t)(value & 1u);
-            bitstream[bit_index] = bit;
-            ++bit_index;
+// Helper (legacy layout): make sure the current block row has a block left.
+// Returns 0 once the block rows are exhausted.
+static int position_iter_legacy_ready(StegPositionIter *iter)
+{
+    while (iter->bc >= iter->scanner.max_col) {
+        if (iter->row + 1 >= iter->scanner.max_row) {
+            return 0;
+        }
+        double start = iter->stats != NULL ? stats_now() : 0.0;
+        ++iter->row;
+        contrast_scanner_scan_row(&iter->scanner, iter->accept);
+        iter->bc = position_iter_next_block(iter, 0);
+        if (iter->stats != NULL) {
+            iter->stats->scan_seconds += stats_now() - start;
         }
     }
+    return 1;
+}
 
-    if (bit_index < total_bits) {
-        fprintf(stderr, "extract_bits: not enough bits available\n");
+// Helper: next run of positions, as row, first column and length (>= 1).
+// The run is consumed whole. Returns 1 if one was produced.
+static int position_iter_next_run(StegPositionIter *iter,
+                                  int32_t *row_out,
+                                  int32_t *col_out,
+                                  int32_t *len_out)
+{
+    if (iter->format == STEG_FORMAT_BITMAP) {
+        while (iter->runs_pos == iter->runs_count) {
+            if (!position_iter_next_row(iter)) {
+                return 0;
+            }
+        }
+        int32_t end = iter->runs[2 * iter->runs_pos + 1];
+        *row_out = iter->row;
+        *col_out = iter->run_col;
+        *len_out = end - iter->run_col;
+        if (++iter->runs_pos < iter->runs_count) {
+            iter->run_col = iter->runs[2 * iter->runs_pos];
+        }
         return 1;
     }
 
-    return 0;
+    // Legacy: the rest of the current row of the current block footprint.
+    if (!position_iter_legacy_ready(iter)) {
+        return 0;
+    }
+    *row_out = iter->row + iter->r;
+    *col_out = iter->bc + iter->c;
+    *len_out = iter->block_size - iter->c;
+
+    iter->c = 0;
+    if (++iter->r == iter->block_size) {
+        iter->r = 0;
+        iter->bc = position_iter_next_block(iter, iter->bc + 1);
+    }
+    return 1;
 }
 
-int steg_encode_message(BmpImage *img,
-                        const uint8_t *message,
-                        size_t message_len,
-                        int block_size,
-                        double contrast_threshold)
+// Helper: next position as (row, col). Returns 1 if one was produced.
+static int position_iter_next_rc(StegPositionIter *iter, int32_t *row_out, int32_t *col_out)
 {
-    assert(img != NULL);
-
-    if (img->data == NULL) {
-        fprintf(stderr, "steg_encode_message: invalid image data\n");
+    if (iter->format == STEG_FORMAT_BITMAP) {
+        while (iter->runs_pos == iter->runs_count) {
+            if (!position_iter_next_row(iter)) {
+                return 0;
+            }
+        }
+        *row_out = iter->row;
+        *col_out = iter->run_col;
+        if (++iter->run_col == iter->runs[2 * iter->runs_pos + 1] &&
+            ++iter->runs_pos < iter->runs_count) {
+            iter->run_col = iter->runs[2 * iter->runs_pos];
+        }
         return 1;
     }
 
-    if (message == NULL && message_len > 0) {
-        fprintf(stderr, "steg_encode_message: message is NULL but length > 0\n");
-        return 1;
+    // Legacy: every pixel of every accepted block, block by block.
+    if (!position_iter_legacy_ready(iter)) {
+        return 0;
     }
 
-    EmbedPosition *positions = NULL;
-    size_t positions_count = 0;
+    *row_out = iter->row + iter->r;
+    *col_out = iter->bc + iter->c;
 
-    if (find_low_contrast_positions(img, block_size, contrast_threshold,
-                                    &positions, &positions_count) != 0) {
-        return 1;
+    if (++iter->c == iter->block_size) {
+        iter->c = 0;
+        if (++iter->r == iter->block_size) {
+            iter->r = 0;
+            iter->bc = position_iter_next_block(iter, iter->bc + 1);
+        }
     }
+    return 1;
+}
 
-    size_t capacity_bits = positions_count * 3u;
-    size_t required_bits = (4u + message_len) * 8u; // 4-byte length header + message
+int steg_position_iter_next(StegPositionIter *iter, EmbedPosition *position_out)
+{
+    assert(iter != NULL);
+    assert(position_out != NULL);
 
-    // If capacity is insufficient, return -1 and do not modify image.
-    if (capacity_bits < required_bits) {
-        free(positions);
-        fprintf(stderr, "steg_encode_message: capacity insufficient "
-                        "(have %zu bits, need %zu bits)\n",
-                capacity_bits, required_bits);
-        return -1;
+    int32_t row = 0;
+    int32_t col = 0;
+    if (!position_iter_next_rc(iter, &row, &col)) {
+        return 0;
     }
 
-    // Build bitstream: [length(4 bytes, little-endian)] [message bytes]
-    size_t total_bytes = 4u + message_len;
-    size_t total_bits = total_bytes * 8u;
+    position_out->pixel_index = row * iter->width + col;
+    return 1;
+}
+
+int32_t steg_position_iter_rows_scanned(const StegPositionIter *iter)
+{
+    assert(iter != NULL);
+    return contrast_scanner_rows_read(&iter->scanner);
+}
 
-    uint8_t *bitstream = (uint8_t *)malloc(total_bits * sizeof(uint8_t));
-    if (!bitstream) {
-        perror("steg_encode_message: malloc");
-        free(positions);
-        return 1;
+// Helper: make *buf hold at least `need` bytes, keeping its contents. The
+// buffer only grows, so reusing it across calls stops allocating once it has
+// reached the largest size needed. Returns 0 on success.
+static int scratch_reserve(void **buf, size_t *capacity, size_t need, const char *caller)
+{
+    if (need <= *capacity && *buf != NULL) {
+        return 0;
     }
 
-    // Pack length as 32-bit unsigned integer in little-endian order.
-    uint32_t len32 = (uint32_t)message_len;
-    uint8_t header[4];
-    header[0] = (uint8_t)(len32 & 0xFFu);
-    header[1] = (uint8_t)((len32 >> 8) & 0xFFu);
-    header[2] = (uint8_t)((len32 >> 16) & 0xFFu);
-    header[3] = (uint8_t)((len32 >> 24) & 0xFFu);
-
-    // Convert bytes to bit stream (MSB-first within each byte).
-    size_t bit_index = 0;
-    for (size_t i = 0; i < 4; ++i) {
-        uint8_t b = header[i];
-        for (int bit_pos = 7; bit_pos >= 0; --bit_pos) {
-            uint8_t bit = (uint8_t)((b >> bit_pos) & 1u);
-            bitstream[bit_index++] = bit;
-        }
+    size_t new_cap = *capacity * 2u;
+    if (new_cap < need) {
+        new_cap = need;
     }
-    for (size_t i = 0; i < message_len; ++i) {
-        uint8_t b = message[i];
-        for (int bit_pos = 7; bit_pos >= 0; --bit_pos) {
-            uint8_t bit = (uint8_t)((b >> bit_pos) & 1u);
-            bitstream[bit_index++] = bit;
-        }
+    if (new_cap < 128u) {
+        new_cap = 128u;
     }
 
-    assert(bit_index == total_bits);
-
-    int rc = embed_bits(img, positions, positions_count, bitstream, total_bits);
+    void *tmp = realloc(*buf, new_cap);
+    if (!tmp) {
+        fprintf(stderr, "%s: out of memory\n", caller);
+        return 1;
+    }
+    *buf = tmp;
+    *capacity = new_cap;
+    return 0;
+}
 
-    free(bitstream);
-    free(positions);
+// Helper: set bits [begin, end) of a bitmap, a word at a time.
+static void bitmap_set_range(uint64_t *bits, size_t begin, size_t end)
+{
+    while (begin < end) {
+        size_t word = begin >> 6;
+        unsigned shift = (unsigned)(begin & 63u);
+        size_t n = 64u - shift;
+        if (n > end - begin) {
+            n = end - begin;
+        }
+        uint64_t mask = n == 64u ? ~(uint64_t)0 : (((uint64_t)1u << n) - 1u) << shift;
+        bits[word] |= mask;
+        begin += n;
+    }
+}
 
-    return rc;
+// Helper: number of set bits in [begin, end) of a bitmap.
+static size_t bitmap_count_range(const uint64_t *bits, size_t begin, size_t end)
+{
+    size_t count = 0;
+    while (begin < end) {
+        size_t word = begin >> 6;
+        unsigned shift = (unsigned)(begin & 63u);
+        size_t n = 64u - shift;
+        if (n > end - begin) {
+            n = end - begin;
+        }
+        uint64_t mask = n == 64u ? ~(uint64_t)0 : (((uint64_t)1u << n) - 1u) << shift;
+        count += popcount64(bits[word] & mask);
+        begin += n;
+    }
+    return count;
 }
 
-int steg_decode_message(const BmpImage *img,
-                        uint8_t **message_out,
-                        size_t *message_len_out,
-                        int block_size,
-                        double contrast_threshold)
+// Helper: collect the STEG_FORMAT_LEGACY positions into *buf (capacity in
+// bytes), using iter as storage and arena (may be NULL) for scratch.
+static int collect_positions(const BmpImage *img,
+                             int block_size,
+                             double contrast_threshold,
+                             StegPositionIter *iter,
+                             StegArena *arena,
+                             EmbedPosition **buf,
+                             size_t *buf_cap,
+                             size_t *count_out,
+                             StegStats *stats)
 {
-    assert(img != NULL);
-    assert(message_out != NULL);
-    assert(message_len_out != NULL);
+    *count_out = 0;
 
-    *message_out = NULL;
-    *message_len_out = 0;
+    if (stats != NULL) {
+        ++stats->calls;
+    }
 
-    if (img->data == NULL) {
-        fprintf(stderr, "steg_decode_message: invalid image data\n");
+    if (arena != NULL && img != NULL &&
+        arena_reset(arena, position_iter_scratch_size(img->width, block_size,
+                                                      STEG_FORMAT_LEGACY)) != 0) {
         return 1;
     }
 
-    EmbedPosition *positions = NULL;
-    size_t positions_count = 0;
+    if (position_iter_init(iter, img, block_size, contrast_threshold,
+                           STEG_FORMAT_LEGACY, arena) != 0) {
+        return 1;
+    }
+    position_iter_set_stats(iter, stats);
+
+    size_t count = 0;
+    EmbedPosition position;
+    while (steg_position_iter_next(iter, &position)) {
+        if ((count + 1u) * sizeof(EmbedPosition) > *buf_cap &&
+            scratch_reserve((void **)buf, buf_cap, (count + 1u) * sizeof(EmbedPosition),
+                            "find_low_contrast_positions") != 0) {
+            position_iter_release(iter);
+            return 1;
+        }
+
+        (*buf)[count++] = position;
+    }
+
+    position_iter_release(iter);
+    *count_out = count;
+    return 0;
+}
+
+// Helper: like collect_positions(), for the selection bitmap at a depth of
+// bits_per_channel. *buf holds the bitmap words (capacity in bytes).
+static int collect_bitmap(const BmpImage *img,
+                          int block_size,
+                          double contrast_threshold,
+                          int bits_per_channel,
+                          StegPositionIter *iter,
+                          StegArena *arena,
+                          uint64_t **buf,
+                          size_t *buf_cap,
+                          StegBitmap *bitmap_out,
+                          StegStats *stats)
+{
+    if (stats != NULL) {
+        ++stats->calls;
+    }
 
-    if (find_low_contrast_positions(img, block_size, contrast_threshold,
-                                    &positions, &positions_count) != 0) {
+    if (arena != NULL && img != NULL &&
+        arena_reset(arena, position_iter_scratch_size(img->width, block_size,
+                                                      STEG_FORMAT_BITMAP)) != 0) {
         return 1;
     }
 
-    size_t capacity_bits = positions_count * 3u;
-    if (capacity_bits < 32u) {
-        fprintf(stderr, "steg_decode_message: not enough bits even for header\n");
-        free(positions);
+    if (position_iter_init(iter, img, block_size, contrast_threshold,
+                           STEG_FORMAT_BITMAP, arena) != 0) {
         return 1;
     }
+    position_iter_set_depth(iter, bits_per_channel);
+    position_iter_set_stats(iter, stats);
 
-    // First read 32 bits (4 bytes) for length header.
-    uint8_t header_bits[32];
-    if (extract_bits(img, positions, positions_count, header_bits, 32u) != 0) {
-        free(positions);
+    size_t pixel_count = (size_t)iter->width * (size_t)iter->height;
+    size_t bits_size = (pixel_count + 63u) / 64u * sizeof(uint64_t);
+    if (scratch_reserve((void **)buf, buf_cap, bits_size, "find_low_contrast_bitmap") != 0) {
+        position_iter_release(iter);
         return 1;
     }
+    uint64_t *bits = *buf;
+    memset(bits, 0, bits_size);
 
-    // Convert header bits (MSB-first per byte) back to 4-byte little-endian integer.
-    uint8_t header_bytes[4] = {0, 0, 0, 0};
-    size_t bit_index = 0;
-    for (size_t i = 0; i < 4; ++i) {
-        uint8_t b = 0;
-        for (int bit_pos = 7; bit_pos >= 0; --bit_pos) {
-            uint8_t bit = header_bits[bit_index++];
-            b |= (uint8_t)(bit << bit_pos);
-        }
-        header_bytes[i] = b;
+    size_t count = 0;
+    int32_t row = 0;
+    int32_t col = 0;
+    int32_t len = 0;
+    while (position_iter_next_run(iter, &row, &col, &len)) {
+        size_t begin = (size_t)row * (size_t)iter->width + (size_t)col;
+        bitmap_set_range(bits, begin, begin + (size_t)len);
+        count += (size_t)len;
     }
 
-    uint32_t len32 = 0;
-    len32 |= (uint32_t)header_bytes[0];
-    len32 |= (uint32_t)header_bytes[1] << 8;
-    len32 |= (uint32_t)header_bytes[2] << 16;
-    len32 |= (uint32_t)header_bytes[3] << 24;
+    bitmap_out->width = iter->width;
+    bitmap_out->height = iter->height;
+    bitmap_out->count = count;
+    bitmap_out->bits = bits;
 
-    size_t message_len = (size_t)len32;
+    position_iter_release(iter);
+    return 0;
+}
 
-    size_t required_bits = (4u + message_len) * 8u;
-    if (capacity_bits < required_bits) {
-        fprintf(stderr, "steg_decode_message: capacity insufficient for stored length\n");
+int find_low_contrast_positions(const BmpImage *img,
+                                int block_size,
+                                double contrast_threshold,
+                                EmbedPosition **positions_out,
+                                size_t *count_out)
+{
+    assert(positions_out != NULL);
+    assert(count_out != NULL);
+
+    *positions_out = NULL;
+    *count_out = 0;
+
+    StegPositionIter iter;
+    EmbedPosition *positions = NULL;
+    size_t capacity = 0;
+    size_t count = 0;
+    if (collect_positions(img, block_size, contrast_threshold, &iter, NULL,
+                          &positions, &capacity, &count, NULL) != 0) {
         free(positions);
         return 1;
     }
 
-    // Now read all bits (header + message).
-    uint8_t *all_bits = (uint8_t *)malloc(required_bits * sizeof(uint8_t));
-    if (!all_bits) {
-        perror("steg_decode_message: malloc");
+    if (count == 0) {
         free(positions);
-        return 1;
+        positions = NULL;
     }
 
-    if (extract_bits(img, positions, positions_count, all_bits, required_bits) != 0) {
-        free(all_bits);
-        free(positions);
+    *positions_out = positions;
+    *count_out = count;
+    return 0;
+}
+
+int find_low_contrast_bitmap(const BmpImage *img,
+                             int block_size,
+                             double contrast_threshold,
+                             StegBitmap *bitmap_out)
+{
+    assert(bitmap_out != NULL);
+
+    memset(bitmap_out, 0, sizeof(*bitmap_out));
+
+    StegPositionIter iter;
+    uint64_t *bits = NULL;
+    size_t capacity = 0;
+    if (collect_bitmap(img, block_size, contrast_threshold, 1, &iter, NULL,
+                       &bits, &capacity, bitmap_out, NULL) != 0) {
+        free(bits);
+        memset(bitmap_out, 0, sizeof(*bitmap_out));
         return 1;
     }
 
-    // Skip first 32 bits, decode remaining into message bytes.
-    uint8_t *message = (uint8_t *)malloc(message_len * sizeof(uint8_t));
-    if (!message) {
-        perror("steg_decode_message: malloc message");
-        free(all_bits);
-        free(positions);
-        return 1;
+    return 0;
+}
+
+void steg_bitmap_free(StegBitmap *bitmap)
+{
+    if (bitmap == NULL) {
+        return;
     }
 
-    size_t bit_offset = 32u;
-    for (size_t i = 0; i < message_len; ++i) {
-        uint8_t b = 0;
-        for (int bit_pos = 7; bit_pos >= 0; --bit_pos) {
-            uint8_t bit = all_bits[bit_offset++];
-            b |= (uint8_t)(bit << bit_pos);
-        }
-        message[i] = b;
+    free(bitmap->bits);
+    bitmap->bits = NULL;
+    bitmap->width = 0;
+    bitmap->height = 0;
+    bitmap->count = 0;
+}
+
+// Parallel band scan.
+//
+// Block rows are split into contiguous bands, one task each. Legacy
+// footprints of a band depend on its own block rows only, so the band lists
+// are simply concatenated in order. In the bitmap, image row y depends on
+// block rows y - block_size + 1 .. y: a band that owns image rows [b0, b1)
+// scans from block row b0 - block_size + 1 to seed its coverage tracker and
+// emits just its own rows. The last band also owns the rows below the last
+// block row. Bitmap words that straddle two bands are collected per band and
+// OR-ed in afterwards, so no word is written by two threads.
+
+// Bands per thread, to even out bands that take longer than others.
+#define SCAN_BANDS_PER_THREAD 4
+
+typedef struct {
+    int32_t first_row;       // block rows [first_row, end_row)
+    int32_t end_row;
+    int failed;
+    // Legacy layout
+    EmbedPosition *positions;
+    size_t count;
+    size_t capacity;
+    // Bitmap layout
+    size_t edge_word[2];     // first and last word the band touches
+    uint64_t edge_bits[2];
+} ScanBand;
+
+typedef struct {
+    const BmpImage *img;
+    int block_size;
+    double contrast_threshold;
+    int32_t width;
+    int32_t height;          // absolute height
+    int32_t max_row;
+    unsigned char channel_mask; // LUMA_CHANNEL_MASK() of the embedding depth
+    uint64_t *bits;          // bitmap layout output
+    ScanBand *bands;
+    int band_count;
+} ParallelScan;
+
+// Helper: split max_row block rows into bands. Returns the band array (NULL
+// on allocation failure) and sets *band_count_out.
+static ScanBand *scan_bands_create(int32_t max_row,
+                                   int block_size,
+                                   StegThreadPool *pool,
+                                   int *band_count_out)
+{
+    // Every band costs up to block_size - 1 extra rows of overlap, so keep
+    // bands at least a few blocks tall.
+    int64_t bands = (int64_t)steg_thread_pool_size(pool) * SCAN_BANDS_PER_THREAD;
+    int64_t max_bands = max_row / ((int64_t)block_size * 4);
+    if (bands > max_bands) {
+        bands = max_bands;
+    }
+    if (bands < 1) {
+        bands = 1;
     }
 
-    free(all_bits);
-    free(positions);
+    ScanBand *band = (ScanBand *)calloc((size_t)bands, sizeof(ScanBand));
+    if (!band) {
+        perror("find_low_contrast_parallel: calloc");
+        return NULL;
+    }
 
-    *message_out = message;
-    *message_len_out = message_len;
+    for (int64_t i = 0; i < bands; ++i) {
+        band[i].first_row = (int32_t)(max_row * i / bands);
+        band[i].end_row = (int32_t)(max_row * (i + 1) / bands);
+    }
 
-    return 0;
+    *band_count_out = (int)bands;
+    return band;
 }
 
+static void scan_band_legacy(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ParallelScan *scan = (ParallelScan *)ctx;
+    ScanBand *band = &scan->bands[task];
+    int block_size = scan->block_size;
+
+    ContrastScanner scanner;
+    if (contrast_scanner_init(&scanner, scan->img, block_size,
+                              scan->contrast_threshold, NULL) != 0) {
+        band->failed = 1;
+        return;
+    }
+    contrast_scanner_seek(&scanner, band->first_row);
+
+    uint8_t *accept = (uint8_t *)malloc((size_t)scanner.max_col);
+    if (!accept) {
+        perror("find_low_contrast_positions_parallel: malloc");
+        contrast_scanner_free(&scanner);
+        band->failed = 1;
+        return;
+    }
+
+    size_t footprint = (size_t)block_size * (size_t)block_size;
+    for (int32_t br = band->first_row; br < band->end_row; ++br) {
+        contrast_scanner_scan_row(&scanner, accept);
+        for (int32_t bc = 0; bc < scanner.max_col; ++bc) {
+            if (!accept[bc]) {
+                continue;
+            }
 
+            if (band->count + footprint > band->capacity) {
+                size_t new_cap = band->capacity == 0 ? 128 : band->capacity * 2;
+                while (new_cap < band->count + footprint) {
+                    new_cap *= 2;
+                }
+                EmbedPosition *tmp = (EmbedPosition *)realloc(
+                    band->positions, new_cap * sizeof(EmbedPosition));
+                if (!tmp) {
+                    perror("find_low_contrast_positions_parallel: realloc");
+                    band->failed = 1;
+                    free(accept);
+                    contrast_scanner_free(&scanner);
+                    return;
+                }
+                band->positions = tmp;
+                band->capacity = new_cap;
+            }
+
+            for (int r = 0; r < block_size; ++r) {
+                int base = (br + r) * scan->width + bc;
+                for (int c = 0; c < block_size; ++c) {
+                    band->positions[band->count++].pixel_index = base + c;
+                }
+            }
+        }
+    }
+
+    free(accept);
+    contrast_scanner_free(&scanner);
+}
+
+static void scan_band_bitmap(void *ctx, int task, int thread)
+{
+    (void)thread;
+    ParallelScan *scan = (ParallelScan *)ctx;
+    ScanBand *band = &scan->bands[task];
+    int block_size = scan->block_size;
+    int32_t width = scan->width;
+
+    // Image rows owned by this band.
+    int32_t y0 = band->first_row;
+    int32_t y1 = task == scan->band_count - 1 ? scan->height : band->end_row;
+    size_t first_word = ((size_t)y0 * (size_t)width) >> 6;
+    size_t last_word = ((size_t)y1 * (size_t)width - 1u) >> 6;
+    band->edge_word[0] = first_word;
+    band->edge_word[1] = last_word;
+
+    ContrastScanner scanner;
+    CoverageTracker tracker;
+    if (contrast_scanner_init(&scanner, scan->img, block_size,
+                              scan->contrast_threshold, NULL) != 0) {
+        band->failed = 1;
+        return;
+    }
+    scanner.channel_mask = scan->channel_mask;
+    uint8_t *accept = (uint8_t *)malloc((size_t)scanner.max_col);
+    if (!accept || coverage_tracker_init(&tracker, width, block_size, NULL) != 0) {
+        if (!accept) {
+            perror("find_low_contrast_bitmap_parallel: malloc");
+        }
+        free(accept);
+        contrast_scanner_free(&scanner);
+        band->failed = 1;
+        return;
+    }
+
+    int32_t start = y0 - (block_size - 1);
+    contrast_scanner_seek(&scanner, start > 0 ? start : 0);
+
+    for (int32_t y = scanner.next_row; y < y1; ++y) {
+        if (y < scan->max_row) {
+            contrast_scanner_scan_row(&scanner, accept);
+            coverage_tracker_add_row(&tracker, y, accept, scanner.max_col);
+        }
+        if (y < y0) {
+            continue;
+        }
+
+        size_t base = (size_t)y * (size_t)width;
+        for (int32_t col = 0; col < width; ++col) {
+            if (tracker.last_row[col] <= y - block_size) {
+                continue;
+            }
+            size_t idx = base + (size_t)col;
+            size_t word = idx >> 6;
+            uint64_t bit = (uint64_t)1u << (idx & 63u);
+            if (word == first_word) {
+                band->edge_bits[0] |= bit;
+            } else if (word == last_word) {
+                band->edge_bits[1] |= bit;
+            } else {
+                scan->bits[word] |= bit;
+            }
+            ++band->count;
+        }
+    }
+
+    free(accept);
+    coverage_tracker_free(&tracker);
+    contrast_scanner_free(&scanner);
+}
+
+// Helper: validate arguments and set up a parallel scan. Returns 0 on
+// success; *scan is ready to run (band_count == 0 when there are no blocks).
+static int parallel_scan_init(ParallelScan *scan,
+                              const BmpImage *img,
+                              int block_size,
+                              double contrast_threshold,
+                              StegThreadPool *pool,
+                              const char *caller)
+{
+    memset(scan, 0, sizeof(*scan));
+
+    if (img == NULL || img->data == NULL) {
+        fprintf(stderr, "%s: invalid image\n", caller);
+        return 1;
+    }
+
+    if (block_size <= 0) {
+        fprintf(stderr, "%s: block_size must be > 0\n", caller);
+        return 1;
+    }
+
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    if (img->width <= 0 || abs_height <= 0) {
+        fprintf(stderr, "%s: invalid dimensions\n", caller);
+        return 1;
+    }
+
+    scan->img = img;
+    scan->block_size = block_size;
+    scan->contrast_threshold = contrast_threshold;
+    scan->width = img->width;
+    scan->height = abs_height;
+    scan->channel_mask = LUMA_CHANNEL_MASK(1);
+
+    if (block_size > img->width || block_size > abs_height) {
+        return 0;
+    }
+
+    scan->max_row = abs_height - block_size + 1;
+    scan->bands = scan_bands_create(scan->max_row, block_size, pool, &scan->band_count);
+    return scan->bands != NULL ? 0 : 1;
+}
+
+static void parallel_scan_free(ParallelScan *scan)
+{
+    for (int i = 0; i < scan->band_count; ++i) {
+        free(scan->bands[i].positions);
+    }
+    free(scan->bands);
+    scan->bands = NULL;
+    scan->band_count = 0;
+}
+
+int find_low_contrast_positions_parallel(const BmpImage *img,
+                                         int block_size,
+                                         double contrast_threshold,
+                                         StegThreadPool *pool,
+                                         EmbedPosition **positions_out,
+                                         size_t *count_out)
+{
+    assert(positions_out != NULL);
+    assert(count_out != NULL);
+
+    *positions_out = NULL;
+    *count_out = 0;
+
+    ParallelScan scan;
+    if (parallel_scan_init(&scan, img, block_size, contrast_threshold, pool,
+                           "find_low_contrast_positions_parallel") != 0) {
+        return 1;
+    }
+
+    thread_pool_run(pool, scan_band_legacy, &scan, scan.band_count);
+
+    size_t total = 0;
+    for (int i = 0; i < scan.band_count; ++i) {
+        if (scan.bands[i].failed) {
+            parallel_scan_free(&scan);
+            return 1;
+        }
+        total += scan.bands[i].count;
+    }
+
+    EmbedPosition *positions = NULL;
+    if (total > 0) {
+        positions = (EmbedPosition *)malloc(total * sizeof(EmbedPosition));
+        if (!positions) {
+            perror("find_low_contrast_positions_parallel: malloc");
+            parallel_scan_free(&scan);
+            return 1;
+        }
+    }
+
+    size_t count = 0;
+    for (int i = 0; i < scan.band_count; ++i) {
+        if (scan.bands[i].count > 0) {
+            memcpy(positions + count, scan.bands[i].positions,
+                   scan.bands[i].count * sizeof(EmbedPosition));
+            count += scan.bands[i].count;
+        }
+    }
+
+    parallel_scan_free(&scan);
+
+    *positions_out = positions;
+    *count_out = count;
+    return 0;
+}
+
+// Helper: find_low_contrast_bitmap_parallel() for an embedding depth of
+// bits_per_channel.
+static int collect_bitmap_parallel(const BmpImage *img,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int bits_per_channel,
+                                   StegThreadPool *pool,
+                                   StegBitmap *bitmap_out)
+{
+    memset(bitmap_out, 0, sizeof(*bitmap_out));
+
+    ParallelScan scan;
+    if (parallel_scan_init(&scan, img, block_size, contrast_threshold, pool,
+                           "find_low_contrast_bitmap_parallel") != 0) {
+        return 1;
+    }
+    scan.channel_mask = LUMA_CHANNEL_MASK(bits_per_channel);
+
+    size_t pixel_count = (size_t)scan.width * (size_t)scan.height;
+    scan.bits = (uint64_t *)calloc((pixel_count + 63u) / 64u, sizeof(uint64_t));
+    if (!scan.bits) {
+        perror("find_low_contrast_bitmap_parallel: calloc");
+        parallel_scan_free(&scan);
+        return 1;
+    }
+
+    thread_pool_run(pool, scan_band_bitmap, &scan, scan.band_count);
+
+    size_t count = 0;
+    for (int i = 0; i < scan.band_count; ++i) {
+        const ScanBand *band = &scan.bands[i];
+        if (band->failed) {
+            free(scan.bits);
+            parallel_scan_free(&scan);
+            return 1;
+        }
+        scan.bits[band->edge_word[0]] |= band->edge_bits[0];
+        scan.bits[band->edge_word[1]] |= band->edge_bits[1];
+        count += band->count;
+    }
+
+    parallel_scan_free(&scan);
+
+    bitmap_out->width = scan.width;
+    bitmap_out->height = scan.height;
+    bitmap_out->count = count;
+    bitmap_out->bits = scan.bits;
+    return 0;
+}
+
+int find_low_contrast_bitmap_parallel(const BmpImage *img,
+                                      int block_size,
+                                      double contrast_threshold,
+                                      StegThreadPool *pool,
+                                      StegBitmap *bitmap_out)
+{
+    assert(bitmap_out != NULL);
+
+    return collect_bitmap_parallel(img, block_size, contrast_threshold, 1, pool, bitmap_out);
+}
+
+// Device scan.
+//
+// The device classifies every block at once into a max_row * max_col accept
+// map. The few blocks it leaves undecided are settled here with the exact
+// evaluation, then the map is turned into the same positions or bitmap the
+// serial scan produces.
+
+// Helper: classify every block of img on gpu into a malloc()ed accept map of
+// *max_row_out * *max_col_out entries, ties resolved. Returns NULL when the
+// serial scan has to be used instead (no device, unsupported arguments,
+// nothing to scan or any failure).
+static uint8_t *gpu_accept_map(const BmpImage *img,
+                               int block_size,
+                               double contrast_threshold,
+                               StegGpu *gpu,
+                               int32_t *max_row_out,
+                               int32_t *max_col_out)
+{
+    if (gpu == NULL || img == NULL || img->data == NULL || block_size <= 0 ||
+        block_size > GPU_MAX_BLOCK_SIZE || !(contrast_threshold > 0.0)) {
+        return NULL;
+    }
+
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    if (img->width <= 0 || abs_height <= 0 || block_size > img->width ||
+        block_size > abs_height) {
+        return NULL;
+    }
+
+    ContrastScanner scanner;
+    if (contrast_scanner_init(&scanner, img, block_size, contrast_threshold, NULL) != 0) {
+        return NULL;
+    }
+
+    size_t blocks = (size_t)scanner.max_row * (size_t)scanner.max_col;
+    uint8_t *accept = (uint8_t *)malloc(blocks);
+    if (!accept) {
+        perror("find_low_contrast_gpu: malloc");
+        contrast_scanner_free(&scanner);
+        return NULL;
+    }
+
+    if (gpu_classify_blocks(gpu, img, block_size, contrast_threshold,
+                            scanner.channel_mask, accept) != 0) {
+        free(accept);
+        contrast_scanner_free(&scanner);
+        return NULL;
+    }
+
+    for (int32_t br = 0; br < scanner.max_row; ++br) {
+        uint8_t *row = accept + (size_t)br * (size_t)scanner.max_col;
+        for (int32_t bc = 0; bc < scanner.max_col; ++bc) {
+            if (row[bc] == GPU_BLOCK_TIE) {
+                row[bc] = (uint8_t)contrast_scanner_block_exact(&scanner, br, bc);
+            }
+        }
+    }
+
+    *max_row_out = scanner.max_row;
+    *max_col_out = scanner.max_col;
+    contrast_scanner_free(&scanner);
+    return accept;
+}
+
+int find_low_contrast_positions_gpu(const BmpImage *img,
+                                    int block_size,
+                                    double contrast_threshold,
+                                    StegGpu *gpu,
+                                    EmbedPosition **positions_out,
+                                    size_t *count_out)
+{
+    assert(positions_out != NULL);
+    assert(count_out != NULL);
+
+    int32_t max_row = 0;
+    int32_t max_col = 0;
+    uint8_t *accept =
+        gpu_accept_map(img, block_size, contrast_threshold, gpu, &max_row, &max_col);
+    if (accept == NULL) {
+        return find_low_contrast_positions(img, block_size, contrast_threshold,
+                                           positions_out, count_out);
+    }
+
+    *positions_out = NULL;
+    *count_out = 0;
+
+    size_t blocks = (size_t)max_row * (size_t)max_col;
+    size_t accepted = 0;
+    for (size_t i = 0; i < blocks; ++i) {
+        accepted += accept[i];
+    }
+
+    size_t footprint = (size_t)block_size * (size_t)block_size;
+    EmbedPosition *positions = NULL;
+    if (accepted > 0) {
+        positions = (EmbedPosition *)malloc(accepted * footprint * sizeof(EmbedPosition));
+        if (!positions) {
+            perror("find_low_contrast_positions_gpu: malloc");
+            free(accept);
+            return 1;
+        }
+    }
+
+    // Footprints in block raster order, as scan_band_legacy() emits them.
+    size_t count = 0;
+    for (int32_t br = 0; br < max_row; ++br) {
+        const uint8_t *row = accept + (size_t)br * (size_t)max_col;
+        for (int32_t bc = 0; bc < max_col; ++bc) {
+            if (!row[bc]) {
+                continue;
+            }
+            for (int r = 0; r < block_size; ++r) {
+                int base = (br + r) * img->width + bc;
+                for (int c = 0; c < block_size; ++c) {
+                    positions[count++].pixel_index = base + c;
+                }
+            }
+        }
+    }
+
+    free(accept);
+    *positions_out = positions;
+    *count_out = count;
+    return 0;
+}
+
+int find_low_contrast_bitmap_gpu(const BmpImage *img,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 StegGpu *gpu,
+                                 StegBitmap *bitmap_out)
+{
+    assert(bitmap_out != NULL);
+
+    int32_t max_row = 0;
+    int32_t max_col = 0;
+    uint8_t *accept =
+        gpu_accept_map(img, block_size, contrast_threshold, gpu, &max_row, &max_col);
+    if (accept == NULL) {
+        return find_low_contrast_bitmap(img, block_size, contrast_threshold, bitmap_out);
+    }
+
+    memset(bitmap_out, 0, sizeof(*bitmap_out));
+
+    int32_t width = img->width;
+    int32_t height = img->height > 0 ? img->height : -img->height;
+    size_t pixel_count = (size_t)width * (size_t)height;
+    uint64_t *bits = (uint64_t *)calloc((pixel_count + 63u) / 64u, sizeof(uint64_t));
+    CoverageTracker tracker;
+    if (!bits || coverage_tracker_init(&tracker, width, block_size, NULL) != 0) {
+        if (!bits) {
+            perror("find_low_contrast_bitmap_gpu: calloc");
+        }
+        free(bits);
+        free(accept);
+        return 1;
+    }
+
+    size_t count = 0;
+    for (int32_t y = 0; y < height; ++y) {
+        if (y < max_row) {
+            coverage_tracker_add_row(&tracker, y, accept + (size_t)y * (size_t)max_col,
+                                     max_col);
+        }
+        count += coverage_tracker_emit_row(&tracker, y, bits);
+    }
+
+    coverage_tracker_free(&tracker);
+    free(accept);
+
+    bitmap_out->width = width;
+    bitmap_out->height = height;
+    bitmap_out->count = count;
+    bitmap_out->bits = bits;
+    return 0;
+}
+
+// Payload bits live in packed bytes, MSB-first: bit k of the stream is bit
+// 7 - k % 8 of bytes[k / 8]. Every selected pixel carries three bit slots, in
+// R, G, B order (indices 2, 1, 0 in the BGR layout), so slot s is channel
+// 2 - s % 3 of the (s / 3)-th selected pixel. At a depth of d bits per
+// channel each channel carries d slots instead, its low bits from bit d - 1
+// down to bit 0.
+//
+// 32-bit pixels carry the same slots in the same channels; their alpha byte
+// is skipped.
+//
+// SlotCursor walks those slots over a lazy position iterator. It is
+// resumable, so a header can be read and the payload that follows it read on
+// from the same spot in a single pass. Positions are taken a run at a time;
+// at a depth of 1, eight pixels of a run (24 slots) are merged as three
+// 64-bit words, or four of 32-bit pixels. The loops are built once per pixel
+// size (slot_cursor_write_px(), slot_cursor_read_px()), so pixel addressing
+// is a constant step in either.
+typedef struct {
+    unsigned char *data;
+    int32_t stride;
+    int32_t pixel_bytes;  // bmp_pixel_bytes() of the image
+    StegPositionIter *iter;
+    size_t slot_index;    // slots consumed so far
+    unsigned char *px;    // current pixel
+    int channel;          // next channel of *px (2 = R .. 0 = B), -1 = exhausted
+    int bit;              // next bit of that channel (depth - 1 .. 0)
+    int depth;            // bits per channel
+    unsigned char *run_px; // next pixel of the current run
+    int32_t run_left;     // pixels of the run from run_px on
+    int32_t run_row;      // row and column of run_px
+    int32_t run_col;
+    int32_t dirty_begin;  // stored rows [dirty_begin, dirty_end) written to
+    int32_t dirty_end;
+    ContrastRowFn fetch_row; // NULL: rows are in data
+    void *fetch_ctx;
+    StegStats *stats;     // NULL: no instrumentation
+    uint64_t *seen;       // stats only: pixels visited so far (legacy layout)
+} SlotCursor;
+
+static void slot_cursor_init(SlotCursor *c, const BmpImage *img, StegPositionIter *iter)
+{
+    c->data = img->data;
+    c->stride = img->stride;
+    c->pixel_bytes = bmp_pixel_bytes(img);
+    c->iter = iter;
+    c->slot_index = 0;
+    c->px = NULL;
+    c->channel = -1;
+    c->bit = 0;
+    c->depth = iter->bits_per_channel;
+    c->run_px = NULL;
+    c->run_left = 0;
+    c->run_row = 0;
+    c->run_col = 0;
+    c->dirty_begin = 0;
+    c->dirty_end = 0;
+    c->fetch_row = NULL;
+    c->fetch_ctx = NULL;
+    c->stats = iter->stats;
+    c->seen = NULL;
+}
+
+// Helper: fetch the next run of positions. Returns 0 when there is none.
+static int slot_cursor_next_run(SlotCursor *c)
+{
+    int32_t row = 0;
+    int32_t col = 0;
+    int32_t len = 0;
+    if (!position_iter_next_run(c->iter, &row, &col, &len)) {
+        return 0;
+    }
+
+    unsigned char *line = c->fetch_row != NULL
+                              ? (unsigned char *)c->fetch_row(c->fetch_ctx, row)
+                              : c->data + (size_t)row * (size_t)c->stride;
+    c->run_px = line + (size_t)col * (size_t)c->pixel_bytes;
+    c->run_left = len;
+    c->run_row = row;
+    c->run_col = col;
+    return 1;
+}
+
+// Helper: consume n pixels of pixel_bytes bytes of the current run.
+static inline void slot_cursor_take(SlotCursor *c, int32_t n, const size_t pixel_bytes)
+{
+    if (c->stats != NULL) {
+        c->stats->positions_emitted += (uint64_t)n;
+        if (c->seen != NULL) {
+            size_t idx = (size_t)c->run_row * (size_t)c->iter->width + (size_t)c->run_col;
+            for (int32_t i = 0; i < n; ++i, ++idx) {
+                uint64_t bit = (uint64_t)1u << (idx & 63u);
+                c->stats->duplicate_writes += (c->seen[idx >> 6] & bit) != 0;
+                c->seen[idx >> 6] |= bit;
+            }
+        }
+    }
+    c->run_px += (size_t)n * pixel_bytes;
+    c->run_left -= n;
+    c->run_col += n;
+}
+
+// Step to the next selected pixel. Returns 0 when there is none.
+static inline int slot_cursor_next_pixel(SlotCursor *c, const size_t pixel_bytes)
+{
+    if (c->run_left == 0 && !slot_cursor_next_run(c)) {
+        return 0;
+    }
+
+    c->px = c->run_px;
+    slot_cursor_take(c, 1, pixel_bytes);
+    c->channel = 2;
+    c->bit = c->depth - 1;
+    return 1;
+}
+
+// Helper: record that the current run's row was written to.
+static inline void slot_cursor_mark_dirty(SlotCursor *c)
+{
+    int32_t row = c->run_row;
+    if (c->dirty_begin >= c->dirty_end) {
+        c->dirty_begin = row;
+        c->dirty_end = row + 1;
+    } else if (row < c->dirty_begin) {
+        c->dirty_begin = row;
+    } else if (row >= c->dirty_end) {
+        c->dirty_end = row + 1;
+    }
+}
+
+// Helper: move past the slot just used.
+static inline void slot_cursor_advance(SlotCursor *c)
+{
+    if (--c->bit < 0) {
+        c->bit = c->depth - 1;
+        --c->channel;
+    }
+    ++c->slot_index;
+}
+
+// Word-at-a-time helpers for eight pixels of a run at a depth of 1.
+//
+// The 24 slots of eight pixels are channel bytes 2, 1, 0, 5, 4, 3, ... in
+// memory. Read as a 24-bit value with slot 0 as the top bit, the slots of
+// pixel i are bits 23 - 3i .. 21 - 3i (R, G, B order); memory byte j holds
+// bit j of the same value with its eight triplets in reverse order.
+//
+// Eight 32-bit pixels are four words of two pixels whose bytes 3 and 7 are
+// alpha: each word holds six of those bits, channel bytes j in memory order
+// once the alpha bytes are left out.
+#define SLOT_LSB_MASK 0x0101010101010101ull
+#define SLOT_BGRA_LSB_MASK 0x0001010100010101ull
+
+static inline uint64_t load_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void store_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+// Reverse the order of the eight 3-bit groups of a 24-bit value.
+static inline uint32_t reverse_triplets24(uint32_t v)
+{
+    v = ((v & 0xFFFu) << 12) | (v >> 12);
+    v = ((v & 0x03F03Fu) << 6) | ((v >> 6) & 0x03F03Fu);
+    v = ((v & 0x1C71C7u) << 3) | ((v >> 3) & 0x1C71C7u);
+    return v;
+}
+
+// Bit i of x (8 bits) into the LSB of byte i of the result.
+static inline uint64_t spread_lsb8(uint32_t x)
+{
+    uint64_t low = ((uint64_t)(x & 0x7Fu) * 0x0002040810204081ull) & SLOT_LSB_MASK;
+    return low | ((uint64_t)(x >> 7) << 56);
+}
+
+// The LSB of byte i of w as bit i of the result.
+static inline uint32_t gather_lsb8(uint64_t w)
+{
+    return (uint32_t)(((w & SLOT_LSB_MASK) * 0x0102040810204080ull) >> 56);
+}
+
+// The 24 stream bits of packed bytes starting at bit `bit`, first bit on top.
+static inline uint32_t get_bits24(const uint8_t *bytes, size_t bit)
+{
+    const uint8_t *b = bytes + (bit >> 3);
+    unsigned off = (unsigned)(bit & 7u);
+    uint32_t v = ((uint32_t)b[0] << 16) | ((uint32_t)b[1] << 8) | b[2];
+    if (off != 0) {
+        v = ((v << off) | ((uint32_t)b[3] >> (8u - off))) & 0xFFFFFFu;
+    }
+    return v;
+}
+
+// OR the 24-bit v into zeroed packed bytes at bit `bit`, first bit on top.
+static inline void put_bits24(uint8_t *bytes, size_t bit, uint32_t v)
+{
+    uint8_t *b = bytes + (bit >> 3);
+    unsigned off = (unsigned)(bit & 7u);
+    if (off == 0) {
+        b[0] |= (uint8_t)(v >> 16);
+        b[1] |= (uint8_t)(v >> 8);
+        b[2] |= (uint8_t)v;
+        return;
+    }
+    uint32_t t = v << (8u - off);
+    b[0] |= (uint8_t)(t >> 24);
+    b[1] |= (uint8_t)(t >> 16);
+    b[2] |= (uint8_t)(t >> 8);
+    b[3] |= (uint8_t)t;
+}
+
+// The slot bits of one word of eight pixels of pixel_bytes bytes (8 of them,
+// or 6 without the alpha bytes) in memory order, and back.
+static inline uint32_t slot_word_gather(uint64_t w, const size_t pixel_bytes)
+{
+    uint32_t x = gather_lsb8(w);
+    return pixel_bytes == 4u ? (x & 0x07u) | ((x >> 1) & 0x38u) : x;
+}
+
+static inline uint64_t slot_word_spread(uint32_t x, const size_t pixel_bytes)
+{
+    return spread_lsb8(pixel_bytes == 4u ? (x & 0x07u) | ((x & 0x38u) << 1) : x);
+}
+
+// The 24 slot bits of eight pixels at p, memory byte j as bit j. Eight
+// pixels are pixel_bytes words.
+static inline uint32_t slot_words_gather(const unsigned char *p, const size_t pixel_bytes)
+{
+    const unsigned word_bits = pixel_bytes == 4u ? 6u : 8u;
+    uint32_t v = 0;
+    for (size_t k = 0; k < pixel_bytes; ++k) {
+        v |= slot_word_gather(load_le64(p + 8u * k), pixel_bytes) << (word_bits * k);
+    }
+    return v;
+}
+
+// Helper: whether the next 24 slots are eight whole pixels of the current
+// run that can go through the word path.
+static inline int slot_cursor_word_ready(const SlotCursor *c, size_t bits_left)
+{
+    return c->depth == 1 && c->channel < 0 && c->run_left >= 8 && bits_left >= 24u;
+}
+
+// Helper: slot_cursor_write() for pixels of pixel_bytes bytes, a constant.
+static inline size_t slot_cursor_write_px(SlotCursor *c,
+                                          const uint8_t *bytes,
+                                          size_t total_bits,
+                                          uint8_t *saved,
+                                          const size_t pixel_bytes)
+{
+    const unsigned word_bits = pixel_bytes == 4u ? 6u : 8u;
+    const uint64_t lsb_mask = pixel_bytes == 4u ? SLOT_BGRA_LSB_MASK : SLOT_LSB_MASK;
+    size_t bit_index = 0;
+    while (bit_index < total_bits) {
+        if (slot_cursor_word_ready(c, total_bits - bit_index)) {
+            unsigned char *p = c->run_px;
+            uint64_t w[4];
+            uint64_t n[4];
+            uint64_t changed = 0;
+            if (saved != NULL) {
+                put_bits24(saved, c->slot_index,
+                           reverse_triplets24(slot_words_gather(p, pixel_bytes)));
+            }
+            uint32_t v = reverse_triplets24(get_bits24(bytes, bit_index));
+            for (size_t k = 0; k < pixel_bytes; ++k) {
+                uint32_t x = (v >> (word_bits * k)) & ((1u << word_bits) - 1u);
+                w[k] = load_le64(p + 8u * k);
+                n[k] = (w[k] & ~lsb_mask) | slot_word_spread(x, pixel_bytes);
+                changed |= n[k] ^ w[k];
+            }
+            if (changed != 0) {
+                for (size_t k = 0; k < pixel_bytes; ++k) {
+                    store_le64(p + 8u * k, n[k]);
+                }
+                slot_cursor_mark_dirty(c);
+            }
+            slot_cursor_take(c, 8, pixel_bytes);
+            c->slot_index += 24u;
+            bit_index += 24u;
+            continue;
+        }
+        if (c->channel < 0 && !slot_cursor_next_pixel(c, pixel_bytes)) {
+            break;
+        }
+        unsigned bit = (bytes[bit_index >> 3] >> (7u - (bit_index & 7u))) & 1u;
+        unsigned shift = (unsigned)c->bit;
+        unsigned char old = c->px[c->channel];
+        if (saved != NULL) {
+            size_t s = c->slot_index;
+            saved[s >> 3] |= (uint8_t)(((old >> shift) & 1u) << (7u - (s & 7u)));
+        }
+        unsigned char value = old;
+        value &= (unsigned char)~(1u << shift);   // clear the slot bit
+        value |= (unsigned char)(bit << shift);   // set it
+        if (value != old) {
+            c->px[c->channel] = value;
+            slot_cursor_mark_dirty(c);
+        }
+        slot_cursor_advance(c);
+        ++bit_index;
+    }
+    return bit_index;
+}
+
+// Write total_bits bits from packed `bytes` into the next slots. When saved
+// is not NULL, the previous value of slot s is stored as bit s of saved
+// (which must be zeroed). Channel bytes that already hold the right bits are
+// not stored to, so a copy-on-write mapping only copies the pages that
+// really change. Returns the number of bits written (less than total_bits
+// only when slots run out).
+static size_t slot_cursor_write(SlotCursor *c,
+                                const uint8_t *bytes,
+                                size_t total_bits,
+                                uint8_t *saved)
+{
+    if (c->pixel_bytes == 4) {
+        return slot_cursor_write_px(c, bytes, total_bits, saved, 4u);
+    }
+    return slot_cursor_write_px(c, bytes, total_bits, saved, 3u);
+}
+
+// Helper: slot_cursor_read() for pixels of pixel_bytes bytes, a constant.
+static inline size_t slot_cursor_read_px(SlotCursor *c,
+                                         uint8_t *bytes,
+                                         size_t total_bits,
+                                         const size_t pixel_bytes)
+{
+    size_t bit_index = 0;
+    while (bit_index < total_bits) {
+        if (slot_cursor_word_ready(c, total_bits - bit_index)) {
+            uint32_t v = slot_words_gather(c->run_px, pixel_bytes);
+            put_bits24(bytes, bit_index, reverse_triplets24(v));
+            slot_cursor_take(c, 8, pixel_bytes);
+            c->slot_index += 24u;
+            bit_index += 24u;
+            continue;
+        }
+        if (c->channel < 0 && !slot_cursor_next_pixel(c, pixel_bytes)) {
+            break;
+        }
+        unsigned bit = (c->px[c->channel] >> (unsigned)c->bit) & 1u;
+        bytes[bit_index >> 3] |= (uint8_t)(bit << (7u - (bit_index & 7u)));
+        slot_cursor_advance(c);
+        ++bit_index;
+    }
+    return bit_index;
+}
+
+// Read total_bits bits from the next slots into packed `bytes`, which must
+// be zeroed. Returns the number of bits read.
+static size_t slot_cursor_read(SlotCursor *c, uint8_t *bytes, size_t total_bits)
+{
+    if (c->pixel_bytes == 4) {
+        return slot_cursor_read_px(c, bytes, total_bits, 4u);
+    }
+    return slot_cursor_read_px(c, bytes, total_bits, 3u);
+}
+
+// Helper: drain the cursor and return the total number of slots it has.
+static size_t slot_cursor_count_slots(SlotCursor *c)
+{
+    size_t depth = (size_t)c->depth;
+    size_t slots = c->slot_index +
+                   (c->channel >= 0 ? (size_t)c->channel * depth + (size_t)c->bit + 1u : 0u) +
+                   (size_t)c->run_left * 3u * depth;
+    int32_t row = 0;
+    int32_t col = 0;
+    int32_t len = 0;
+    while (position_iter_next_run(c->iter, &row, &col, &len)) {
+        slots += (size_t)len * 3u * depth;
+    }
+    c->channel = -1;
+    c->run_left = 0;
+    return slots;
+}
+
+// Helper: drop the positions up to and including pixel (row, col) in raster
+// order, so that the next slot is in the first selected pixel after it.
+static void slot_cursor_skip_past(SlotCursor *c, int32_t row, int32_t col)
+{
+    for (;;) {
+        if (c->run_left == 0 && !slot_cursor_next_run(c)) {
+            return;
+        }
+        if (c->run_row > row) {
+            return;
+        }
+        if (c->run_row == row) {
+            // Pixels of the run up to col.
+            int32_t n = col + 1 - c->run_col;
+            if (n < c->run_left) {
+                if (n > 0) {
+                    c->run_px += (size_t)n * (size_t)c->pixel_bytes;
+                    c->run_left -= n;
+                    c->run_col += n;
+                }
+                return;
+            }
+        }
+        c->run_left = 0;
+    }
+}
+
+// Parallel embed and extract.
+//
+// With the whole selection known, every slot of the payload stream has a
+// fixed place: slot s is in the (s / (3 * depth))-th selected pixel. The
+// stream is cut into ranges of selected pixels that start on a multiple of
+// eight, so every range starts on a stream byte too (eight pixels carry
+// 3 * depth bytes) and no channel byte is shared by two ranges. Each task
+// seeks its own iterator to the first pixel of its range and runs a slot
+// cursor over it; extracted message bytes land straight in the output
+// buffer.
+
+// Smaller payloads go through the lazy serial cursor, which also only scans
+// as many rows as they need.
+#define PARALLEL_SLOTS_MIN_BITS ((size_t)1u << 20)
+// Ranges per thread, and the fewest selected pixels worth a task.
+#define PARALLEL_SLOTS_PER_THREAD 4
+#define PARALLEL_SLOTS_MIN_PIXELS ((size_t)1u << 16)
+
+typedef struct {
+    size_t first_pixel;  // selected pixels [first_pixel, end_pixel)
+    size_t end_pixel;
+    StegPositionIter iter; // set up front, so a task cannot fail halfway
+    int32_t row;         // row of first_pixel
+    size_t row_skip;     // selected pixels of that row before first_pixel
+    int failed;
+    int32_t dirty_begin; // encode: stored rows written to
+    int32_t dirty_end;
+} SlotRange;
+
+typedef struct {
+    const BmpImage *img;    // written through by an embed
+    const StegBitmap *selection;
+    int depth;
+    const uint8_t *header;  // stream bytes [0, header_len)
+    size_t header_len;
+    const uint8_t *message; // encode: stream bytes from header_len on
+    uint8_t *out;           // extract: message bytes, zeroed
+    size_t stream_len;      // bytes
+    SlotRange *ranges;
+    int range_count;
+    int32_t dirty_begin;    // embed: stored rows written to, all ranges
+    int32_t dirty_end;
+} ParallelSlots;
+
+// Helper: whether a payload of stream_bits is worth cutting into ranges.
+static int parallel_slots_wanted(StegThreadPool *pool, size_t stream_bits)
+{
+    return pool != NULL && steg_thread_pool_size(pool) > 1 &&
+           stream_bits >= PARALLEL_SLOTS_MIN_BITS;
+}
+
+// Helper: cut the ps->stream_len bytes of the stream into ranges over
+// ps->selection, which must hold them all. Returns 0 on success; on failure
+// nothing needs releasing.
+static int parallel_slots_init(ParallelSlots *ps, StegThreadPool *pool)
+{
+    size_t slots_per_pixel = 3u * (size_t)ps->depth;
+    size_t pixels = (ps->stream_len * 8u + slots_per_pixel - 1u) / slots_per_pixel;
+
+    size_t ranges = (size_t)steg_thread_pool_size(pool) * PARALLEL_SLOTS_PER_THREAD;
+    if (ranges > pixels / PARALLEL_SLOTS_MIN_PIXELS) {
+        ranges = pixels / PARALLEL_SLOTS_MIN_PIXELS;
+    }
+    if (ranges < 1) {
+        ranges = 1;
+    }
+
+    ps->ranges = (SlotRange *)calloc(ranges, sizeof(SlotRange));
+    if (!ps->ranges) {
+        perror("steg_parallel_slots: calloc");
+        return 1;
+    }
+    ps->range_count = (int)ranges;
+
+    // One pass over the rows finds the row of every range start.
+    const StegBitmap *sel = ps->selection;
+    size_t before = 0;   // selected pixels above row y
+    int32_t y = 0;
+    size_t row_count = bitmap_count_range(sel->bits, 0, (size_t)sel->width);
+    for (size_t i = 0; i < ranges; ++i) {
+        SlotRange *range = &ps->ranges[i];
+        range->first_pixel = pixels * i / ranges / 8u * 8u;
+        range->end_pixel = i + 1 == ranges ? pixels : pixels * (i + 1) / ranges / 8u * 8u;
+        while (before + row_count <= range->first_pixel) {
+            before += row_count;
+            ++y;
+            size_t base = (size_t)y * (size_t)sel->width;
+            row_count = bitmap_count_range(sel->bits, base, base + (size_t)sel->width);
+        }
+        range->row = y;
+        range->row_skip = range->first_pixel - before;
+
+        if (position_iter_init_selection(&range->iter, sel, NULL) != 0) {
+            for (size_t j = 0; j < i; ++j) {
+                position_iter_release(&ps->ranges[j].iter);
+            }
+            free(ps->ranges);
+            ps->ranges = NULL;
+            return 1;
+        }
+        position_iter_set_depth(&range->iter, ps->depth);
+    }
+    return 0;
+}
+
+// Helper: one range of a parallel embed (ps->message) or extract (ps->out).
+static void parallel_slots_task(ParallelSlots *ps, int task, int embed)
+{
+    SlotRange *range = &ps->ranges[task];
+    size_t slots_per_pixel = 3u * (size_t)ps->depth;
+    size_t begin = range->first_pixel * slots_per_pixel / 8u;
+    size_t end = task + 1 == ps->range_count ? ps->stream_len
+                                             : range->end_pixel * slots_per_pixel / 8u;
+    if (begin >= end) {
+        return;
+    }
+
+    position_iter_seek(&range->iter, range->row, range->row_skip);
+    SlotCursor cursor;
+    slot_cursor_init(&cursor, ps->img, &range->iter);
+
+    // The range may start in the header; the message follows it.
+    size_t done = 0;
+    size_t want = 0;
+    if (begin < ps->header_len) {
+        size_t n = (end < ps->header_len ? end : ps->header_len) - begin;
+        uint8_t skipped[PAYLOAD_MAX_HEADER_BYTES];
+        memset(skipped, 0, sizeof(skipped));
+        done += embed ? slot_cursor_write(&cursor, ps->header + begin, n * 8u, NULL)
+                      : slot_cursor_read(&cursor, skipped, n * 8u);
+        want += n * 8u;
+        begin += n;
+    }
+    if (begin < end && done == want) {
+        size_t offset = begin - ps->header_len;
+        size_t n = end - begin;
+        done += embed ? slot_cursor_write(&cursor, ps->message + offset, n * 8u, NULL)
+                      : slot_cursor_read(&cursor, ps->out + offset, n * 8u);
+        want += n * 8u;
+    }
+
+    range->failed = done != want;
+    range->dirty_begin = cursor.dirty_begin;
+    range->dirty_end = cursor.dirty_end;
+}
+
+static void parallel_embed_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    parallel_slots_task((ParallelSlots *)ctx, task, 1);
+}
+
+static void parallel_extract_task(void *ctx, int task, int thread)
+{
+    (void)thread;
+    parallel_slots_task((ParallelSlots *)ctx, task, 0);
+}
+
+// Helper: run an initialised ParallelSlots on pool and tidy up. Returns 0
+// when every range went through.
+static int parallel_slots_run(ParallelSlots *ps, StegThreadPool *pool, int embed)
+{
+    thread_pool_run(pool, embed ? parallel_embed_task : parallel_extract_task, ps,
+                    ps->range_count);
+
+    int failed = 0;
+    for (int i = 0; i < ps->range_count; ++i) {
+        SlotRange *range = &ps->ranges[i];
+        position_iter_release(&range->iter);
+        failed |= range->failed;
+        if (range->dirty_begin >= range->dirty_end) {
+            continue;
+        }
+        if (ps->dirty_begin >= ps->dirty_end || range->dirty_begin < ps->dirty_begin) {
+            ps->dirty_begin = range->dirty_begin;
+        }
+        if (range->dirty_end > ps->dirty_end) {
+            ps->dirty_end = range->dirty_end;
+        }
+    }
+    free(ps->ranges);
+    ps->ranges = NULL;
+    return failed;
+}
+
+// Helper: the parallel path of encode_message(), for a tagged layout
+// without compression. The whole selection is needed up front (a parallel
+// scan when selection is NULL), which also settles capacity before anything
+// is written, so no undo log is kept.
+static int encode_message_parallel(BmpImage *img,
+                                   const uint8_t *header,
+                                   size_t header_len,
+                                   const uint8_t *message,
+                                   size_t message_len,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int bits_per_channel,
+                                   const StegBitmap *selection,
+                                   StegThreadPool *pool,
+                                   StegStats *stats)
+{
+    double start = stats != NULL ? stats_now() : 0.0;
+    StegBitmap scanned;
+    memset(&scanned, 0, sizeof(scanned));
+    if (selection == NULL) {
+        if (collect_bitmap_parallel(img, block_size, contrast_threshold, bits_per_channel,
+                                    pool, &scanned) != 0) {
+            return 1;
+        }
+        selection = &scanned;
+    }
+    if (stats != NULL) {
+        double now = stats_now();
+        stats->scan_seconds += now - start;
+        start = now;
+    }
+
+    size_t required_bits = (header_len + message_len) * 8u;
+    size_t capacity_bits = selection->count * 3u * (size_t)bits_per_channel;
+    if (capacity_bits < required_bits) {
+        steg_bitmap_free(&scanned);
+        fprintf(stderr, "steg_encode_message: capacity insufficient "
+                        "(have %zu bits, need %zu bits)\n",
+                capacity_bits, required_bits);
+        return -1;
+    }
+
+    ParallelSlots ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.img = img;
+    ps.selection = selection;
+    ps.depth = bits_per_channel;
+    ps.header = header;
+    ps.header_len = header_len;
+    ps.message = message;
+    ps.stream_len = header_len + message_len;
+    int rc = parallel_slots_init(&ps, pool) != 0 || parallel_slots_run(&ps, pool, 1) != 0;
+    steg_bitmap_free(&scanned);
+    bmp_mark_dirty(img, ps.dirty_begin, ps.dirty_end);
+
+    if (stats != NULL && rc == 0) {
+        size_t slots_per_pixel = 3u * (size_t)bits_per_channel;
+        stats->embed_seconds += stats_now() - start;
+        stats->bits_written += required_bits;
+        stats->positions_emitted += (required_bits + slots_per_pixel - 1u) / slots_per_pixel;
+    }
+    return rc;
+}
+
+// Compressed output on its way into the slots.
+typedef struct {
+    SlotCursor *cursor;
+    uint8_t *saved;      // undo log, see slot_cursor_write()
+    size_t written;      // bits
+} EmbedSink;
+
+// Helper: CodecSinkFn writing straight into the slots, stopping the codec
+// as soon as they run out.
+static int embed_sink(void *ctx, const uint8_t *data, size_t len)
+{
+    EmbedSink *sink = (EmbedSink *)ctx;
+    size_t bits = slot_cursor_write(sink->cursor, data, len * 8u, sink->saved);
+    sink->written += bits;
+    return bits == len * 8u ? 0 : 1;
+}
+
+// Helper: the encoder behind the public entry points. iter is storage for
+// the position iterator, arena (may be NULL) supplies its scratch and *saved
+// is a reusable buffer (capacity in bytes) for the undo log. When stats is
+// not NULL, *seen (capacity in bytes) tracks visited pixels of the legacy
+// layout to count duplicate writes. A codec other than STEG_CODEC_NONE
+// stores the message compressed, which needs STEG_FORMAT_COMPACT. pool (may
+// be NULL) embeds a large uncompressed tagged payload in parallel ranges.
+static int encode_message(BmpImage *img,
+                          const uint8_t *message,
+                          size_t message_len,
+                          int block_size,
+                          double contrast_threshold,
+                          int format,
+                          int bits_per_channel,
+                          int codec,
+                          const StegBitmap *selection,
+                          StegPositionIter *iter,
+                          StegArena *arena,
+                          StegThreadPool *pool,
+                          uint8_t **saved_buf,
+                          size_t *saved_cap,
+                          StegStats *stats,
+                          uint64_t **seen_buf,
+                          size_t *seen_cap)
+{
+    assert(img != NULL);
+
+    double start = stats != NULL ? stats_now() : 0.0;
+    if (stats != NULL) {
+        ++stats->calls;
+    }
+
+    if (img->data == NULL) {
+        fprintf(stderr, "steg_encode_message: invalid image data\n");
+        return 1;
+    }
+
+    if (message == NULL && message_len > 0) {
+        fprintf(stderr, "steg_encode_message: message is NULL but length > 0\n");
+        return 1;
+    }
+
+    if (format != STEG_FORMAT_LEGACY && format != STEG_FORMAT_BITMAP &&
+        format != STEG_FORMAT_COMPACT) {
+        fprintf(stderr, "steg_encode_message: unsupported format %d\n", format);
+        return 1;
+    }
+
+    if (bits_per_channel < 1 || bits_per_channel > STEG_MAX_BITS_PER_CHANNEL) {
+        fprintf(stderr, "steg_encode_message: bits_per_channel must be 1..%d\n",
+                STEG_MAX_BITS_PER_CHANNEL);
+        return 1;
+    }
+
+    if (bits_per_channel > 1 && format == STEG_FORMAT_LEGACY) {
+        fprintf(stderr, "steg_encode_message: multi-bit payloads need a tagged layout\n");
+        return 1;
+    }
+
+    if (codec != STEG_CODEC_NONE) {
+        if (codec != STEG_CODEC_LZ4 && codec != STEG_CODEC_ZSTD) {
+            fprintf(stderr, "steg_encode_message: unsupported codec %d\n", codec);
+            return 1;
+        }
+        if (format != STEG_FORMAT_COMPACT) {
+            fprintf(stderr, "steg_encode_message: compressed payloads need the compact layout\n");
+            return 1;
+        }
+        if (!codec_available(codec)) {
+            fprintf(stderr, "steg_encode_message: codec %s is not available\n",
+                    codec_name(codec));
+            return 1;
+        }
+    }
+
+    // Legacy:     [length(4 bytes, little-endian)] [message bytes]
+    // Bitmap:     [format tag] [length(4 bytes, little-endian)] [check] [message bytes]
+    // Compact:    [format tag] [length(varint, 1-5 bytes)] [check] [message bytes]
+    // Compressed: [format tag] [codec] [length(varint, 1-5 bytes)] [check] [frame]
+    uint8_t header[PAYLOAD_MAX_HEADER_BYTES];
+    size_t header_len =
+        payload_header_encode(header, format, codec, bits_per_channel, (uint32_t)message_len);
+    size_t header_bits = header_len * 8u;
+    size_t message_bits = message_len * 8u;
+    size_t required_bits = header_bits + message_bits;
+    // The compressed size is only known once the frame is written.
+    size_t payload_len =
+        codec != STEG_CODEC_NONE ? codec_compress_bound(codec, message_len) : message_len;
+
+    if (format != STEG_FORMAT_LEGACY && codec == STEG_CODEC_NONE &&
+        parallel_slots_wanted(pool, required_bits)) {
+        return encode_message_parallel(img, header, header_len, message, message_len,
+                                       block_size, contrast_threshold, bits_per_channel,
+                                       selection, pool, stats);
+    }
+
+    if (position_iter_begin(iter, img, block_size, contrast_threshold, format,
+                            bits_per_channel, selection, arena) != 0) {
+        return 1;
+    }
+
+    // Positions are generated only as far as the payload reaches. The
+    // previous LSBs are kept so the image can be put back untouched if the
+    // cover turns out to be too small.
+    if (scratch_reserve((void **)saved_buf, saved_cap, header_len + payload_len,
+                        "steg_encode_message") != 0) {
+        position_iter_release(iter);
+        return 1;
+    }
+    uint8_t *saved = *saved_buf;
+    memset(saved, 0, header_len + payload_len);
+
+    position_iter_set_stats(iter, stats);
+    SlotCursor cursor;
+    slot_cursor_init(&cursor, img, iter);
+
+    if (stats != NULL && format == STEG_FORMAT_LEGACY) {
+        size_t seen_size = ((size_t)iter->width * (size_t)iter->height + 63u) / 64u * 8u;
+        if (scratch_reserve((void **)seen_buf, seen_cap, seen_size,
+                            "steg_encode_message") != 0) {
+            position_iter_release(iter);
+            return 1;
+        }
+        memset(*seen_buf, 0, seen_size);
+        cursor.seen = *seen_buf;
+    }
+
+    double scan_before = 0.0;
+    if (stats != NULL) {
+        double now = stats_now();
+        stats->setup_seconds += now - start;
+        start = now;
+        scan_before = stats->scan_seconds;
+    }
+
+    // Header and message are embedded straight from their packed bytes; the
+    // message simply starts at the slot right after the header. A compressed
+    // message goes in as the codec hands out its frame, one staging buffer
+    // at a time.
+    int codec_rc = 0;
+    size_t written = slot_cursor_write(&cursor, header, header_bits, saved);
+    if (written == header_bits && codec != STEG_CODEC_NONE) {
+        EmbedSink sink = {&cursor, saved, 0};
+        codec_rc = codec_compress(codec, message, message_len, embed_sink, &sink);
+        written += sink.written;
+        required_bits = codec_rc == 0 ? written : written + 1u;
+    } else if (written == header_bits && message_bits > 0) {
+        written += slot_cursor_write(&cursor, message, message_bits, saved);
+    }
+
+    if (stats != NULL) {
+        // Blocks are scanned lazily while writing; that time is scan time.
+        stats->embed_seconds += stats_now() - start - (stats->scan_seconds - scan_before);
+        stats->bits_written += written;
+    }
+
+    if (written < required_bits || codec_rc > 0) {
+        // Capacity is insufficient: restore the image and return -1.
+        size_t capacity_bits = slot_cursor_count_slots(&cursor);
+        position_iter_release(iter);
+
+        // Same reservation as before, so this never allocates.
+        int rc = position_iter_begin(iter, img, block_size, contrast_threshold, format,
+                                     bits_per_channel, selection, arena);
+        if (rc == 0) {
+            slot_cursor_init(&cursor, img, iter);
+            slot_cursor_write(&cursor, saved, written, NULL);
+            position_iter_release(iter);
+        }
+
+        if (codec_rc > 0) {
+            fprintf(stderr, "steg_encode_message: %s compression failed\n", codec_name(codec));
+            return 1;
+        }
+        if (codec != STEG_CODEC_NONE) {
+            fprintf(stderr, "steg_encode_message: capacity insufficient "
+                            "(have %zu bits, compressed payload needs more)\n",
+                    capacity_bits);
+        } else {
+            fprintf(stderr, "steg_encode_message: capacity insufficient "
+                            "(have %zu bits, need %zu bits)\n",
+                    capacity_bits, required_bits);
+        }
+        return rc == 0 ? -1 : 1;
+    }
+
+    // Lets bmp_save_in_place() write back only the rows that changed.
+    bmp_mark_dirty(img, cursor.dirty_begin, cursor.dirty_end);
+
+    position_iter_release(iter);
+    return 0;
+}
+
+int steg_encode_message(BmpImage *img,
+                        const uint8_t *message,
+                        size_t message_len,
+                        int block_size,
+                        double contrast_threshold)
+{
+    return steg_encode_message_format(img, message, message_len,
+                                      block_size, contrast_threshold,
+                                      STEG_FORMAT_COMPACT);
+}
+
+int steg_encode_message_format(BmpImage *img,
+                               const uint8_t *message,
+                               size_t message_len,
+                               int block_size,
+                               double contrast_threshold,
+                               int format)
+{
+    StegPositionIter iter;
+    uint8_t *saved = NULL;
+    size_t saved_cap = 0;
+    int rc = encode_message(img, message, message_len, block_size, contrast_threshold,
+                            format, 1, STEG_CODEC_NONE, NULL, &iter, NULL, NULL,
+                            &saved, &saved_cap, NULL, NULL, NULL);
+    free(saved);
+    return rc;
+}
+
+int steg_encode_message_depth(BmpImage *img,
+                              const uint8_t *message,
+                              size_t message_len,
+                              int block_size,
+                              double contrast_threshold,
+                              int bits_per_channel)
+{
+    return steg_encode_message_compressed(img, message, message_len, block_size,
+                                          contrast_threshold, bits_per_channel,
+                                          STEG_CODEC_NONE);
+}
+
+int steg_encode_message_compressed(BmpImage *img,
+                                   const uint8_t *message,
+                                   size_t message_len,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int bits_per_channel,
+                                   int codec)
+{
+    StegPositionIter iter;
+    uint8_t *saved = NULL;
+    size_t saved_cap = 0;
+    int rc = encode_message(img, message, message_len, block_size, contrast_threshold,
+                            STEG_FORMAT_COMPACT, bits_per_channel, codec, NULL, &iter, NULL,
+                            NULL, &saved, &saved_cap, NULL, NULL, NULL);
+    free(saved);
+    return rc;
+}
+
+// Helper: the adaptive encoder behind the public entry points. iter is
+// storage for the position iterators, arena (may be NULL) supplies their
+// scratch and *saved is a reusable buffer (capacity in bytes) for the undo
+// log.
+static int encode_message_adaptive(BmpImage *img,
+                                   const uint8_t *message,
+                                   size_t message_len,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int bits_per_channel,
+                                   StegPositionIter *iter,
+                                   StegArena *arena,
+                                   uint8_t **saved_buf,
+                                   size_t *saved_cap,
+                                   StegStats *stats,
+                                   double *threshold_out)
+{
+    assert(img != NULL);
+
+    double start = stats != NULL ? stats_now() : 0.0;
+    double scan_before = 0.0;
+    if (stats != NULL) {
+        ++stats->calls;
+        scan_before = stats->scan_seconds;
+    }
+
+    if (img->data == NULL) {
+        fprintf(stderr, "steg_encode_message_adaptive: invalid image data\n");
+        return 1;
+    }
+
+    if (message == NULL && message_len > 0) {
+        fprintf(stderr, "steg_encode_message_adaptive: message is NULL but length > 0\n");
+        return 1;
+    }
+
+    if (bits_per_channel < 1 || bits_per_channel > STEG_MAX_BITS_PER_CHANNEL) {
+        fprintf(stderr, "steg_encode_message_adaptive: bits_per_channel must be 1..%d\n",
+                STEG_MAX_BITS_PER_CHANNEL);
+        return 1;
+    }
+
+    // Adaptive: [format tag] [threshold(8 bytes)] [length(varint, 1-5 bytes)]
+    // [check] at contrast_threshold, then [message bytes] at the threshold
+    // found.
+    // The undo log holds the header slots, then the message slots.
+    uint8_t header[PAYLOAD_MAX_HEADER_BYTES];
+    size_t header_len = payload_header_size(STEG_FORMAT_ADAPTIVE, (uint32_t)message_len);
+    size_t header_bits = header_len * 8u;
+    size_t message_bits = message_len * 8u;
+    if (scratch_reserve((void **)saved_buf, saved_cap, header_len + message_len,
+                        "steg_encode_message_adaptive") != 0) {
+        return 1;
+    }
+    uint8_t *saved = *saved_buf;
+    memset(saved, 0, header_len + message_len);
+
+    // Where the header ends does not depend on the threshold it holds;
+    // reading its slots also keeps their bits for the undo log.
+    if (position_iter_begin(iter, img, block_size, contrast_threshold, STEG_FORMAT_COMPACT,
+                            bits_per_channel, NULL, arena) != 0) {
+        return 1;
+    }
+    position_iter_set_stats(iter, stats);
+    SlotCursor cursor;
+    slot_cursor_init(&cursor, img, iter);
+    size_t header_slots = slot_cursor_read(&cursor, saved, header_bits);
+    int32_t after_row = cursor.run_row;
+    int32_t after_col = cursor.run_col - 1;
+    position_iter_release(iter);
+    if (header_slots != header_bits) {
+        fprintf(stderr, "steg_encode_message_adaptive: capacity insufficient "
+                        "(have %zu bits at threshold %g, the header needs %zu bits)\n",
+                header_slots, contrast_threshold, header_bits);
+        return -1;
+    }
+
+    double threshold = 0.0;
+    int rc = adaptive_find_threshold(img, block_size, bits_per_channel, after_row, after_col,
+                                     message_bits, stats, &threshold);
+    if (rc != 0) {
+        if (rc == -1) {
+            fprintf(stderr, "steg_encode_message_adaptive: capacity insufficient "
+                            "(need %zu bits even with every block selected)\n",
+                    message_bits);
+        }
+        return rc == -1 ? -1 : 1;
+    }
+
+    if (stats != NULL) {
+        // The header slots and the search are scan time.
+        double now = stats_now();
+        stats->setup_seconds += now - start - (stats->scan_seconds - scan_before);
+        start = now;
+        scan_before = stats->scan_seconds;
+    }
+
+    // The message first: the search makes the same selection as this scan,
+    // so it fits, but if it does not the header is not written at all.
+    uint8_t *message_saved = saved + header_len;
+    if (position_iter_begin(iter, img, block_size, threshold, STEG_FORMAT_COMPACT,
+                            bits_per_channel, NULL, arena) != 0) {
+        return 1;
+    }
+    position_iter_set_stats(iter, stats);
+    slot_cursor_init(&cursor, img, iter);
+    slot_cursor_skip_past(&cursor, after_row, after_col);
+    size_t written = message_bits > 0
+                         ? slot_cursor_write(&cursor, message, message_bits, message_saved)
+                         : 0u;
+    int32_t dirty_begin = cursor.dirty_begin;
+    int32_t dirty_end = cursor.dirty_end;
+    position_iter_release(iter);
+
+    if (written < message_bits) {
+        // Same reservation as before, so this never allocates.
+        rc = position_iter_begin(iter, img, block_size, threshold, STEG_FORMAT_COMPACT,
+                                 bits_per_channel, NULL, arena);
+        if (rc == 0) {
+            slot_cursor_init(&cursor, img, iter);
+            slot_cursor_skip_past(&cursor, after_row, after_col);
+            slot_cursor_write(&cursor, message_saved, written, NULL);
+            position_iter_release(iter);
+        }
+        fprintf(stderr, "steg_encode_message_adaptive: capacity insufficient "
+                        "(have %zu bits at threshold %g, need %zu bits)\n",
+                written, threshold, message_bits);
+        return rc == 0 ? -1 : 1;
+    }
+
+    payload_adaptive_header_encode(header, bits_per_channel, threshold, (uint32_t)message_len);
+    if (position_iter_begin(iter, img, block_size, contrast_threshold, STEG_FORMAT_COMPACT,
+                            bits_per_channel, NULL, arena) != 0) {
+        return 1;
+    }
+    position_iter_set_stats(iter, stats);
+    slot_cursor_init(&cursor, img, iter);
+    slot_cursor_write(&cursor, header, header_bits, NULL);
+    position_iter_release(iter);
+
+    if (stats != NULL) {
+        stats->embed_seconds += stats_now() - start - (stats->scan_seconds - scan_before);
+        stats->bits_written += header_bits + written;
+    }
+
+    // Lets bmp_save_in_place() write back only the rows that changed.
+    bmp_mark_dirty(img, cursor.dirty_begin, cursor.dirty_end);
+    bmp_mark_dirty(img, dirty_begin, dirty_end);
+
+    if (threshold_out != NULL) {
+        *threshold_out = threshold;
+    }
+    return 0;
+}
+
+int steg_encode_message_adaptive(BmpImage *img,
+                                 const uint8_t *message,
+                                 size_t message_len,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 int bits_per_channel,
+                                 double *threshold_out)
+{
+    StegPositionIter iter;
+    uint8_t *saved = NULL;
+    size_t saved_cap = 0;
+    int rc = encode_message_adaptive(img, message, message_len, block_size, contrast_threshold,
+                                     bits_per_channel, &iter, NULL, &saved, &saved_cap, NULL,
+                                     threshold_out);
+    free(saved);
+    return rc;
+}
+
+int steg_codec_available(int codec)
+{
+    return codec == STEG_CODEC_NONE ? 1 : codec_available(codec);
+}
+
+// Streaming encode.
+//
+// The cover is read in stored row order through a ring of block_size + 1
+// rows. The scanner and the slot cursor fetch rows through the ring: block
+// row br needs rows br .. br + block_size - 1, and in the bitmap layout the
+// cursor only writes row br once block row br has been scanned. Loading a
+// new row therefore evicts the oldest one, which is final and goes straight
+// to the output. Rows past the payload are copied through unchanged.
+typedef struct {
+    BmpStream in;
+    BmpStream out;
+    unsigned char *ring;
+    int32_t ring_rows;
+    size_t stride;
+    int32_t height;      // absolute height
+    int32_t loaded;      // rows [0, loaded) have been read
+    int32_t flushed;     // rows [0, flushed) have been written
+    int failed;          // an I/O error happened
+} StreamWindow;
+
+static unsigned char *stream_window_slot(StreamWindow *w, int32_t y)
+{
+    return w->ring + (size_t)(y % w->ring_rows) * w->stride;
+}
+
+// Helper: write every loaded row below `end` to the output.
+static void stream_window_flush(StreamWindow *w, int32_t end)
+{
+    while (w->flushed < end) {
+        if (!w->failed && bmp_stream_write_rows(&w->out, stream_window_slot(w, w->flushed), 1) != 0) {
+            w->failed = 1;
+        }
+        ++w->flushed;
+    }
+}
+
+static const unsigned char *stream_window_row(void *ctx, int32_t y)
+{
+    StreamWindow *w = (StreamWindow *)ctx;
+    assert(y >= w->flushed && y < w->height);
+
+    while (w->loaded <= y) {
+        stream_window_flush(w, w->loaded - w->ring_rows + 1);
+        unsigned char *slot = stream_window_slot(w, w->loaded);
+        if (!w->failed && bmp_stream_read_rows(&w->in, slot, 1) != 0) {
+            w->failed = 1;
+        }
+        if (w->failed) {
+            memset(slot, 0, w->stride);
+        }
+        ++w->loaded;
+    }
+    return stream_window_slot(w, y);
+}
+
+int steg_encode_file_streaming(const char *input_bmp,
+                               const char *output_bmp,
+                               const uint8_t *message,
+                               size_t message_len,
+                               int block_size,
+                               double contrast_threshold)
+{
+    if (input_bmp == NULL || output_bmp == NULL) {
+        fprintf(stderr, "steg_encode_file_streaming: filename is NULL\n");
+        return 1;
+    }
+
+    // Whatever the spelling: the output is only renamed over its file at the
+    // end, but the input has to be read until then.
+    if (bmp_same_file(input_bmp, output_bmp)) {
+        fprintf(stderr, "steg_encode_file_streaming: input and output must differ\n");
+        return 1;
+    }
+
+    if (message == NULL && message_len > 0) {
+        fprintf(stderr, "steg_encode_file_streaming: message is NULL but length > 0\n");
+        return 1;
+    }
+
+    if (block_size <= 0) {
+        fprintf(stderr, "steg_encode_file_streaming: block_size must be > 0\n");
+        return 1;
+    }
+
+    StreamWindow w;
+    memset(&w, 0, sizeof(w));
+    if (bmp_stream_open_read(input_bmp, &w.in) != 0) {
+        return 1;
+    }
+
+    w.stride = (size_t)w.in.info.stride;
+    w.height = w.in.info.height > 0 ? w.in.info.height : -w.in.info.height;
+    w.ring_rows = block_size < w.height ? block_size + 1 : w.height;
+    w.ring = (unsigned char *)malloc((size_t)w.ring_rows * w.stride);
+    if (!w.ring) {
+        perror("steg_encode_file_streaming: malloc");
+        bmp_stream_close(&w.in);
+        return 1;
+    }
+
+    if (bmp_stream_open_write(output_bmp, &w.in.info, &w.out) != 0) {
+        free(w.ring);
+        bmp_stream_close(&w.in);
+        return 1;
+    }
+
+    // The iterator only needs a non-NULL data pointer; every row access goes
+    // through the window.
+    BmpImage view = w.in.info;
+    view.data = w.ring;
+
+    StegPositionIter iter;
+    int rc = position_iter_init(&iter, &view, block_size, contrast_threshold,
+                                STEG_FORMAT_BITMAP, NULL);
+    if (rc == 0) {
+        iter.scanner.fetch_row = stream_window_row;
+        iter.scanner.fetch_ctx = &w;
+
+        SlotCursor cursor;
+        slot_cursor_init(&cursor, &view, &iter);
+        cursor.fetch_row = stream_window_row;
+        cursor.fetch_ctx = &w;
+
+        uint8_t header[PAYLOAD_MAX_HEADER_BYTES];
+        size_t header_len =
+            payload_header_encode(header, STEG_FORMAT_COMPACT, STEG_CODEC_NONE, 1,
+                                  (uint32_t)message_len);
+        size_t required_bits = (header_len + message_len) * 8u;
+
+        size_t written = slot_cursor_write(&cursor, header, header_len * 8u, NULL);
+        if (written == header_len * 8u && message_len > 0) {
+            written += slot_cursor_write(&cursor, message, message_len * 8u, NULL);
+        }
+        if (written < required_bits) {
+            fprintf(stderr, "steg_encode_file_streaming: capacity insufficient "
+                            "(need %zu bits)\n", required_bits);
+            rc = -1;
+        }
+        position_iter_release(&iter);
+    }
+
+    if (rc == 0) {
+        // Flush the window, then copy the remaining rows through it.
+        stream_window_flush(&w, w.loaded);
+        while (!w.failed && w.loaded < w.height) {
+            stream_window_row(&w, w.loaded);
+            stream_window_flush(&w, w.loaded);
+        }
+        if (w.failed) {
+            rc = 1;
+        }
+    }
+
+    if (rc != 0) {
+        bmp_stream_discard(&w.out);
+    } else if (bmp_stream_close(&w.out) != 0) {
+        rc = 1;
+    }
+    bmp_stream_close(&w.in);
+    free(w.ring);
+
+    // Nothing written reached output_bmp; an older file there goes too, but
+    // only once it is certain not to be the input.
+    if (rc != 0 && !bmp_same_file(input_bmp, output_bmp)) {
+        remove(output_bmp);
+    }
+    return rc;
+}
+
+// Returned by the per-layout decoders when the image carries no payload in
+// that layout, so the caller can try the next one.
+#define DECODE_NO_PAYLOAD 2
+
+// Helper: upper bound on the number of slots of a layout, used to reject
+// absurd stored lengths before allocating for them.
+static size_t max_slots(const BmpImage *img, int block_size, int format, int bits_per_channel)
+{
+    size_t width = (size_t)img->width;
+    size_t height = (size_t)(img->height > 0 ? img->height : -img->height);
+    if (format != STEG_FORMAT_LEGACY) {
+        return width * height * 3u * (size_t)bits_per_channel;
+    }
+    if ((size_t)block_size > width || (size_t)block_size > height) {
+        return 0;
+    }
+    size_t blocks = (width - (size_t)block_size + 1u) * (height - (size_t)block_size + 1u);
+    return blocks * (size_t)block_size * (size_t)block_size * 3u;
+}
+
+// Helper: upper bound on the message length of a compressed header_len byte
+// header of codec: the frame gets at most the slots left after the header
+// and expands by at most codec_max_ratio().
+static size_t compressed_len_bound(const BmpImage *img,
+                                   int block_size,
+                                   int format,
+                                   int bits_per_channel,
+                                   size_t header_len,
+                                   int codec)
+{
+    size_t bytes = max_slots(img, block_size, format, bits_per_channel) / 8u;
+    size_t frame = bytes > header_len ? bytes - header_len : 0u;
+    size_t ratio = codec_max_ratio(codec);
+    return frame > SIZE_MAX / (ratio > 0u ? ratio : 1u) ? SIZE_MAX : frame * ratio;
+}
+
+// Helper: read the header at the cursor into *out. A tagged layout (format
+// other than STEG_FORMAT_LEGACY) accepts every tagged header at this depth,
+// compressed included, and gives up as soon as the tag byte is wrong.
+// out->header_len is the number of header bytes consumed either way.
+// Returns 0 on success, non-zero when the header is incomplete or invalid.
+static int read_header(SlotCursor *cursor,
+                       int format,
+                       int bits_per_channel,
+                       PayloadHeader *out)
+{
+    uint8_t bytes[PAYLOAD_MAX_HEADER_BYTES];
+    memset(bytes, 0, sizeof(bytes));
+    size_t h = 0;
+    int found = STEG_FORMAT_LEGACY;
+    out->codec = STEG_CODEC_NONE;
+    out->header_len = 0;
+    out->threshold = 0.0;
+
+    if (format != STEG_FORMAT_LEGACY) {
+        if (slot_cursor_read(cursor, bytes, 8u) != 8u) {
+            return 1;
+        }
+        out->header_len = ++h;
+        if (bytes[0] == STEG_FORMAT_COMPACT_TAG(bits_per_channel)) {
+            found = STEG_FORMAT_COMPACT;
+        } else if (bytes[0] == STEG_FORMAT_BITMAP_TAG(bits_per_channel)) {
+            found = STEG_FORMAT_BITMAP;
+        } else if (bytes[0] == STEG_FORMAT_COMPRESSED_TAG(bits_per_channel)) {
+            found = STEG_FORMAT_COMPACT;
+            if (slot_cursor_read(cursor, bytes + h, 8u) != 8u) {
+                return 1;
+            }
+            out->header_len = ++h;
+            if (bytes[1] != STEG_CODEC_LZ4 && bytes[1] != STEG_CODEC_ZSTD) {
+                return 1;
+            }
+            out->codec = bytes[1];
+        } else if (bytes[0] == STEG_FORMAT_ADAPTIVE_TAG(bits_per_channel)) {
+            found = STEG_FORMAT_ADAPTIVE;
+            if (slot_cursor_read(cursor, bytes + h, PAYLOAD_THRESHOLD_BYTES * 8u) !=
+                PAYLOAD_THRESHOLD_BYTES * 8u) {
+                return 1;
+            }
+            h += PAYLOAD_THRESHOLD_BYTES;
+            out->header_len = h;
+            // Also rejects NaN.
+            double threshold = payload_threshold_decode(bytes + 1);
+            if (!(threshold > 0.0 && threshold <= PAYLOAD_MAX_THRESHOLD)) {
+                return 1;
+            }
+            out->threshold = threshold;
+        } else {
+            return 1;
+        }
+    }
+    out->format = found;
+
+    uint32_t len32 = 0;
+    if (found == STEG_FORMAT_COMPACT || found == STEG_FORMAT_ADAPTIVE) {
+        // Only the shortest encoding of a 32-bit length is valid, which
+        // rejects most stray tags after a byte or two more.
+        for (unsigned shift = 0;; shift += 7u) {
+            if (slot_cursor_read(cursor, bytes + h, 8u) != 8u) {
+                return 1;
+            }
+            uint8_t b = bytes[h];
+            out->header_len = ++h;
+            if (shift == 28u && b > 0x0Fu) {
+                return 1;
+            }
+            len32 |= (uint32_t)(b & 0x7Fu) << shift;
+            if (!(b & 0x80u)) {
+                if (shift > 0u && b == 0u) {
+                    return 1;
+                }
+                break;
+            }
+        }
+        // The check byte rejects a legacy length that reads as a tag and a
+        // varint (see STEG_FORMAT_COMPACT).
+        if (slot_cursor_read(cursor, bytes + h, 8u) != 8u) {
+            return 1;
+        }
+        out->header_len = h + 1u;
+        if (bytes[h] != payload_check_byte(bytes, h)) {
+            return 1;
+        }
+    } else {
+        if (slot_cursor_read(cursor, bytes + h, 32u) != 32u) {
+            return 1;
+        }
+        out->header_len = h + 4u;
+        len32 |= (uint32_t)bytes[h];
+        len32 |= (uint32_t)bytes[h + 1u] << 8;
+        len32 |= (uint32_t)bytes[h + 2u] << 16;
+        len32 |= (uint32_t)bytes[h + 3u] << 24;
+        if (found == STEG_FORMAT_BITMAP) {
+            // As for the varint headers, the check byte keeps a legacy
+            // length and message from reading as a bitmap header.
+            h += 4u;
+            if (slot_cursor_read(cursor, bytes + h, 8u) != 8u) {
+                return 1;
+            }
+            out->header_len = h + 1u;
+            if (bytes[h] != payload_check_byte(bytes, h)) {
+                return 1;
+            }
+        }
+    }
+
+    out->len = len32;
+    return 0;
+}
+
+// Helper: CodecSourceFn reading whole bytes from the slots.
+static size_t extract_source(void *ctx, uint8_t *dst, size_t max)
+{
+    memset(dst, 0, max);
+    return slot_cursor_read((SlotCursor *)ctx, dst, max * 8u) / 8u;
+}
+
+// Bytes the first chunk of slot_cursor_read_growing() reads.
+#define DECODE_FIRST_CHUNK ((size_t)1u << 16)
+
+// Helper: read len bytes from the cursor into *buf (reusable, capacity in
+// bytes), growing it as the slots deliver: chunk by chunk, each as large as
+// what was read so far. A stored length the image cannot back then costs no
+// more memory than the slots there are. *bits_out is the number of bits
+// read. Returns 0 on success (whether or not all of len was there),
+// non-zero when out of memory.
+static int slot_cursor_read_growing(SlotCursor *cursor,
+                                    uint8_t **buf,
+                                    size_t *buf_cap,
+                                    size_t len,
+                                    size_t *bits_out)
+{
+    size_t done = 0;
+    *bits_out = 0;
+    while (done < len) {
+        size_t chunk = done > DECODE_FIRST_CHUNK ? done : DECODE_FIRST_CHUNK;
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+        if (scratch_reserve((void **)buf, buf_cap, done + chunk, "steg_decode_message") != 0) {
+            return 1;
+        }
+        memset(*buf + done, 0, chunk);
+        size_t got = slot_cursor_read(cursor, *buf + done, chunk * 8u);
+        *bits_out += got;
+        done += chunk;
+        if (got != chunk * 8u) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Helper: the parallel path of decode_layout(), once a header_len byte
+// header of a message_len byte message has been read at a depth of
+// bits_per_channel. The message is extracted into *buf (reusable, capacity
+// in bytes), reserved only once the selection, or a parallel scan when that
+// is NULL, is known to hold it. Returns 0 on success, DECODE_NO_PAYLOAD when
+// the selection is too small for the message.
+static int decode_message_parallel(const BmpImage *img,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int bits_per_channel,
+                                   const StegBitmap *selection,
+                                   StegThreadPool *pool,
+                                   size_t header_len,
+                                   uint8_t **buf,
+                                   size_t *buf_cap,
+                                   size_t message_len,
+                                   StegStats *stats)
+{
+    double start = stats != NULL ? stats_now() : 0.0;
+    StegBitmap scanned;
+    memset(&scanned, 0, sizeof(scanned));
+    if (selection == NULL) {
+        if (collect_bitmap_parallel(img, block_size, contrast_threshold, bits_per_channel,
+                                    pool, &scanned) != 0) {
+            return 1;
+        }
+        selection = &scanned;
+    }
+    if (stats != NULL) {
+        double now = stats_now();
+        stats->scan_seconds += now - start;
+        start = now;
+    }
+
+    size_t required_bits = (header_len + message_len) * 8u;
+    if (selection->count * 3u * (size_t)bits_per_channel < required_bits) {
+        steg_bitmap_free(&scanned);
+        return DECODE_NO_PAYLOAD;
+    }
+    if (scratch_reserve((void **)buf, buf_cap, message_len > 0 ? message_len : 1u,
+                        "steg_decode_message") != 0) {
+        steg_bitmap_free(&scanned);
+        return 1;
+    }
+    uint8_t *out = *buf;
+    memset(out, 0, message_len);
+
+    ParallelSlots ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.img = img;
+    ps.selection = selection;
+    ps.depth = bits_per_channel;
+    ps.header_len = header_len;
+    ps.out = out;
+    ps.stream_len = header_len + message_len;
+    int rc = parallel_slots_init(&ps, pool) != 0 || parallel_slots_run(&ps, pool, 0) != 0;
+    steg_bitmap_free(&scanned);
+
+    if (stats != NULL && rc == 0) {
+        stats->extract_seconds += stats_now() - start;
+        stats->bits_read += message_len * 8u;
+    }
+    return rc;
+}
+
+// Helper: read a payload of the given layout and depth; format is
+// STEG_FORMAT_LEGACY or a tagged layout, which recognises every tagged
+// header and reports the one found in *header_out (may be NULL). The
+// message lands in *buf (reusable, capacity in bytes), decompressed if need
+// be; with buf NULL only the header is read and checked and just the stored
+// length is returned. A tagged layout decode reads its positions from
+// selection when it is not NULL instead of scanning, and with a pool (may be
+// NULL) extracts a large uncompressed message in parallel ranges; the
+// message of an adaptive payload is always read from a lazy scan at its
+// stored threshold. Quiet,
+// returning DECODE_NO_PAYLOAD, when no tag is found or the stored length is
+// implausible.
+static int decode_layout(const BmpImage *img,
+                         int block_size,
+                         double contrast_threshold,
+                         int format,
+                         int bits_per_channel,
+                         const StegBitmap *selection,
+                         StegPositionIter *iter,
+                         StegArena *arena,
+                         StegThreadPool *pool,
+                         uint8_t **buf,
+                         size_t *buf_cap,
+                         size_t *message_len_out,
+                         PayloadHeader *header_out,
+                         StegStats *stats)
+{
+    int tagged = format != STEG_FORMAT_LEGACY;
+    double start = stats != NULL ? stats_now() : 0.0;
+
+    if (position_iter_begin(iter, img, block_size, contrast_threshold, format,
+                            bits_per_channel, selection, arena) != 0) {
+        return 1;
+    }
+
+    // Header and message are read in one pass: the cursor simply carries on
+    // after the header.
+    position_iter_set_stats(iter, stats);
+    SlotCursor cursor;
+    slot_cursor_init(&cursor, img, iter);
+
+    double scan_before = 0.0;
+    if (stats != NULL) {
+        double now = stats_now();
+        stats->setup_seconds += now - start;
+        start = now;
+        scan_before = stats->scan_seconds;
+    }
+
+    PayloadHeader header;
+    int header_rc = read_header(&cursor, format, bits_per_channel, &header);
+    size_t header_len = header.header_len;
+    if (header_rc != 0) {
+        position_iter_release(iter);
+        if (stats != NULL) {
+            stats->bits_read += header_len * 8u;
+        }
+        if (tagged) {
+            return DECODE_NO_PAYLOAD;
+        }
+        fprintf(stderr, "steg_decode_message: not enough bits even for header\n");
+        return 1;
+    }
+
+    size_t message_len = (size_t)header.len;
+    // A compressed message may well be longer than the cover; its frame
+    // has to hold at least the magic number.
+    size_t required_bits =
+        (header_len + (header.codec != STEG_CODEC_NONE ? CODEC_MAGIC_BYTES : message_len)) * 8u;
+
+    // A legacy image can start with a tag byte by chance; an implausible
+    // length sends it back to the legacy decoder.
+    if (required_bits > max_slots(img, block_size, format, bits_per_channel)) {
+        position_iter_release(iter);
+        if (stats != NULL) {
+            stats->bits_read += header_len * 8u;
+        }
+        if (tagged) {
+            return DECODE_NO_PAYLOAD;
+        }
+        fprintf(stderr, "steg_decode_message: capacity insufficient for stored length\n");
+        return 1;
+    }
+
+    // Nor is the length a compressed frame claims to expand to unbounded.
+    if (header.codec != STEG_CODEC_NONE &&
+        message_len > compressed_len_bound(img, block_size, format, bits_per_channel, header_len,
+                                           header.codec)) {
+        position_iter_release(iter);
+        if (stats != NULL) {
+            stats->bits_read += header_len * 8u;
+        }
+        return DECODE_NO_PAYLOAD;
+    }
+
+    uint8_t magic[CODEC_MAGIC_BYTES] = {0, 0, 0, 0};
+    if (header.codec != STEG_CODEC_NONE) {
+        size_t magic_bits = slot_cursor_read(&cursor, magic, CODEC_MAGIC_BYTES * 8u);
+        if (magic_bits != CODEC_MAGIC_BYTES * 8u || !codec_magic_matches(header.codec, magic)) {
+            position_iter_release(iter);
+            if (stats != NULL) {
+                stats->bits_read += header_len * 8u + magic_bits;
+            }
+            return DECODE_NO_PAYLOAD;
+        }
+        header_len += CODEC_MAGIC_BYTES;
+    }
+
+    if (header_out != NULL) {
+        *header_out = header;
+    }
+
+    if (buf == NULL) {
+        position_iter_release(iter);
+        if (stats != NULL) {
+            stats->extract_seconds += stats_now() - start - (stats->scan_seconds - scan_before);
+            stats->bits_read += header_len * 8u;
+        }
+        *message_len_out = message_len;
+        return 0;
+    }
+
+    // Always hand back a valid pointer, even for an empty message. The
+    // codec fills the bounded length it was given exactly; an uncompressed
+    // message grows the buffer as its slots are read instead, since its
+    // stored length is only known to fit max_slots().
+    size_t reserve = header.codec != STEG_CODEC_NONE ? message_len : 0u;
+    if (scratch_reserve((void **)buf, buf_cap, reserve > 0 ? reserve : 1u,
+                        "steg_decode_message") != 0) {
+        position_iter_release(iter);
+        return 1;
+    }
+
+    if (header.codec != STEG_CODEC_NONE) {
+        if (!codec_available(header.codec)) {
+            position_iter_release(iter);
+            fprintf(stderr, "steg_decode_message: payload is compressed with %s, "
+                            "which is not available\n", codec_name(header.codec));
+            return 1;
+        }
+        // The frame is pulled from the slots as the codec asks for it.
+        size_t consumed = 0;
+        int rc = codec_decompress(header.codec, magic, CODEC_MAGIC_BYTES, extract_source,
+                                  &cursor, *buf, message_len, &consumed);
+        position_iter_release(iter);
+        if (stats != NULL) {
+            stats->extract_seconds += stats_now() - start - (stats->scan_seconds - scan_before);
+            stats->bits_read += (header_len - CODEC_MAGIC_BYTES + consumed) * 8u;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "steg_decode_message: compressed payload is damaged\n");
+            return 1;
+        }
+        *message_len_out = message_len;
+        return 0;
+    }
+
+    if (header.format == STEG_FORMAT_ADAPTIVE) {
+        // The message is at the positions of the stored threshold, from the
+        // first one after the last header pixel on.
+        int32_t after_row = cursor.run_row;
+        int32_t after_col = cursor.run_col - 1;
+        position_iter_release(iter);
+        if (position_iter_begin(iter, img, block_size, header.threshold, STEG_FORMAT_COMPACT,
+                                bits_per_channel, NULL, arena) != 0) {
+            return 1;
+        }
+        position_iter_set_stats(iter, stats);
+        slot_cursor_init(&cursor, img, iter);
+        slot_cursor_skip_past(&cursor, after_row, after_col);
+    } else if (tagged && parallel_slots_wanted(pool, required_bits)) {
+        position_iter_release(iter);
+        int rc = decode_message_parallel(img, block_size, contrast_threshold, bits_per_channel,
+                                         selection, pool, header_len, buf, buf_cap, message_len,
+                                         stats);
+        if (stats != NULL) {
+            stats->bits_read += header_len * 8u;
+        }
+        if (rc == 0) {
+            *message_len_out = message_len;
+        }
+        return rc;
+    }
+
+    // Then read on into the message bits that follow the header.
+    size_t read_bits = 0;
+    if (slot_cursor_read_growing(&cursor, buf, buf_cap, message_len, &read_bits) != 0) {
+        position_iter_release(iter);
+        return 1;
+    }
+    if (stats != NULL) {
+        // Blocks are scanned lazily while reading; that time is scan time.
+        stats->extract_seconds += stats_now() - start - (stats->scan_seconds - scan_before);
+        stats->bits_read += header_len * 8u + read_bits;
+    }
+    if (read_bits != message_len * 8u) {
+        position_iter_release(iter);
+        if (tagged) {
+            return DECODE_NO_PAYLOAD;
+        }
+        fprintf(stderr, "steg_decode_message: capacity insufficient for stored length\n");
+        return 1;
+    }
+
+    position_iter_release(iter);
+
+    *message_len_out = message_len;
+    return 0;
+}
+
+// Helper: compute the full selection of key and store it in cache. Failing
+// only costs the cache entry.
+static void selection_cache_fill(StegSelectionCache *cache,
+                                 const SelectionKey *key,
+                                 const BmpImage *img)
+{
+    StegPositionIter iter;
+    uint64_t *words = NULL;
+    size_t capacity = 0;
+    StegBitmap bitmap;
+    if (collect_bitmap(img, key->block_size, key->contrast_threshold, key->bits_per_channel,
+                       &iter, NULL, &words, &capacity, &bitmap, NULL) != 0) {
+        free(words);
+        return;
+    }
+    selection_cache_insert(cache, key, &bitmap);
+}
+
+// Helper: the decoder behind the public entry points. Every layout is
+// recognised: the tagged layouts are tried first and the legacy layout is
+// used when no format tag is found. cache (may be NULL) supplies and keeps
+// tagged layout selections; pool (may be NULL) extracts large messages in
+// parallel ranges.
+static int decode_message(const BmpImage *img,
+                          int block_size,
+                          double contrast_threshold,
+                          StegSelectionCache *cache,
+                          StegPositionIter *iter,
+                          StegArena *arena,
+                          StegThreadPool *pool,
+                          uint8_t **buf,
+                          size_t *buf_cap,
+                          size_t *message_len_out,
+                          StegStats *stats)
+{
+    assert(img != NULL);
+
+    if (stats != NULL) {
+        ++stats->calls;
+    }
+
+    if (img->data == NULL) {
+        fprintf(stderr, "steg_decode_message: invalid image data\n");
+        return 1;
+    }
+
+    SelectionKey keys[STEG_MAX_BITS_PER_CHANNEL];
+    if (cache != NULL) {
+        selection_keys_init(keys, img, block_size, contrast_threshold);
+    }
+
+    // Selection depends on the depth, so each depth is a separate attempt.
+    // Failed attempts stop after the header, which only scans the first rows.
+    for (int bits = 1; bits <= STEG_MAX_BITS_PER_CHANNEL; ++bits) {
+        const SelectionKey *key = &keys[bits - 1];
+        SelectionEntry *entry = NULL;
+        if (cache != NULL) {
+            entry = selection_cache_acquire(cache, key);
+        }
+
+        int rc = decode_layout(img, block_size, contrast_threshold, STEG_FORMAT_BITMAP, bits,
+                               entry != NULL ? &entry->bitmap : NULL,
+                               iter, arena, pool, buf, buf_cap, message_len_out, NULL, stats);
+
+        if (entry != NULL) {
+            selection_cache_release(cache, entry);
+        } else if (cache != NULL && rc == 0) {
+            selection_cache_fill(cache, key, img);
+        }
+        if (rc != DECODE_NO_PAYLOAD) {
+            return rc;
+        }
+    }
+
+    return decode_layout(img, block_size, contrast_threshold, STEG_FORMAT_LEGACY, 1, NULL,
+                         iter, arena, NULL, buf, buf_cap, message_len_out, NULL, stats);
+}
+
+int steg_decode_message(const BmpImage *img,
+                        uint8_t **message_out,
+                        size_t *message_len_out,
+                        int block_size,
+                        double contrast_threshold)
+{
+    return steg_decode_message_cached(NULL, img, message_out, message_len_out,
+                                      block_size, contrast_threshold);
+}
+
+int steg_decode_message_cached(StegSelectionCache *cache,
+                               const BmpImage *img,
+                               uint8_t **message_out,
+                               size_t *message_len_out,
+                               int block_size,
+                               double contrast_threshold)
+{
+    assert(message_out != NULL);
+    assert(message_len_out != NULL);
+
+    *message_out = NULL;
+    *message_len_out = 0;
+
+    StegPositionIter iter;
+    uint8_t *message = NULL;
+    size_t capacity = 0;
+    size_t message_len = 0;
+    if (decode_message(img, block_size, contrast_threshold, cache, &iter, NULL, NULL,
+                       &message, &capacity, &message_len, NULL) != 0) {
+        free(message);
+        return 1;
+    }
+
+    *message_out = message;
+    *message_len_out = message_len;
+    return 0;
+}
+
+// Helper: read the legacy header of img quietly into *header_out.
+// Returns 0 on success, DECODE_NO_PAYLOAD when the slots run out first,
+// non-zero on other errors.
+static int probe_legacy_header(const BmpImage *img,
+                               int block_size,
+                               double contrast_threshold,
+                               StegPositionIter *iter,
+                               StegArena *arena,
+                               PayloadHeader *header_out,
+                               StegStats *stats)
+{
+    if (position_iter_begin(iter, img, block_size, contrast_threshold, STEG_FORMAT_LEGACY, 1,
+                            NULL, arena) != 0) {
+        return 1;
+    }
+    position_iter_set_stats(iter, stats);
+    SlotCursor cursor;
+    slot_cursor_init(&cursor, img, iter);
+    int rc = read_header(&cursor, STEG_FORMAT_LEGACY, 1, header_out);
+    position_iter_release(iter);
+    if (stats != NULL) {
+        stats->bits_read += cursor.slot_index;
+    }
+    return rc == 0 ? 0 : DECODE_NO_PAYLOAD;
+}
+
+// Helper: whether a header needing required_bits slots at a depth of
+// bits_per_channel is within STEG_PROBE_CAPACITY_SLACK of the estimated
+// capacity. A legacy payload visits every pixel once per accepted block
+// covering it, up to block_size^2 times.
+static int probe_plausible(const BmpImage *img,
+                           int block_size,
+                           double contrast_threshold,
+                           int format,
+                           int bits_per_channel,
+                           int codec,
+                           size_t required_bits)
+{
+    StegCapacity capacity;
+    if (steg_query_capacity_depth(img, block_size, contrast_threshold, bits_per_channel,
+                                  STEG_CAPACITY_ESTIMATE, &capacity) != 0) {
+        return 0;
+    }
+    double bound = (double)capacity.bits * (double)STEG_PROBE_CAPACITY_SLACK;
+    if (format == STEG_FORMAT_LEGACY) {
+        bound *= (double)block_size * (double)block_size;
+    }
+    // A compressed frame expands by at most codec_max_ratio().
+    if (codec != STEG_CODEC_NONE) {
+        bound *= (double)codec_max_ratio(codec);
+    }
+    return (double)required_bits <= bound;
+}
+
+// Helper: the probe behind the public entry points.
+static int probe_message(const BmpImage *img,
+                         int block_size,
+                         double contrast_threshold,
+                         StegPositionIter *iter,
+                         StegArena *arena,
+                         StegProbe *probe_out,
+                         StegStats *stats)
+{
+    assert(img != NULL);
+    assert(probe_out != NULL);
+
+    memset(probe_out, 0, sizeof(*probe_out));
+    probe_out->codec = STEG_CODEC_NONE;
+
+    if (stats != NULL) {
+        ++stats->calls;
+    }
+
+    if (img->data == NULL) {
+        fprintf(stderr, "steg_probe_message: invalid image data\n");
+        return 1;
+    }
+
+    // Unlike the decoder, an implausible tagged header does not end the
+    // search: the next depths and the legacy layout are still tried.
+    PayloadHeader header;
+    for (int bits = 1; bits <= STEG_MAX_BITS_PER_CHANNEL; ++bits) {
+        size_t message_len = 0;
+        int rc = decode_layout(img, block_size, contrast_threshold, STEG_FORMAT_BITMAP, bits,
+                               NULL, iter, arena, NULL, NULL, NULL, &message_len, &header,
+                               stats);
+        if (rc == DECODE_NO_PAYLOAD) {
+            continue;
+        }
+        if (rc != 0) {
+            return 1;
+        }
+        // The sample tiles say little about the sparse selection an adaptive
+        // threshold tends to have; its header is checked for a sane
+        // threshold instead.
+        int adaptive = header.format == STEG_FORMAT_ADAPTIVE;
+        if (!adaptive &&
+            !probe_plausible(img, block_size, contrast_threshold, header.format, bits,
+                             header.codec, (header.header_len + message_len) * 8u)) {
+            continue;
+        }
+        probe_out->found = 1;
+        probe_out->format = header.format;
+        probe_out->bits_per_channel = bits;
+        probe_out->codec = header.codec;
+        probe_out->message_len = message_len;
+        probe_out->contrast_threshold = adaptive ? header.threshold : contrast_threshold;
+        return 0;
+    }
+
+    int rc = probe_legacy_header(img, block_size, contrast_threshold, iter, arena, &header,
+                                 stats);
+    if (rc == DECODE_NO_PAYLOAD) {
+        return 0;
+    }
+    if (rc != 0) {
+        return 1;
+    }
+    size_t required_bits = (header.header_len + (size_t)header.len) * 8u;
+    if (header.len == 0 ||
+        required_bits > max_slots(img, block_size, STEG_FORMAT_LEGACY, 1) ||
+        !probe_plausible(img, block_size, contrast_threshold, STEG_FORMAT_LEGACY, 1,
+                         STEG_CODEC_NONE, required_bits)) {
+        return 0;
+    }
+    probe_out->found = 1;
+    probe_out->format = STEG_FORMAT_LEGACY;
+    probe_out->bits_per_channel = 1;
+    probe_out->message_len = header.len;
+    probe_out->contrast_threshold = contrast_threshold;
+    return 0;
+}
+
+int steg_probe_message(const BmpImage *img,
+                       int block_size,
+                       double contrast_threshold,
+                       StegProbe *probe_out)
+{
+    StegPositionIter iter;
+    return probe_message(img, block_size, contrast_threshold, &iter, NULL, probe_out, NULL);
+}
+
+// Helper: the updater behind the public entry points. The stored header
+// gives the depth and the layout; the payload then goes in exactly as encode_message()
+// would put it, and the writer leaves bytes that already hold their bits
+// alone. cache (may be NULL) supplies the selection of a known cover.
+static int update_message(BmpImage *img,
+                          const uint8_t *message,
+                          size_t message_len,
+                          int block_size,
+                          double contrast_threshold,
+                          StegSelectionCache *cache,
+                          StegPositionIter *iter,
+                          StegArena *arena,
+                          StegThreadPool *pool,
+                          uint8_t **saved_buf,
+                          size_t *saved_cap,
+                          StegStats *stats)
+{
+    assert(img != NULL);
+
+    if (img->data == NULL) {
+        fprintf(stderr, "steg_update_message: invalid image data\n");
+        return 1;
+    }
+
+    int depth = 1;
+    PayloadHeader header = {STEG_FORMAT_COMPACT, STEG_CODEC_NONE, 0, 0, 0.0};
+    SelectionEntry *entry = NULL;
+    SelectionKey keys[STEG_MAX_BITS_PER_CHANNEL];
+    if (cache != NULL) {
+        selection_keys_init(keys, img, block_size, contrast_threshold);
+    }
+    for (int bits = 1; bits <= STEG_MAX_BITS_PER_CHANNEL; ++bits) {
+        SelectionEntry *candidate = NULL;
+        if (cache != NULL) {
+            candidate = selection_cache_acquire(cache, &keys[bits - 1]);
+        }
+
+        size_t stored_len = 0;
+        int rc = decode_layout(img, block_size, contrast_threshold, STEG_FORMAT_BITMAP, bits,
+                               candidate != NULL ? &candidate->bitmap : NULL,
+                               iter, arena, NULL, NULL, NULL, &stored_len, &header, stats);
+        if (rc == 0) {
+            depth = bits;
+            entry = candidate;
+            break;
+        }
+        if (candidate != NULL) {
+            selection_cache_release(cache, candidate);
+        }
+        if (rc != DECODE_NO_PAYLOAD) {
+            return 1;
+        }
+    }
+
+    if (header.format == STEG_FORMAT_ADAPTIVE) {
+        if (entry != NULL) {
+            selection_cache_release(cache, entry);
+        }
+        return encode_message_adaptive(img, message, message_len, block_size,
+                                       contrast_threshold, depth, iter, arena, saved_buf,
+                                       saved_cap, stats, NULL);
+    }
+
+    int rc = encode_message(img, message, message_len, block_size, contrast_threshold,
+                            header.format, depth, header.codec,
+                            entry != NULL ? &entry->bitmap : NULL,
+                            iter, arena, pool, saved_buf, saved_cap, stats, NULL, NULL);
+    if (entry != NULL) {
+        selection_cache_release(cache, entry);
+    }
+    return rc;
+}
+
+int steg_update_message(BmpImage *img,
+                        const uint8_t *message,
+                        size_t message_len,
+                        int block_size,
+                        double contrast_threshold)
+{
+    StegPositionIter iter;
+    uint8_t *saved = NULL;
+    size_t saved_cap = 0;
+    int rc = update_message(img, message, message_len, block_size, contrast_threshold,
+                            NULL, &iter, NULL, NULL, &saved, &saved_cap, NULL);
+    free(saved);
+    return rc;
+}
+
+// Reusable state for the _ctx entry points. Everything a call needs is kept
+// here and only grows, so repeating calls at one resolution stop allocating.
+struct StegContext {
+    StegArena arena;            // scanner, coverage and iterator scratch
+    StegPositionIter iter;
+    uint8_t *buffer;            // encode undo log / decoded message
+    size_t buffer_cap;
+    EmbedPosition *positions;
+    size_t positions_cap;
+    uint64_t *bits;
+    size_t bits_cap;
+    uint64_t *seen;             // stats only: duplicate write tracking
+    size_t seen_cap;
+    StegStats *stats;           // NULL: no instrumentation
+    StegSelectionCache *cache;  // NULL: decodes always scan
+    StegThreadPool *pool;       // NULL: serial embed and extract
+};
+
+// Helper: record the scratch held by ctx after a call.
+static void context_note_scratch(StegContext *ctx)
+{
+    if (ctx->stats == NULL) {
+        return;
+    }
+    size_t scratch = ctx->arena.capacity + ctx->buffer_cap + ctx->positions_cap +
+                     ctx->bits_cap + ctx->seen_cap;
+    if (scratch > ctx->stats->peak_scratch_bytes) {
+        ctx->stats->peak_scratch_bytes = scratch;
+    }
+}
+
+void steg_context_set_stats(StegContext *ctx, StegStats *stats)
+{
+    assert(ctx != NULL);
+    ctx->stats = stats;
+}
+
+void steg_context_set_selection_cache(StegContext *ctx, StegSelectionCache *cache)
+{
+    assert(ctx != NULL);
+    ctx->cache = cache;
+}
+
+void steg_context_set_thread_pool(StegContext *ctx, StegThreadPool *pool)
+{
+    assert(ctx != NULL);
+    ctx->pool = pool;
+}
+
+StegContext *steg_context_create(void)
+{
+    StegContext *ctx = (StegContext *)calloc(1, sizeof(StegContext));
+    if (!ctx) {
+        perror("steg_context_create: calloc");
+        return NULL;
+    }
+    return ctx;
+}
+
+void steg_context_destroy(StegContext *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    arena_free(&ctx->arena);
+    free(ctx->buffer);
+    free(ctx->positions);
+    free(ctx->bits);
+    free(ctx->seen);
+    free(ctx);
+}
+
+int steg_encode_message_ctx(StegContext *ctx,
+                            BmpImage *img,
+                            const uint8_t *message,
+                            size_t message_len,
+                            int block_size,
+                            double contrast_threshold)
+{
+    return steg_encode_message_format_ctx(ctx, img, message, message_len, block_size,
+                                          contrast_threshold, STEG_FORMAT_COMPACT);
+}
+
+int steg_encode_message_format_ctx(StegContext *ctx,
+                                   BmpImage *img,
+                                   const uint8_t *message,
+                                   size_t message_len,
+                                   int block_size,
+                                   double contrast_threshold,
+                                   int format)
+{
+    assert(ctx != NULL);
+
+    int rc = encode_message(img, message, message_len, block_size, contrast_threshold,
+                            format, 1, STEG_CODEC_NONE, NULL, &ctx->iter, &ctx->arena,
+                            ctx->pool, &ctx->buffer, &ctx->buffer_cap,
+                            ctx->stats, &ctx->seen, &ctx->seen_cap);
+    context_note_scratch(ctx);
+    return rc;
+}
+
+int steg_encode_message_depth_ctx(StegContext *ctx,
+                                  BmpImage *img,
+                                  const uint8_t *message,
+                                  size_t message_len,
+                                  int block_size,
+                                  double contrast_threshold,
+                                  int bits_per_channel)
+{
+    return steg_encode_message_compressed_ctx(ctx, img, message, message_len, block_size,
+                                              contrast_threshold, bits_per_channel,
+                                              STEG_CODEC_NONE);
+}
+
+int steg_encode_message_compressed_ctx(StegContext *ctx,
+                                       BmpImage *img,
+                                       const uint8_t *message,
+                                       size_t message_len,
+                                       int block_size,
+                                       double contrast_threshold,
+                                       int bits_per_channel,
+                                       int codec)
+{
+    assert(ctx != NULL);
+
+    int rc = encode_message(img, message, message_len, block_size, contrast_threshold,
+                            STEG_FORMAT_COMPACT, bits_per_channel, codec, NULL,
+                            &ctx->iter, &ctx->arena, ctx->pool, &ctx->buffer, &ctx->buffer_cap,
+                            ctx->stats, &ctx->seen, &ctx->seen_cap);
+    context_note_scratch(ctx);
+    return rc;
+}
+
+int steg_encode_message_adaptive_ctx(StegContext *ctx,
+                                     BmpImage *img,
+                                     const uint8_t *message,
+                                     size_t message_len,
+                                     int block_size,
+                                     double contrast_threshold,
+                                     int bits_per_channel,
+                                     double *threshold_out)
+{
+    assert(ctx != NULL);
+
+    int rc = encode_message_adaptive(img, message, message_len, block_size,
+                                     contrast_threshold, bits_per_channel, &ctx->iter,
+                                     &ctx->arena, &ctx->buffer, &ctx->buffer_cap, ctx->stats,
+                                     threshold_out);
+    context_note_scratch(ctx);
+    return rc;
+}
+
+int steg_update_message_ctx(StegContext *ctx,
+                            BmpImage *img,
+                            const uint8_t *message,
+                            size_t message_len,
+                            int block_size,
+                            double contrast_threshold)
+{
+    assert(ctx != NULL);
+
+    int rc = update_message(img, message, message_len, block_size, contrast_threshold,
+                            ctx->cache, &ctx->iter, &ctx->arena, ctx->pool,
+                            &ctx->buffer, &ctx->buffer_cap, ctx->stats);
+    context_note_scratch(ctx);
+    return rc;
+}
+
+int steg_decode_message_ctx(StegContext *ctx,
+                            const BmpImage *img,
+                            const uint8_t **message_out,
+                            size_t *message_len_out,
+                            int block_size,
+                            double contrast_threshold)
+{
+    assert(ctx != NULL);
+    assert(message_out != NULL);
+    assert(message_len_out != NULL);
+
+    *message_out = NULL;
+    *message_len_out = 0;
+
+    size_t message_len = 0;
+    int rc = decode_message(img, block_size, contrast_threshold, ctx->cache,
+                            &ctx->iter, &ctx->arena, ctx->pool,
+                            &ctx->buffer, &ctx->buffer_cap, &message_len, ctx->stats);
+    context_note_scratch(ctx);
+    if (rc != 0) {
+        return 1;
+    }
+
+    *message_out = ctx->buffer;
+    *message_len_out = message_len;
+    return 0;
+}
+
+int steg_probe_message_ctx(StegContext *ctx,
+                           const BmpImage *img,
+                           int block_size,
+                           double contrast_threshold,
+                           StegProbe *probe_out)
+{
+    assert(ctx != NULL);
+
+    int rc = probe_message(img, block_size, contrast_threshold, &ctx->iter, &ctx->arena,
+                           probe_out, ctx->stats);
+    context_note_scratch(ctx);
+    return rc;
+}
+
+int find_low_contrast_positions_ctx(StegContext *ctx,
+                                    const BmpImage *img,
+                                    int block_size,
+                                    double contrast_threshold,
+                                    const EmbedPosition **positions_out,
+                                    size_t *count_out)
+{
+    assert(ctx != NULL);
+    assert(positions_out != NULL);
+    assert(count_out != NULL);
+
+    *positions_out = NULL;
+    *count_out = 0;
+
+    size_t count = 0;
+    int rc = collect_positions(img, block_size, contrast_threshold, &ctx->iter, &ctx->arena,
+                               &ctx->positions, &ctx->positions_cap, &count, ctx->stats);
+    context_note_scratch(ctx);
+    if (rc != 0) {
+        return 1;
+    }
+
+    *positions_out = ctx->positions;
+    *count_out = count;
+    return 0;
+}
+
+int find_low_contrast_bitmap_ctx(StegContext *ctx,
+                                 const BmpImage *img,
+                                 int block_size,
+                                 double contrast_threshold,
+                                 StegBitmap *bitmap_out)
+{
+    assert(ctx != NULL);
+    assert(bitmap_out != NULL);
+
+    memset(bitmap_out, 0, sizeof(*bitmap_out));
+
+    int rc = collect_bitmap(img, block_size, contrast_threshold, 1, &ctx->iter, &ctx->arena,
+                            &ctx->bits, &ctx->bits_cap, bitmap_out, ctx->stats);
+    context_note_scratch(ctx);
+    if (rc != 0) {
+        memset(bitmap_out, 0, sizeof(*bitmap_out));
+        return 1;
+    }
+
+    return 0;
+}
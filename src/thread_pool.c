@@ -0,0 +1,176 @@
+// thread_pool.c - Fixed-size pthread pool used for parallel scans.
+
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    StegThreadPool *pool;
+    int index;
+} WorkerArg;
+
+struct StegThreadPool {
+    pthread_t *threads;
+    WorkerArg *args;
+    int worker_count;          // threads besides the caller
+    pthread_mutex_t run_mutex; // serialises thread_pool_run() callers
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    ThreadPoolTaskFn fn;
+    void *ctx;
+    int task_count;
+    int next_task;
+    int tasks_done;
+    int shutdown;
+};
+
+// Helper: take and run tasks until none are left. Called with mutex held,
+// returns with it held.
+static void run_pending_tasks(StegThreadPool *pool, int thread)
+{
+    while (pool->next_task < pool->task_count) {
+        int task = pool->next_task++;
+        ThreadPoolTaskFn fn = pool->fn;
+        void *ctx = pool->ctx;
+
+        pthread_mutex_unlock(&pool->mutex);
+        fn(ctx, task, thread);
+        pthread_mutex_lock(&pool->mutex);
+
+        if (++pool->tasks_done == pool->task_count) {
+            pthread_cond_broadcast(&pool->done_cond);
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    StegThreadPool *pool = ((WorkerArg *)arg)->pool;
+    int thread = ((WorkerArg *)arg)->index;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->shutdown && pool->next_task >= pool->task_count) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        run_pending_tasks(pool, thread);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+StegThreadPool *steg_thread_pool_create(int num_threads)
+{
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    StegThreadPool *pool = (StegThreadPool *)calloc(1, sizeof(StegThreadPool));
+    if (!pool) {
+        perror("steg_thread_pool_create: calloc");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->run_mutex, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    int workers = num_threads - 1;
+    if (workers > 0) {
+        pool->threads = (pthread_t *)malloc((size_t)workers * sizeof(pthread_t));
+        pool->args = (WorkerArg *)malloc((size_t)workers * sizeof(WorkerArg));
+        if (!pool->threads || !pool->args) {
+            perror("steg_thread_pool_create: malloc");
+            steg_thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < workers; ++i) {
+        pool->args[i].pool = pool;
+        pool->args[i].index = i + 1;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->args[i]) != 0) {
+            fprintf(stderr, "steg_thread_pool_create: pthread_create failed\n");
+            steg_thread_pool_destroy(pool);
+            return NULL;
+        }
+        ++pool->worker_count;
+    }
+
+    return pool;
+}
+
+void steg_thread_pool_destroy(StegThreadPool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->worker_count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_mutex_destroy(&pool->run_mutex);
+    free(pool->threads);
+    free(pool->args);
+    free(pool);
+}
+
+int steg_thread_pool_size(const StegThreadPool *pool)
+{
+    return pool != NULL ? pool->worker_count + 1 : 1;
+}
+
+void thread_pool_run(StegThreadPool *pool, ThreadPoolTaskFn fn, void *ctx, int task_count)
+{
+    if (task_count <= 0) {
+        return;
+    }
+
+    if (pool == NULL || pool->worker_count == 0 || task_count == 1) {
+        for (int task = 0; task < task_count; ++task) {
+            fn(ctx, task, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->run_mutex);
+    pthread_mutex_lock(&pool->mutex);
+
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->task_count = task_count;
+    pool->next_task = 0;
+    pool->tasks_done = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+
+    run_pending_tasks(pool, 0);
+    while (pool->tasks_done < pool->task_count) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+
+    pool->fn = NULL;
+    pool->ctx = NULL;
+    pool->task_count = 0;
+    pool->next_task = 0;
+
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&pool->run_mutex);
+}
@@ -0,0 +1,26 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Private to steg_lib: parallel-for on a StegThreadPool.
+
+#include "steg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// thread is the index, in [0, steg_thread_pool_size()), of the thread running
+// the task (0 is the caller), for per-thread scratch.
+typedef void (*ThreadPoolTaskFn)(void *ctx, int task, int thread);
+
+// Run fn(ctx, 0, t) .. fn(ctx, task_count - 1, t) on the pool and wait for
+// all of them. The calling thread takes tasks too. pool may be NULL, in which case
+// the tasks run serially on the caller. Concurrent calls on one pool are
+// serialised; a task must not call back into the same pool.
+void thread_pool_run(StegThreadPool *pool, ThreadPoolTaskFn fn, void *ctx, int task_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
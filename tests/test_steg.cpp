@@ -4,10 +4,21 @@
 
 extern "C" {
 #include "bmp.h"
+#include "contrast.h"
+#include "luma.h"
+#include "payload.h"
 #include "steg.h"
 }
 
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <string>
+#include <vector>
 
 // Helper to create a synthetic BMP image in memory with solid color.
 static void create_test_image(int32_t width,
@@ -17,13 +28,13 @@ static void create_test_image(int32_t width,
                               unsigned char b,
                               BmpImage *img)
 {
+    std::memset(img, 0, sizeof(*img)); // heap storage, nothing dirty
     img->width = width;
     img->height = height;
     img->stride = ((width * 3 + 3) / 4) * 4;
     int32_t abs_height = height > 0 ? height : -height;
     img->size = img->stride * abs_height;
 
-    std::memset(img->header, 0, sizeof(img->header)); // not used for tests
 
     img->data = (unsigned char *)std::malloc((size_t)img->size);
     ASSERT_NE(img->data, nullptr);
@@ -123,3 +134,2327 @@ TEST(StegIntegrationTest, TooLargeMessageFails)
 }
 
 
+
+// Reference implementation of the original per-block two-pass scan, used to
+// check that the integral-image engine selects exactly the same blocks.
+static std::vector<int> reference_positions(const BmpImage *img,
+                                            int block_size,
+                                            double contrast_threshold)
+{
+    int32_t width = img->width;
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+
+    std::vector<double> lum((size_t)width * (size_t)abs_height);
+    for (int32_t row = 0; row < abs_height; ++row) {
+        for (int32_t col = 0; col < width; ++col) {
+            size_t base = (size_t)row * (size_t)img->stride + (size_t)col * 3u;
+            unsigned char b = (unsigned char)(img->data[base + 0] & 0xFEu);
+            unsigned char g = (unsigned char)(img->data[base + 1] & 0xFEu);
+            unsigned char r = (unsigned char)(img->data[base + 2] & 0xFEu);
+            lum[(size_t)row * (size_t)width + (size_t)col] =
+                0.299 * (double)r + 0.587 * (double)g + 0.114 * (double)b;
+        }
+    }
+
+    std::vector<int> out;
+    for (int32_t br = 0; br + block_size <= abs_height; ++br) {
+        for (int32_t bc = 0; bc + block_size <= width; ++bc) {
+            double sum = 0.0;
+            int n = 0;
+            for (int r = 0; r < block_size; ++r) {
+                for (int c = 0; c < block_size; ++c) {
+                    sum += lum[(size_t)(br + r) * (size_t)width + (size_t)(bc + c)];
+                    ++n;
+                }
+            }
+            double mean = sum / (double)n;
+            double sq_sum = 0.0;
+            for (int r = 0; r < block_size; ++r) {
+                for (int c = 0; c < block_size; ++c) {
+                    double d = lum[(size_t)(br + r) * (size_t)width + (size_t)(bc + c)] - mean;
+                    sq_sum += d * d;
+                }
+            }
+            if (std::sqrt(sq_sum / (double)n) < contrast_threshold) {
+                for (int r = 0; r < block_size; ++r) {
+                    for (int c = 0; c < block_size; ++c) {
+                        out.push_back((br + r) * width + (bc + c));
+                    }
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// Fill an image with a deterministic mix of flat patches, two-level
+// patterns that hit the threshold exactly, and noise.
+static void fill_mixed_pattern(BmpImage *img, uint32_t seed)
+{
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    uint32_t state = seed;
+    for (int32_t row = 0; row < abs_height; ++row) {
+        for (int32_t col = 0; col < img->width; ++col) {
+            state = state * 1664525u + 1013904223u;
+            size_t base = (size_t)row * (size_t)img->stride + (size_t)col * 3u;
+            int region = (col / 8 + row / 8) % 3;
+            for (int ch = 0; ch < 3; ++ch) {
+                unsigned char v;
+                if (region == 0) {
+                    v = (unsigned char)(120 + ((state >> (8 + ch)) & 1u));
+                } else if (region == 1) {
+                    v = (unsigned char)(((col + row) & 1) ? 102 : 100);
+                } else {
+                    v = (unsigned char)((state >> (8 * ch)) & 0xFFu);
+                }
+                img->data[base + (size_t)ch] = v;
+            }
+        }
+    }
+}
+
+// 4) Integral-image selection matches the original two-pass selection.
+TEST(StegSelectionTest, MatchesReferenceScan)
+{
+    BmpImage img;
+    create_test_image(37, 29, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 12345u);
+
+    const int block_sizes[] = {1, 2, 4, 8};
+    const double thresholds[] = {0.0, 0.5, 1.0, 5.0, 40.0};
+
+    for (int block_size : block_sizes) {
+        for (double threshold : thresholds) {
+            EmbedPosition *positions = nullptr;
+            size_t count = 0;
+            ASSERT_EQ(find_low_contrast_positions(&img, block_size, threshold,
+                                                  &positions, &count), 0);
+
+            std::vector<int> expected = reference_positions(&img, block_size, threshold);
+            ASSERT_EQ(count, expected.size())
+                << "block_size=" << block_size << " threshold=" << threshold;
+            for (size_t i = 0; i < count; ++i) {
+                ASSERT_EQ(positions[i].pixel_index, expected[i]);
+            }
+            std::free(positions);
+        }
+    }
+
+    bmp_free(&img);
+}
+
+// 5) The bitmap selection is the deduplicated union of the block footprints.
+TEST(StegSelectionTest, BitmapIsUnionOfBlockPixels)
+{
+    BmpImage img;
+    create_test_image(37, 29, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 777u);
+
+    const int block_sizes[] = {1, 3, 8};
+    for (int block_size : block_sizes) {
+        EmbedPosition *positions = nullptr;
+        size_t count = 0;
+        ASSERT_EQ(find_low_contrast_positions(&img, block_size, 5.0,
+                                              &positions, &count), 0);
+
+        std::vector<bool> expected((size_t)img.width * (size_t)img.height, false);
+        for (size_t i = 0; i < count; ++i) {
+            expected[(size_t)positions[i].pixel_index] = true;
+        }
+        std::free(positions);
+
+        StegBitmap bitmap;
+        ASSERT_EQ(find_low_contrast_bitmap(&img, block_size, 5.0, &bitmap), 0);
+        size_t set = 0;
+        for (size_t i = 0; i < expected.size(); ++i) {
+            bool bit = ((bitmap.bits[i / 64] >> (i % 64)) & 1u) != 0;
+            ASSERT_EQ(bit, (bool)expected[i]) << "pixel " << i;
+            set += bit ? 1u : 0u;
+        }
+        EXPECT_EQ(bitmap.count, set);
+        steg_bitmap_free(&bitmap);
+    }
+
+    bmp_free(&img);
+}
+
+// 6) Images written in the legacy layout are still decoded.
+TEST(StegIntegrationTest, LegacyLayoutStillDecodes)
+{
+    BmpImage img;
+    create_test_image(16, 16, 100, 100, 100, &img);
+
+    const char *msg = "legacy payload";
+    size_t msg_len = std::strlen(msg);
+
+    // block_size 1 has no overlapping footprints, so the legacy layout is
+    // lossless here.
+    ASSERT_EQ(steg_encode_message_format(&img, (const uint8_t *)msg, msg_len,
+                                         1, 1.0, STEG_FORMAT_LEGACY), 0);
+
+    uint8_t *decoded = nullptr;
+    size_t decoded_len = 0;
+    ASSERT_EQ(steg_decode_message(&img, &decoded, &decoded_len, 1, 1.0), 0);
+    ASSERT_EQ(decoded_len, msg_len);
+    EXPECT_EQ(std::memcmp(decoded, msg, msg_len), 0);
+
+    std::free(decoded);
+    bmp_free(&img);
+}
+
+// 7) The fixed-point luma path selects exactly what the double path selects,
+// including blocks whose stddev lands right on the threshold.
+TEST(StegSelectionTest, FixedPointLumaMatchesDoublePath)
+{
+    BmpImage img;
+    create_test_image(48, 40, 0, 0, 0, &img);
+
+    // Smooth colour gradients with low-amplitude noise: block stddevs spread
+    // densely around the thresholds swept below.
+    uint32_t state = 99u;
+    for (int32_t row = 0; row < img.height; ++row) {
+        for (int32_t col = 0; col < img.width; ++col) {
+            size_t base = (size_t)row * (size_t)img.stride + (size_t)col * 3u;
+            for (int ch = 0; ch < 3; ++ch) {
+                state = state * 1664525u + 1013904223u;
+                int v = 40 + col * (ch + 1) + row * (3 - ch) + (int)((state >> 24) % 9u);
+                img.data[base + (size_t)ch] = (unsigned char)(v & 0xFF);
+            }
+        }
+    }
+
+    const int block_sizes[] = {2, 3, 5};
+    for (int block_size : block_sizes) {
+        for (int step = 1; step <= 40; ++step) {
+            double threshold = 0.25 * (double)step;
+
+            EmbedPosition *positions = nullptr;
+            size_t count = 0;
+            ASSERT_EQ(find_low_contrast_positions(&img, block_size, threshold,
+                                                  &positions, &count), 0);
+
+            std::vector<int> expected = reference_positions(&img, block_size, threshold);
+            ASSERT_EQ(count, expected.size())
+                << "block_size=" << block_size << " threshold=" << threshold;
+            for (size_t i = 0; i < count; ++i) {
+                ASSERT_EQ(positions[i].pixel_index, expected[i]);
+            }
+            std::free(positions);
+        }
+    }
+
+    bmp_free(&img);
+}
+
+// 8) Every SIMD luma kernel available on this CPU matches the scalar kernel,
+// for all row widths around the vector sizes, every channel mask and both
+// pixel sizes.
+TEST(StegLumaTest, KernelsMatchScalar)
+{
+    for (int32_t pixel_bytes : {3, 4}) {
+        LumaRowFn scalar = luma_row_kernel_px(LUMA_KERNEL_SCALAR, pixel_bytes);
+        ASSERT_NE(scalar, nullptr);
+
+        for (int k = 0; k < LUMA_KERNEL_COUNT; ++k) {
+            LumaRowFn kernel = luma_row_kernel_px((LumaKernel)k, pixel_bytes);
+            if (kernel == nullptr) {
+                continue;
+            }
+
+            uint32_t state = 2024u + (uint32_t)k;
+            for (int32_t width = 0; width <= 100; ++width) {
+                // Exact-size buffer: kernels must not read past the last pixel.
+                std::vector<unsigned char> bgr((size_t)width * (size_t)pixel_bytes + 1u);
+                for (size_t i = 0; i < bgr.size(); ++i) {
+                    state = state * 1664525u + 1013904223u;
+                    bgr[i] = (unsigned char)(state >> 24);
+                }
+
+                for (int bits = 1; bits <= STEG_MAX_BITS_PER_CHANNEL; ++bits) {
+                    unsigned char mask = LUMA_CHANNEL_MASK(bits);
+                    std::vector<uint16_t> expected((size_t)width + 1u);
+                    std::vector<uint16_t> actual((size_t)width + 1u);
+                    scalar(bgr.data(), expected.data(), width, mask);
+                    kernel(bgr.data(), actual.data(), width, mask);
+
+                    for (int32_t col = 0; col < width; ++col) {
+                        ASSERT_EQ(actual[(size_t)col], expected[(size_t)col])
+                            << luma_kernel_name((LumaKernel)k) << " pixel_bytes=" << pixel_bytes
+                            << " width=" << width << " bits=" << bits << " col=" << col;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// 9) Payload bits go out MSB-first, R then G then B, in raster order, and
+// nothing but channel LSBs is touched.
+TEST(StegIntegrationTest, PackedBitsWireFormat)
+{
+    BmpImage img;
+    create_test_image(7, 5, 90, 90, 90, &img);
+
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    const uint8_t msg[2] = {0x5A, 0xC3};
+    ASSERT_EQ(steg_encode_message_format(&img, msg, sizeof(msg), 1, 1.0, STEG_FORMAT_BITMAP),
+              0);
+
+    uint8_t expected[8] = {STEG_FORMAT_TAG(STEG_FORMAT_BITMAP), 2, 0, 0, 0, 0, 0x5A, 0xC3};
+    expected[5] = payload_check_byte(expected, 5);
+    size_t bit = 0;
+    for (int32_t row = 0; row < img.height && bit < sizeof(expected) * 8u; ++row) {
+        for (int32_t col = 0; col < img.width && bit < sizeof(expected) * 8u; ++col) {
+            size_t base = (size_t)row * (size_t)img.stride + (size_t)col * 3u;
+            for (int channel = 2; channel >= 0 && bit < sizeof(expected) * 8u; --channel) {
+                unsigned want = (expected[bit / 8] >> (7 - bit % 8)) & 1u;
+                ASSERT_EQ(img.data[base + (size_t)channel] & 1u, want) << "bit " << bit;
+                ++bit;
+            }
+        }
+    }
+
+    for (int32_t i = 0; i < img.size; ++i) {
+        EXPECT_EQ(img.data[i] & 0xFEu, original[(size_t)i] & 0xFEu);
+    }
+
+    bmp_free(&img);
+}
+
+// 10) Longer binary payload whose length is not a multiple of 3 bits.
+TEST(StegIntegrationTest, BinaryPayloadRoundTrip)
+{
+    BmpImage img;
+    create_test_image(64, 48, 30, 60, 90, &img);
+
+    std::vector<uint8_t> msg(1001);
+    uint32_t state = 5u;
+    for (size_t i = 0; i < msg.size(); ++i) {
+        state = state * 1664525u + 1013904223u;
+        msg[i] = (uint8_t)(state >> 24);
+    }
+
+    ASSERT_EQ(steg_encode_message(&img, msg.data(), msg.size(), 8, 5.0), 0);
+
+    uint8_t *decoded = nullptr;
+    size_t decoded_len = 0;
+    ASSERT_EQ(steg_decode_message(&img, &decoded, &decoded_len, 8, 5.0), 0);
+    ASSERT_EQ(decoded_len, msg.size());
+    EXPECT_EQ(std::memcmp(decoded, msg.data(), msg.size()), 0);
+
+    std::free(decoded);
+    bmp_free(&img);
+}
+
+// 11) The iterator only reads the rows it needs and yields the same
+// positions as the array and bitmap APIs.
+TEST(StegSelectionTest, PositionIteratorIsLazy)
+{
+    BmpImage img;
+    create_test_image(512, 384, 70, 70, 70, &img);
+
+    StegPositionIter *iter = nullptr;
+    ASSERT_EQ(steg_position_iter_create(&img, 8, 5.0, STEG_FORMAT_BITMAP, &iter), 0);
+
+    EmbedPosition position;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(steg_position_iter_next(iter, &position), 1);
+        EXPECT_EQ(position.pixel_index, i);
+    }
+    // 1000 pixels lie in the first two rows; those need block rows 0 and 1,
+    // i.e. image rows 0..8.
+    EXPECT_LE(steg_position_iter_rows_scanned(iter), 9);
+    steg_position_iter_free(iter);
+
+    bmp_free(&img);
+}
+
+TEST(StegSelectionTest, PositionIteratorMatchesCollectedForms)
+{
+    BmpImage img;
+    create_test_image(37, 29, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 4242u);
+
+    StegBitmap bitmap;
+    ASSERT_EQ(find_low_contrast_bitmap(&img, 3, 5.0, &bitmap), 0);
+
+    StegPositionIter *iter = nullptr;
+    ASSERT_EQ(steg_position_iter_create(&img, 3, 5.0, STEG_FORMAT_BITMAP, &iter), 0);
+    EmbedPosition position;
+    size_t yielded = 0;
+    int prev = -1;
+    while (steg_position_iter_next(iter, &position)) {
+        size_t i = (size_t)position.pixel_index;
+        EXPECT_GT(position.pixel_index, prev);
+        EXPECT_TRUE((bitmap.bits[i / 64] >> (i % 64)) & 1u);
+        prev = position.pixel_index;
+        ++yielded;
+    }
+    EXPECT_EQ(yielded, bitmap.count);
+    steg_position_iter_free(iter);
+    steg_bitmap_free(&bitmap);
+
+    bmp_free(&img);
+}
+
+// 12) A failed encode leaves the cover untouched.
+TEST(StegIntegrationTest, TooLargeMessageLeavesImageUnchanged)
+{
+    BmpImage img;
+    create_test_image(16, 16, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 31u);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    std::vector<uint8_t> msg(4096, 0xA5);
+    EXPECT_EQ(steg_encode_message(&img, msg.data(), msg.size(), 2, 5.0), -1);
+    EXPECT_EQ(std::memcmp(img.data, original.data(), original.size()), 0);
+
+    bmp_free(&img);
+}
+
+// 13) Band-parallel scans merge to exactly the serial results, whatever the
+// number of threads and however bitmap words straddle the bands.
+TEST(StegSelectionTest, ParallelScanMatchesSerial)
+{
+    const int32_t sizes[][2] = {{131, 97}, {64, 200}, {5, 300}, {3, 3}};
+    const int block_sizes[] = {1, 3, 8};
+    const int thread_counts[] = {1, 2, 3, 8};
+
+    for (const auto &size : sizes) {
+        BmpImage img;
+        create_test_image(size[0], size[1], 0, 0, 0, &img);
+        fill_mixed_pattern(&img, 1000u + (uint32_t)size[0]);
+
+        for (int block_size : block_sizes) {
+            EmbedPosition *serial_pos = nullptr;
+            size_t serial_count = 0;
+            ASSERT_EQ(find_low_contrast_positions(&img, block_size, 5.0,
+                                                  &serial_pos, &serial_count), 0);
+            StegBitmap serial_bitmap;
+            ASSERT_EQ(find_low_contrast_bitmap(&img, block_size, 5.0, &serial_bitmap), 0);
+            size_t words = ((size_t)size[0] * (size_t)size[1] + 63u) / 64u;
+
+            for (int threads : thread_counts) {
+                StegThreadPool *pool = steg_thread_pool_create(threads);
+                ASSERT_NE(pool, nullptr);
+                EXPECT_EQ(steg_thread_pool_size(pool), threads);
+
+                EmbedPosition *pos = nullptr;
+                size_t count = 0;
+                ASSERT_EQ(find_low_contrast_positions_parallel(&img, block_size, 5.0, pool,
+                                                               &pos, &count), 0);
+                ASSERT_EQ(count, serial_count);
+                for (size_t i = 0; i < count; ++i) {
+                    ASSERT_EQ(pos[i].pixel_index, serial_pos[i].pixel_index);
+                }
+                free(pos);
+
+                StegBitmap bitmap;
+                ASSERT_EQ(find_low_contrast_bitmap_parallel(&img, block_size, 5.0, pool,
+                                                            &bitmap), 0);
+                EXPECT_EQ(bitmap.count, serial_bitmap.count);
+                EXPECT_EQ(std::memcmp(bitmap.bits, serial_bitmap.bits,
+                                      words * sizeof(uint64_t)), 0)
+                    << size[0] << "x" << size[1] << " bs=" << block_size
+                    << " threads=" << threads;
+                steg_bitmap_free(&bitmap);
+
+                steg_thread_pool_destroy(pool);
+            }
+
+            free(serial_pos);
+            steg_bitmap_free(&serial_bitmap);
+        }
+
+        bmp_free(&img);
+    }
+}
+
+// Helper: fill in a minimal valid 24-bit (or 32-bit) BMP header for img.
+static void set_bmp_header(BmpImage *img)
+{
+    unsigned char *h = img->header;
+    uint32_t file_size = 54u + (uint32_t)img->size;
+    uint32_t data_offset = 54u;
+    uint32_t info_size = 40u;
+    uint16_t planes = 1;
+    uint16_t bpp = (uint16_t)(bmp_pixel_bytes(img) * 8);
+    uint32_t image_size = (uint32_t)img->size;
+
+    std::memset(h, 0, 54);
+    h[0] = 'B';
+    h[1] = 'M';
+    std::memcpy(h + 2, &file_size, 4);
+    std::memcpy(h + 10, &data_offset, 4);
+    std::memcpy(h + 14, &info_size, 4);
+    std::memcpy(h + 18, &img->width, 4);
+    std::memcpy(h + 22, &img->height, 4);
+    std::memcpy(h + 26, &planes, 2);
+    std::memcpy(h + 28, &bpp, 2);
+    std::memcpy(h + 34, &image_size, 4);
+}
+
+// 14) Mapped covers: copy-on-write encode leaves the input file alone and
+// an in-place save rewrites only the rows the payload touched.
+TEST(BmpMappedTest, CopyOnWriteEncodeAndInPlaceSave)
+{
+    std::string in_path = ::testing::TempDir() + "steg_mapped_in.bmp";
+    std::string out_path = ::testing::TempDir() + "steg_mapped_out.bmp";
+
+    BmpImage src;
+    create_test_image(33, 120, 0, 0, 0, &src);
+    fill_mixed_pattern(&src, 99u);
+    set_bmp_header(&src);
+    ASSERT_EQ(bmp_save(in_path.c_str(), &src), 0);
+    ASSERT_EQ(bmp_save(out_path.c_str(), &src), 0);
+
+    BmpImage img;
+    ASSERT_EQ(bmp_load_mapped(in_path.c_str(), &img, BMP_STORAGE_MAP_COPY), 0);
+    EXPECT_EQ(img.size, src.size);
+    EXPECT_EQ(std::memcmp(img.data, src.data, (size_t)src.size), 0);
+    EXPECT_GE(img.dirty_begin, img.dirty_end);
+
+    const char *msg = "mapped";
+    ASSERT_EQ(steg_encode_message(&img, (const uint8_t *)msg, std::strlen(msg), 3, 5.0), 0);
+    EXPECT_LT(img.dirty_begin, img.dirty_end);
+    EXPECT_LT(img.dirty_end - img.dirty_begin, 120);
+
+    // Rows outside the dirty range are unchanged.
+    for (int32_t row = 0; row < 120; ++row) {
+        if (row >= img.dirty_begin && row < img.dirty_end) {
+            continue;
+        }
+        size_t off = (size_t)row * (size_t)img.stride;
+        ASSERT_EQ(std::memcmp(img.data + off, src.data + off, (size_t)img.stride), 0);
+    }
+
+    ASSERT_EQ(bmp_save_in_place(out_path.c_str(), &img), 0);
+
+    // The input file still holds the original pixels.
+    BmpImage reread;
+    ASSERT_EQ(bmp_load(in_path.c_str(), &reread), 0);
+    EXPECT_EQ(std::memcmp(reread.data, src.data, (size_t)src.size), 0);
+    bmp_free(&reread);
+
+    // The patched output decodes through a read-only mapping.
+    BmpImage out;
+    ASSERT_EQ(bmp_load_mapped(out_path.c_str(), &out, BMP_STORAGE_MAP_READ), 0);
+    EXPECT_EQ(std::memcmp(out.data, img.data, (size_t)img.size), 0);
+
+    uint8_t *decoded = nullptr;
+    size_t decoded_len = 0;
+    ASSERT_EQ(steg_decode_message(&out, &decoded, &decoded_len, 3, 5.0), 0);
+    ASSERT_EQ(decoded_len, std::strlen(msg));
+    EXPECT_EQ(std::memcmp(decoded, msg, decoded_len), 0);
+    free(decoded);
+
+    bmp_free(&out);
+    bmp_free(&img);
+    bmp_free(&src);
+    std::remove(in_path.c_str());
+    std::remove(out_path.c_str());
+}
+
+// Helper: a message length that fits the bitmap layout of img.
+static size_t bitmap_capacity_hint(const BmpImage *img)
+{
+    StegBitmap bitmap;
+    if (find_low_contrast_bitmap(img, 3, 5.0, &bitmap) != 0) {
+        return 0;
+    }
+    size_t bytes = bitmap.count * 3u / 8u;
+    steg_bitmap_free(&bitmap);
+    return bytes > 5u ? (bytes - 5u) / 2u : 0u;
+}
+
+// 15) Context entry points match the allocating ones and reuse their scratch
+// memory once the largest image has been seen.
+TEST(StegContextTest, MatchesAllocatingApiAndReusesScratch)
+{
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+
+    BmpImage small_img;
+    BmpImage large_img;
+    create_test_image(23, 17, 0, 0, 0, &small_img);
+    create_test_image(64, 48, 0, 0, 0, &large_img);
+    fill_mixed_pattern(&small_img, 5u);
+    fill_mixed_pattern(&large_img, 6u);
+
+    const uint8_t *prev_message = nullptr;
+    for (int round = 0; round < 3; ++round) {
+        for (BmpImage *img : {&large_img, &small_img}) {
+            EmbedPosition *positions = nullptr;
+            size_t count = 0;
+            ASSERT_EQ(find_low_contrast_positions(img, 3, 5.0, &positions, &count), 0);
+            const EmbedPosition *ctx_positions = nullptr;
+            size_t ctx_count = 0;
+            ASSERT_EQ(find_low_contrast_positions_ctx(ctx, img, 3, 5.0,
+                                                      &ctx_positions, &ctx_count), 0);
+            ASSERT_EQ(ctx_count, count);
+            for (size_t i = 0; i < count; ++i) {
+                ASSERT_EQ(ctx_positions[i].pixel_index, positions[i].pixel_index);
+            }
+            free(positions);
+
+            StegBitmap bitmap;
+            ASSERT_EQ(find_low_contrast_bitmap(img, 3, 5.0, &bitmap), 0);
+            StegBitmap ctx_bitmap;
+            ASSERT_EQ(find_low_contrast_bitmap_ctx(ctx, img, 3, 5.0, &ctx_bitmap), 0);
+            size_t words = ((size_t)img->width * (size_t)img->height + 63u) / 64u;
+            EXPECT_EQ(ctx_bitmap.count, bitmap.count);
+            EXPECT_EQ(std::memcmp(ctx_bitmap.bits, bitmap.bits, words * 8u), 0);
+            steg_bitmap_free(&bitmap);
+
+            std::vector<uint8_t> msg(bitmap_capacity_hint(img), (uint8_t)(0x30 + round));
+            std::vector<unsigned char> copy(img->data, img->data + img->size);
+            ASSERT_EQ(steg_encode_message_ctx(ctx, img, msg.data(), msg.size(), 3, 5.0), 0);
+            std::vector<unsigned char> encoded(img->data, img->data + img->size);
+            std::memcpy(img->data, copy.data(), copy.size());
+            ASSERT_EQ(steg_encode_message(img, msg.data(), msg.size(), 3, 5.0), 0);
+            EXPECT_EQ(std::memcmp(img->data, encoded.data(), encoded.size()), 0);
+
+            const uint8_t *decoded = nullptr;
+            size_t decoded_len = 0;
+            ASSERT_EQ(steg_decode_message_ctx(ctx, img, &decoded, &decoded_len, 3, 5.0), 0);
+            ASSERT_EQ(decoded_len, msg.size());
+            EXPECT_EQ(std::memcmp(decoded, msg.data(), msg.size()), 0);
+
+            // The large image comes first, so later calls fit the buffers.
+            if (round > 0) {
+                EXPECT_EQ(decoded, prev_message);
+            }
+            prev_message = decoded;
+        }
+    }
+
+    bmp_free(&small_img);
+    bmp_free(&large_img);
+    steg_context_destroy(ctx);
+}
+
+// 16) Capacity query counts exactly what encode can use; the estimate mode
+// lands close to it.
+TEST(StegCapacityTest, ExactMatchesEncodeAndEstimateIsClose)
+{
+    BmpImage img;
+    create_test_image(53, 41, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 77u);
+
+    StegBitmap bitmap;
+    ASSERT_EQ(find_low_contrast_bitmap(&img, 3, 5.0, &bitmap), 0);
+    StegCapacity capacity;
+    ASSERT_EQ(steg_query_capacity(&img, 3, 5.0, STEG_CAPACITY_EXACT, &capacity), 0);
+    EXPECT_EQ(capacity.selected_pixels, bitmap.count);
+    EXPECT_EQ(capacity.bits, bitmap.count * 3u);
+    EXPECT_EQ(capacity.estimated, 0);
+    steg_bitmap_free(&bitmap);
+
+    // Too small to sample: the estimate is the exact count.
+    StegCapacity small_estimate;
+    ASSERT_EQ(steg_query_capacity(&img, 3, 5.0, STEG_CAPACITY_ESTIMATE, &small_estimate), 0);
+    EXPECT_EQ(small_estimate.bits, capacity.bits);
+    EXPECT_EQ(small_estimate.estimated, 0);
+
+    ASSERT_GT(capacity.max_message_len, 0u);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+    std::vector<uint8_t> msg(capacity.max_message_len + 1u, 0x5A);
+    EXPECT_EQ(steg_encode_message(&img, msg.data(), msg.size(), 3, 5.0), -1);
+    EXPECT_EQ(steg_encode_message(&img, msg.data(), msg.size() - 1u, 3, 5.0), 0);
+    std::memcpy(img.data, original.data(), original.size());
+    bmp_free(&img);
+
+    BmpImage large;
+    create_test_image(640, 512, 0, 0, 0, &large);
+    fill_mixed_pattern(&large, 78u);
+    StegCapacity exact;
+    StegCapacity estimate;
+    ASSERT_EQ(steg_query_capacity(&large, 4, 5.0, STEG_CAPACITY_EXACT, &exact), 0);
+    ASSERT_EQ(steg_query_capacity(&large, 4, 5.0, STEG_CAPACITY_ESTIMATE, &estimate), 0);
+    EXPECT_EQ(estimate.estimated, 1);
+    EXPECT_NEAR((double)estimate.bits, (double)exact.bits, 0.1 * (double)exact.bits);
+    bmp_free(&large);
+}
+
+// Helper: read a whole file.
+static std::vector<unsigned char> read_file_bytes(const std::string &path)
+{
+    std::vector<unsigned char> bytes;
+    FILE *f = std::fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        return bytes;
+    }
+    unsigned char buf[4096];
+    size_t n = 0;
+    while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) {
+        bytes.insert(bytes.end(), buf, buf + n);
+    }
+    std::fclose(f);
+    return bytes;
+}
+
+// 17) Streaming encode writes the same file as load + encode + save, for
+// bottom-up and top-down covers, removes its output on failure and refuses
+// to write over its input under any spelling.
+TEST(StegStreamingTest, MatchesInMemoryEncode)
+{
+    std::string in_path = ::testing::TempDir() + "steg_stream_in.bmp";
+    std::string out_path = ::testing::TempDir() + "steg_stream_out.bmp";
+    std::string ref_path = ::testing::TempDir() + "steg_stream_ref.bmp";
+
+    for (int32_t height : {57, -57}) {
+        for (int block_size : {1, 4, 8}) {
+            BmpImage img;
+            create_test_image(45, height, 0, 0, 0, &img);
+            fill_mixed_pattern(&img, 500u + (uint32_t)block_size);
+            set_bmp_header(&img);
+            ASSERT_EQ(bmp_save(in_path.c_str(), &img), 0);
+
+            StegCapacity capacity;
+            ASSERT_EQ(steg_query_capacity(&img, block_size, 5.0, STEG_CAPACITY_EXACT,
+                                          &capacity), 0);
+            ASSERT_GT(capacity.max_message_len, 0u);
+            std::vector<uint8_t> msg(capacity.max_message_len);
+            for (size_t i = 0; i < msg.size(); ++i) {
+                msg[i] = (uint8_t)(i * 37u + 11u);
+            }
+
+            ASSERT_EQ(steg_encode_file_streaming(in_path.c_str(), out_path.c_str(),
+                                                 msg.data(), msg.size(), block_size, 5.0), 0);
+            ASSERT_EQ(steg_encode_message(&img, msg.data(), msg.size(), block_size, 5.0), 0);
+            ASSERT_EQ(bmp_save(ref_path.c_str(), &img), 0);
+            EXPECT_EQ(read_file_bytes(out_path), read_file_bytes(ref_path))
+                << "height=" << height << " bs=" << block_size;
+
+            // One byte more does not fit: no output is left behind.
+            msg.push_back(0);
+            EXPECT_EQ(steg_encode_file_streaming(in_path.c_str(), out_path.c_str(),
+                                                 msg.data(), msg.size(), block_size, 5.0), -1);
+            EXPECT_TRUE(read_file_bytes(out_path).empty());
+
+            bmp_free(&img);
+        }
+    }
+
+    // The input under another spelling is refused and left intact.
+    std::vector<unsigned char> cover = read_file_bytes(in_path);
+    ASSERT_FALSE(cover.empty());
+    std::string dir = ::testing::TempDir() + "steg_stream_dir";
+    mkdir(dir.c_str(), 0755);
+    std::string alias = dir + "/../steg_stream_in.bmp";
+    std::string link_path = ::testing::TempDir() + "steg_stream_link.bmp";
+    ASSERT_EQ(link(in_path.c_str(), link_path.c_str()), 0);
+    const uint8_t byte = 0x5A;
+    for (const std::string &out : {alias, link_path}) {
+        EXPECT_NE(steg_encode_file_streaming(in_path.c_str(), out.c_str(), &byte, 1, 4, 5.0), 0)
+            << out;
+        EXPECT_EQ(read_file_bytes(in_path), cover) << out;
+    }
+    std::remove(link_path.c_str());
+    rmdir(dir.c_str());
+
+    std::remove(in_path.c_str());
+    std::remove(ref_path.c_str());
+}
+
+// 18) The in-memory BMP API round-trips without touching disk, and the
+// zero-copy wrapper encodes straight into the caller's buffer.
+TEST(BmpMemoryTest, LoadSaveAndWrapRoundTrip)
+{
+    BmpImage img;
+    create_test_image(30, -22, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 321u);
+    set_bmp_header(&img);
+
+    unsigned char *file = nullptr;
+    size_t file_len = 0;
+    ASSERT_EQ(bmp_save_to_memory(&img, &file, &file_len), 0);
+    ASSERT_EQ(file_len, 54u + (size_t)img.size);
+
+    BmpImage copy;
+    ASSERT_EQ(bmp_load_from_memory(file, file_len, &copy), 0);
+    EXPECT_EQ(copy.width, 30);
+    EXPECT_EQ(copy.height, -22);
+    EXPECT_EQ(copy.storage, BMP_STORAGE_HEAP);
+    EXPECT_EQ(std::memcmp(copy.data, img.data, (size_t)img.size), 0);
+    bmp_free(&copy);
+    EXPECT_NE(bmp_load_from_memory(file, file_len - 1u, &copy), 0);
+
+    BmpImage wrapped;
+    ASSERT_EQ(bmp_wrap_memory(file, file_len, &wrapped), 0);
+    EXPECT_EQ(wrapped.data, file + 54);
+    EXPECT_EQ(wrapped.storage, BMP_STORAGE_BORROWED);
+
+    const char *msg = "no temp files";
+    ASSERT_EQ(steg_encode_message(&wrapped, (const uint8_t *)msg, std::strlen(msg), 2, 5.0), 0);
+    bmp_free(&wrapped); // leaves the buffer alone
+
+    // The caller's buffer now is the encoded file.
+    ASSERT_EQ(bmp_load_from_memory(file, file_len, &copy), 0);
+    uint8_t *decoded = nullptr;
+    size_t decoded_len = 0;
+    ASSERT_EQ(steg_decode_message(&copy, &decoded, &decoded_len, 2, 5.0), 0);
+    ASSERT_EQ(decoded_len, std::strlen(msg));
+    EXPECT_EQ(std::memcmp(decoded, msg, decoded_len), 0);
+    free(decoded);
+
+    bmp_free(&copy);
+    free(file);
+    bmp_free(&img);
+}
+
+// 19) Stats attached to a context count the work of each call: every block
+// is evaluated once per scan, the header and message bits are all written
+// and read back, and only the overlapping legacy layout writes a pixel twice.
+TEST(StegStatsTest, CountersTrackCalls)
+{
+    BmpImage img;
+    create_test_image(40, 30, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 99u);
+
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    StegStats stats;
+    std::memset(&stats, 0, sizeof(stats));
+    steg_context_set_stats(ctx, &stats);
+
+    const int bs = 4;
+    StegBitmap bitmap;
+    ASSERT_EQ(find_low_contrast_bitmap_ctx(ctx, &img, bs, 5.0, &bitmap), 0);
+    EXPECT_EQ(stats.calls, 1u);
+    EXPECT_EQ(stats.blocks_evaluated, (uint64_t)(40 - bs + 1) * (uint64_t)(30 - bs + 1));
+    EXPECT_GT(stats.blocks_accepted, 0u);
+    EXPECT_LE(stats.blocks_accepted, stats.blocks_evaluated);
+    EXPECT_LE(stats.blocks_exact, stats.blocks_evaluated);
+    EXPECT_GT(stats.peak_scratch_bytes, 0u);
+
+    const char *msg = "counted";
+    const size_t len = std::strlen(msg);
+    std::memset(&stats, 0, sizeof(stats));
+    ASSERT_EQ(steg_encode_message_ctx(ctx, &img, (const uint8_t *)msg, len, bs, 5.0), 0);
+    EXPECT_EQ(stats.calls, 1u);
+    EXPECT_EQ(stats.bits_written, (uint64_t)(3u + len) * 8u);
+    EXPECT_EQ(stats.duplicate_writes, 0u);
+    EXPECT_GE(stats.positions_emitted * 3u, stats.bits_written);
+    EXPECT_GE(stats.scan_seconds, stats.luma_seconds);
+
+    const uint8_t *out = nullptr;
+    size_t out_len = 0;
+    ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, bs, 5.0), 0);
+    ASSERT_EQ(out_len, len);
+    EXPECT_EQ(std::memcmp(out, msg, len), 0);
+    EXPECT_EQ(stats.calls, 2u);
+    EXPECT_EQ(stats.bits_read, (uint64_t)(3u + len) * 8u);
+
+    // Overlapping blocks of a flat cover revisit pixels in the legacy layout.
+    BmpImage flat;
+    create_test_image(24, 24, 80, 80, 80, &flat);
+    std::memset(&stats, 0, sizeof(stats));
+    ASSERT_EQ(steg_encode_message_format_ctx(ctx, &flat, (const uint8_t *)msg, len, bs, 5.0,
+                                             STEG_FORMAT_LEGACY), 0);
+    EXPECT_GT(stats.duplicate_writes, 0u);
+
+    // Detached stats stay untouched.
+    steg_context_set_stats(ctx, nullptr);
+    StegStats before = stats;
+    ASSERT_EQ(steg_encode_message_ctx(ctx, &flat, (const uint8_t *)msg, len, bs, 5.0), 0);
+    EXPECT_EQ(std::memcmp(&before, &stats, sizeof(stats)), 0);
+
+    steg_context_destroy(ctx);
+    bmp_free(&flat);
+    bmp_free(&img);
+}
+
+// 20) Multi-bit payloads round-trip at every depth, fill exactly the capacity
+// reported for that depth, only touch the low bits of each channel and leave
+// the selection for that depth unchanged.
+TEST(StegDepthTest, MultiBitRoundTripAndCapacity)
+{
+    BmpImage img;
+    create_test_image(48, 36, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 2718u);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    const int bs = 3;
+    for (int bits = 1; bits <= STEG_MAX_BITS_PER_CHANNEL; ++bits) {
+        std::memcpy(img.data, original.data(), original.size());
+
+        StegCapacity cap;
+        ASSERT_EQ(steg_query_capacity_depth(&img, bs, 5.0, bits, STEG_CAPACITY_EXACT, &cap), 0);
+        ASSERT_GT(cap.max_message_len, 0u);
+        EXPECT_EQ(cap.bits, cap.selected_pixels * 3u * (size_t)bits);
+
+        // One byte too many fails and leaves the cover untouched.
+        std::vector<uint8_t> msg(cap.max_message_len + 1u);
+        for (size_t i = 0; i < msg.size(); ++i) {
+            msg[i] = (uint8_t)(i * 37u + (unsigned)bits);
+        }
+        EXPECT_EQ(steg_encode_message_depth(&img, msg.data(), msg.size(), bs, 5.0, bits), -1);
+        EXPECT_EQ(std::memcmp(img.data, original.data(), original.size()), 0);
+
+        msg.pop_back();
+        ASSERT_EQ(steg_encode_message_depth(&img, msg.data(), msg.size(), bs, 5.0, bits), 0);
+
+        unsigned char low = (unsigned char)((1u << bits) - 1u);
+        for (size_t i = 0; i < original.size(); ++i) {
+            ASSERT_EQ(img.data[i] & (unsigned char)~low, original[i] & (unsigned char)~low)
+                << "bits=" << bits << " byte=" << i;
+        }
+
+        StegCapacity after;
+        ASSERT_EQ(steg_query_capacity_depth(&img, bs, 5.0, bits, STEG_CAPACITY_EXACT, &after), 0);
+        EXPECT_EQ(after.selected_pixels, cap.selected_pixels);
+
+        uint8_t *out = nullptr;
+        size_t out_len = 0;
+        ASSERT_EQ(steg_decode_message(&img, &out, &out_len, bs, 5.0), 0) << "bits=" << bits;
+        ASSERT_EQ(out_len, msg.size());
+        EXPECT_EQ(std::memcmp(out, msg.data(), out_len), 0);
+        std::free(out);
+    }
+
+    const uint8_t one = 1;
+    EXPECT_NE(steg_encode_message_depth(&img, &one, 1, bs, 5.0, 0), 0);
+    EXPECT_NE(steg_encode_message_depth(&img, &one, 1, bs, 5.0, STEG_MAX_BITS_PER_CHANNEL + 1),
+              0);
+
+    bmp_free(&img);
+}
+
+// 21) Embedding whole runs of pixels a word at a time lays the bits out
+// exactly as the slot order says, for payloads that start and end anywhere
+// inside a run, and extraction reads them back.
+TEST(StegIntegrationTest, RunEmbedMatchesSlotOrder)
+{
+    BmpImage img;
+    create_test_image(61, 23, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 4242u);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    const int bs = 2;
+    StegBitmap bitmap;
+    ASSERT_EQ(find_low_contrast_bitmap(&img, bs, 5.0, &bitmap), 0);
+
+    std::vector<size_t> order;
+    for (int32_t row = 0; row < img.height; ++row) {
+        for (int32_t col = 0; col < img.width; ++col) {
+            size_t idx = (size_t)row * (size_t)img.width + (size_t)col;
+            if ((bitmap.bits[idx / 64] >> (idx % 64)) & 1u) {
+                order.push_back((size_t)row * (size_t)img.stride + (size_t)col * 3u);
+            }
+        }
+    }
+    steg_bitmap_free(&bitmap);
+    ASSERT_GT(order.size(), 100u);
+
+    for (size_t len = 0; len <= 29; ++len) {
+        std::memcpy(img.data, original.data(), original.size());
+        std::vector<uint8_t> payload(6u + len);
+        payload[0] = STEG_FORMAT_TAG(STEG_FORMAT_BITMAP);
+        payload[1] = (uint8_t)len;
+        payload[5] = payload_check_byte(payload.data(), 5);
+        for (size_t i = 0; i < len; ++i) {
+            payload[6u + i] = (uint8_t)(i * 151u + len);
+        }
+        ASSERT_EQ(steg_encode_message_format(&img, payload.data() + 6, len, bs, 5.0,
+                                             STEG_FORMAT_BITMAP), 0);
+
+        std::vector<unsigned char> expected = original;
+        for (size_t bit = 0; bit < payload.size() * 8u; ++bit) {
+            size_t offset = order[bit / 3u] + (size_t)(2u - bit % 3u);
+            unsigned want = (payload[bit / 8u] >> (7u - bit % 8u)) & 1u;
+            expected[offset] = (unsigned char)((expected[offset] & 0xFEu) | want);
+        }
+        ASSERT_EQ(std::memcmp(img.data, expected.data(), expected.size()), 0) << "len=" << len;
+
+        uint8_t *out = nullptr;
+        size_t out_len = 0;
+        ASSERT_EQ(steg_decode_message(&img, &out, &out_len, bs, 5.0), 0);
+        ASSERT_EQ(out_len, len);
+        EXPECT_EQ(std::memcmp(out, payload.data() + 6, len), 0);
+        std::free(out);
+    }
+
+    bmp_free(&img);
+}
+
+static void decode_expect(StegSelectionCache *cache,
+                          const BmpImage *img,
+                          const std::vector<uint8_t> &expected,
+                          int block_size = 3,
+                          double contrast_threshold = 5.0)
+{
+    uint8_t *out = nullptr;
+    size_t out_len = 0;
+    ASSERT_EQ(steg_decode_message_cached(cache, img, &out, &out_len, block_size,
+                                         contrast_threshold),
+              0)
+        << "message of " << expected.size() << " bytes";
+    ASSERT_EQ(out_len, expected.size());
+    EXPECT_EQ(std::memcmp(out, expected.data(), out_len), 0);
+    std::free(out);
+}
+
+// 22) The selection cache serves every stego copy of a cover from one map,
+// from memory and from its sidecar directory, without changing what decodes;
+// legacy payloads bypass it.
+TEST(StegSelectionCacheTest, HitsAcrossCopiesAndProcesses)
+{
+    BmpImage cover;
+    create_test_image(40, 30, 0, 0, 0, &cover);
+    fill_mixed_pattern(&cover, 4242u);
+
+    std::vector<BmpImage> copies(3);
+    std::vector<std::vector<uint8_t>> messages(3);
+    for (size_t i = 0; i < copies.size(); ++i) {
+        create_test_image(40, 30, 0, 0, 0, &copies[i]);
+        std::memcpy(copies[i].data, cover.data, cover.size);
+        for (size_t j = 0; j < 5u + i * 7u; ++j) {
+            messages[i].push_back((uint8_t)(j * 31u + i));
+        }
+    }
+    ASSERT_EQ(steg_encode_message(&copies[0], messages[0].data(), messages[0].size(), 3, 5.0), 0);
+    ASSERT_EQ(steg_encode_message(&copies[1], messages[1].data(), messages[1].size(), 3, 5.0), 0);
+    // block_size 1 keeps the legacy layout lossless.
+    ASSERT_EQ(steg_encode_message_format(&copies[2], messages[2].data(), messages[2].size(), 1,
+                                         1.0, STEG_FORMAT_LEGACY),
+              0);
+
+    std::string dir = ::testing::TempDir() + "steg_selection_cache";
+    mkdir(dir.c_str(), 0700);
+
+    StegSelectionCacheStats cs;
+    StegSelectionCache *cache = steg_selection_cache_create(4, dir.c_str());
+    ASSERT_NE(cache, nullptr);
+    decode_expect(cache, &copies[0], messages[0]);
+    steg_selection_cache_get_stats(cache, &cs);
+    EXPECT_EQ(cs.memory_hits, 0u);
+    EXPECT_EQ(cs.disk_hits, 0u);
+    EXPECT_GE(cs.misses, 1u);
+    uint64_t misses = cs.misses;
+
+    decode_expect(cache, &copies[1], messages[1]);
+    steg_selection_cache_get_stats(cache, &cs);
+    EXPECT_EQ(cs.memory_hits, 1u);
+    EXPECT_EQ(cs.misses, misses);
+
+    // Through a context too.
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    steg_context_set_selection_cache(ctx, cache);
+    const uint8_t *ctx_out = nullptr;
+    size_t ctx_len = 0;
+    ASSERT_EQ(steg_decode_message_ctx(ctx, &copies[0], &ctx_out, &ctx_len, 3, 5.0), 0);
+    ASSERT_EQ(ctx_len, messages[0].size());
+    EXPECT_EQ(std::memcmp(ctx_out, messages[0].data(), ctx_len), 0);
+    steg_context_destroy(ctx);
+    steg_selection_cache_get_stats(cache, &cs);
+    EXPECT_EQ(cs.memory_hits, 2u);
+
+    // Legacy payloads scan as before.
+    decode_expect(cache, &copies[2], messages[2], 1, 1.0);
+    steg_selection_cache_destroy(cache);
+
+    // A cache that keeps nothing in memory reads the sidecar written above.
+    cache = steg_selection_cache_create(0, dir.c_str());
+    ASSERT_NE(cache, nullptr);
+    decode_expect(cache, &copies[1], messages[1]);
+    steg_selection_cache_get_stats(cache, &cs);
+    EXPECT_EQ(cs.memory_hits, 0u);
+    EXPECT_EQ(cs.disk_hits, 1u);
+    steg_selection_cache_destroy(cache);
+
+    // Without a cache nothing changes.
+    decode_expect(nullptr, &copies[1], messages[1]);
+    EXPECT_EQ(steg_selection_cache_create(4, (dir + "/missing").c_str()), nullptr);
+
+    DIR *d = opendir(dir.c_str());
+    ASSERT_NE(d, nullptr);
+    while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] != '.') {
+            std::remove((dir + "/" + e->d_name).c_str());
+        }
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+
+    for (BmpImage &copy : copies) {
+        bmp_free(&copy);
+    }
+    bmp_free(&cover);
+}
+
+// 23) Updating a payload keeps its depth, gives the same pixels as a fresh
+// encode at that depth and only writes (and marks dirty) the rows whose bits
+// change.
+TEST(StegUpdateTest, MatchesEncodeAndTouchesOnlyChangedRows)
+{
+    BmpImage img;
+    create_test_image(48, 60, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 1618u);
+    std::vector<unsigned char> cover(img.data, img.data + img.size);
+
+    const int bs = 3;
+    std::vector<uint8_t> first(120);
+    for (size_t i = 0; i < first.size(); ++i) {
+        first[i] = (uint8_t)(i * 13u + 7u);
+    }
+    ASSERT_EQ(steg_encode_message_depth(&img, first.data(), first.size(), bs, 5.0, 2), 0);
+    std::vector<unsigned char> stego(img.data, img.data + img.size);
+
+    // Change only the last byte: the header and most of the payload stay.
+    std::vector<uint8_t> second = first;
+    second.back() ^= 0xFFu;
+
+    BmpImage ref;
+    create_test_image(48, 60, 0, 0, 0, &ref);
+    std::memcpy(ref.data, stego.data(), stego.size());
+    ASSERT_EQ(steg_encode_message_depth(&ref, second.data(), second.size(), bs, 5.0, 2), 0);
+
+    img.dirty_begin = img.dirty_end = 0;
+    ASSERT_EQ(steg_update_message(&img, second.data(), second.size(), bs, 5.0), 0);
+    EXPECT_EQ(std::memcmp(img.data, ref.data, (size_t)img.size), 0);
+    ASSERT_LT(img.dirty_begin, img.dirty_end);
+    EXPECT_GT(img.dirty_begin, 0);
+    for (int32_t row = 0; row < 60; ++row) {
+        if (row >= img.dirty_begin && row < img.dirty_end) {
+            continue;
+        }
+        size_t off = (size_t)row * (size_t)img.stride;
+        ASSERT_EQ(std::memcmp(img.data + off, stego.data() + off, (size_t)img.stride), 0)
+            << "row " << row;
+    }
+
+    uint8_t *out = nullptr;
+    size_t out_len = 0;
+    ASSERT_EQ(steg_decode_message(&img, &out, &out_len, bs, 5.0), 0);
+    ASSERT_EQ(out_len, second.size());
+    EXPECT_EQ(std::memcmp(out, second.data(), out_len), 0);
+    std::free(out);
+
+    // The same payload again writes nothing.
+    img.dirty_begin = img.dirty_end = 0;
+    ASSERT_EQ(steg_update_message(&img, second.data(), second.size(), bs, 5.0), 0);
+    EXPECT_GE(img.dirty_begin, img.dirty_end);
+
+    // Too large: nothing changes.
+    StegCapacity cap;
+    ASSERT_EQ(steg_query_capacity_depth(&img, bs, 5.0, 2, STEG_CAPACITY_EXACT, &cap), 0);
+    std::vector<uint8_t> huge(cap.max_message_len + 1u, 0x5Au);
+    EXPECT_EQ(steg_update_message(&img, huge.data(), huge.size(), bs, 5.0), -1);
+    EXPECT_EQ(std::memcmp(img.data, ref.data, (size_t)img.size), 0);
+
+    // Through a context, with the selection from a cache filled by a decode.
+    StegSelectionCache *cache = steg_selection_cache_create(2, nullptr);
+    ASSERT_NE(cache, nullptr);
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    steg_context_set_selection_cache(ctx, cache);
+    const uint8_t *ctx_out = nullptr;
+    ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &ctx_out, &out_len, bs, 5.0), 0);
+    ASSERT_EQ(steg_update_message_ctx(ctx, &img, first.data(), first.size(), bs, 5.0), 0);
+    EXPECT_EQ(std::memcmp(img.data, stego.data(), stego.size()), 0);
+    StegSelectionCacheStats cs;
+    steg_selection_cache_get_stats(cache, &cs);
+    EXPECT_EQ(cs.memory_hits, 1u);
+    steg_context_destroy(ctx);
+    steg_selection_cache_destroy(cache);
+
+    // A cover without a payload gets a plain 1-bit encode.
+    std::memcpy(img.data, cover.data(), cover.size());
+    std::memcpy(ref.data, cover.data(), cover.size());
+    ASSERT_EQ(steg_update_message(&img, first.data(), first.size(), bs, 5.0), 0);
+    ASSERT_EQ(steg_encode_message(&ref, first.data(), first.size(), bs, 5.0), 0);
+    EXPECT_EQ(std::memcmp(img.data, ref.data, (size_t)img.size), 0);
+
+    bmp_free(&ref);
+    bmp_free(&img);
+}
+
+// Helper: every accept row of a scan of img from block row `from` on.
+static std::vector<uint8_t> scan_all_rows(const BmpImage *img,
+                                          int block_size,
+                                          double threshold,
+                                          int layout,
+                                          int32_t from,
+                                          int32_t *rows_read)
+{
+    ContrastScanner s;
+    EXPECT_EQ(contrast_scanner_init_layout(&s, img, block_size, threshold, layout, nullptr), 0);
+    contrast_scanner_seek(&s, from);
+    std::vector<uint8_t> rows((size_t)(s.max_row - from) * (size_t)s.max_col);
+    for (int32_t br = from; br < s.max_row; ++br) {
+        contrast_scanner_scan_row(&s, rows.data() + (size_t)(br - from) * (size_t)s.max_col);
+    }
+    *rows_read = contrast_scanner_rows_read(&s);
+    contrast_scanner_free(&s);
+    return rows;
+}
+
+// 24) The tiled scan accepts exactly the blocks the integral-image scan does,
+// across tile boundaries, from any starting block row and for blocks wider
+// than a tile.
+TEST(StegSelectionTest, TiledScanMatchesIntegral)
+{
+    struct Case {
+        int32_t width;
+        int32_t height;
+        int block_size;
+    };
+    const Case cases[] = {
+        {2 * CONTRAST_TILE_COLS + 37, 24, 1},
+        {2 * CONTRAST_TILE_COLS + 37, 24, 3},
+        {CONTRAST_TILE_COLS + 5, 30, 8},
+        {CONTRAST_TILE_COLS / 2, 20, 5},
+        {CONTRAST_TILE_COLS + 40, CONTRAST_TILE_COLS + 3, CONTRAST_TILE_COLS + 2},
+    };
+    const double thresholds[] = {0.0, 1.0, 5.0, 40.0};
+
+    for (const Case &c : cases) {
+        BmpImage img;
+        create_test_image(c.width, c.height, 0, 0, 0, &img);
+        fill_mixed_pattern(&img, (uint32_t)(c.width * 31 + c.block_size));
+        for (double t : thresholds) {
+            int32_t max_row = c.height - c.block_size + 1;
+            for (int32_t from : {0, max_row / 2}) {
+                int32_t read_integral = 0;
+                int32_t read_tiled = 0;
+                std::vector<uint8_t> integral = scan_all_rows(
+                    &img, c.block_size, t, CONTRAST_LAYOUT_INTEGRAL, from, &read_integral);
+                std::vector<uint8_t> tiled = scan_all_rows(
+                    &img, c.block_size, t, CONTRAST_LAYOUT_TILED, from, &read_tiled);
+                EXPECT_EQ(integral, tiled) << "width=" << c.width << " bs=" << c.block_size
+                                           << " t=" << t << " from=" << from;
+                EXPECT_EQ(read_integral, read_tiled);
+                EXPECT_EQ(read_tiled, c.height);
+            }
+        }
+        bmp_free(&img);
+    }
+}
+
+// 25) Device scans give exactly the serial selection, whether a device is
+// present (ties settled on the host) or the scan falls back to the CPU.
+TEST(StegSelectionTest, GpuScanMatchesSerial)
+{
+    StegGpu *gpu = steg_gpu_create();
+    EXPECT_NE(steg_gpu_device_name(gpu), nullptr);
+
+    const int32_t sizes[][2] = {{131, 97}, {5, 300}, {3, 3}};
+    const int block_sizes[] = {1, 3, 8, 300};
+    const double thresholds[] = {0.0, 1.0, 5.0, 40.0};
+
+    for (const auto &size : sizes) {
+        BmpImage img;
+        create_test_image(size[0], size[1], 0, 0, 0, &img);
+        fill_mixed_pattern(&img, 2000u + (uint32_t)size[0]);
+        size_t words = ((size_t)size[0] * (size_t)size[1] + 63u) / 64u;
+
+        for (int block_size : block_sizes) {
+            for (double t : thresholds) {
+                EmbedPosition *serial_pos = nullptr;
+                size_t serial_count = 0;
+                ASSERT_EQ(find_low_contrast_positions(&img, block_size, t, &serial_pos,
+                                                      &serial_count), 0);
+                EmbedPosition *pos = nullptr;
+                size_t count = 0;
+                ASSERT_EQ(find_low_contrast_positions_gpu(&img, block_size, t, gpu, &pos,
+                                                          &count), 0);
+                ASSERT_EQ(count, serial_count);
+                for (size_t i = 0; i < count; ++i) {
+                    ASSERT_EQ(pos[i].pixel_index, serial_pos[i].pixel_index);
+                }
+                free(pos);
+                free(serial_pos);
+
+                StegBitmap serial_bitmap;
+                ASSERT_EQ(find_low_contrast_bitmap(&img, block_size, t, &serial_bitmap), 0);
+                StegBitmap bitmap;
+                ASSERT_EQ(find_low_contrast_bitmap_gpu(&img, block_size, t, gpu, &bitmap), 0);
+                EXPECT_EQ(bitmap.count, serial_bitmap.count);
+                if (serial_bitmap.bits != nullptr) {
+                    EXPECT_EQ(std::memcmp(bitmap.bits, serial_bitmap.bits,
+                                          words * sizeof(uint64_t)), 0)
+                        << size[0] << "x" << size[1] << " bs=" << block_size << " t=" << t
+                        << " device=" << steg_gpu_device_name(gpu);
+                }
+                steg_bitmap_free(&bitmap);
+                steg_bitmap_free(&serial_bitmap);
+            }
+        }
+        bmp_free(&img);
+    }
+
+    steg_gpu_destroy(gpu);
+}
+
+// Helper: set the LSBs of img to bytes, MSB-first, R then G then B in raster
+// order (the slot order of a 1-bit tagged payload when every pixel is
+// selected).
+static void write_lsb_stream(BmpImage *img, const std::vector<uint8_t> &bytes)
+{
+    size_t bit = 0;
+    for (int32_t row = 0; row < img->height && bit < bytes.size() * 8u; ++row) {
+        for (int32_t col = 0; col < img->width && bit < bytes.size() * 8u; ++col) {
+            unsigned char *px = img->data + (size_t)row * (size_t)img->stride + (size_t)col * 3u;
+            for (int channel = 2; channel >= 0 && bit < bytes.size() * 8u; --channel) {
+                unsigned want = (bytes[bit / 8] >> (7 - bit % 8)) & 1u;
+                px[channel] = (unsigned char)((px[channel] & 0xFEu) | want);
+                ++bit;
+            }
+        }
+    }
+}
+
+// 26) The compact header is the tag, a varint length and a check byte: 3
+// bytes for short messages, one more from 128 bytes. Only the shortest
+// varint with the right check byte decodes,
+// tagged payloads of the older bitmap header still decode and keep that
+// header when updated, and an image without a payload is given up after a
+// byte per depth plus the legacy length.
+TEST(StegFormatTest, CompactHeaderFramesShortMessages)
+{
+    BmpImage img;
+    create_test_image(40, 30, 90, 90, 90, &img);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    StegStats stats;
+    steg_context_set_stats(ctx, &stats);
+
+    for (size_t len : {0u, 1u, 127u, 128u, 300u}) {
+        std::memcpy(img.data, original.data(), original.size());
+        std::vector<uint8_t> msg(len);
+        for (size_t i = 0; i < len; ++i) {
+            msg[i] = (uint8_t)(i * 29u + 7u);
+        }
+        size_t header = len < 128u ? 3u : 4u;
+
+        std::memset(&stats, 0, sizeof(stats));
+        ASSERT_EQ(steg_encode_message_ctx(ctx, &img, msg.data(), len, 1, 1.0), 0);
+        EXPECT_EQ(stats.bits_written, (uint64_t)(header + len) * 8u) << "len=" << len;
+
+        std::vector<uint8_t> expected = {STEG_FORMAT_COMPACT_TAG(1)};
+        if (len < 128u) {
+            expected.push_back((uint8_t)len);
+        } else {
+            expected.push_back((uint8_t)(0x80u | (len & 0x7Fu)));
+            expected.push_back((uint8_t)(len >> 7));
+        }
+        expected.push_back(payload_check_byte(expected.data(), expected.size()));
+        expected.insert(expected.end(), msg.begin(), msg.end());
+        std::vector<unsigned char> want = original;
+        BmpImage want_img = img;
+        want_img.data = want.data();
+        write_lsb_stream(&want_img, expected);
+        ASSERT_EQ(std::memcmp(img.data, want.data(), want.size()), 0) << "len=" << len;
+
+        const uint8_t *out = nullptr;
+        size_t out_len = 0;
+        std::memset(&stats, 0, sizeof(stats));
+        ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, 1, 1.0), 0);
+        ASSERT_EQ(out_len, len);
+        EXPECT_EQ(std::memcmp(out, msg.data(), len), 0);
+        EXPECT_EQ(stats.bits_read, (uint64_t)(header + len) * 8u);
+    }
+
+    // Hand-made headers: the shortest varint decodes, a redundant zero
+    // group, a length past 32 bits or a wrong check byte does not.
+    struct Framing {
+        std::vector<uint8_t> bytes;
+        int decodes;
+    };
+    const uint8_t tag = STEG_FORMAT_COMPACT_TAG(1);
+    const uint8_t short_header[] = {tag, 3};
+    const uint8_t long_header[] = {tag, 0x83, 0x00};
+    const uint8_t check = payload_check_byte(short_header, 2);
+    const Framing framings[] = {
+        {{tag, 3, check, 'a', 'b', 'c'}, 1},
+        {{tag, 3, (uint8_t)(check ^ 0x01u), 'a', 'b', 'c'}, 0},
+        {{tag, 3, 0, 'a', 'b', 'c'}, 0},
+        {{tag, 0x83, 0x00, payload_check_byte(long_header, 3), 'a', 'b', 'c'}, 0},
+        {{tag, 0x80, 0x80, 0x80, 0x80, 0x10}, 0},
+    };
+    for (const Framing &f : framings) {
+        // Every legacy length of a flat cover of 0xFF channels is implausible.
+        std::memset(img.data, 0xFF, (size_t)img.size);
+        write_lsb_stream(&img, f.bytes);
+        uint8_t *out = nullptr;
+        size_t out_len = 0;
+        int rc = steg_decode_message(&img, &out, &out_len, 1, 1.0);
+        EXPECT_EQ(rc == 0, f.decodes != 0);
+        if (rc == 0) {
+            ASSERT_EQ(out_len, 3u);
+            EXPECT_EQ(std::memcmp(out, "abc", 3), 0);
+        }
+        std::free(out);
+    }
+
+    // No payload: 8 bits at each depth, then the 32-bit legacy length.
+    std::memset(img.data, 0xFF, (size_t)img.size);
+    std::memset(&stats, 0, sizeof(stats));
+    const uint8_t *out = nullptr;
+    size_t out_len = 0;
+    EXPECT_NE(steg_decode_message_ctx(ctx, &img, &out, &out_len, 1, 1.0), 0);
+    EXPECT_EQ(stats.bits_read, (uint64_t)(8u * STEG_MAX_BITS_PER_CHANNEL + 32u));
+
+    // The bitmap header still decodes, and an update keeps it.
+    const uint8_t first[] = "first payload";
+    const uint8_t second[] = "second";
+    std::memcpy(img.data, original.data(), original.size());
+    ASSERT_EQ(steg_encode_message_format(&img, first, sizeof(first), 1, 1.0,
+                                         STEG_FORMAT_BITMAP), 0);
+    ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, 1, 1.0), 0);
+    ASSERT_EQ(out_len, sizeof(first));
+    EXPECT_EQ(std::memcmp(out, first, sizeof(first)), 0);
+    std::vector<unsigned char> fresh(img.data, img.data + img.size);
+    ASSERT_EQ(steg_update_message(&img, second, sizeof(second), 1, 1.0), 0);
+
+    BmpImage fresh_img = img;
+    fresh_img.data = fresh.data();
+    ASSERT_EQ(steg_encode_message_format(&fresh_img, second, sizeof(second), 1, 1.0,
+                                         STEG_FORMAT_BITMAP), 0);
+    EXPECT_EQ(std::memcmp(img.data, fresh.data(), fresh.size()), 0);
+
+    steg_context_destroy(ctx);
+    bmp_free(&img);
+}
+
+// 27) A compressed payload carries a message larger than the raw capacity,
+// decodes transparently, writes fewer bits than the raw message, keeps its
+// codec when updated and leaves the image untouched when even the
+// compressed frame does not fit. Codecs whose library is missing are
+// skipped.
+TEST(StegCompressionTest, CompressedPayloadRoundTrip)
+{
+    BmpImage img;
+    create_test_image(120, 80, 90, 90, 90, &img);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+    size_t raw_capacity = (size_t)img.width * (size_t)img.height * 3u / 8u;
+
+    std::string text;
+    for (int i = 0; text.size() < 2u * raw_capacity; ++i) {
+        text += "{\"id\":" + std::to_string(i) + ",\"name\":\"cover\",\"tags\":[\"a\",\"b\"]},";
+    }
+    const uint8_t *msg = (const uint8_t *)text.data();
+    ASSERT_EQ(steg_encode_message(&img, msg, text.size(), 1, 1.0), -1);
+
+    std::vector<uint8_t> noise(raw_capacity);
+    uint32_t seed = 12345u;
+    for (uint8_t &b : noise) {
+        seed = seed * 1103515245u + 12345u;
+        b = (uint8_t)(seed >> 24);
+    }
+
+    EXPECT_EQ(steg_codec_available(STEG_CODEC_NONE), 1);
+    EXPECT_NE(steg_encode_message_compressed(&img, msg, text.size(), 1, 1.0, 1, 7), 0);
+
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    StegStats stats;
+    steg_context_set_stats(ctx, &stats);
+
+    for (int codec : {STEG_CODEC_LZ4, STEG_CODEC_ZSTD}) {
+        if (!steg_codec_available(codec)) {
+            EXPECT_NE(steg_encode_message_compressed(&img, msg, text.size(), 1, 1.0, 1, codec), 0);
+            continue;
+        }
+        for (int bits = 1; bits <= 2; ++bits) {
+            std::memcpy(img.data, original.data(), original.size());
+            std::memset(&stats, 0, sizeof(stats));
+            ASSERT_EQ(steg_encode_message_compressed_ctx(ctx, &img, msg, text.size(), 1, 1.0,
+                                                         bits, codec), 0) << "codec=" << codec;
+            EXPECT_LT(stats.bits_written, (uint64_t)text.size() * 8u);
+
+            const uint8_t *out = nullptr;
+            size_t out_len = 0;
+            ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, 1, 1.0), 0);
+            ASSERT_EQ(out_len, text.size());
+            EXPECT_EQ(std::memcmp(out, msg, out_len), 0);
+
+            uint8_t *copy = nullptr;
+            ASSERT_EQ(steg_decode_message(&img, &copy, &out_len, 1, 1.0), 0);
+            ASSERT_EQ(out_len, text.size());
+            EXPECT_EQ(std::memcmp(copy, msg, out_len), 0);
+            std::free(copy);
+        }
+
+        // The update is a fresh compressed encode over the stego image.
+        std::string second = text.substr(0, text.size() / 3u);
+        const uint8_t *second_msg = (const uint8_t *)second.data();
+        std::vector<unsigned char> fresh(img.data, img.data + img.size);
+        ASSERT_EQ(steg_update_message(&img, second_msg, second.size(), 1, 1.0), 0);
+        BmpImage fresh_img = img;
+        fresh_img.data = fresh.data();
+        ASSERT_EQ(steg_encode_message_compressed(&fresh_img, second_msg, second.size(), 1, 1.0,
+                                                 2, codec), 0);
+        EXPECT_EQ(std::memcmp(img.data, fresh.data(), fresh.size()), 0);
+
+        // Noise does not compress: the frame outgrows the cover.
+        std::memcpy(img.data, original.data(), original.size());
+        EXPECT_EQ(steg_encode_message_compressed(&img, noise.data(), noise.size(), 1, 1.0, 1,
+                                                 codec), -1);
+        EXPECT_EQ(std::memcmp(img.data, original.data(), original.size()), 0);
+    }
+
+    steg_context_destroy(ctx);
+    bmp_free(&img);
+}
+
+// 28) With a thread pool, large payloads are embedded and extracted in
+// parallel ranges. The image, its dirty rows and the decoded message match
+// the serial path at every depth, with or without a cached selection, up to
+// the last byte of capacity; one byte more fails and leaves the image as
+// it was.
+TEST(StegParallelTest, RangedEmbedExtractMatchesSerial)
+{
+    BmpImage img;
+    create_test_image(1400, 1000, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 2024u);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    StegThreadPool *pool = steg_thread_pool_create(3);
+    ASSERT_NE(pool, nullptr);
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    steg_context_set_thread_pool(ctx, pool);
+    StegStats stats;
+    steg_context_set_stats(ctx, &stats);
+
+    for (int bits = 1; bits <= STEG_MAX_BITS_PER_CHANNEL; ++bits) {
+        StegCapacity cap;
+        ASSERT_EQ(steg_query_capacity_depth(&img, 3, 5.0, bits, STEG_CAPACITY_EXACT, &cap), 0);
+        ASSERT_GE(cap.bits, (size_t)1u << 21) << "bits=" << bits;
+
+        for (size_t len : {cap.max_message_len / 2u + 5u, cap.max_message_len}) {
+            std::vector<uint8_t> msg(len);
+            for (size_t i = 0; i < len; ++i) {
+                msg[i] = (uint8_t)(i * 131u + (i >> 9) + (unsigned)bits);
+            }
+
+            std::vector<unsigned char> serial = original;
+            BmpImage serial_img = img;
+            serial_img.data = serial.data();
+            serial_img.dirty_begin = serial_img.dirty_end = 0;
+            ASSERT_EQ(steg_encode_message_depth(&serial_img, msg.data(), len, 3, 5.0, bits), 0);
+
+            std::memcpy(img.data, original.data(), original.size());
+            img.dirty_begin = img.dirty_end = 0;
+            std::memset(&stats, 0, sizeof(stats));
+            ASSERT_EQ(steg_encode_message_depth_ctx(ctx, &img, msg.data(), len, 3, 5.0, bits), 0);
+            ASSERT_EQ(std::memcmp(img.data, serial.data(), serial.size()), 0)
+                << "bits=" << bits << " len=" << len;
+            EXPECT_EQ(img.dirty_begin, serial_img.dirty_begin);
+            EXPECT_EQ(img.dirty_end, serial_img.dirty_end);
+            EXPECT_EQ(stats.bits_written, (uint64_t)(len + 5u) * 8u);
+
+            const uint8_t *out = nullptr;
+            size_t out_len = 0;
+            ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, 3, 5.0), 0);
+            ASSERT_EQ(out_len, len);
+            EXPECT_EQ(std::memcmp(out, msg.data(), len), 0);
+        }
+
+        // One byte past capacity.
+        std::vector<uint8_t> big(cap.max_message_len + 1u, 0x5A);
+        std::memcpy(img.data, original.data(), original.size());
+        EXPECT_EQ(steg_encode_message_depth_ctx(ctx, &img, big.data(), big.size(), 3, 5.0, bits),
+                  -1);
+        EXPECT_EQ(std::memcmp(img.data, original.data(), original.size()), 0);
+    }
+
+    // A cached selection skips the scan; an update goes through it too.
+    StegSelectionCache *cache = steg_selection_cache_create(4, nullptr);
+    ASSERT_NE(cache, nullptr);
+    steg_context_set_selection_cache(ctx, cache);
+    std::vector<uint8_t> first(300000, 0x11);
+    std::vector<uint8_t> second(250000);
+    for (size_t i = 0; i < second.size(); ++i) {
+        second[i] = (uint8_t)(i ^ (i >> 7));
+    }
+    std::memcpy(img.data, original.data(), original.size());
+    ASSERT_EQ(steg_encode_message_ctx(ctx, &img, first.data(), first.size(), 3, 5.0), 0);
+    const uint8_t *out = nullptr;
+    size_t out_len = 0;
+    ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, 3, 5.0), 0);
+    ASSERT_EQ(out_len, first.size());
+    std::vector<unsigned char> fresh(img.data, img.data + img.size);
+    ASSERT_EQ(steg_update_message_ctx(ctx, &img, second.data(), second.size(), 3, 5.0), 0);
+    BmpImage fresh_img = img;
+    fresh_img.data = fresh.data();
+    ASSERT_EQ(steg_encode_message(&fresh_img, second.data(), second.size(), 3, 5.0), 0);
+    EXPECT_EQ(std::memcmp(img.data, fresh.data(), fresh.size()), 0);
+    ASSERT_EQ(steg_decode_message_ctx(ctx, &img, &out, &out_len, 3, 5.0), 0);
+    ASSERT_EQ(out_len, second.size());
+    EXPECT_EQ(std::memcmp(out, second.data(), out_len), 0);
+
+    steg_context_destroy(ctx);
+    steg_selection_cache_destroy(cache);
+    steg_thread_pool_destroy(pool);
+    bmp_free(&img);
+}
+
+// 29) A message larger than any one cover is split over several and comes
+// back whatever order the covers are given in, with or without a pool. Too
+// little room overall fails with -1 and changes no cover; a missing shard, a
+// shard of another set and a damaged shard are all rejected.
+TEST(StegShardTest, SplitsOverCoversAndReassembles)
+{
+    const int32_t sizes[3][2] = {{200, 150}, {320, 200}, {260, 240}};
+    BmpImage imgs[3];
+    std::vector<unsigned char> originals[3];
+    size_t total = 0, largest = 0;
+    for (int i = 0; i < 3; ++i) {
+        create_test_image(sizes[i][0], sizes[i][1], 0, 0, 0, &imgs[i]);
+        fill_mixed_pattern(&imgs[i], 90u + (uint32_t)i);
+        originals[i].assign(imgs[i].data, imgs[i].data + imgs[i].size);
+        StegCapacity cap;
+        ASSERT_EQ(steg_query_capacity(&imgs[i], 3, 5.0, STEG_CAPACITY_EXACT, &cap), 0);
+        ASSERT_GT(cap.max_message_len, STEG_SHARD_HEADER_BYTES);
+        total += cap.max_message_len - STEG_SHARD_HEADER_BYTES;
+        largest = cap.max_message_len > largest ? cap.max_message_len : largest;
+    }
+    BmpImage *ptrs[3] = {&imgs[0], &imgs[1], &imgs[2]};
+    auto restore = [&]() {
+        for (int i = 0; i < 3; ++i) {
+            std::memcpy(imgs[i].data, originals[i].data(), originals[i].size());
+        }
+    };
+
+    StegThreadPool *pool = steg_thread_pool_create(3);
+    ASSERT_NE(pool, nullptr);
+
+    // One byte too many: nothing is written.
+    std::vector<uint8_t> msg(total + 1u);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = (uint8_t)(i * 131u + (i >> 9));
+    }
+    EXPECT_EQ(steg_encode_sharded(ptrs, 3, msg.data(), msg.size(), 3, 5.0, pool), -1);
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(std::memcmp(imgs[i].data, originals[i].data(), originals[i].size()), 0);
+    }
+
+    // Exactly full, and well over one cover.
+    msg.pop_back();
+    ASSERT_GT(msg.size(), largest);
+    ASSERT_EQ(steg_encode_sharded(ptrs, 3, msg.data(), msg.size(), 3, 5.0, pool), 0);
+    const int orders[3][3] = {{0, 1, 2}, {2, 0, 1}, {1, 2, 0}};
+    for (const auto &order : orders) {
+        const BmpImage *given[3] = {&imgs[order[0]], &imgs[order[1]], &imgs[order[2]]};
+        for (StegThreadPool *p : {pool, (StegThreadPool *)nullptr}) {
+            uint8_t *out = nullptr;
+            size_t out_len = 0;
+            ASSERT_EQ(steg_decode_sharded(given, 3, &out, &out_len, 3, 5.0, p), 0);
+            ASSERT_EQ(out_len, msg.size());
+            EXPECT_EQ(std::memcmp(out, msg.data(), out_len), 0);
+            std::free(out);
+        }
+    }
+
+    uint8_t *out = nullptr;
+    size_t out_len = 0;
+    const BmpImage *two[2] = {&imgs[0], &imgs[2]};
+    EXPECT_NE(steg_decode_sharded(two, 2, &out, &out_len, 3, 5.0, pool), 0);
+    const BmpImage *repeated[3] = {&imgs[0], &imgs[0], &imgs[2]};
+    EXPECT_NE(steg_decode_sharded(repeated, 3, &out, &out_len, 3, 5.0, pool), 0);
+
+    // Cover 1 from another message over the same covers.
+    std::vector<unsigned char> first_set(imgs[1].data, imgs[1].data + imgs[1].size);
+    std::vector<uint8_t> other(msg.size() / 2u, 0x3C);
+    restore();
+    ASSERT_EQ(steg_encode_sharded(ptrs, 3, other.data(), other.size(), 3, 5.0, pool), 0);
+    std::vector<unsigned char> second_set(imgs[1].data, imgs[1].data + imgs[1].size);
+    std::memcpy(imgs[1].data, first_set.data(), first_set.size());
+    const BmpImage *mixed[3] = {&imgs[0], &imgs[1], &imgs[2]};
+    EXPECT_NE(steg_decode_sharded(mixed, 3, &out, &out_len, 3, 5.0, pool), 0);
+    std::memcpy(imgs[1].data, second_set.data(), second_set.size());
+    ASSERT_EQ(steg_decode_sharded(mixed, 3, &out, &out_len, 3, 5.0, pool), 0);
+    ASSERT_EQ(out_len, other.size());
+    EXPECT_EQ(std::memcmp(out, other.data(), out_len), 0);
+    std::free(out);
+    out = nullptr;
+
+    // A payload byte of shard 1 changed under its checksum.
+    uint8_t *piece = nullptr;
+    size_t piece_len = 0;
+    ASSERT_EQ(steg_decode_message(&imgs[1], &piece, &piece_len, 3, 5.0), 0);
+    ASSERT_GT(piece_len, STEG_SHARD_HEADER_BYTES);
+    piece[piece_len - 1u] ^= 0x01u;
+    ASSERT_EQ(steg_encode_message(&imgs[1], piece, piece_len, 3, 5.0), 0);
+    std::free(piece);
+    EXPECT_NE(steg_decode_sharded(mixed, 3, &out, &out_len, 3, 5.0, pool), 0);
+
+    // An empty message still makes a set, of empty shards.
+    restore();
+    ASSERT_EQ(steg_encode_sharded(ptrs, 3, nullptr, 0, 3, 5.0, pool), 0);
+    ASSERT_EQ(steg_decode_sharded(mixed, 3, &out, &out_len, 3, 5.0, nullptr), 0);
+    EXPECT_EQ(out_len, 0u);
+    std::free(out);
+
+    steg_thread_pool_destroy(pool);
+    for (int i = 0; i < 3; ++i) {
+        bmp_free(&imgs[i]);
+    }
+}
+
+// Helper: a 32-bit copy of the 24-bit src with alpha bytes from seed.
+static void make_bgra_copy(const BmpImage *src, uint32_t seed, BmpImage *dst)
+{
+    std::memset(dst, 0, sizeof(*dst));
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->bytes_per_pixel = 4;
+    dst->stride = src->width * 4;
+    int32_t abs_height = src->height > 0 ? src->height : -src->height;
+    dst->size = dst->stride * abs_height;
+    dst->data = (unsigned char *)std::malloc((size_t)dst->size);
+    ASSERT_NE(dst->data, nullptr);
+    uint32_t state = seed;
+    for (int32_t row = 0; row < abs_height; ++row) {
+        for (int32_t col = 0; col < src->width; ++col) {
+            const unsigned char *in = src->data + (size_t)row * (size_t)src->stride +
+                                      (size_t)col * 3u;
+            unsigned char *out = dst->data + (size_t)row * (size_t)dst->stride +
+                                 (size_t)col * 4u;
+            state = state * 1664525u + 1013904223u;
+            std::memcpy(out, in, 3);
+            out[3] = (unsigned char)(state >> 24);
+        }
+    }
+    set_bmp_header(dst);
+}
+
+// Helper: whether the 32-bit img holds the pixels of the 24-bit ref and the
+// alpha bytes of the 32-bit alpha_ref.
+static bool bgra_matches(const BmpImage *img, const BmpImage *ref, const BmpImage *alpha_ref)
+{
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    for (int32_t row = 0; row < abs_height; ++row) {
+        for (int32_t col = 0; col < img->width; ++col) {
+            size_t at = (size_t)row * (size_t)img->stride + (size_t)col * 4u;
+            if (std::memcmp(img->data + at,
+                            ref->data + (size_t)row * (size_t)ref->stride + (size_t)col * 3u,
+                            3) != 0 ||
+                img->data[at + 3u] != alpha_ref->data[at + 3u]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 30) A 32-bit cover selects the blocks of the same 24-bit cover and carries
+// its payload in the same B, G, R bits, bottom-up or top-down, at any depth,
+// through the serial, parallel and file paths; alpha is never touched.
+TEST(StegBgraTest, MatchesTwentyFourBitCover)
+{
+    std::string path = ::testing::TempDir() + "steg_bgra.bmp";
+    StegThreadPool *pool = steg_thread_pool_create(3);
+    ASSERT_NE(pool, nullptr);
+
+    for (int32_t height : {1000, -1000}) {
+        BmpImage rgb;
+        create_test_image(1400, height, 0, 0, 0, &rgb);
+        fill_mixed_pattern(&rgb, 3030u);
+        BmpImage bgra;
+        make_bgra_copy(&rgb, 77u, &bgra);
+        BmpImage alpha_ref;
+        make_bgra_copy(&rgb, 77u, &alpha_ref);
+        std::vector<unsigned char> rgb_original(rgb.data, rgb.data + rgb.size);
+
+        for (int bits : {1, 3}) {
+            StegCapacity cap24, cap32;
+            ASSERT_EQ(steg_query_capacity_depth(&rgb, 3, 5.0, bits, STEG_CAPACITY_EXACT,
+                                                &cap24), 0);
+            ASSERT_EQ(steg_query_capacity_depth(&bgra, 3, 5.0, bits, STEG_CAPACITY_EXACT,
+                                                &cap32), 0);
+            EXPECT_EQ(cap32.bits, cap24.bits);
+            ASSERT_EQ(cap32.max_message_len, cap24.max_message_len);
+
+            // Small enough for the serial cursor, then large enough for the
+            // parallel ranges.
+            for (size_t len : {(size_t)5000u, cap24.max_message_len}) {
+                std::vector<uint8_t> msg(len);
+                for (size_t i = 0; i < len; ++i) {
+                    msg[i] = (uint8_t)(i * 29u + (i >> 8) + (size_t)bits);
+                }
+                std::memcpy(rgb.data, rgb_original.data(), rgb_original.size());
+                std::memcpy(bgra.data, alpha_ref.data, (size_t)bgra.size);
+                ASSERT_EQ(steg_encode_message_depth(&rgb, msg.data(), len, 3, 5.0, bits), 0);
+
+                StegContext *ctx = steg_context_create();
+                ASSERT_NE(ctx, nullptr);
+                steg_context_set_thread_pool(ctx, len > 5000u ? pool : nullptr);
+                ASSERT_EQ(steg_encode_message_depth_ctx(ctx, &bgra, msg.data(), len, 3, 5.0,
+                                                        bits), 0);
+                EXPECT_TRUE(bgra_matches(&bgra, &rgb, &alpha_ref))
+                    << "height=" << height << " bits=" << bits << " len=" << len;
+
+                const uint8_t *out = nullptr;
+                size_t out_len = 0;
+                ASSERT_EQ(steg_decode_message_ctx(ctx, &bgra, &out, &out_len, 3, 5.0), 0);
+                ASSERT_EQ(out_len, len);
+                EXPECT_EQ(std::memcmp(out, msg.data(), len), 0);
+                steg_context_destroy(ctx);
+            }
+        }
+
+        // Saved and mapped back, the image is read as 32-bit and decodes.
+        ASSERT_EQ(bmp_save(path.c_str(), &bgra), 0);
+        BmpImage mapped;
+        ASSERT_EQ(bmp_load_mapped(path.c_str(), &mapped, BMP_STORAGE_MAP_READ), 0);
+        EXPECT_EQ(mapped.bytes_per_pixel, 4);
+        EXPECT_EQ(mapped.stride, 1400 * 4);
+        ASSERT_EQ(mapped.size, bgra.size);
+        EXPECT_EQ(std::memcmp(mapped.data, bgra.data, (size_t)bgra.size), 0);
+        uint8_t *decoded = nullptr;
+        size_t decoded_len = 0;
+        ASSERT_EQ(steg_decode_message(&mapped, &decoded, &decoded_len, 3, 5.0), 0);
+        EXPECT_GT(decoded_len, 5000u);
+        std::free(decoded);
+        bmp_free(&mapped);
+
+        // The streaming encoder reads and writes 32-bit rows too.
+        std::string out_path = path + ".out";
+        std::memcpy(rgb.data, rgb_original.data(), rgb_original.size());
+        ASSERT_EQ(bmp_save(path.c_str(), &alpha_ref), 0);
+        std::vector<uint8_t> msg(60000u, 0xA5);
+        ASSERT_EQ(steg_encode_file_streaming(path.c_str(), out_path.c_str(), msg.data(),
+                                             msg.size(), 3, 5.0), 0);
+        ASSERT_EQ(steg_encode_message(&rgb, msg.data(), msg.size(), 3, 5.0), 0);
+        BmpImage streamed;
+        ASSERT_EQ(bmp_load(out_path.c_str(), &streamed), 0);
+        EXPECT_TRUE(bgra_matches(&streamed, &rgb, &alpha_ref)) << "height=" << height;
+        bmp_free(&streamed);
+        std::remove(out_path.c_str());
+
+        bmp_free(&alpha_ref);
+        bmp_free(&bgra);
+        bmp_free(&rgb);
+    }
+
+    std::remove(path.c_str());
+    steg_thread_pool_destroy(pool);
+}
+
+// 31) A probe finds every layout, depth and codec the decoder does with the
+// stored length, reading only headers, and rejects covers without a payload
+// after a few block rows.
+TEST(StegProbeTest, FindsHeadersAndRejectsCoversEarly)
+{
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    StegStats stats;
+    steg_context_set_stats(ctx, &stats);
+
+    BmpImage img;
+    create_test_image(320, 240, 0, 0, 0, &img);
+    size_t total_blocks = (size_t)(320 - 3 + 1) * (size_t)(240 - 3 + 1);
+    for (uint32_t seed = 1; seed <= 40; ++seed) {
+        fill_mixed_pattern(&img, seed * 7919u);
+        std::memset(&stats, 0, sizeof(stats));
+        StegProbe probe;
+        ASSERT_EQ(steg_probe_message_ctx(ctx, &img, 3, 5.0, &probe), 0);
+        EXPECT_EQ(probe.found, 0) << "seed=" << seed << " len=" << probe.message_len;
+        EXPECT_LT(stats.blocks_evaluated, total_blocks / 4u) << "seed=" << seed;
+        EXPECT_LT(stats.bits_read, 1024u) << "seed=" << seed;
+    }
+
+    fill_mixed_pattern(&img, 4711u);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+    std::vector<uint8_t> msg(3000);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = (uint8_t)(i % 61u);
+    }
+
+    struct Case {
+        int format;
+        int bits;
+        int codec;
+    };
+    std::vector<Case> cases = {{STEG_FORMAT_COMPACT, 1, STEG_CODEC_NONE},
+                               {STEG_FORMAT_COMPACT, 3, STEG_CODEC_NONE},
+                               {STEG_FORMAT_BITMAP, 1, STEG_CODEC_NONE}};
+    for (int codec : {STEG_CODEC_LZ4, STEG_CODEC_ZSTD}) {
+        if (steg_codec_available(codec)) {
+            cases.push_back({STEG_FORMAT_COMPACT, 2, codec});
+        }
+    }
+    for (const Case &c : cases) {
+        std::memcpy(img.data, original.data(), original.size());
+        if (c.codec != STEG_CODEC_NONE) {
+            ASSERT_EQ(steg_encode_message_compressed(&img, msg.data(), msg.size(), 3, 5.0,
+                                                     c.bits, c.codec), 0);
+        } else if (c.bits != 1) {
+            ASSERT_EQ(steg_encode_message_depth(&img, msg.data(), msg.size(), 3, 5.0, c.bits),
+                      0);
+        } else {
+            ASSERT_EQ(steg_encode_message_format(&img, msg.data(), msg.size(), 3, 5.0,
+                                                 c.format), 0);
+        }
+
+        StegProbe probe;
+        ASSERT_EQ(steg_probe_message(&img, 3, 5.0, &probe), 0);
+        EXPECT_EQ(probe.found, 1) << "format=" << c.format << " codec=" << c.codec;
+        EXPECT_EQ(probe.format, c.format);
+        EXPECT_EQ(probe.bits_per_channel, c.bits);
+        EXPECT_EQ(probe.codec, c.codec);
+        EXPECT_EQ(probe.message_len, msg.size());
+
+        uint8_t *out = nullptr;
+        size_t out_len = 0;
+        ASSERT_EQ(steg_decode_message(&img, &out, &out_len, 3, 5.0), 0);
+        EXPECT_EQ(out_len, probe.message_len);
+        std::free(out);
+    }
+
+    // block_size 1 keeps the legacy layout lossless; its empty message is
+    // indistinguishable from a cover.
+    BmpImage legacy;
+    create_test_image(64, 64, 100, 100, 100, &legacy);
+    ASSERT_EQ(steg_encode_message_format(&legacy, msg.data(), 200, 1, 1.0, STEG_FORMAT_LEGACY),
+              0);
+    StegProbe probe;
+    ASSERT_EQ(steg_probe_message(&legacy, 1, 1.0, &probe), 0);
+    EXPECT_EQ(probe.found, 1);
+    EXPECT_EQ(probe.format, STEG_FORMAT_LEGACY);
+    EXPECT_EQ(probe.bits_per_channel, 1);
+    EXPECT_EQ(probe.message_len, 200u);
+    bmp_free(&legacy);
+    create_test_image(64, 64, 100, 100, 100, &legacy);
+    ASSERT_EQ(steg_probe_message(&legacy, 1, 1.0, &probe), 0);
+    EXPECT_EQ(probe.found, 0);
+
+    steg_context_destroy(ctx);
+    bmp_free(&legacy);
+    bmp_free(&img);
+}
+
+// Cover whose block contrast rises from left to right: flat rows on top,
+// then noise whose amplitude grows with every 16 columns.
+static void fill_contrast_ramp(BmpImage *img, uint32_t seed)
+{
+    int32_t abs_height = img->height > 0 ? img->height : -img->height;
+    uint32_t state = seed;
+    for (int32_t row = 0; row < abs_height; ++row) {
+        for (int32_t col = 0; col < img->width; ++col) {
+            state = state * 1664525u + 1013904223u;
+            int amp = row < 8 ? 0 : col / 16;
+            int v = 128 + (int)((state >> 8) % (uint32_t)(2 * amp + 1)) - amp;
+            unsigned char *px = img->data + (size_t)row * (size_t)img->stride + (size_t)col * 3u;
+            px[0] = px[1] = px[2] = (unsigned char)(v & ~7);
+        }
+    }
+}
+
+// 32) An adaptive encode stores the lowest threshold the message fits at,
+// below or above the caller's, and decodes, probes and updates without being
+// told it.
+TEST(StegAdaptiveTest, StoresLowestFittingThreshold)
+{
+    BmpImage cover;
+    create_test_image(256, 128, 0, 0, 0, &cover);
+    fill_contrast_ramp(&cover, 99u);
+    const int bs = 4;
+    const double base = 5.0;
+
+    StegCapacity at_base;
+    ASSERT_EQ(steg_query_capacity(&cover, bs, base, STEG_CAPACITY_EXACT, &at_base), 0);
+
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+
+    BmpImage img;
+    create_test_image(256, 128, 0, 0, 0, &img);
+    for (int bits : {1, 2}) {
+        for (size_t len : {(size_t)40, at_base.max_message_len * (size_t)bits + 600u}) {
+            std::vector<uint8_t> msg(len);
+            for (size_t i = 0; i < len; ++i) {
+                msg[i] = (uint8_t)(i * 37u + (size_t)bits);
+            }
+
+            std::memcpy(img.data, cover.data, cover.size);
+            double threshold = 0.0;
+            ASSERT_EQ(steg_encode_message_adaptive(&img, msg.data(), len, bs, base, bits,
+                                                   &threshold), 0);
+            if (len > at_base.max_message_len) {
+                EXPECT_GT(threshold, base) << "bits=" << bits;
+            } else {
+                EXPECT_LT(threshold, base) << "bits=" << bits;
+            }
+
+            // Tight: just below the candidate before it, the whole selection,
+            // even with the first row, the header's, is too small.
+            StegCapacity below;
+            ASSERT_EQ(steg_query_capacity_depth(&cover, bs,
+                                                threshold - 2.0 / 256.0 - 1e-9, bits,
+                                                STEG_CAPACITY_EXACT, &below), 0);
+            size_t spare = below.selected_pixels > 256u ? below.selected_pixels - 256u : 0u;
+            EXPECT_LT(spare * 3u * (size_t)bits, len * 8u) << "bits=" << bits << " len=" << len;
+
+            uint8_t *out = nullptr;
+            size_t out_len = 0;
+            ASSERT_EQ(steg_decode_message(&img, &out, &out_len, bs, base), 0);
+            ASSERT_EQ(out_len, len);
+            EXPECT_EQ(std::memcmp(out, msg.data(), len), 0);
+            std::free(out);
+
+            StegProbe probe;
+            ASSERT_EQ(steg_probe_message(&img, bs, base, &probe), 0);
+            EXPECT_EQ(probe.found, 1);
+            EXPECT_EQ(probe.format, STEG_FORMAT_ADAPTIVE);
+            EXPECT_EQ(probe.bits_per_channel, bits);
+            EXPECT_EQ(probe.message_len, len);
+            EXPECT_EQ(probe.contrast_threshold, threshold);
+
+            // Same result from a context.
+            std::vector<unsigned char> encoded(img.data, img.data + img.size);
+            std::memcpy(img.data, cover.data, cover.size);
+            double ctx_threshold = 0.0;
+            ASSERT_EQ(steg_encode_message_adaptive_ctx(ctx, &img, msg.data(), len, bs, base,
+                                                       bits, &ctx_threshold), 0);
+            EXPECT_EQ(ctx_threshold, threshold);
+            EXPECT_EQ(std::memcmp(img.data, encoded.data(), img.size), 0);
+        }
+    }
+
+    // An update searches again at the stored depth.
+    std::vector<uint8_t> update(120, 0x5Au);
+    ASSERT_EQ(steg_update_message(&img, update.data(), update.size(), bs, base), 0);
+    StegProbe probe;
+    ASSERT_EQ(steg_probe_message(&img, bs, base, &probe), 0);
+    EXPECT_EQ(probe.format, STEG_FORMAT_ADAPTIVE);
+    EXPECT_EQ(probe.bits_per_channel, 2);
+    EXPECT_LT(probe.contrast_threshold, base);
+    uint8_t *out = nullptr;
+    size_t out_len = 0;
+    ASSERT_EQ(steg_decode_message(&img, &out, &out_len, bs, base), 0);
+    ASSERT_EQ(out_len, update.size());
+    EXPECT_EQ(std::memcmp(out, update.data(), out_len), 0);
+    std::free(out);
+
+    // Too large even with every block: the image is left alone.
+    std::memcpy(img.data, cover.data, cover.size);
+    std::vector<uint8_t> huge(256u * 128u * 3u / 8u, 1u);
+    EXPECT_EQ(steg_encode_message_adaptive(&img, huge.data(), huge.size(), bs, base, 1,
+                                           nullptr), -1);
+    EXPECT_EQ(std::memcmp(img.data, cover.data, cover.size), 0);
+
+    steg_context_destroy(ctx);
+    bmp_free(&img);
+    bmp_free(&cover);
+}
+
+// 33) Saving a mapped cover over its own file under another spelling
+// replaces the file instead of truncating it under the mapping.
+TEST(BmpMappedTest, SaveOverMappedAliasKeepsMapping)
+{
+    std::string dir = ::testing::TempDir() + "steg_alias_dir";
+    std::string path = ::testing::TempDir() + "steg_alias.bmp";
+    std::string alias = dir + "/../steg_alias.bmp";
+    mkdir(dir.c_str(), 0755);
+
+    BmpImage src;
+    create_test_image(40, 64, 0, 0, 0, &src);
+    fill_mixed_pattern(&src, 33u);
+    set_bmp_header(&src);
+    ASSERT_EQ(bmp_save(path.c_str(), &src), 0);
+
+    EXPECT_EQ(bmp_same_file(path.c_str(), alias.c_str()), 1);
+    EXPECT_EQ(bmp_same_file(path.c_str(), dir.c_str()), 0);
+    EXPECT_EQ(bmp_same_file(path.c_str(), (dir + "/missing.bmp").c_str()), 0);
+
+    BmpImage img;
+    ASSERT_EQ(bmp_load_mapped(path.c_str(), &img, BMP_STORAGE_MAP_COPY), 0);
+    const char *msg = "alias";
+    ASSERT_EQ(steg_encode_message(&img, (const uint8_t *)msg, std::strlen(msg), 3, 5.0), 0);
+
+    // Both saves read every page of the mapping, which must still be there.
+    ASSERT_EQ(bmp_save(alias.c_str(), &img), 0);
+    ASSERT_EQ(bmp_save(path.c_str(), &img), 0);
+
+    BmpImage out;
+    ASSERT_EQ(bmp_load(path.c_str(), &out), 0);
+    ASSERT_EQ(out.size, img.size);
+    EXPECT_EQ(std::memcmp(out.data, img.data, (size_t)img.size), 0);
+
+    uint8_t *decoded = nullptr;
+    size_t decoded_len = 0;
+    ASSERT_EQ(steg_decode_message(&out, &decoded, &decoded_len, 3, 5.0), 0);
+    ASSERT_EQ(decoded_len, std::strlen(msg));
+    EXPECT_EQ(std::memcmp(decoded, msg, decoded_len), 0);
+    free(decoded);
+
+    // No temporary file is left behind.
+    DIR *d = opendir(::testing::TempDir().c_str());
+    ASSERT_NE(d, nullptr);
+    for (struct dirent *e = readdir(d); e != nullptr; e = readdir(d)) {
+        EXPECT_EQ(std::strstr(e->d_name, "steg_alias.bmp."), nullptr) << e->d_name;
+    }
+    closedir(d);
+
+    bmp_free(&out);
+    bmp_free(&img);
+    bmp_free(&src);
+    std::remove(path.c_str());
+    rmdir(dir.c_str());
+}
+
+// 34) A legacy length whose low byte is a format tag is not taken for a
+// tagged header: the byte after the tag and varint, where the compact check
+// byte would be, is 0 for every legacy message below 16 MiB, and the bitmap
+// check byte rejects the short length a message starting with 0 gives it.
+TEST(StegFormatTest, LegacyLengthLikeTagStillDecodes)
+{
+    BmpImage img;
+    create_test_image(320, 300, 100, 100, 100, &img);
+    std::vector<unsigned char> original(img.data, img.data + img.size);
+
+    for (int first_zero = 0; first_zero <= 1; ++first_zero) {
+        for (unsigned high : {0x00u, 0x01u, 0x02u, 0x40u, 0x7Fu}) {
+            for (unsigned low = 0xA0u; low <= 0xAFu; ++low) {
+                size_t len = (size_t)(high << 8 | low);
+                // A first byte of 0 makes the bitmap length after a 0xA2 tag
+                // a short one.
+                std::vector<uint8_t> msg(len);
+                for (size_t i = 0; i < len; ++i) {
+                    msg[i] = (uint8_t)(i * 37u + (first_zero ? 0u : low));
+                }
+
+                // block_size 1: the legacy and tagged layouts walk the same slots.
+                std::memcpy(img.data, original.data(), original.size());
+                ASSERT_EQ(steg_encode_message_format(&img, msg.data(), len, 1, 1.0,
+                                                     STEG_FORMAT_LEGACY), 0) << "len=" << len;
+
+                uint8_t *decoded = nullptr;
+                size_t decoded_len = 0;
+                ASSERT_EQ(steg_decode_message(&img, &decoded, &decoded_len, 1, 1.0), 0)
+                    << "len=" << len;
+                ASSERT_EQ(decoded_len, len);
+                EXPECT_EQ(std::memcmp(decoded, msg.data(), len), 0) << "len=" << len;
+                std::free(decoded);
+
+                StegProbe probe;
+                ASSERT_EQ(steg_probe_message(&img, 1, 1.0, &probe), 0) << "len=" << len;
+                EXPECT_EQ(probe.found, 1) << "len=" << len;
+                EXPECT_EQ(probe.format, STEG_FORMAT_LEGACY) << "len=" << len;
+            }
+        }
+    }
+
+    bmp_free(&img);
+}
+
+// 35) A sidecar whose stored count disagrees with its bits, or with a bit
+// set past the last pixel, is ignored and its selection scanned again.
+TEST(StegSelectionCacheTest, RejectsCorruptSidecarCount)
+{
+    BmpImage img;
+    create_test_image(40, 30, 0, 0, 0, &img);
+    fill_mixed_pattern(&img, 4242u);
+    std::vector<uint8_t> msg(9);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = (uint8_t)(i * 53u + 1u);
+    }
+    ASSERT_EQ(steg_encode_message(&img, msg.data(), msg.size(), 3, 5.0), 0);
+
+    std::string dir = ::testing::TempDir() + "steg_selection_corrupt";
+    mkdir(dir.c_str(), 0700);
+    StegSelectionCache *cache = steg_selection_cache_create(0, dir.c_str());
+    ASSERT_NE(cache, nullptr);
+    decode_expect(cache, &img, msg);
+    steg_selection_cache_destroy(cache);
+
+    std::string path;
+    DIR *d = opendir(dir.c_str());
+    ASSERT_NE(d, nullptr);
+    while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] != '.') {
+            path = dir + "/" + e->d_name;
+        }
+    }
+    closedir(d);
+    ASSERT_FALSE(path.empty());
+
+    std::vector<unsigned char> pristine;
+    FILE *f = std::fopen(path.c_str(), "rb");
+    ASSERT_NE(f, nullptr);
+    for (int c = std::fgetc(f); c != EOF; c = std::fgetc(f)) {
+        pristine.push_back((unsigned char)c);
+    }
+    std::fclose(f);
+    // 48-byte header (count at 40), then 19 words for 1200 pixels.
+    ASSERT_EQ(pristine.size(), 48u + 19u * 8u);
+
+    // The count one higher, then the top bit of the last word set.
+    for (size_t offset : {(size_t)40u, pristine.size() - 1u}) {
+        std::vector<unsigned char> corrupt = pristine;
+        corrupt[offset] = (unsigned char)(offset == 40u ? corrupt[offset] + 1u
+                                                        : corrupt[offset] | 0x80u);
+        f = std::fopen(path.c_str(), "wb");
+        ASSERT_NE(f, nullptr);
+        ASSERT_EQ(std::fwrite(corrupt.data(), 1, corrupt.size(), f), corrupt.size());
+        std::fclose(f);
+
+        cache = steg_selection_cache_create(0, dir.c_str());
+        ASSERT_NE(cache, nullptr);
+        decode_expect(cache, &img, msg);
+        StegSelectionCacheStats cs;
+        steg_selection_cache_get_stats(cache, &cs);
+        EXPECT_EQ(cs.disk_hits, 0u) << "offset=" << offset;
+        EXPECT_GE(cs.misses, 1u);
+        steg_selection_cache_destroy(cache);
+    }
+
+    // The scan wrote a valid sidecar back.
+    cache = steg_selection_cache_create(0, dir.c_str());
+    ASSERT_NE(cache, nullptr);
+    decode_expect(cache, &img, msg);
+    StegSelectionCacheStats cs;
+    steg_selection_cache_get_stats(cache, &cs);
+    EXPECT_EQ(cs.disk_hits, 1u);
+    steg_selection_cache_destroy(cache);
+
+    std::remove(path.c_str());
+    rmdir(dir.c_str());
+    bmp_free(&img);
+}
+
+// Helper: a flat cover whose LSBs (block size 1) hold a compressed LZ4
+// header claiming len bytes, followed by the LZ4 frame magic.
+static void write_compressed_claim(BmpImage *img, uint32_t len)
+{
+    std::vector<uint8_t> bytes = {STEG_FORMAT_COMPRESSED_TAG(1), STEG_CODEC_LZ4};
+    for (uint32_t v = len; ; v >>= 7) {
+        bytes.push_back((uint8_t)(v >= 0x80u ? (v & 0x7Fu) | 0x80u : v));
+        if (v < 0x80u) {
+            break;
+        }
+    }
+    bytes.push_back(payload_check_byte(bytes.data(), bytes.size()));
+    bytes.insert(bytes.end(), {0x04, 0x22, 0x4D, 0x18});
+    write_lsb_stream(img, bytes);
+}
+
+// 36) A compressed header whose length no frame in the cover can expand to
+// is given up on before anything is allocated for it or the frame is read.
+TEST(StegCompressionTest, RejectsUnboundedCompressedLength)
+{
+    BmpImage img;
+    create_test_image(64, 64, 90, 90, 90, &img);
+    write_compressed_claim(&img, 0xF0000000u);
+
+    StegContext *ctx = steg_context_create();
+    ASSERT_NE(ctx, nullptr);
+    StegStats stats;
+    std::memset(&stats, 0, sizeof(stats));
+    steg_context_set_stats(ctx, &stats);
+    const uint8_t *out = nullptr;
+    size_t out_len = 0;
+    EXPECT_NE(steg_decode_message_ctx(ctx, &img, &out, &out_len, 1, 1.0), 0);
+    // The 8 header bytes at depth 1, a tag byte at depths 2 and 3 and the
+    // legacy length: never the frame magic.
+    EXPECT_EQ(stats.bits_read, (uint64_t)(64u + 8u + 8u + 32u));
+
+    steg_context_destroy(ctx);
+    bmp_free(&img);
+}
+
+// 37) The probe holds a compressed length to the capacity estimate times the
+// codec's largest expansion, not just to what the whole image could frame.
+TEST(StegProbeTest, RejectsOversizedCompressedLength)
+{
+    // Flat top rows hold the header, noise below selects no block.
+    BmpImage img;
+    create_test_image(256, 256, 90, 90, 90, &img);
+    uint32_t seed = 777u;
+    for (size_t i = (size_t)16u * (size_t)img.stride; i < (size_t)img.size; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        img.data[i] = (uint8_t)(seed >> 24);
+    }
+
+    StegCapacity capacity;
+    ASSERT_EQ(steg_query_capacity(&img, 4, 5.0, STEG_CAPACITY_EXACT, &capacity), 0);
+    ASSERT_EQ(capacity.bits, (size_t)256u * 16u * 3u);
+
+    // Within what the estimate allows for an LZ4 frame, then far past it but
+    // still below what all 256 rows could expand to.
+    for (uint32_t len : {100000u, 3000000u}) {
+        write_compressed_claim(&img, len);
+        StegProbe probe;
+        ASSERT_EQ(steg_probe_message(&img, 4, 5.0, &probe), 0);
+        // The tagged header bits may still read as a short legacy length.
+        int compressed = probe.found && probe.codec == STEG_CODEC_LZ4;
+        EXPECT_EQ(compressed, len == 100000u ? 1 : 0) << "len=" << len;
+        if (compressed) {
+            EXPECT_EQ(probe.message_len, len);
+        }
+    }
+
+    bmp_free(&img);
+}
+
+// 38) A cover too small for a shard header is left out of the set and
+// unchanged, instead of failing the encode, and decode ignores it among the
+// shards. Only the usable covers count toward the capacity.
+TEST(StegShardTest, SkipsCoversTooSmallForAHeader)
+{
+    BmpImage imgs[3];
+    create_test_image(200, 150, 0, 0, 0, &imgs[0]);
+    fill_mixed_pattern(&imgs[0], 141u);
+    create_test_image(2, 2, 0, 0, 0, &imgs[1]);
+    fill_mixed_pattern(&imgs[1], 142u);
+    create_test_image(260, 240, 0, 0, 0, &imgs[2]);
+    fill_mixed_pattern(&imgs[2], 143u);
+    std::vector<unsigned char> tiny(imgs[1].data, imgs[1].data + imgs[1].size);
+
+    size_t total = 0;
+    for (int i : {0, 2}) {
+        StegCapacity cap;
+        ASSERT_EQ(steg_query_capacity(&imgs[i], 3, 5.0, STEG_CAPACITY_EXACT, &cap), 0);
+        ASSERT_GT(cap.max_message_len, STEG_SHARD_HEADER_BYTES);
+        total += cap.max_message_len - STEG_SHARD_HEADER_BYTES;
+    }
+    BmpImage *ptrs[3] = {&imgs[0], &imgs[1], &imgs[2]};
+
+    StegThreadPool *pool = steg_thread_pool_create(3);
+    ASSERT_NE(pool, nullptr);
+
+    std::vector<uint8_t> msg(total + 1u);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = (uint8_t)(i * 37u + (i >> 7));
+    }
+    EXPECT_EQ(steg_encode_sharded(ptrs, 3, msg.data(), msg.size(), 3, 5.0, pool), -1);
+    msg.pop_back();
+    ASSERT_EQ(steg_encode_sharded(ptrs, 3, msg.data(), msg.size(), 3, 5.0, pool), 0);
+    EXPECT_EQ(std::memcmp(imgs[1].data, tiny.data(), tiny.size()), 0);
+
+    const BmpImage *all[3] = {&imgs[2], &imgs[1], &imgs[0]};
+    const BmpImage *shards[2] = {&imgs[0], &imgs[2]};
+    for (const BmpImage *const *given : {all, shards}) {
+        uint8_t *out = nullptr;
+        size_t out_len = 0;
+        ASSERT_EQ(steg_decode_sharded(given, given == all ? 3 : 2, &out, &out_len, 3, 5.0,
+                                      pool), 0);
+        ASSERT_EQ(out_len, msg.size());
+        EXPECT_EQ(std::memcmp(out, msg.data(), out_len), 0);
+        std::free(out);
+    }
+
+    // The set has two shards: one of them missing is still an error.
+    uint8_t *out = nullptr;
+    size_t out_len = 0;
+    const BmpImage *missing[2] = {&imgs[1], &imgs[2]};
+    EXPECT_NE(steg_decode_sharded(missing, 2, &out, &out_len, 3, 5.0, pool), 0);
+
+    // No usable cover at all.
+    BmpImage *only_tiny[1] = {&imgs[1]};
+    EXPECT_EQ(steg_encode_sharded(only_tiny, 1, msg.data(), 1, 3, 5.0, pool), -1);
+
+    steg_thread_pool_destroy(pool);
+    for (int i = 0; i < 3; ++i) {
+        bmp_free(&imgs[i]);
+    }
+}